@@ -4,6 +4,9 @@
 #define AH_SUCCESS 0
 #define AH_FAILURE 1
 
+#define AH_MAX_FRAMES_IN_FLIGHT 3
+#define AH_DEFAULT_FRAMES_IN_FLIGHT 2
+
 #include <vulkan/vulkan_core.h>
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
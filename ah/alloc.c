@@ -0,0 +1,395 @@
+#include "alloc.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vulkan/vulkan_core.h>
+#include "ah.h"
+#include "errors.h"
+#include "helpers.h"
+
+AH_RESULT ah_alloc_init(ah_allocator_t *allocator, VkPhysicalDevice physical_device, VkDevice device) {
+    memset(allocator, 0, sizeof(ah_allocator_t));
+    allocator->device = device;
+
+    // Memory properties never change for a device, query them once
+    vkGetPhysicalDeviceMemoryProperties(physical_device, &allocator->memory_properties);
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(physical_device, &properties);
+    allocator->buffer_image_granularity = properties.limits.bufferImageGranularity;
+    allocator->max_device_allocations = properties.limits.maxMemoryAllocationCount;
+    allocator->non_coherent_atom_size = properties.limits.nonCoherentAtomSize;
+
+    return AH_SUCCESS;
+}
+
+void ah_alloc_destroy(ah_allocator_t *allocator) {
+    for (uint32_t i = 0; i < AH_ALLOC_MAX_BLOCKS; i++) {
+        ah_alloc_block_t *block = &allocator->blocks[i];
+        if (block->memory == VK_NULL_HANDLE) {
+            continue;
+        }
+
+        vkFreeMemory(allocator->device, block->memory, NULL);
+        free(block->free_ranges);
+        memset(block, 0, sizeof(ah_alloc_block_t));
+    }
+}
+
+AH_RESULT ah_alloc_find_memory_type(ah_allocator_t *allocator, uint32_t type_filter, VkMemoryPropertyFlags properties, uint32_t *memory_type) {
+    VkPhysicalDeviceMemoryProperties *mem_properties = &allocator->memory_properties;
+
+    for (uint32_t i = 0; i < mem_properties->memoryTypeCount; i++) {
+        if (type_filter & (1 << i) && (mem_properties->memoryTypes[i].propertyFlags & properties) == properties) {
+            *memory_type = i;
+            return AH_SUCCESS;
+        }
+    }
+
+    set_error("Couldn't find appropriate memory type");
+    return AH_FAILURE;
+}
+
+/// Small heaps, like the host visible BAR window, get smaller blocks so a
+/// single block doesn't take all of it
+VkDeviceSize block_size_for_type(ah_allocator_t *allocator, uint32_t memory_type) {
+    uint32_t heap = allocator->memory_properties.memoryTypes[memory_type].heapIndex;
+    VkDeviceSize heap_size = allocator->memory_properties.memoryHeaps[heap].size;
+
+    if (heap_size / 8 < AH_ALLOC_BLOCK_SIZE) {
+        return align_up(heap_size / 8, 1024 * 1024);
+    }
+
+    return AH_ALLOC_BLOCK_SIZE;
+}
+
+bool is_host_visible(ah_allocator_t *allocator, uint32_t memory_type) {
+    return allocator->memory_properties.memoryTypes[memory_type].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT;
+}
+
+AH_RESULT allocate_device_memory(ah_allocator_t *allocator, VkDeviceSize size, uint32_t memory_type, VkDeviceMemory *memory, uint8_t **mapped) {
+    if (allocator->num_device_allocations >= allocator->max_device_allocations) {
+        set_error("Out of device memory allocations");
+        return AH_FAILURE;
+    }
+
+    VkMemoryAllocateInfo alloc_info = {};
+    alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    alloc_info.allocationSize = size;
+    alloc_info.memoryTypeIndex = memory_type;
+
+    if (vkAllocateMemory(allocator->device, &alloc_info, NULL, memory) != VK_SUCCESS) {
+        set_error("Failed allocating device memory");
+        return AH_FAILURE;
+    }
+
+    *mapped = NULL;
+    if (is_host_visible(allocator, memory_type) &&
+        vkMapMemory(allocator->device, *memory, 0, VK_WHOLE_SIZE, 0, (void**)mapped) != VK_SUCCESS) {
+        vkFreeMemory(allocator->device, *memory, NULL);
+        set_error("Failed mapping device memory");
+        return AH_FAILURE;
+    }
+
+    allocator->num_device_allocations++;
+    return AH_SUCCESS;
+}
+
+AH_RESULT create_block(ah_allocator_t *allocator, uint32_t memory_type, int32_t *block_index) {
+    for (int32_t i = 0; i < AH_ALLOC_MAX_BLOCKS; i++) {
+        ah_alloc_block_t *block = &allocator->blocks[i];
+        if (block->memory != VK_NULL_HANDLE) {
+            continue;
+        }
+
+        block->size = block_size_for_type(allocator, memory_type);
+        if (allocate_device_memory(allocator, block->size, memory_type, &block->memory, &block->mapped) != AH_SUCCESS) {
+            return AH_FAILURE;
+        }
+
+        block->memory_type = memory_type;
+        block->used = 0;
+        block->free_ranges_capacity = 16;
+        block->free_ranges = (ah_alloc_range_t*)malloc(sizeof(ah_alloc_range_t)*block->free_ranges_capacity);
+        block->free_ranges[0].offset = 0;
+        block->free_ranges[0].size = block->size;
+        block->num_free_ranges = 1;
+
+        *block_index = i;
+        return AH_SUCCESS;
+    }
+
+    set_error("Out of allocator blocks");
+    return AH_FAILURE;
+}
+
+void insert_free_range(ah_alloc_block_t *block, uint32_t index, VkDeviceSize offset, VkDeviceSize size) {
+    if (block->num_free_ranges == block->free_ranges_capacity) {
+        block->free_ranges_capacity *= 2;
+        block->free_ranges = (ah_alloc_range_t*)realloc(block->free_ranges, sizeof(ah_alloc_range_t)*block->free_ranges_capacity);
+    }
+
+    memmove(
+        &block->free_ranges[index + 1],
+        &block->free_ranges[index],
+        sizeof(ah_alloc_range_t)*(block->num_free_ranges - index)
+    );
+    block->free_ranges[index].offset = offset;
+    block->free_ranges[index].size = size;
+    block->num_free_ranges++;
+}
+
+void remove_free_range(ah_alloc_block_t *block, uint32_t index) {
+    memmove(
+        &block->free_ranges[index],
+        &block->free_ranges[index + 1],
+        sizeof(ah_alloc_range_t)*(block->num_free_ranges - index - 1)
+    );
+    block->num_free_ranges--;
+}
+
+/// First fit. Alignment padding in front of the allocation stays in the
+/// free list instead of being lost.
+bool block_alloc(ah_alloc_block_t *block, VkDeviceSize size, VkDeviceSize alignment, VkDeviceSize *offset) {
+    for (uint32_t i = 0; i < block->num_free_ranges; i++) {
+        ah_alloc_range_t range = block->free_ranges[i];
+        VkDeviceSize start = align_up(range.offset, alignment);
+        VkDeviceSize end = start + size;
+
+        if (end > range.offset + range.size) {
+            continue;
+        }
+
+        VkDeviceSize lead = start - range.offset;
+        VkDeviceSize trail = range.offset + range.size - end;
+
+        if (lead > 0 && trail > 0) {
+            block->free_ranges[i].size = lead;
+            insert_free_range(block, i + 1, end, trail);
+        } else if (lead > 0) {
+            block->free_ranges[i].size = lead;
+        } else if (trail > 0) {
+            block->free_ranges[i].offset = end;
+            block->free_ranges[i].size = trail;
+        } else {
+            remove_free_range(block, i);
+        }
+
+        block->used += size;
+        *offset = start;
+        return true;
+    }
+
+    return false;
+}
+
+void block_free(ah_alloc_block_t *block, VkDeviceSize offset, VkDeviceSize size) {
+    uint32_t index = 0;
+    while (index < block->num_free_ranges && block->free_ranges[index].offset < offset) {
+        index++;
+    }
+
+    bool merge_prev = index > 0 &&
+        block->free_ranges[index - 1].offset + block->free_ranges[index - 1].size == offset;
+    bool merge_next = index < block->num_free_ranges &&
+        offset + size == block->free_ranges[index].offset;
+
+    if (merge_prev && merge_next) {
+        block->free_ranges[index - 1].size += size + block->free_ranges[index].size;
+        remove_free_range(block, index);
+    } else if (merge_prev) {
+        block->free_ranges[index - 1].size += size;
+    } else if (merge_next) {
+        block->free_ranges[index].offset = offset;
+        block->free_ranges[index].size += size;
+    } else {
+        insert_free_range(block, index, offset, size);
+    }
+
+    block->used -= size;
+}
+
+AH_RESULT ah_alloc_memory(ah_allocator_t *allocator, const VkMemoryRequirements *requirements, VkMemoryPropertyFlags properties, ah_alloc_kind_t kind, ah_allocation_t *allocation) {
+    uint32_t memory_type;
+    if (ah_alloc_find_memory_type(allocator, requirements->memoryTypeBits, properties, &memory_type) != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
+
+    VkDeviceSize size = requirements->size;
+    VkDeviceSize alignment = requirements->alignment;
+
+    // An optimal image owns every granularity page it touches, so no linear
+    // resource can ever land on the same page
+    if (kind == AH_ALLOC_OPTIMAL && allocator->buffer_image_granularity > alignment) {
+        alignment = allocator->buffer_image_granularity;
+    }
+    if (kind == AH_ALLOC_OPTIMAL) {
+        size = align_up(size, allocator->buffer_image_granularity);
+    }
+
+    allocation->memory_type = memory_type;
+    allocation->size = size;
+
+    // Anything too big to share a block gets its own allocation
+    if (size > block_size_for_type(allocator, memory_type) / 2) {
+        uint8_t *mapped;
+        if (allocate_device_memory(allocator, size, memory_type, &allocation->memory, &mapped) != AH_SUCCESS) {
+            return AH_FAILURE;
+        }
+
+        allocation->offset = 0;
+        allocation->mapped = mapped;
+        allocation->block = -1;
+        allocator->dedicated_bytes += size;
+        allocator->bytes_used += size;
+        allocator->num_allocations++;
+        return AH_SUCCESS;
+    }
+
+    int32_t block_index = -1;
+    VkDeviceSize offset = 0;
+
+    for (int32_t i = 0; i < AH_ALLOC_MAX_BLOCKS; i++) {
+        ah_alloc_block_t *block = &allocator->blocks[i];
+        if (block->memory == VK_NULL_HANDLE || block->memory_type != memory_type) {
+            continue;
+        }
+
+        if (block_alloc(block, size, alignment, &offset)) {
+            block_index = i;
+            break;
+        }
+    }
+
+    if (block_index < 0) {
+        if (create_block(allocator, memory_type, &block_index) != AH_SUCCESS) {
+            return AH_FAILURE;
+        }
+
+        if (!block_alloc(&allocator->blocks[block_index], size, alignment, &offset)) {
+            set_error("Allocation doesn't fit in a fresh block");
+            return AH_FAILURE;
+        }
+    }
+
+    ah_alloc_block_t *block = &allocator->blocks[block_index];
+    allocation->memory = block->memory;
+    allocation->offset = offset;
+    allocation->mapped = block->mapped ? block->mapped + offset : NULL;
+    allocation->block = block_index;
+    allocator->bytes_used += size;
+    allocator->num_allocations++;
+
+    return AH_SUCCESS;
+}
+
+void ah_alloc_free(ah_allocator_t *allocator, ah_allocation_t *allocation) {
+    if (allocation->memory == VK_NULL_HANDLE) {
+        return;
+    }
+
+    allocator->bytes_used -= allocation->size;
+    allocator->num_allocations--;
+
+    if (allocation->block < 0) {
+        vkFreeMemory(allocator->device, allocation->memory, NULL);
+        allocator->dedicated_bytes -= allocation->size;
+        allocator->num_device_allocations--;
+        memset(allocation, 0, sizeof(ah_allocation_t));
+        return;
+    }
+
+    ah_alloc_block_t *block = &allocator->blocks[allocation->block];
+    block_free(block, allocation->offset, allocation->size);
+
+    // Give empty blocks back to the driver, but keep the last one of each
+    // memory type around so allocate/free cycles don't thrash
+    if (block->used == 0) {
+        bool has_other_block = false;
+        for (int32_t i = 0; i < AH_ALLOC_MAX_BLOCKS; i++) {
+            if (i != allocation->block &&
+                allocator->blocks[i].memory != VK_NULL_HANDLE &&
+                allocator->blocks[i].memory_type == block->memory_type) {
+                has_other_block = true;
+                break;
+            }
+        }
+
+        if (has_other_block) {
+            vkFreeMemory(allocator->device, block->memory, NULL);
+            free(block->free_ranges);
+            memset(block, 0, sizeof(ah_alloc_block_t));
+            allocator->num_device_allocations--;
+        }
+    }
+
+    memset(allocation, 0, sizeof(ah_allocation_t));
+}
+
+/// Make device writes to a mapped allocation visible to the host, nothing
+/// to do for coherent memory. The range is widened to whole atoms.
+AH_RESULT ah_alloc_invalidate(ah_allocator_t *allocator, const ah_allocation_t *allocation) {
+    if (allocator->memory_properties.memoryTypes[allocation->memory_type].propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT) {
+        return AH_SUCCESS;
+    }
+
+    VkDeviceSize memory_size = allocation->block < 0 ? allocation->size : allocator->blocks[allocation->block].size;
+    VkDeviceSize atom = allocator->non_coherent_atom_size;
+    VkDeviceSize offset = allocation->offset / atom * atom;
+    VkDeviceSize end = align_up(allocation->offset + allocation->size, atom);
+
+    VkMappedMemoryRange range = {};
+    range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+    range.memory = allocation->memory;
+    range.offset = offset;
+    range.size = end < memory_size ? end - offset : VK_WHOLE_SIZE;
+
+    if (vkInvalidateMappedMemoryRanges(allocator->device, 1, &range) != VK_SUCCESS) {
+        set_error("Failed to invalidate mapped memory");
+        return AH_FAILURE;
+    }
+    return AH_SUCCESS;
+}
+
+void ah_alloc_get_stats(ah_allocator_t *allocator, ah_alloc_stats_t *stats) {
+    VkDeviceSize total_free = 0;
+    VkDeviceSize largest_free = 0;
+
+    stats->bytes_reserved = allocator->dedicated_bytes;
+
+    for (uint32_t i = 0; i < AH_ALLOC_MAX_BLOCKS; i++) {
+        ah_alloc_block_t *block = &allocator->blocks[i];
+        if (block->memory == VK_NULL_HANDLE) {
+            continue;
+        }
+
+        stats->bytes_reserved += block->size;
+        for (uint32_t j = 0; j < block->num_free_ranges; j++) {
+            total_free += block->free_ranges[j].size;
+            if (block->free_ranges[j].size > largest_free) {
+                largest_free = block->free_ranges[j].size;
+            }
+        }
+    }
+
+    stats->bytes_used = allocator->bytes_used;
+    stats->num_allocations = allocator->num_allocations;
+    stats->num_device_allocations = allocator->num_device_allocations;
+    stats->fragmentation = total_free == 0 ? 0.0f : 1.0f - (float)largest_free / (float)total_free;
+}
+
+void ah_alloc_print_stats(ah_allocator_t *allocator) {
+    ah_alloc_stats_t stats;
+    ah_alloc_get_stats(allocator, &stats);
+
+    printf(
+        "GPU memory: %.2f MiB used, %.2f MiB reserved, %u allocations in %u device allocations, %.1f%% fragmentation\n",
+        stats.bytes_used / (1024.0 * 1024.0),
+        stats.bytes_reserved / (1024.0 * 1024.0),
+        stats.num_allocations,
+        stats.num_device_allocations,
+        stats.fragmentation * 100.0f
+    );
+}
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "ah.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <vulkan/vulkan_core.h>
+
+#define AH_ALLOC_BLOCK_SIZE (64 * 1024 * 1024)
+#define AH_ALLOC_MAX_BLOCKS 128
+
+typedef enum ah_alloc_kind {
+    // Buffers and linear images
+    AH_ALLOC_LINEAR,
+    // Optimal tiling images, kept `bufferImageGranularity` apart from
+    // linear resources
+    AH_ALLOC_OPTIMAL,
+} ah_alloc_kind_t;
+
+typedef struct ah_alloc_range {
+    VkDeviceSize offset;
+    VkDeviceSize size;
+} ah_alloc_range_t;
+
+typedef struct ah_alloc_block {
+    VkDeviceMemory memory;
+    VkDeviceSize size;
+    VkDeviceSize used;
+    uint32_t memory_type;
+    // Host visible blocks stay mapped for their whole lifetime
+    uint8_t *mapped;
+
+    // Free ranges sorted by offset, neighbours are merged on free
+    ah_alloc_range_t *free_ranges;
+    uint32_t num_free_ranges;
+    uint32_t free_ranges_capacity;
+} ah_alloc_block_t;
+
+typedef struct ah_allocation {
+    VkDeviceMemory memory;
+    VkDeviceSize offset;
+    VkDeviceSize size;
+    // Points at `offset` inside the memory when it is host visible
+    void *mapped;
+    uint32_t memory_type;
+    // Index into the allocator blocks, -1 for dedicated allocations
+    int32_t block;
+} ah_allocation_t;
+
+typedef struct ah_alloc_stats {
+    VkDeviceSize bytes_used;
+    VkDeviceSize bytes_reserved;
+    uint32_t num_allocations;
+    uint32_t num_device_allocations;
+    // 1 - largest free range / total free bytes, 0 when free space is
+    // one contiguous range
+    float fragmentation;
+} ah_alloc_stats_t;
+
+typedef struct ah_allocator {
+    VkDevice device;
+    VkPhysicalDeviceMemoryProperties memory_properties;
+    VkDeviceSize buffer_image_granularity;
+    uint32_t max_device_allocations;
+    VkDeviceSize non_coherent_atom_size;
+
+    ah_alloc_block_t blocks[AH_ALLOC_MAX_BLOCKS];
+
+    VkDeviceSize bytes_used;
+    VkDeviceSize dedicated_bytes;
+    uint32_t num_allocations;
+    uint32_t num_device_allocations;
+} ah_allocator_t;
+
+AH_RESULT ah_alloc_init(ah_allocator_t *allocator, VkPhysicalDevice physical_device, VkDevice device);
+void ah_alloc_destroy(ah_allocator_t *allocator);
+AH_RESULT ah_alloc_find_memory_type(ah_allocator_t *allocator, uint32_t type_filter, VkMemoryPropertyFlags properties, uint32_t *memory_type);
+AH_RESULT ah_alloc_memory(ah_allocator_t *allocator, const VkMemoryRequirements *requirements, VkMemoryPropertyFlags properties, ah_alloc_kind_t kind, ah_allocation_t *allocation);
+void ah_alloc_free(ah_allocator_t *allocator, ah_allocation_t *allocation);
+AH_RESULT ah_alloc_invalidate(ah_allocator_t *allocator, const ah_allocation_t *allocation);
+void ah_alloc_get_stats(ah_allocator_t *allocator, ah_alloc_stats_t *stats);
+void ah_alloc_print_stats(ah_allocator_t *allocator);
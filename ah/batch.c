@@ -0,0 +1,349 @@
+#include "batch.h"
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vulkan/vulkan_core.h>
+#include "ah.h"
+#include "capture.h"
+#include "errors.h"
+#include "frame.h"
+#include "image_file.h"
+#include "instancing.h"
+#include "instrument.h"
+#include "jobs.h"
+#include "mesh.h"
+#include "scheduler.h"
+#include "vk.h"
+
+/// At most one integer conversion for the frame number, and one is needed
+/// when the job renders more than a frame. Only the 0-+ and space flags
+/// and a width are allowed, anything else would make snprintf read
+/// arguments that aren't there or print something other than a number.
+bool valid_output_pattern(const ah_batch_job_t *job) {
+    uint32_t conversions = 0;
+
+    for (const char *c = job->output; *c; c++) {
+        if (*c != '%') {
+            continue;
+        }
+        c++;
+        if (*c == '%') {
+            continue;
+        }
+
+        c += strspn(c, "0-+ ");
+        c += strspn(c, "0123456789");
+        if (*c != 'u' && *c != 'd') {
+            return false;
+        }
+        conversions++;
+    }
+
+    return conversions == 1 || (conversions == 0 && job->first_frame == job->last_frame);
+}
+
+/// Read a job list, one job per line:
+///
+///     output mesh instances first-frame last-frame [camera-x camera-y zoom]
+///
+/// `output` is a printf pattern for the frame number ending in .png or .ppm,
+/// `mesh` is "-" for the built-in triangle. Blank lines and lines starting
+/// with # are skipped.
+AH_RESULT ah_batch_load(ah_batch_t *batch, const char *path) {
+    memset(batch, 0, sizeof(ah_batch_t));
+
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        set_error("Could not open job list");
+        return AH_FAILURE;
+    }
+
+    uint32_t capacity = 0;
+    char line[1024];
+    while (fgets(line, sizeof(line), fp)) {
+        const char *start = line + strspn(line, " \t");
+        if (*start == '#' || *start == '\n' || *start == '\r' || *start == '\0') {
+            continue;
+        }
+
+        ah_batch_job_t job = {};
+        job.camera[2] = 1.0f;
+        char mesh[AH_BATCH_MAX_PATH];
+        int fields = sscanf(
+            start,
+            "%255s %255s %u %u %u %f %f %f",
+            job.output,
+            mesh,
+            &job.num_instances,
+            &job.first_frame,
+            &job.last_frame,
+            &job.camera[0],
+            &job.camera[1],
+            &job.camera[2]
+        );
+
+        if ((fields != 5 && fields != 8) ||
+            job.last_frame < job.first_frame ||
+            !valid_output_pattern(&job) ||
+            ah_image_file_format_from_path(job.output, &job.format) != AH_SUCCESS) {
+            fclose(fp);
+            free(batch->jobs);
+            batch->jobs = NULL;
+            set_error("Malformed job, expected: output mesh instances first last [x y zoom]");
+            return AH_FAILURE;
+        }
+        if (strcmp(mesh, "-") != 0) {
+            memcpy(job.mesh, mesh, sizeof(job.mesh));
+        }
+
+        if (batch->num_jobs == capacity) {
+            capacity = capacity ? capacity * 2 : 16;
+            ah_batch_job_t *jobs = (ah_batch_job_t*)realloc(batch->jobs, sizeof(ah_batch_job_t) * capacity);
+            if (!jobs) {
+                fclose(fp);
+                free(batch->jobs);
+                batch->jobs = NULL;
+                batch->num_jobs = 0;
+                set_error("Out of memory reading job list");
+                return AH_FAILURE;
+            }
+            batch->jobs = jobs;
+        }
+        batch->jobs[batch->num_jobs++] = job;
+    }
+    fclose(fp);
+
+    if (batch->num_jobs == 0) {
+        set_error("Job list is empty");
+        return AH_FAILURE;
+    }
+
+    return AH_SUCCESS;
+}
+
+/// Set up `vk_state` for batch rendering before `ah_vk_init`. The first
+/// job's scene is loaded by init, so its vertex format is the one the
+/// pipelines are built for.
+void ah_batch_configure(ah_batch_t *batch, vulkan_state_t *vk_state) {
+    vk_state->headless = true;
+    vk_state->watch_shaders = false;
+    // Every frame needs its job's mesh, and a texture would still be
+    // growing over the first frames
+    vk_state->stream_assets = false;
+    vk_state->texture_path = NULL;
+    vk_state->capture.consume = ah_batch_consume;
+    vk_state->capture.user = batch;
+
+    ah_batch_job_t *first = &batch->jobs[0];
+    vk_state->mesh_path = first->mesh[0] ? first->mesh : NULL;
+    vk_state->num_instances = first->num_instances;
+    memcpy(batch->mesh, first->mesh, sizeof(batch->mesh));
+    batch->mesh_loaded = true;
+}
+
+/// Start the encoders, after `ah_vk_init`
+AH_RESULT ah_batch_init(ah_batch_t *batch, vulkan_state_t *vk_state) {
+    if (!vk_state->capture.enabled) {
+        set_error("Frames can't be captured");
+        return AH_FAILURE;
+    }
+    batch->capture = &vk_state->capture;
+
+    // Half the cores, the other half records and submits frames
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    if (ah_jobs_init(&batch->encoders, cores > 3 ? (uint32_t)(cores / 2) : 1) != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
+
+    for (uint32_t i = 0; i < AH_CAPTURE_SLOTS; i++) {
+        batch->outputs[i].batch = batch;
+    }
+
+    return AH_SUCCESS;
+}
+
+/// Runs on an encoder, straight from the mapped capture buffer
+void encode_output(void *data, uint32_t worker) {
+    (void)worker;
+    ah_batch_output_t *output = (ah_batch_output_t*)data;
+    ah_batch_t *batch = output->batch;
+    const ah_capture_frame_t *frame = &output->frame;
+
+    AH_ZONE_BEGIN(zone, "encode");
+    if (ah_image_file_write(output->path, output->format, frame->pixels, frame->format, frame->width, frame->height) == AH_SUCCESS) {
+        atomic_fetch_add_explicit(&batch->num_written, 1, memory_order_relaxed);
+    } else {
+        printf("Failed to write %s\n", output->path);
+        atomic_fetch_add_explicit(&batch->num_failed, 1, memory_order_relaxed);
+    }
+    AH_ZONE_END(zone);
+
+    ah_capture_release(batch->capture, frame->slot);
+}
+
+/// Capture consumer, queues the encode of a landed frame
+void ah_batch_consume(const ah_capture_frame_t *frame, void *user) {
+    ah_batch_t *batch = (ah_batch_t*)user;
+    ah_batch_output_t *output = &batch->outputs[frame->slot];
+    output->frame = *frame;
+    ah_jobs_push(&batch->encoders, encode_output, output, &output->encoded);
+}
+
+/// Wait until capture slot `slot` can take another frame. The caller helps
+/// the encoders meanwhile instead of sleeping.
+AH_RESULT reclaim_slot(ah_batch_t *batch, vulkan_state_t *vk_state, uint32_t slot) {
+    if (ah_capture_flush(vk_state, slot) != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
+
+    AH_ZONE_BEGIN(zone, "encode wait");
+    ah_jobs_wait(&batch->encoders, &batch->outputs[slot].encoded);
+    AH_ZONE_END(zone);
+    return AH_SUCCESS;
+}
+
+/// Switch to the scene of `job`. The mesh is only replaced when it changes,
+/// and must have the vertex format the pipelines were built for.
+AH_RESULT load_scene(ah_batch_t *batch, vulkan_state_t *vk_state, const ah_batch_job_t *job) {
+    bool mesh_changed = !batch->mesh_loaded || strcmp(batch->mesh, job->mesh) != 0;
+
+    if (mesh_changed) {
+        ah_mesh_t mesh;
+        if (job->mesh[0]) {
+            if (ah_mesh_open(&mesh, job->mesh) != AH_SUCCESS) {
+                return AH_FAILURE;
+            }
+        } else {
+            ah_mesh_init_triangle(&mesh);
+        }
+
+        if (mesh.vertex_format != vk_state->mesh.vertex_format) {
+            ah_mesh_destroy(vk_state, &mesh);
+            set_error("Mesh vertex format differs from the first job's");
+            return AH_FAILURE;
+        }
+
+        // Frames in flight still draw the old mesh
+        if (ah_scheduler_wait(vk_state, AH_QUEUE_GRAPHICS, vk_state->scheduler.timelines[AH_QUEUE_GRAPHICS].submitted) != AH_SUCCESS) {
+            ah_mesh_destroy(vk_state, &mesh);
+            return AH_FAILURE;
+        }
+        ah_mesh_destroy(vk_state, &vk_state->mesh);
+        vk_state->mesh = mesh;
+        batch->mesh_loaded = false;
+
+        if (ah_mesh_upload(vk_state, &vk_state->mesh) != AH_SUCCESS) {
+            return AH_FAILURE;
+        }
+        vk_state->draws[0] = ah_mesh_draw(&vk_state->mesh);
+        memcpy(batch->mesh, job->mesh, sizeof(batch->mesh));
+        batch->mesh_loaded = true;
+    }
+
+    // The indirect commands hold the mesh's index count
+    if (mesh_changed || vk_state->instancing.num_instances != job->num_instances) {
+        if (ah_instancing_set_count(vk_state, job->num_instances) != AH_SUCCESS) {
+            return AH_FAILURE;
+        }
+    }
+
+    float zoom = job->camera[2];
+    glm_mat4_identity(vk_state->view_projection);
+    vk_state->view_projection[0][0] = zoom;
+    vk_state->view_projection[1][1] = zoom;
+    vk_state->view_projection[3][0] = -job->camera[0] * zoom;
+    vk_state->view_projection[3][1] = -job->camera[1] * zoom;
+
+    return AH_SUCCESS;
+}
+
+/// Render one frame of `job` and queue its readback
+AH_RESULT render_frame(ah_batch_t *batch, vulkan_state_t *vk_state, const ah_batch_job_t *job, uint32_t frame_number) {
+    // The frame takes the capture ring's next slot, free once reclaimed
+    uint32_t slot = batch->capture->next_slot;
+    if (reclaim_slot(batch, vk_state, slot) != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
+
+    ah_batch_output_t *output = &batch->outputs[slot];
+    if (snprintf(output->path, sizeof(output->path), job->output, frame_number) >= (int)sizeof(output->path)) {
+        set_error("Output path too long");
+        return AH_FAILURE;
+    }
+    output->format = job->format;
+
+    if (ah_vk_draw_frame(vk_state, frame_number, NULL) != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
+    if (!batch->capture->enabled) {
+        set_error("Capture stopped");
+        return AH_FAILURE;
+    }
+
+    return AH_SUCCESS;
+}
+
+/// Render every job and report throughput. A job whose scene can't be
+/// loaded is skipped, a device error stops the batch.
+AH_RESULT ah_batch_run(ah_batch_t *batch, vulkan_state_t *vk_state) {
+    double start = ah_now_ms();
+    uint32_t num_skipped = 0;
+
+    for (uint32_t i = 0; i < batch->num_jobs; i++) {
+        ah_batch_job_t *job = &batch->jobs[i];
+
+        if (load_scene(batch, vk_state, job) != AH_SUCCESS) {
+            print_error("batch/load_scene");
+            printf("Skipping job %u, %s\n", i + 1, job->output);
+            num_skipped++;
+            continue;
+        }
+
+        for (uint64_t frame_number = job->first_frame; frame_number <= job->last_frame; frame_number++) {
+            if (render_frame(batch, vk_state, job, (uint32_t)frame_number) != AH_SUCCESS) {
+                print_error("batch/render_frame");
+                return AH_FAILURE;
+            }
+        }
+    }
+
+    for (uint32_t i = 0; i < AH_CAPTURE_SLOTS; i++) {
+        if (reclaim_slot(batch, vk_state, i) != AH_SUCCESS) {
+            print_error("batch/reclaim_slot");
+            return AH_FAILURE;
+        }
+    }
+
+    double seconds = (ah_now_ms() - start) / 1000.0;
+    uint32_t num_written = atomic_load(&batch->num_written);
+    uint32_t num_failed = atomic_load(&batch->num_failed);
+    printf(
+        "Batch: %u images at %ux%u in %.2f s, %.1f images/s, %u failed, %u of %u jobs skipped\n",
+        num_written,
+        vk_state->swapchain_extent.width,
+        vk_state->swapchain_extent.height,
+        seconds,
+        seconds > 0.0 ? num_written / seconds : 0.0,
+        num_failed,
+        num_skipped,
+        batch->num_jobs
+    );
+
+    return num_failed == 0 && num_skipped == 0 ? AH_SUCCESS : AH_FAILURE;
+}
+
+/// Before `ah_vk_cleanup`, which frees the capture buffers the encoders
+/// read from
+void ah_batch_destroy(ah_batch_t *batch, vulkan_state_t *vk_state) {
+    (void)vk_state;
+    if (batch->encoders.num_workers > 0) {
+        ah_jobs_destroy(&batch->encoders);
+    }
+
+    free(batch->jobs);
+    batch->jobs = NULL;
+    batch->num_jobs = 0;
+}
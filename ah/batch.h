@@ -0,0 +1,70 @@
+#pragma once
+
+#include "ah.h"
+#include "capture.h"
+#include "image_file.h"
+#include "jobs.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <vulkan/vulkan_core.h>
+
+#define AH_BATCH_MAX_PATH 256
+
+typedef struct vulkan_state vulkan_state_t;
+
+/// One line of a job list: a scene, the camera looking at it and the frames
+/// to render into numbered files
+typedef struct ah_batch_job {
+    // printf pattern taking the frame number, the extension picks the format
+    char output[AH_BATCH_MAX_PATH];
+    ah_image_file_format_t format;
+    // Empty for the built-in triangle
+    char mesh[AH_BATCH_MAX_PATH];
+    uint32_t num_instances;
+    uint32_t first_frame;
+    uint32_t last_frame;
+    // Centre of the view and its magnification
+    float camera[3];
+} ah_batch_job_t;
+
+/// The file a capture slot's frame goes to
+typedef struct ah_batch_output {
+    char path[AH_BATCH_MAX_PATH];
+    ah_image_file_format_t format;
+    ah_capture_frame_t frame;
+    ah_job_counter_t encoded;
+    struct ah_batch *batch;
+} ah_batch_output_t;
+
+/// Renders a job list headless with one device and one set of pipelines.
+/// Frames are copied out through the capture ring and each file is encoded
+/// on a worker pool of its own, straight from the mapped buffer. Rendering,
+/// readback and encoding of different frames overlap, but unlike a live
+/// capture no frame is dropped: the render loop helps encoding until the
+/// next slot frees up.
+typedef struct ah_batch {
+    ah_batch_job_t *jobs;
+    uint32_t num_jobs;
+
+    // Separate from `vk_state->jobs`, waiting on render jobs never picks up
+    // an encode
+    ah_job_pool_t encoders;
+    ah_batch_output_t outputs[AH_CAPTURE_SLOTS];
+    ah_capture_t *capture;
+
+    // Mesh of the loaded scene, empty for the triangle. Not loaded after a
+    // failed switch, the next job loads its own.
+    char mesh[AH_BATCH_MAX_PATH];
+    bool mesh_loaded;
+
+    _Atomic uint32_t num_written;
+    _Atomic uint32_t num_failed;
+} ah_batch_t;
+
+AH_RESULT ah_batch_load(ah_batch_t *batch, const char *path);
+void ah_batch_configure(ah_batch_t *batch, vulkan_state_t *vk_state);
+AH_RESULT ah_batch_init(ah_batch_t *batch, vulkan_state_t *vk_state);
+void ah_batch_consume(const ah_capture_frame_t *frame, void *user);
+AH_RESULT ah_batch_run(ah_batch_t *batch, vulkan_state_t *vk_state);
+void ah_batch_destroy(ah_batch_t *batch, vulkan_state_t *vk_state);
@@ -0,0 +1,471 @@
+#include "bindless.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vulkan/vulkan_core.h>
+#include "ah.h"
+#include "errors.h"
+#include "scheduler.h"
+#include "vk.h"
+
+AH_RESULT ah_handles_init(ah_handle_allocator_t *handles, uint32_t capacity) {
+    memset(handles, 0, sizeof(ah_handle_allocator_t));
+    handles->capacity = capacity;
+    handles->free_handles = (uint32_t*)malloc(sizeof(uint32_t)*capacity);
+    handles->retired = (ah_retired_handle_t*)malloc(sizeof(ah_retired_handle_t)*capacity);
+    handles->allocated = (bool*)calloc(capacity, sizeof(bool));
+
+    if (!handles->free_handles || !handles->retired || !handles->allocated) {
+        set_error("Error allocating bindless handles");
+        return AH_FAILURE;
+    }
+
+    return AH_SUCCESS;
+}
+
+/// Move retired handles the graphics queue is done with to the free list
+void collect_handles(vulkan_state_t *vk_state, ah_handle_allocator_t *handles) {
+    uint32_t num_kept = 0;
+
+    for (uint32_t i = 0; i < handles->num_retired; i++) {
+        ah_retired_handle_t *retired = &handles->retired[i];
+
+        if (ah_scheduler_poll(vk_state, AH_QUEUE_GRAPHICS, retired->value)) {
+            handles->free_handles[handles->num_free++] = retired->handle;
+        } else {
+            handles->retired[num_kept++] = *retired;
+        }
+    }
+
+    handles->num_retired = num_kept;
+}
+
+/// Reused slots come first to keep the tables dense, AH_BINDLESS_NONE once
+/// every slot is taken or still read by frames in flight
+uint32_t ah_handles_alloc(vulkan_state_t *vk_state, ah_handle_allocator_t *handles) {
+    if (handles->num_free == 0 && handles->num_retired > 0) {
+        collect_handles(vk_state, handles);
+    }
+
+    uint32_t handle = AH_BINDLESS_NONE;
+    if (handles->num_free > 0) {
+        handle = handles->free_handles[--handles->num_free];
+    } else if (handles->next < handles->capacity) {
+        handle = handles->next++;
+    }
+
+    if (handle != AH_BINDLESS_NONE) {
+        handles->allocated[handle] = true;
+    }
+    return handle;
+}
+
+/// Handles that are free or already retired are ignored
+void ah_handles_free(vulkan_state_t *vk_state, ah_handle_allocator_t *handles, uint32_t handle) {
+    if (handle >= handles->next || !handles->allocated[handle]) {
+        return;
+    }
+    handles->allocated[handle] = false;
+
+    ah_retired_handle_t *retired = &handles->retired[handles->num_retired++];
+    retired->handle = handle;
+    retired->value = vk_state->scheduler.timelines[AH_QUEUE_GRAPHICS].submitted;
+}
+
+void ah_handles_destroy(ah_handle_allocator_t *handles) {
+    free(handles->free_handles);
+    free(handles->retired);
+    free(handles->allocated);
+    handles->free_handles = NULL;
+    handles->retired = NULL;
+    handles->allocated = NULL;
+}
+
+uint32_t min_u32(uint32_t a, uint32_t b) {
+    return a < b ? a : b;
+}
+
+/// Array sizes that fit the regular descriptor limits, the update after
+/// bind ones are far above AH_BINDLESS_MAX_IMAGES and _BUFFERS
+void descriptor_counts(vulkan_state_t *vk_state, uint32_t *num_images, uint32_t *num_buffers) {
+    *num_images = AH_BINDLESS_MAX_IMAGES;
+    *num_buffers = AH_BINDLESS_MAX_BUFFERS;
+    if (vk_state->features.update_after_bind) {
+        return;
+    }
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(vk_state->physical_device, &properties);
+    VkPhysicalDeviceLimits *limits = &properties.limits;
+
+    uint32_t images = min_u32(limits->maxPerStageDescriptorSampledImages, limits->maxPerStageDescriptorSamplers);
+    images = min_u32(images, min_u32(limits->maxDescriptorSetSampledImages, limits->maxDescriptorSetSamplers));
+    uint32_t buffers = min_u32(limits->maxPerStageDescriptorStorageBuffers, limits->maxDescriptorSetStorageBuffers);
+
+    // The other sets of the scene pipelines count against the same limits
+    if (images > AH_BINDLESS_RESERVED_DESCRIPTORS) {
+        *num_images = min_u32(*num_images, images - AH_BINDLESS_RESERVED_DESCRIPTORS);
+    } else {
+        *num_images = 1;
+    }
+    if (buffers > AH_BINDLESS_RESERVED_DESCRIPTORS) {
+        *num_buffers = min_u32(*num_buffers, buffers - AH_BINDLESS_RESERVED_DESCRIPTORS);
+    } else {
+        *num_buffers = 1;
+    }
+}
+
+AH_RESULT create_bindless_descriptors(vulkan_state_t *vk_state) {
+    ah_bindless_t *bindless = &vk_state->bindless;
+    bool update_after_bind = vk_state->features.update_after_bind;
+
+    // Sampled images at binding 0, storage buffers at binding 1
+    VkDescriptorSetLayoutBinding bindings[2] = {};
+    bindings[0].binding = 0;
+    bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    bindings[0].descriptorCount = bindless->images.capacity;
+    bindings[0].stageFlags = VK_SHADER_STAGE_ALL_GRAPHICS | VK_SHADER_STAGE_COMPUTE_BIT;
+    bindings[1].binding = 1;
+    bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    bindings[1].descriptorCount = bindless->buffers.capacity;
+    bindings[1].stageFlags = VK_SHADER_STAGE_ALL_GRAPHICS | VK_SHADER_STAGE_COMPUTE_BIT;
+
+    // Unwritten slots are fine as long as shaders don't read them. With
+    // update after bind, slots no pending frame reads can be rewritten
+    // while it executes.
+    VkDescriptorBindingFlags binding_flags[2];
+    for (uint32_t i = 0; i < 2; i++) {
+        binding_flags[i] = VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT;
+        if (update_after_bind) {
+            binding_flags[i] |= VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT |
+                VK_DESCRIPTOR_BINDING_UPDATE_UNUSED_WHILE_PENDING_BIT;
+        }
+    }
+
+    VkDescriptorSetLayoutBindingFlagsCreateInfo binding_flags_info = {};
+    binding_flags_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO;
+    binding_flags_info.bindingCount = 2;
+    binding_flags_info.pBindingFlags = binding_flags;
+
+    VkDescriptorSetLayoutCreateInfo layout_info = {};
+    layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layout_info.pNext = &binding_flags_info;
+    layout_info.flags = update_after_bind ? VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT : 0;
+    layout_info.bindingCount = 2;
+    layout_info.pBindings = bindings;
+
+    if (vkCreateDescriptorSetLayout(vk_state->device, &layout_info, NULL, &bindless->set_layout) != VK_SUCCESS) {
+        set_error("Error creating bindless descriptor set layout");
+        return AH_FAILURE;
+    }
+
+    bindless->num_sets = update_after_bind ? 1 : vk_state->frames_in_flight;
+
+    VkDescriptorPoolSize pool_sizes[2] = {};
+    pool_sizes[0].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    pool_sizes[0].descriptorCount = bindless->images.capacity * bindless->num_sets;
+    pool_sizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    pool_sizes[1].descriptorCount = bindless->buffers.capacity * bindless->num_sets;
+
+    VkDescriptorPoolCreateInfo pool_info = {};
+    pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool_info.flags = update_after_bind ? VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT : 0;
+    pool_info.maxSets = bindless->num_sets;
+    pool_info.poolSizeCount = 2;
+    pool_info.pPoolSizes = pool_sizes;
+
+    if (vkCreateDescriptorPool(vk_state->device, &pool_info, NULL, &bindless->descriptor_pool) != VK_SUCCESS) {
+        set_error("Error creating bindless descriptor pool");
+        return AH_FAILURE;
+    }
+
+    VkDescriptorSetLayout set_layouts[AH_MAX_FRAMES_IN_FLIGHT];
+    for (uint32_t i = 0; i < bindless->num_sets; i++) {
+        set_layouts[i] = bindless->set_layout;
+    }
+
+    VkDescriptorSetAllocateInfo alloc_info = {};
+    alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    alloc_info.descriptorPool = bindless->descriptor_pool;
+    alloc_info.descriptorSetCount = bindless->num_sets;
+    alloc_info.pSetLayouts = set_layouts;
+
+    if (vkAllocateDescriptorSets(vk_state->device, &alloc_info, bindless->descriptor_sets) != VK_SUCCESS) {
+        set_error("Error allocating bindless descriptor set");
+        return AH_FAILURE;
+    }
+
+    VkSamplerCreateInfo sampler_info = {};
+    sampler_info.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+    sampler_info.magFilter = VK_FILTER_LINEAR;
+    sampler_info.minFilter = VK_FILTER_LINEAR;
+    sampler_info.mipmapMode = VK_SAMPLER_MIPMAP_MODE_LINEAR;
+    sampler_info.addressModeU = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+    sampler_info.addressModeV = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+    sampler_info.addressModeW = VK_SAMPLER_ADDRESS_MODE_REPEAT;
+    sampler_info.maxLod = VK_LOD_CLAMP_NONE;
+
+    if (vkCreateSampler(vk_state->device, &sampler_info, NULL, &bindless->default_sampler) != VK_SUCCESS) {
+        set_error("Error creating bindless sampler");
+        return AH_FAILURE;
+    }
+
+    return AH_SUCCESS;
+}
+
+/// Create the bindless set and the material table, which takes storage
+/// buffer slot AH_BINDLESS_MATERIAL_TABLE, and a plain white material
+AH_RESULT ah_bindless_init(vulkan_state_t *vk_state) {
+    ah_bindless_t *bindless = &vk_state->bindless;
+    memset(bindless, 0, sizeof(ah_bindless_t));
+
+    uint32_t num_images;
+    uint32_t num_buffers;
+    descriptor_counts(vk_state, &num_images, &num_buffers);
+
+    if (ah_handles_init(&bindless->images, num_images) != AH_SUCCESS ||
+        ah_handles_init(&bindless->buffers, num_buffers) != AH_SUCCESS ||
+        ah_handles_init(&bindless->materials, AH_BINDLESS_MAX_MATERIALS) != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
+
+    if (create_bindless_descriptors(vk_state) != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
+
+    VkDeviceSize table_size = sizeof(ah_material_t)*AH_BINDLESS_MAX_MATERIALS;
+    if (ah_vk_create_buffer(
+        vk_state,
+        table_size,
+        VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+        &bindless->material_buffer,
+        &bindless->material_allocation)
+    != AH_SUCCESS) {
+        set_error("Failed to create material table");
+        return AH_FAILURE;
+    }
+    bindless->material_data = (ah_material_t*)bindless->material_allocation.mapped;
+
+    if (ah_bindless_add_buffer(vk_state, bindless->material_buffer, 0, table_size) != AH_BINDLESS_MATERIAL_TABLE) {
+        set_error("Material table didn't get its buffer slot");
+        return AH_FAILURE;
+    }
+
+    ah_material_t material = {};
+    material.color[0] = 1.0f;
+    material.color[1] = 1.0f;
+    material.color[2] = 1.0f;
+    material.color[3] = 1.0f;
+    material.texture = AH_BINDLESS_NONE;
+
+    if (ah_bindless_add_material(vk_state, &material) != AH_BINDLESS_DEFAULT_MATERIAL) {
+        set_error("Default material didn't get its slot");
+        return AH_FAILURE;
+    }
+
+    return AH_SUCCESS;
+}
+
+void write_descriptor(vulkan_state_t *vk_state, VkDescriptorSet set, const ah_bindless_write_t *pending) {
+    VkWriteDescriptorSet write = {};
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.dstSet = set;
+    write.dstBinding = pending->binding;
+    write.dstArrayElement = pending->element;
+    write.descriptorCount = 1;
+    if (pending->binding == 0) {
+        write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+        write.pImageInfo = &pending->image;
+    } else {
+        write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        write.pBufferInfo = &pending->buffer;
+    }
+    vkUpdateDescriptorSets(vk_state->device, 1, &write, 0, NULL);
+}
+
+/// Whether a slot can be written now, false while the pending writes of
+/// the per-frame sets are full
+bool can_write(vulkan_state_t *vk_state) {
+    if (vk_state->features.update_after_bind ||
+        vk_state->bindless.num_pending_writes < AH_BINDLESS_MAX_PENDING_WRITES) {
+        return true;
+    }
+
+    set_error("Too many bindless writes pending");
+    return false;
+}
+
+/// Straight into the set with update after bind, otherwise into every set
+/// as its frame slot comes up in `ah_bindless_flush`
+void queue_write(vulkan_state_t *vk_state, const ah_bindless_write_t *write) {
+    ah_bindless_t *bindless = &vk_state->bindless;
+    if (vk_state->features.update_after_bind) {
+        write_descriptor(vk_state, bindless->descriptor_sets[0], write);
+        return;
+    }
+
+    ah_bindless_write_t *pending = &bindless->pending_writes[bindless->num_pending_writes++];
+    *pending = *write;
+    pending->written = 0;
+}
+
+/// A freed slot is never read again, writes still on their way to other
+/// sets may point at objects destroyed by then
+void cancel_writes(vulkan_state_t *vk_state, uint32_t binding, uint32_t element) {
+    ah_bindless_t *bindless = &vk_state->bindless;
+    uint32_t num_kept = 0;
+
+    for (uint32_t i = 0; i < bindless->num_pending_writes; i++) {
+        ah_bindless_write_t *pending = &bindless->pending_writes[i];
+        if (pending->binding != binding || pending->element != element) {
+            bindless->pending_writes[num_kept++] = *pending;
+        }
+    }
+
+    bindless->num_pending_writes = num_kept;
+}
+
+/// Register an image for sampling, with the default linear repeat sampler
+/// when `sampler` is VK_NULL_HANDLE. The view must be in
+/// SHADER_READ_ONLY_OPTIMAL whenever a shader reads it.
+uint32_t ah_bindless_add_image(vulkan_state_t *vk_state, VkImageView view, VkSampler sampler) {
+    ah_bindless_t *bindless = &vk_state->bindless;
+    if (!can_write(vk_state)) {
+        return AH_BINDLESS_NONE;
+    }
+
+    uint32_t handle = ah_handles_alloc(vk_state, &bindless->images);
+    if (handle == AH_BINDLESS_NONE) {
+        set_error("Out of bindless image slots");
+        return AH_BINDLESS_NONE;
+    }
+
+    ah_bindless_write_t write = {};
+    write.binding = 0;
+    write.element = handle;
+    write.image.sampler = sampler != VK_NULL_HANDLE ? sampler : bindless->default_sampler;
+    write.image.imageView = view;
+    write.image.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    queue_write(vk_state, &write);
+
+    return handle;
+}
+
+void ah_bindless_remove_image(vulkan_state_t *vk_state, uint32_t handle) {
+    cancel_writes(vk_state, 0, handle);
+    ah_handles_free(vk_state, &vk_state->bindless.images, handle);
+}
+
+/// Whether every set has the image, only then can every frame slot sample it
+bool ah_bindless_image_written(vulkan_state_t *vk_state, uint32_t handle) {
+    ah_bindless_t *bindless = &vk_state->bindless;
+
+    for (uint32_t i = 0; i < bindless->num_pending_writes; i++) {
+        const ah_bindless_write_t *pending = &bindless->pending_writes[i];
+        if (pending->binding == 0 && pending->element == handle) {
+            return false;
+        }
+    }
+    return true;
+}
+
+uint32_t ah_bindless_add_buffer(vulkan_state_t *vk_state, VkBuffer buffer, VkDeviceSize offset, VkDeviceSize range) {
+    ah_bindless_t *bindless = &vk_state->bindless;
+    if (!can_write(vk_state)) {
+        return AH_BINDLESS_NONE;
+    }
+
+    uint32_t handle = ah_handles_alloc(vk_state, &bindless->buffers);
+    if (handle == AH_BINDLESS_NONE) {
+        set_error("Out of bindless buffer slots");
+        return AH_BINDLESS_NONE;
+    }
+
+    ah_bindless_write_t write = {};
+    write.binding = 1;
+    write.element = handle;
+    write.buffer.buffer = buffer;
+    write.buffer.offset = offset;
+    write.buffer.range = range;
+    queue_write(vk_state, &write);
+
+    return handle;
+}
+
+void ah_bindless_remove_buffer(vulkan_state_t *vk_state, uint32_t handle) {
+    cancel_writes(vk_state, 1, handle);
+    ah_handles_free(vk_state, &vk_state->bindless.buffers, handle);
+}
+
+uint32_t ah_bindless_add_material(vulkan_state_t *vk_state, const ah_material_t *material) {
+    ah_bindless_t *bindless = &vk_state->bindless;
+
+    uint32_t handle = ah_handles_alloc(vk_state, &bindless->materials);
+    if (handle == AH_BINDLESS_NONE) {
+        set_error("Out of material slots");
+        return AH_BINDLESS_NONE;
+    }
+
+    bindless->material_data[handle] = *material;
+    return handle;
+}
+
+/// Written in place, frames already in flight may see the new values
+void ah_bindless_update_material(vulkan_state_t *vk_state, uint32_t handle, const ah_material_t *material) {
+    ah_bindless_t *bindless = &vk_state->bindless;
+    if (handle >= bindless->materials.next) {
+        return;
+    }
+
+    bindless->material_data[handle] = *material;
+}
+
+void ah_bindless_remove_material(vulkan_state_t *vk_state, uint32_t handle) {
+    ah_handles_free(vk_state, &vk_state->bindless.materials, handle);
+}
+
+/// Before recording into `frame`, once the GPU is done with its slot. Only
+/// does something without update after bind: the slot's set gets every
+/// write it missed.
+void ah_bindless_flush(vulkan_state_t *vk_state, uint32_t frame) {
+    ah_bindless_t *bindless = &vk_state->bindless;
+    uint32_t all_sets = (1u << bindless->num_sets) - 1;
+    uint32_t num_kept = 0;
+
+    for (uint32_t i = 0; i < bindless->num_pending_writes; i++) {
+        ah_bindless_write_t *pending = &bindless->pending_writes[i];
+        if (!(pending->written & (1u << frame))) {
+            write_descriptor(vk_state, bindless->descriptor_sets[frame], pending);
+            pending->written |= 1u << frame;
+        }
+        if (pending->written != all_sets) {
+            bindless->pending_writes[num_kept++] = *pending;
+        }
+    }
+
+    bindless->num_pending_writes = num_kept;
+}
+
+/// Bind the set at set 0 of `layout`, once per command buffer is enough
+void ah_bindless_bind(vulkan_state_t *vk_state, VkCommandBuffer command_buffer, VkPipelineBindPoint bind_point, VkPipelineLayout layout) {
+    ah_bindless_t *bindless = &vk_state->bindless;
+    uint32_t set = vk_state->features.update_after_bind ? 0 : vk_state->current_frame;
+    vkCmdBindDescriptorSets(command_buffer, bind_point, layout, 0, 1, &bindless->descriptor_sets[set], 0, NULL);
+}
+
+void ah_bindless_destroy(vulkan_state_t *vk_state) {
+    ah_bindless_t *bindless = &vk_state->bindless;
+
+    if (bindless->material_buffer != VK_NULL_HANDLE) {
+        ah_vk_destroy_buffer(vk_state, bindless->material_buffer, &bindless->material_allocation);
+    }
+    vkDestroySampler(vk_state->device, bindless->default_sampler, NULL);
+    vkDestroyDescriptorPool(vk_state->device, bindless->descriptor_pool, NULL);
+    vkDestroyDescriptorSetLayout(vk_state->device, bindless->set_layout, NULL);
+
+    ah_handles_destroy(&bindless->images);
+    ah_handles_destroy(&bindless->buffers);
+    ah_handles_destroy(&bindless->materials);
+}
@@ -0,0 +1,127 @@
+#pragma once
+
+#include "ah.h"
+#include "alloc.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <vulkan/vulkan_core.h>
+
+// Sizes of the descriptor arrays, far below what descriptor indexing
+// devices allow per stage. Without update after bind they are clamped to
+// the device limits.
+#define AH_BINDLESS_MAX_IMAGES 4096
+#define AH_BINDLESS_MAX_BUFFERS 1024
+#define AH_BINDLESS_MAX_MATERIALS 1024
+// Descriptor writes not yet in the set of every frame slot, only without
+// update after bind
+#define AH_BINDLESS_MAX_PENDING_WRITES 256
+// Left to the other sets of a pipeline when the arrays are sized to the
+// device limits
+#define AH_BINDLESS_RESERVED_DESCRIPTORS 8
+// Handed out when a table is full, also "no texture" in materials
+#define AH_BINDLESS_NONE UINT32_MAX
+// Created with the tables, see shaders/bindless.glsl
+#define AH_BINDLESS_MATERIAL_TABLE 0
+#define AH_BINDLESS_DEFAULT_MATERIAL 0
+
+// Push constants are visible to both stages of the scene pipelines. The
+// range is the size every device supports, ah_draw_constants_t comes first
+// and the rest is free for small per-draw data, see ah_frame_push.
+#define AH_DRAW_CONSTANT_STAGES (VK_SHADER_STAGE_VERTEX_BIT | VK_SHADER_STAGE_FRAGMENT_BIT)
+#define AH_PUSH_CONSTANT_SIZE 128
+#define AH_PUSH_DATA_OFFSET 32
+
+typedef struct vulkan_state vulkan_state_t;
+
+/// One entry of the GPU material table, matches Material in
+/// shaders/bindless.glsl
+typedef struct ah_material {
+    float color[4];
+    // Bindless image handle, AH_BINDLESS_NONE when untextured
+    uint32_t texture;
+    uint32_t padding[3];
+} ah_material_t;
+
+/// The only per-draw state of the scene pipelines, matches AhDraw in
+/// shaders/bindless.glsl
+typedef struct ah_draw_constants {
+    // Scale in xy and offset in zw applied to positions
+    float dequantize[4];
+    uint32_t material;
+} ah_draw_constants_t;
+
+typedef struct ah_retired_handle {
+    uint32_t handle;
+    uint64_t value;
+} ah_retired_handle_t;
+
+/// Slots of one descriptor array or table. Freed slots may still be read by
+/// frames in flight, they are reused once the graphics timeline passes the
+/// value submitted when they were freed.
+typedef struct ah_handle_allocator {
+    uint32_t capacity;
+    // Slots at or past this were never handed out
+    uint32_t next;
+    uint32_t *free_handles;
+    uint32_t num_free;
+    ah_retired_handle_t *retired;
+    uint32_t num_retired;
+    // Handed out and not freed since, a slot is retired at most once so
+    // `retired` never holds more than `capacity`
+    bool *allocated;
+} ah_handle_allocator_t;
+
+/// A slot of binding 0 or 1, waiting for the sets that don't have it yet
+typedef struct ah_bindless_write {
+    uint32_t binding;
+    uint32_t element;
+    VkDescriptorImageInfo image;
+    VkDescriptorBufferInfo buffer;
+    // Frame slots whose set is written
+    uint32_t written;
+} ah_bindless_write_t;
+
+/// One descriptor set holding every sampled image and storage buffer the
+/// scene uses, bound once per command buffer. Slots are written with update
+/// after bind, so registering resources never waits on frames in flight.
+/// Devices without it get a set per frame slot instead, and writes reach
+/// each set in `ah_bindless_flush` once its slot is free again. Draws pick
+/// their material with a push constant.
+typedef struct ah_bindless {
+    VkDescriptorSetLayout set_layout;
+    VkDescriptorPool descriptor_pool;
+    // One with update after bind, one per frame in flight without
+    VkDescriptorSet descriptor_sets[AH_MAX_FRAMES_IN_FLIGHT];
+    uint32_t num_sets;
+    VkSampler default_sampler;
+
+    ah_bindless_write_t pending_writes[AH_BINDLESS_MAX_PENDING_WRITES];
+    uint32_t num_pending_writes;
+
+    ah_handle_allocator_t images;
+    ah_handle_allocator_t buffers;
+    ah_handle_allocator_t materials;
+
+    // Host visible and mapped, written in place
+    VkBuffer material_buffer;
+    ah_allocation_t material_allocation;
+    ah_material_t *material_data;
+} ah_bindless_t;
+
+AH_RESULT ah_handles_init(ah_handle_allocator_t *handles, uint32_t capacity);
+uint32_t ah_handles_alloc(vulkan_state_t *vk_state, ah_handle_allocator_t *handles);
+void ah_handles_free(vulkan_state_t *vk_state, ah_handle_allocator_t *handles, uint32_t handle);
+void ah_handles_destroy(ah_handle_allocator_t *handles);
+
+AH_RESULT ah_bindless_init(vulkan_state_t *vk_state);
+uint32_t ah_bindless_add_image(vulkan_state_t *vk_state, VkImageView view, VkSampler sampler);
+void ah_bindless_remove_image(vulkan_state_t *vk_state, uint32_t handle);
+bool ah_bindless_image_written(vulkan_state_t *vk_state, uint32_t handle);
+uint32_t ah_bindless_add_buffer(vulkan_state_t *vk_state, VkBuffer buffer, VkDeviceSize offset, VkDeviceSize range);
+void ah_bindless_remove_buffer(vulkan_state_t *vk_state, uint32_t handle);
+uint32_t ah_bindless_add_material(vulkan_state_t *vk_state, const ah_material_t *material);
+void ah_bindless_update_material(vulkan_state_t *vk_state, uint32_t handle, const ah_material_t *material);
+void ah_bindless_remove_material(vulkan_state_t *vk_state, uint32_t handle);
+void ah_bindless_flush(vulkan_state_t *vk_state, uint32_t frame);
+void ah_bindless_bind(vulkan_state_t *vk_state, VkCommandBuffer command_buffer, VkPipelineBindPoint bind_point, VkPipelineLayout layout);
+void ah_bindless_destroy(vulkan_state_t *vk_state);
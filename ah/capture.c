@@ -0,0 +1,228 @@
+#include "capture.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <vulkan/vulkan_core.h>
+#include "ah.h"
+#include "errors.h"
+#include "instrument.h"
+#include "render_graph.h"
+#include "scheduler.h"
+#include "vk.h"
+
+/// Host cached memory makes the consumer's reads of the pixels fast, cached
+/// and coherent is preferred, then cached alone, which is invalidated before
+/// each hand over, and uncached only where no type is cached
+AH_RESULT create_capture_buffer(vulkan_state_t *vk_state, ah_capture_slot_t *slot) {
+    VkExtent2D extent = vk_state->swapchain_extent;
+    VkDeviceSize size = (VkDeviceSize)extent.width * extent.height * 4;
+    VkBufferUsageFlags usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+
+    slot->width = extent.width;
+    slot->height = extent.height;
+    slot->format = vk_state->swapchain_image_format;
+
+    const VkMemoryPropertyFlags properties[] = {
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+    };
+    for (uint32_t i = 0; i < sizeof(properties) / sizeof(properties[0]); i++) {
+        if (ah_vk_create_buffer(vk_state, size, usage, properties[i], &slot->buffer, &slot->allocation) == AH_SUCCESS) {
+            return AH_SUCCESS;
+        }
+    }
+
+    slot->buffer = VK_NULL_HANDLE;
+    set_error("Failed to create capture buffer");
+    return AH_FAILURE;
+}
+
+/// After the swapchain is created. Capturing is skipped when the surface
+/// can't be copied from.
+AH_RESULT ah_capture_init(vulkan_state_t *vk_state) {
+    ah_capture_t *capture = &vk_state->capture;
+    capture->enabled = false;
+    capture->next_slot = 0;
+    capture->recording_slot = AH_CAPTURE_NONE;
+    for (uint32_t i = 0; i < AH_CAPTURE_SLOTS; i++) {
+        capture->slots[i].buffer = VK_NULL_HANDLE;
+        atomic_init(&capture->slots[i].state, AH_CAPTURE_FREE);
+    }
+
+    if (!capture->consume) {
+        return AH_SUCCESS;
+    }
+    if (!vk_state->headless &&
+        !(vk_state->swapchain_support.capabilities.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_SRC_BIT)) {
+        printf("Swapchain images can't be copied from, capture disabled\n");
+        return AH_SUCCESS;
+    }
+
+    for (uint32_t i = 0; i < AH_CAPTURE_SLOTS; i++) {
+        if (create_capture_buffer(vk_state, &capture->slots[i]) != AH_SUCCESS) {
+            return AH_FAILURE;
+        }
+    }
+
+    capture->enabled = true;
+    return AH_SUCCESS;
+}
+
+void hand_over(vulkan_state_t *vk_state, uint32_t slot_index) {
+    ah_capture_t *capture = &vk_state->capture;
+    ah_capture_slot_t *slot = &capture->slots[slot_index];
+    atomic_store_explicit(&slot->state, AH_CAPTURE_CONSUMING, memory_order_relaxed);
+    AH_COUNTER_ADD(AH_COUNTER_FRAMES_CAPTURED, 1);
+
+    // The copy is only visible through non-coherent memory once invalidated
+    if (ah_alloc_invalidate(&vk_state->allocator, &slot->allocation) != AH_SUCCESS) {
+        print_error("capture/hand_over");
+    }
+
+    ah_capture_frame_t frame = {};
+    frame.pixels = slot->allocation.mapped;
+    frame.width = slot->width;
+    frame.height = slot->height;
+    frame.format = slot->format;
+    frame.frame_number = slot->frame_number;
+    frame.slot = slot_index;
+    capture->consume(&frame, capture->user);
+}
+
+/// Before recording: hand every landed copy to the consumer and pick the
+/// slot this frame copies into. Slots are used in ring order, a frame whose
+/// slot the consumer still holds is dropped.
+void ah_capture_begin_frame(vulkan_state_t *vk_state, uint32_t frame_number) {
+    ah_capture_t *capture = &vk_state->capture;
+    capture->recording_slot = AH_CAPTURE_NONE;
+    if (!capture->enabled) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < AH_CAPTURE_SLOTS; i++) {
+        ah_capture_slot_t *slot = &capture->slots[i];
+        if (atomic_load_explicit(&slot->state, memory_order_relaxed) == AH_CAPTURE_COPYING &&
+            ah_scheduler_poll(vk_state, AH_QUEUE_GRAPHICS, slot->value)) {
+            hand_over(vk_state, i);
+        }
+    }
+
+    ah_capture_slot_t *slot = &capture->slots[capture->next_slot];
+    if (atomic_load_explicit(&slot->state, memory_order_acquire) != AH_CAPTURE_FREE) {
+        AH_COUNTER_ADD(AH_COUNTER_FRAMES_DROPPED, 1);
+        return;
+    }
+
+    // Nothing reads a free slot, so it can follow a resize without a wait
+    if (slot->width != vk_state->swapchain_extent.width ||
+        slot->height != vk_state->swapchain_extent.height ||
+        slot->format != vk_state->swapchain_image_format) {
+        ah_vk_destroy_buffer(vk_state, slot->buffer, &slot->allocation);
+        if (create_capture_buffer(vk_state, slot) != AH_SUCCESS) {
+            print_error("capture/begin_frame");
+            capture->enabled = false;
+            return;
+        }
+    }
+
+    slot->frame_number = frame_number;
+    capture->recording_slot = capture->next_slot;
+}
+
+/// Render graph pass after the backbuffer is finished, copies it into the
+/// frame's slot
+AH_RESULT ah_capture_record(const ah_graph_pass_context_t *context, void *user) {
+    (void)user;
+    vulkan_state_t *vk_state = context->vk_state;
+    ah_capture_t *capture = &vk_state->capture;
+    if (capture->recording_slot == AH_CAPTURE_NONE) {
+        return AH_SUCCESS;
+    }
+    ah_capture_slot_t *slot = &capture->slots[capture->recording_slot];
+
+    VkBufferImageCopy region = {};
+    region.bufferOffset = 0;
+    region.bufferRowLength = 0;
+    region.bufferImageHeight = 0;
+    region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    region.imageSubresource.mipLevel = 0;
+    region.imageSubresource.baseArrayLayer = 0;
+    region.imageSubresource.layerCount = 1;
+    region.imageExtent.width = slot->width;
+    region.imageExtent.height = slot->height;
+    region.imageExtent.depth = 1;
+
+    vkCmdCopyImageToBuffer(
+        context->command_buffer,
+        ah_render_graph_image(context->graph, vk_state->backbuffer),
+        VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+        slot->buffer,
+        1,
+        &region
+    );
+
+    // Visible to the host once the timeline passes this frame
+    VkMemoryBarrier2 barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2;
+    barrier.srcStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+    barrier.srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+    barrier.dstStageMask = VK_PIPELINE_STAGE_2_HOST_BIT;
+    barrier.dstAccessMask = VK_ACCESS_2_HOST_READ_BIT;
+
+    VkDependencyInfo dependency = {};
+    dependency.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
+    dependency.memoryBarrierCount = 1;
+    dependency.pMemoryBarriers = &barrier;
+    vkCmdPipelineBarrier2(context->command_buffer, &dependency);
+
+    return AH_SUCCESS;
+}
+
+/// After the frame in `frame` was submitted, its copy lands with it
+void ah_capture_frame_submitted(vulkan_state_t *vk_state, uint32_t frame) {
+    ah_capture_t *capture = &vk_state->capture;
+    if (capture->recording_slot == AH_CAPTURE_NONE) {
+        return;
+    }
+
+    ah_capture_slot_t *slot = &capture->slots[capture->recording_slot];
+    slot->value = vk_state->scheduler.frame_values[frame];
+    atomic_store_explicit(&slot->state, AH_CAPTURE_COPYING, memory_order_relaxed);
+    capture->next_slot = (capture->next_slot + 1) % AH_CAPTURE_SLOTS;
+    capture->recording_slot = AH_CAPTURE_NONE;
+}
+
+/// Wait for the copy into `slot` and hand it over now instead of at the
+/// next frame, for consumers that must see every frame before going on
+AH_RESULT ah_capture_flush(vulkan_state_t *vk_state, uint32_t slot) {
+    ah_capture_t *capture = &vk_state->capture;
+    if (atomic_load_explicit(&capture->slots[slot].state, memory_order_relaxed) != AH_CAPTURE_COPYING) {
+        return AH_SUCCESS;
+    }
+
+    if (ah_scheduler_wait(vk_state, AH_QUEUE_GRAPHICS, capture->slots[slot].value) != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
+    hand_over(vk_state, slot);
+    return AH_SUCCESS;
+}
+
+/// The consumer is done with the pixels of `slot`, from any thread
+void ah_capture_release(ah_capture_t *capture, uint32_t slot) {
+    atomic_store_explicit(&capture->slots[slot].state, AH_CAPTURE_FREE, memory_order_release);
+}
+
+/// Every slot must be released by now, the buffers are unmapped
+void ah_capture_destroy(vulkan_state_t *vk_state) {
+    ah_capture_t *capture = &vk_state->capture;
+    for (uint32_t i = 0; i < AH_CAPTURE_SLOTS; i++) {
+        if (capture->slots[i].buffer != VK_NULL_HANDLE) {
+            ah_vk_destroy_buffer(vk_state, capture->slots[i].buffer, &capture->slots[i].allocation);
+            capture->slots[i].buffer = VK_NULL_HANDLE;
+        }
+    }
+    capture->enabled = false;
+}
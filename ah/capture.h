@@ -0,0 +1,78 @@
+#pragma once
+
+#include "ah.h"
+#include "alloc.h"
+#include "render_graph.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <vulkan/vulkan_core.h>
+
+// Frames copied out or held by the consumer at once
+#define AH_CAPTURE_SLOTS 4
+#define AH_CAPTURE_NONE UINT32_MAX
+
+typedef struct vulkan_state vulkan_state_t;
+
+/// A finished frame in a mapped readback buffer, rows tightly packed at 4
+/// bytes per texel
+typedef struct ah_capture_frame {
+    const uint8_t *pixels;
+    uint32_t width;
+    uint32_t height;
+    VkFormat format;
+    // `index` the frame was drawn with
+    uint32_t frame_number;
+    // Pass to `ah_capture_release` once done with the pixels
+    uint32_t slot;
+} ah_capture_frame_t;
+
+/// Called on the render thread once the copy of a frame has landed. The
+/// pixels stay valid until the slot is released, which can happen on any
+/// thread, so slow consumers should hand them to a worker and return.
+typedef void (*ah_capture_consume_fn)(const ah_capture_frame_t *frame, void *user);
+
+typedef enum ah_capture_state {
+    AH_CAPTURE_FREE,
+    // The frame copying into it was submitted, `value` tells when it landed
+    AH_CAPTURE_COPYING,
+    AH_CAPTURE_CONSUMING,
+} ah_capture_state_t;
+
+typedef struct ah_capture_slot {
+    VkBuffer buffer;
+    ah_allocation_t allocation;
+    // Swapchain the buffer was sized for, a free slot is recreated when the
+    // swapchain changes
+    uint32_t width;
+    uint32_t height;
+    VkFormat format;
+    _Atomic ah_capture_state_t state;
+    uint64_t value;
+    uint32_t frame_number;
+} ah_capture_slot_t;
+
+/// Copies every frame's backbuffer into a ring of persistently mapped,
+/// host cached buffers from the frame's own command buffer, and hands the
+/// mapped memory to `consume` once the graphics timeline passes the frame.
+/// When the consumer still holds the next slot the frame is not captured,
+/// rendering never waits on it.
+typedef struct ah_capture {
+    // Set before `ah_vk_init` to capture, NULL otherwise
+    ah_capture_consume_fn consume;
+    void *user;
+
+    bool enabled;
+    ah_capture_slot_t slots[AH_CAPTURE_SLOTS];
+    uint32_t next_slot;
+    // Slot the frame being recorded copies into, or none when it is dropped
+    uint32_t recording_slot;
+} ah_capture_t;
+
+AH_RESULT ah_capture_init(vulkan_state_t *vk_state);
+void ah_capture_begin_frame(vulkan_state_t *vk_state, uint32_t frame_number);
+AH_RESULT ah_capture_record(const ah_graph_pass_context_t *context, void *user);
+void ah_capture_frame_submitted(vulkan_state_t *vk_state, uint32_t frame);
+AH_RESULT ah_capture_flush(vulkan_state_t *vk_state, uint32_t slot);
+void ah_capture_release(ah_capture_t *capture, uint32_t slot);
+void ah_capture_destroy(vulkan_state_t *vk_state);
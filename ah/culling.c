@@ -0,0 +1,366 @@
+#include "culling.h"
+
+#include <math.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <vulkan/vulkan_core.h>
+#include "ah.h"
+#include "errors.h"
+#include "hot_reload.h"
+#include "instrument.h"
+#include "pipeline_builder.h"
+#include "profiler.h"
+#include "scheduler.h"
+#include "simulation.h"
+#include "vertex.h"
+#include "vk.h"
+
+AH_RESULT create_culling_descriptors(vulkan_state_t *vk_state) {
+    ah_culling_t *culling = &vk_state->culling;
+
+    // Instances in, visible instances out, the draw command and the stats
+    VkDescriptorSetLayoutBinding bindings[4] = {};
+    for (uint32_t i = 0; i < 4; i++) {
+        bindings[i].binding = i;
+        bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        bindings[i].descriptorCount = 1;
+        bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    }
+
+    VkDescriptorSetLayoutCreateInfo layout_info = {};
+    layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layout_info.bindingCount = 4;
+    layout_info.pBindings = bindings;
+
+    if (vkCreateDescriptorSetLayout(vk_state->device, &layout_info, NULL, &culling->set_layout) != VK_SUCCESS) {
+        set_error("Error creating culling descriptor set layout");
+        return AH_FAILURE;
+    }
+
+    VkDescriptorPoolSize pool_size = {};
+    pool_size.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    pool_size.descriptorCount = 4 * vk_state->frames_in_flight;
+
+    VkDescriptorPoolCreateInfo pool_info = {};
+    pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool_info.maxSets = vk_state->frames_in_flight;
+    pool_info.poolSizeCount = 1;
+    pool_info.pPoolSizes = &pool_size;
+
+    if (vkCreateDescriptorPool(vk_state->device, &pool_info, NULL, &culling->descriptor_pool) != VK_SUCCESS) {
+        set_error("Error creating culling descriptor pool");
+        return AH_FAILURE;
+    }
+
+    VkDescriptorSetLayout set_layouts[AH_MAX_FRAMES_IN_FLIGHT];
+    for (uint32_t i = 0; i < vk_state->frames_in_flight; i++) {
+        set_layouts[i] = culling->set_layout;
+    }
+
+    VkDescriptorSetAllocateInfo alloc_info = {};
+    alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    alloc_info.descriptorPool = culling->descriptor_pool;
+    alloc_info.descriptorSetCount = vk_state->frames_in_flight;
+    alloc_info.pSetLayouts = set_layouts;
+
+    if (vkAllocateDescriptorSets(vk_state->device, &alloc_info, culling->descriptor_sets) != VK_SUCCESS) {
+        set_error("Error allocating culling descriptor sets");
+        return AH_FAILURE;
+    }
+
+    return AH_SUCCESS;
+}
+
+/// The cull shader appends once per subgroup, which needs ballots in
+/// compute shaders
+bool culling_supported(vulkan_state_t *vk_state) {
+    VkPhysicalDeviceSubgroupProperties subgroup_properties = {};
+    subgroup_properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SUBGROUP_PROPERTIES;
+
+    VkPhysicalDeviceProperties2 properties = {};
+    properties.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+    properties.pNext = &subgroup_properties;
+    vkGetPhysicalDeviceProperties2(vk_state->physical_device, &properties);
+
+    return (subgroup_properties.supportedStages & VK_SHADER_STAGE_COMPUTE_BIT) &&
+        (subgroup_properties.supportedOperations & VK_SUBGROUP_FEATURE_BALLOT_BIT);
+}
+
+/// Set up the cull pipeline. Does nothing unless `vk_state->cull_instances`
+/// is set, the instances are then drawn straight from their buffer.
+AH_RESULT ah_culling_init(vulkan_state_t *vk_state) {
+    ah_culling_t *culling = &vk_state->culling;
+    memset(culling, 0, sizeof(ah_culling_t));
+
+    if (!vk_state->cull_instances) {
+        return AH_SUCCESS;
+    }
+    if (!culling_supported(vk_state)) {
+        printf("Subgroup ballots unavailable in compute, drawing every instance\n");
+        return AH_SUCCESS;
+    }
+    culling->enabled = true;
+
+    if (create_culling_descriptors(vk_state) != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
+
+    VkPushConstantRange push_constant_range = {};
+    push_constant_range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    push_constant_range.offset = 0;
+    push_constant_range.size = sizeof(ah_cull_params_t);
+
+    VkPipelineLayoutCreateInfo pipeline_layout_info = {};
+    pipeline_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipeline_layout_info.setLayoutCount = 1;
+    pipeline_layout_info.pSetLayouts = &culling->set_layout;
+    pipeline_layout_info.pushConstantRangeCount = 1;
+    pipeline_layout_info.pPushConstantRanges = &push_constant_range;
+
+    if (vkCreatePipelineLayout(vk_state->device, &pipeline_layout_info, NULL, &culling->pipeline_layout) != VK_SUCCESS) {
+        set_error("Error creating culling pipeline layout");
+        return AH_FAILURE;
+    }
+
+    ah_compute_pipeline_desc_t desc = {};
+    desc.comp_path = "./cull_comp.spv";
+    desc.layout = culling->pipeline_layout;
+
+    if (ah_vk_build_compute_pipeline(vk_state->device, vk_state->pipeline_cache, &desc, &culling->pipeline) != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
+    // Dispatched inside the frame's command buffer
+    ah_hot_reload_track_compute(vk_state, "culling", &desc, AH_QUEUE_GRAPHICS, &culling->pipeline);
+
+    return AH_SUCCESS;
+}
+
+/// Hand the per-slot buffers to the scheduler, frames still drawing from
+/// them keep them alive until they finish
+void retire_culling_buffers(vulkan_state_t *vk_state) {
+    ah_culling_t *culling = &vk_state->culling;
+
+    for (uint32_t i = 0; i < AH_MAX_FRAMES_IN_FLIGHT; i++) {
+        if (culling->visible_buffers[i] != VK_NULL_HANDLE) {
+            ah_scheduler_retire_buffer(vk_state, culling->visible_buffers[i], &culling->visible_allocations[i]);
+            culling->visible_buffers[i] = VK_NULL_HANDLE;
+        }
+        if (culling->indirect_buffers[i] != VK_NULL_HANDLE) {
+            ah_scheduler_retire_buffer(vk_state, culling->indirect_buffers[i], &culling->indirect_allocations[i]);
+            culling->indirect_buffers[i] = VK_NULL_HANDLE;
+        }
+        if (culling->stats_buffers[i] != VK_NULL_HANDLE) {
+            ah_scheduler_retire_buffer(vk_state, culling->stats_buffers[i], &culling->stats_allocations[i]);
+            culling->stats_buffers[i] = VK_NULL_HANDLE;
+        }
+        culling->recorded[i] = false;
+    }
+    culling->num_instances = 0;
+}
+
+/// Cull `num_instances` instances read from `base_buffer`, or from the
+/// simulation's output when it runs. Call after the simulation got the same
+/// instances. The previous buffers are retired, the descriptor sets wait
+/// for the frames already submitted.
+AH_RESULT ah_culling_set_instances(vulkan_state_t *vk_state, VkBuffer base_buffer, uint32_t num_instances) {
+    ah_culling_t *culling = &vk_state->culling;
+    if (!culling->enabled) {
+        return AH_SUCCESS;
+    }
+
+    retire_culling_buffers(vk_state);
+    if (num_instances == 0) {
+        return AH_SUCCESS;
+    }
+
+    // The sets are rewritten in place, so no frame may still read them
+    if (ah_scheduler_wait(vk_state, AH_QUEUE_GRAPHICS, vk_state->scheduler.timelines[AH_QUEUE_GRAPHICS].submitted) != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
+
+    // Every field but the instance count is fixed, the cull pass writes it
+    VkDrawIndexedIndirectCommand command = {};
+    command.indexCount = vk_state->mesh.num_indices;
+    command.instanceCount = 0;
+    command.firstIndex = 0;
+    command.vertexOffset = 0;
+    command.firstInstance = 0;
+
+    VkDeviceSize size = sizeof(instance_t) * num_instances;
+    for (uint32_t i = 0; i < vk_state->frames_in_flight; i++) {
+        if (ah_vk_create_buffer(
+            vk_state,
+            size,
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            &culling->visible_buffers[i],
+            &culling->visible_allocations[i])
+        != AH_SUCCESS) {
+            set_error("Failed to create visible instance buffer");
+            return AH_FAILURE;
+        }
+
+        if (ah_vk_create_device_buffer(
+            vk_state,
+            &command,
+            sizeof(command),
+            VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            &culling->indirect_buffers[i],
+            &culling->indirect_allocations[i])
+        != AH_SUCCESS) {
+            set_error("Failed to create culled indirect buffer");
+            return AH_FAILURE;
+        }
+        culling->index_counts[i] = command.indexCount;
+
+        if (ah_vk_create_buffer(
+            vk_state,
+            sizeof(ah_cull_stats_t),
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+            VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+            &culling->stats_buffers[i],
+            &culling->stats_allocations[i])
+        != AH_SUCCESS) {
+            set_error("Failed to create cull stats buffer");
+            return AH_FAILURE;
+        }
+
+        VkDescriptorBufferInfo buffer_infos[4] = {};
+        buffer_infos[0].buffer = ah_simulation_instance_buffer(vk_state, base_buffer, i);
+        buffer_infos[0].offset = 0;
+        buffer_infos[0].range = size;
+        buffer_infos[1].buffer = culling->visible_buffers[i];
+        buffer_infos[1].offset = 0;
+        buffer_infos[1].range = size;
+        buffer_infos[2].buffer = culling->indirect_buffers[i];
+        buffer_infos[2].offset = 0;
+        buffer_infos[2].range = sizeof(command);
+        buffer_infos[3].buffer = culling->stats_buffers[i];
+        buffer_infos[3].offset = 0;
+        buffer_infos[3].range = sizeof(ah_cull_stats_t);
+
+        VkWriteDescriptorSet write = {};
+        write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        write.dstSet = culling->descriptor_sets[i];
+        write.dstBinding = 0;
+        write.descriptorCount = 4;
+        write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        write.pBufferInfo = buffer_infos;
+        vkUpdateDescriptorSets(vk_state->device, 1, &write, 0, NULL);
+    }
+
+    culling->num_instances = num_instances;
+    return AH_SUCCESS;
+}
+
+/// Whether the instances are drawn from the visible buffers this frame
+bool ah_culling_active(vulkan_state_t *vk_state) {
+    return vk_state->culling.enabled && vk_state->culling.num_instances > 0;
+}
+
+/// Frustum planes of `view_projection` (Gribb and Hartmann), normalised so
+/// a sphere radius compares against the plane distance. Depth runs from 0
+/// to 1.
+void extract_frustum_planes(mat4 view_projection, float planes[6][4]) {
+    // Matrices are column major, column i holds component i of every row
+    for (uint32_t i = 0; i < 4; i++) {
+        float x = view_projection[i][0];
+        float y = view_projection[i][1];
+        float z = view_projection[i][2];
+        float w = view_projection[i][3];
+
+        planes[0][i] = w + x;
+        planes[1][i] = w - x;
+        planes[2][i] = w + y;
+        planes[3][i] = w - y;
+        planes[4][i] = z;
+        planes[5][i] = w - z;
+    }
+
+    for (uint32_t i = 0; i < 6; i++) {
+        float length = sqrtf(planes[i][0] * planes[i][0] + planes[i][1] * planes[i][1] + planes[i][2] * planes[i][2]);
+        if (length > 0.0f) {
+            for (uint32_t j = 0; j < 4; j++) {
+                planes[i][j] /= length;
+            }
+        }
+    }
+}
+
+/// Record the cull pass of slot `frame`, outside any render pass and before
+/// the draws reading its output. The counts of the frame that last used the
+/// slot are read back first, the slot wait already covered it.
+void ah_culling_record(vulkan_state_t *vk_state, VkCommandBuffer command_buffer, uint32_t frame) {
+    ah_culling_t *culling = &vk_state->culling;
+    if (!ah_culling_active(vk_state)) {
+        return;
+    }
+
+    if (culling->recorded[frame]) {
+        memcpy(&culling->stats, culling->stats_allocations[frame].mapped, sizeof(ah_cull_stats_t));
+        AH_COUNTER_ADD(AH_COUNTER_VISIBLE_INSTANCES, culling->stats.visible);
+        AH_COUNTER_ADD(AH_COUNTER_CULLED_INSTANCES, culling->stats.culled);
+    }
+
+    uint32_t scope = ah_profiler_begin(vk_state, command_buffer, "cull");
+
+    vkCmdFillBuffer(command_buffer, culling->indirect_buffers[frame], offsetof(VkDrawIndexedIndirectCommand, instanceCount), sizeof(uint32_t), 0);
+    vkCmdFillBuffer(command_buffer, culling->stats_buffers[frame], 0, sizeof(ah_cull_stats_t), 0);
+    // The scene mesh was swapped since the slot last drew
+    if (culling->index_counts[frame] != vk_state->mesh.num_indices) {
+        vkCmdFillBuffer(command_buffer, culling->indirect_buffers[frame], offsetof(VkDrawIndexedIndirectCommand, indexCount), sizeof(uint32_t), vk_state->mesh.num_indices);
+        culling->index_counts[frame] = vk_state->mesh.num_indices;
+    }
+
+    VkMemoryBarrier2 clear_barrier = {};
+    clear_barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2;
+    clear_barrier.srcStageMask = VK_PIPELINE_STAGE_2_CLEAR_BIT;
+    clear_barrier.srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+    clear_barrier.dstStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT;
+    clear_barrier.dstAccessMask = VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT | VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT;
+
+    VkDependencyInfo dependency = {};
+    dependency.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
+    dependency.memoryBarrierCount = 1;
+    dependency.pMemoryBarriers = &clear_barrier;
+    vkCmdPipelineBarrier2(command_buffer, &dependency);
+
+    ah_cull_params_t params = {};
+    extract_frustum_planes(vk_state->view_projection, params.planes);
+    memcpy(params.sphere, vk_state->mesh.bounds, sizeof(params.sphere));
+    params.num_instances = culling->num_instances;
+
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, culling->pipeline);
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, culling->pipeline_layout, 0, 1, &culling->descriptor_sets[frame], 0, NULL);
+    vkCmdPushConstants(command_buffer, culling->pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(params), &params);
+    vkCmdDispatch(command_buffer, (culling->num_instances + AH_CULLING_GROUP_SIZE - 1) / AH_CULLING_GROUP_SIZE, 1, 1);
+
+    // The draw reads the count and the visible instances, the host reads
+    // the stats once the frame is done
+    VkMemoryBarrier2 cull_barrier = {};
+    cull_barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2;
+    cull_barrier.srcStageMask = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+    cull_barrier.srcAccessMask = VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+    cull_barrier.dstStageMask = VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT | VK_PIPELINE_STAGE_2_VERTEX_ATTRIBUTE_INPUT_BIT | VK_PIPELINE_STAGE_2_HOST_BIT;
+    cull_barrier.dstAccessMask = VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT | VK_ACCESS_2_VERTEX_ATTRIBUTE_READ_BIT | VK_ACCESS_2_HOST_READ_BIT;
+
+    dependency.pMemoryBarriers = &cull_barrier;
+    vkCmdPipelineBarrier2(command_buffer, &dependency);
+
+    ah_profiler_end(vk_state, command_buffer, scope);
+    culling->recorded[frame] = true;
+}
+
+void ah_culling_destroy(vulkan_state_t *vk_state) {
+    ah_culling_t *culling = &vk_state->culling;
+    if (!culling->enabled) {
+        return;
+    }
+
+    retire_culling_buffers(vk_state);
+    vkDestroyPipeline(vk_state->device, culling->pipeline, NULL);
+    vkDestroyPipelineLayout(vk_state->device, culling->pipeline_layout, NULL);
+    vkDestroyDescriptorPool(vk_state->device, culling->descriptor_pool, NULL);
+    vkDestroyDescriptorSetLayout(vk_state->device, culling->set_layout, NULL);
+}
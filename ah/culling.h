@@ -0,0 +1,64 @@
+#pragma once
+
+#include "ah.h"
+#include "alloc.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <vulkan/vulkan_core.h>
+
+#define AH_CULLING_GROUP_SIZE 64
+
+typedef struct vulkan_state vulkan_state_t;
+
+/// Push constants of shaders/cull.comp
+typedef struct ah_cull_params {
+    // xyz normal pointing inside and w distance, a point p is inside the
+    // frustum when dot(xyz, p) + w >= 0 for all six
+    float planes[6][4];
+    // Model space bounding sphere of the mesh, centre xyz and radius w
+    float sphere[4];
+    uint32_t num_instances;
+} ah_cull_params_t;
+
+/// Written by the cull pass, read back once the frame slot comes around
+typedef struct ah_cull_stats {
+    uint32_t visible;
+    uint32_t culled;
+} ah_cull_stats_t;
+
+/// Tests every instance's bounding sphere against the view frustum in a
+/// compute pass at the start of the frame and packs the visible ones at the
+/// front of a per-slot buffer. The same pass counts them into the
+/// instanceCount of the indirect draw, so draw cost follows what is on
+/// screen and the CPU never learns the count on the frame's critical path.
+typedef struct ah_culling {
+    bool enabled;
+
+    VkDescriptorSetLayout set_layout;
+    VkDescriptorPool descriptor_pool;
+    VkDescriptorSet descriptor_sets[AH_MAX_FRAMES_IN_FLIGHT];
+    VkPipelineLayout pipeline_layout;
+    VkPipeline pipeline;
+
+    uint32_t num_instances;
+    // Per frame slot, since the previous frame may still draw from its own
+    VkBuffer visible_buffers[AH_MAX_FRAMES_IN_FLIGHT];
+    ah_allocation_t visible_allocations[AH_MAX_FRAMES_IN_FLIGHT];
+    VkBuffer indirect_buffers[AH_MAX_FRAMES_IN_FLIGHT];
+    ah_allocation_t indirect_allocations[AH_MAX_FRAMES_IN_FLIGHT];
+    // Index count in each slot's command, rewritten when the mesh changes
+    uint32_t index_counts[AH_MAX_FRAMES_IN_FLIGHT];
+    // Host visible and mapped
+    VkBuffer stats_buffers[AH_MAX_FRAMES_IN_FLIGHT];
+    ah_allocation_t stats_allocations[AH_MAX_FRAMES_IN_FLIGHT];
+    bool recorded[AH_MAX_FRAMES_IN_FLIGHT];
+
+    // Counts of the most recent frame the GPU finished
+    ah_cull_stats_t stats;
+} ah_culling_t;
+
+AH_RESULT ah_culling_init(vulkan_state_t *vk_state);
+AH_RESULT ah_culling_set_instances(vulkan_state_t *vk_state, VkBuffer base_buffer, uint32_t num_instances);
+void ah_culling_record(vulkan_state_t *vk_state, VkCommandBuffer command_buffer, uint32_t frame);
+bool ah_culling_active(vulkan_state_t *vk_state);
+void ah_culling_destroy(vulkan_state_t *vk_state);
@@ -2,7 +2,9 @@
 
 #include <stdio.h>
 
-char *error_msg;
+// Per thread, pipeline workers, encoders and the hot reload thread report
+// their own failures while the render thread reports its
+_Thread_local char *error_msg;
 
 void print_error(char *extra) {
     printf("%s: %s\n", extra, error_msg);
@@ -0,0 +1,209 @@
+#include "frame.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <vulkan/vulkan_core.h>
+#include "ah.h"
+#include "bindless.h"
+#include "capture.h"
+#include "errors.h"
+#include "frame_alloc.h"
+#include "hot_reload.h"
+#include "instrument.h"
+#include "pacing.h"
+#include "profiler.h"
+#include "scheduler.h"
+#include "simulation.h"
+#include "streaming.h"
+#include "texture.h"
+#include "upload.h"
+
+double ah_now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec * 1000.0 + (double)ts.tv_nsec / 1000000.0;
+}
+
+AH_RESULT ah_vk_draw_frame(vulkan_state_t *vk_state, uint32_t index, ah_frame_timings_t *timings) {
+    uint32_t frame = vk_state->current_frame;
+    VkCommandBuffer command_buffer = vk_state->command_buffers[frame];
+    ah_frame_timings_t frame_timings = {-1.0, -1.0, -1.0};
+    ah_pacing_frame_begin(vk_state);
+    AH_ZONE_BEGIN(frame_zone, "draw frame");
+
+    if (vk_state->swapchain_dirty) {
+        if (ah_vk_recreate_swapchain(vk_state) != AH_SUCCESS) {
+            return AH_FAILURE;
+        }
+
+        // Minimized, there is nothing to draw into
+        if (vk_state->swapchain_dirty) {
+            if (timings) {
+                *timings = frame_timings;
+            }
+            return AH_SUCCESS;
+        }
+    }
+
+    // Only wait for the frame that last used this slot, the others keep
+    // running on the GPU while we record. When the GPU is already past it
+    // this is a counter read, not a wait.
+    AH_ZONE_BEGIN(slot_zone, "slot wait");
+    if (ah_scheduler_wait(vk_state, AH_QUEUE_GRAPHICS, vk_state->scheduler.frame_values[frame]) != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
+    AH_ZONE_END(slot_zone);
+    ah_scheduler_collect(vk_state);
+    ah_vk_collect_retired_swapchains(vk_state);
+    ah_frame_alloc_reset(vk_state, frame);
+    ah_hot_reload_poll(vk_state);
+
+    // Offscreen targets are owned by their frame slot, so there is nothing
+    // to acquire and the slot can be recorded into right away
+    uint32_t image_index = frame;
+    if (!vk_state->headless) {
+        AH_ZONE_BEGIN(acquire_zone, "acquire");
+        VkResult result = vkAcquireNextImageKHR(
+            vk_state->device,
+            vk_state->swapchain,
+            UINT64_MAX,
+            vk_state->image_available_semaphores[frame],
+            VK_NULL_HANDLE,
+            &image_index
+        );
+        AH_ZONE_END(acquire_zone);
+
+        // Nothing was submitted for the slot, it is reused by the next frame
+        // once the swapchain has been recreated. A suboptimal image can
+        // still be drawn, it is recreated after presenting.
+        if (result == VK_ERROR_OUT_OF_DATE_KHR) {
+            vk_state->swapchain_dirty = true;
+            if (timings) {
+                *timings = frame_timings;
+            }
+            return AH_SUCCESS;
+        }
+
+        if (result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR) {
+            set_error("Error acquiring swapchain image");
+            return AH_FAILURE;
+        }
+    }
+
+    if (ah_profiler_collect(vk_state, frame, &frame_timings.gpu_ms) != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
+
+    // This frame's share of streamed assets, and the ones that arrived
+    // replace their placeholders before anything is recorded
+    if (ah_stream_update(vk_state) != AH_SUCCESS || ah_vk_poll_scene_mesh(vk_state) != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
+
+    // Scene texture levels the window can show, the rest are dropped
+    if (vk_state->scene_texture != AH_TEXTURE_NONE) {
+        uint32_t level = ah_texture_level_for_extent(vk_state, vk_state->scene_texture, vk_state->swapchain_extent);
+        ah_texture_request(vk_state, vk_state->scene_texture, level);
+    }
+    if (ah_textures_update(vk_state) != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
+
+    // Copies queued since the last frame have to land before it draws
+    AH_ZONE_BEGIN(upload_zone, "upload flush");
+    if (ah_upload_flush(vk_state) != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
+    AH_ZONE_END(upload_zone);
+
+    // Submitted before recording, so it runs on the compute queue while the
+    // previous frame's graphics work is still finishing
+    ah_submit_waits_t waits = {};
+    if (ah_upload_add_wait(vk_state, &waits) != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
+    if (ah_simulation_submit(vk_state, frame, &waits) != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
+
+    // Picks the readback slot before the capture pass is recorded
+    ah_capture_begin_frame(vk_state, index);
+    // Bindless slots registered since the slot's set was last used
+    ah_bindless_flush(vk_state, frame);
+
+    AH_ZONE_BEGIN(record_zone, "record");
+    double record_start = ah_now_ms();
+    vkResetCommandBuffer(command_buffer, 0);
+    if (ah_vk_record_command_buffer(vk_state, command_buffer, image_index, index) != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
+    frame_timings.record_ms = ah_now_ms() - record_start;
+    AH_ZONE_END(record_zone);
+
+    VkSemaphore render_finished = VK_NULL_HANDLE;
+    if (!vk_state->headless) {
+        if (ah_scheduler_add_binary_wait(&waits, vk_state->image_available_semaphores[frame], VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT) != AH_SUCCESS) {
+            return AH_FAILURE;
+        }
+        render_finished = vk_state->render_finished_semaphores[image_index];
+    }
+
+    AH_ZONE_BEGIN(submit_zone, "submit");
+    double submit_start = ah_now_ms();
+    if (ah_scheduler_submit(vk_state, AH_QUEUE_GRAPHICS, command_buffer, &waits, render_finished, &vk_state->scheduler.frame_values[frame]) != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
+    frame_timings.submit_ms = ah_now_ms() - submit_start;
+    AH_ZONE_END(submit_zone);
+    ah_profiler_frame_submitted(vk_state, frame);
+    ah_capture_frame_submitted(vk_state, frame);
+    ah_textures_frame_submitted(vk_state, frame);
+    vk_state->frame_count++;
+
+    if (!vk_state->headless) {
+        VkPresentInfoKHR present_info = {};
+        present_info.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
+        present_info.waitSemaphoreCount = 1;
+        present_info.pWaitSemaphores = &render_finished;
+
+        VkSwapchainKHR swapchains[] = {vk_state->swapchain};
+        present_info.swapchainCount = 1;
+        present_info.pSwapchains = swapchains;
+        present_info.pImageIndices = &image_index;
+        present_info.pResults = NULL;
+
+        uint64_t present_id = ah_pacing_frame_presented(vk_state, frame_timings.gpu_ms);
+        VkPresentIdKHR present_id_info = {};
+        present_id_info.sType = VK_STRUCTURE_TYPE_PRESENT_ID_KHR;
+        present_id_info.swapchainCount = 1;
+        present_id_info.pPresentIds = &present_id;
+        if (vk_state->pacer.wait_for_present) {
+            present_info.pNext = &present_id_info;
+        }
+
+        vk_state->last_present_value = vk_state->scheduler.frame_values[frame];
+        AH_ZONE_BEGIN(present_zone, "present");
+        VkResult result = vkQueuePresentKHR(vk_state->present_queue, &present_info);
+        AH_ZONE_END(present_zone);
+        if (result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR) {
+            vk_state->swapchain_dirty = true;
+        } else if (result != VK_SUCCESS) {
+            set_error("Error presenting");
+            return AH_FAILURE;
+        }
+
+        ah_pacing_poll(vk_state);
+    }
+
+    vk_state->current_frame = (frame + 1) % vk_state->frames_in_flight;
+
+    AH_ZONE_END(frame_zone);
+    ah_instrument_frame_end(&vk_state->trace);
+
+    if (timings) {
+        *timings = frame_timings;
+    }
+
+    return AH_SUCCESS;
+}
@@ -0,0 +1,17 @@
+#pragma once
+
+#include "ah.h"
+#include "vk.h"
+
+typedef struct ah_frame_timings {
+    // CPU time spent recording the command buffer
+    double record_ms;
+    // CPU time spent inside vkQueueSubmit
+    double submit_ms;
+    // GPU time of the frame that previously used this slot, negative when
+    // there is no result (first use of the slot or no timestamp support)
+    double gpu_ms;
+} ah_frame_timings_t;
+
+double ah_now_ms();
+AH_RESULT ah_vk_draw_frame(vulkan_state_t *vk_state, uint32_t index, ah_frame_timings_t *timings);
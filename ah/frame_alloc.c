@@ -0,0 +1,187 @@
+#include "frame_alloc.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <vulkan/vulkan_core.h>
+#include "ah.h"
+#include "bindless.h"
+#include "errors.h"
+#include "vk.h"
+
+AH_RESULT create_frame_descriptors(vulkan_state_t *vk_state) {
+    ah_frame_allocator_t *frame_alloc = &vk_state->frame_alloc;
+
+    // Uniform data at binding 0, storage data at binding 1, both placed by
+    // the dynamic offsets given when binding
+    VkDescriptorSetLayoutBinding bindings[2] = {};
+    bindings[0].binding = 0;
+    bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+    bindings[0].descriptorCount = 1;
+    bindings[0].stageFlags = VK_SHADER_STAGE_ALL_GRAPHICS | VK_SHADER_STAGE_COMPUTE_BIT;
+    bindings[1].binding = 1;
+    bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+    bindings[1].descriptorCount = 1;
+    bindings[1].stageFlags = VK_SHADER_STAGE_ALL_GRAPHICS | VK_SHADER_STAGE_COMPUTE_BIT;
+
+    VkDescriptorSetLayoutCreateInfo layout_info = {};
+    layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layout_info.bindingCount = 2;
+    layout_info.pBindings = bindings;
+
+    if (vkCreateDescriptorSetLayout(vk_state->device, &layout_info, NULL, &frame_alloc->set_layout) != VK_SUCCESS) {
+        set_error("Error creating frame descriptor set layout");
+        return AH_FAILURE;
+    }
+
+    VkDescriptorPoolSize pool_sizes[2] = {};
+    pool_sizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+    pool_sizes[0].descriptorCount = 1;
+    pool_sizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+    pool_sizes[1].descriptorCount = 1;
+
+    VkDescriptorPoolCreateInfo pool_info = {};
+    pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool_info.maxSets = 1;
+    pool_info.poolSizeCount = 2;
+    pool_info.pPoolSizes = pool_sizes;
+
+    if (vkCreateDescriptorPool(vk_state->device, &pool_info, NULL, &frame_alloc->descriptor_pool) != VK_SUCCESS) {
+        set_error("Error creating frame descriptor pool");
+        return AH_FAILURE;
+    }
+
+    VkDescriptorSetAllocateInfo alloc_info = {};
+    alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    alloc_info.descriptorPool = frame_alloc->descriptor_pool;
+    alloc_info.descriptorSetCount = 1;
+    alloc_info.pSetLayouts = &frame_alloc->set_layout;
+
+    if (vkAllocateDescriptorSets(vk_state->device, &alloc_info, &frame_alloc->descriptor_set) != VK_SUCCESS) {
+        set_error("Error allocating frame descriptor set");
+        return AH_FAILURE;
+    }
+
+    // Written once, only the dynamic offsets change afterwards
+    VkDescriptorBufferInfo buffer_infos[2] = {};
+    buffer_infos[0].buffer = frame_alloc->buffer;
+    buffer_infos[0].offset = 0;
+    buffer_infos[0].range = AH_FRAME_UNIFORM_RANGE;
+    buffer_infos[1].buffer = frame_alloc->buffer;
+    buffer_infos[1].offset = 0;
+    buffer_infos[1].range = AH_FRAME_STORAGE_RANGE;
+
+    VkWriteDescriptorSet writes[2] = {};
+    for (uint32_t i = 0; i < 2; i++) {
+        writes[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        writes[i].dstSet = frame_alloc->descriptor_set;
+        writes[i].dstBinding = i;
+        writes[i].descriptorCount = 1;
+        writes[i].descriptorType = bindings[i].descriptorType;
+        writes[i].pBufferInfo = &buffer_infos[i];
+    }
+    vkUpdateDescriptorSets(vk_state->device, 2, writes, 0, NULL);
+
+    return AH_SUCCESS;
+}
+
+AH_RESULT ah_frame_alloc_init(vulkan_state_t *vk_state) {
+    ah_frame_allocator_t *frame_alloc = &vk_state->frame_alloc;
+    memset(frame_alloc, 0, sizeof(ah_frame_allocator_t));
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(vk_state->physical_device, &properties);
+    frame_alloc->alignment = properties.limits.minUniformBufferOffsetAlignment;
+    if (properties.limits.minStorageBufferOffsetAlignment > frame_alloc->alignment) {
+        frame_alloc->alignment = properties.limits.minStorageBufferOffsetAlignment;
+    }
+
+    // A descriptor range starting at the very end of the last region still
+    // has to fit in the buffer
+    VkDeviceSize size = AH_FRAME_ALLOC_SIZE * vk_state->frames_in_flight + AH_FRAME_STORAGE_RANGE;
+    if (ah_vk_create_buffer(
+        vk_state,
+        size,
+        VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+        &frame_alloc->buffer,
+        &frame_alloc->allocation)
+    != AH_SUCCESS) {
+        set_error("Failed to create frame allocator buffer");
+        return AH_FAILURE;
+    }
+    frame_alloc->mapped = (uint8_t*)frame_alloc->allocation.mapped;
+
+    return create_frame_descriptors(vk_state);
+}
+
+/// Start handing out `frame`'s region from the beginning again. The
+/// graphics timeline must have reached the slot's value, nothing reads the
+/// region anymore by then.
+void ah_frame_alloc_reset(vulkan_state_t *vk_state, uint32_t frame) {
+    ah_frame_allocator_t *frame_alloc = &vk_state->frame_alloc;
+
+    frame_alloc->frame = frame;
+    frame_alloc->head = 0;
+}
+
+/// Hand out `size` bytes of the current frame's region, aligned for use as
+/// a dynamic offset. Valid until the slot comes around again.
+AH_RESULT ah_frame_alloc(vulkan_state_t *vk_state, VkDeviceSize size, ah_frame_range_t *range) {
+    ah_frame_allocator_t *frame_alloc = &vk_state->frame_alloc;
+
+    VkDeviceSize offset = (frame_alloc->head + frame_alloc->alignment - 1) & ~(frame_alloc->alignment - 1);
+    if (offset + size > AH_FRAME_ALLOC_SIZE) {
+        set_error("Frame allocator is out of space");
+        return AH_FAILURE;
+    }
+    frame_alloc->head = offset + size;
+    if (frame_alloc->head > frame_alloc->peak) {
+        frame_alloc->peak = frame_alloc->head;
+    }
+
+    VkDeviceSize buffer_offset = (VkDeviceSize)frame_alloc->frame * AH_FRAME_ALLOC_SIZE + offset;
+    range->offset = (uint32_t)buffer_offset;
+    range->data = frame_alloc->mapped + buffer_offset;
+
+    return AH_SUCCESS;
+}
+
+AH_RESULT ah_frame_alloc_write(vulkan_state_t *vk_state, const void *data, VkDeviceSize size, ah_frame_range_t *range) {
+    if (ah_frame_alloc(vk_state, size, range) != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
+
+    memcpy(range->data, data, size);
+    return AH_SUCCESS;
+}
+
+/// Bind the per-frame set at AH_FRAME_ALLOC_SET of `layout`, the uniform
+/// and storage descriptors start at the given ranges
+void ah_frame_alloc_bind(vulkan_state_t *vk_state, VkCommandBuffer command_buffer, VkPipelineBindPoint bind_point, VkPipelineLayout layout, uint32_t uniform_offset, uint32_t storage_offset) {
+    uint32_t dynamic_offsets[] = {uniform_offset, storage_offset};
+    vkCmdBindDescriptorSets(command_buffer, bind_point, layout, AH_FRAME_ALLOC_SET, 1, &vk_state->frame_alloc.descriptor_set, 2, dynamic_offsets);
+}
+
+/// Fast path for small per-draw data, pushed at AH_PUSH_DATA_OFFSET without
+/// touching memory or descriptors. Fails when it doesn't fit, allocate a
+/// range instead.
+AH_RESULT ah_frame_push(VkCommandBuffer command_buffer, VkPipelineLayout layout, const void *data, uint32_t size) {
+    if (size > AH_PUSH_CONSTANT_SIZE - AH_PUSH_DATA_OFFSET) {
+        set_error("Push data doesn't fit in the push constants");
+        return AH_FAILURE;
+    }
+
+    vkCmdPushConstants(command_buffer, layout, AH_DRAW_CONSTANT_STAGES, AH_PUSH_DATA_OFFSET, size, data);
+    return AH_SUCCESS;
+}
+
+void ah_frame_alloc_destroy(vulkan_state_t *vk_state) {
+    ah_frame_allocator_t *frame_alloc = &vk_state->frame_alloc;
+
+    if (frame_alloc->buffer != VK_NULL_HANDLE) {
+        printf("Frame allocator peak: %lu of %lu bytes\n", (unsigned long)frame_alloc->peak, (unsigned long)AH_FRAME_ALLOC_SIZE);
+        ah_vk_destroy_buffer(vk_state, frame_alloc->buffer, &frame_alloc->allocation);
+    }
+    vkDestroyDescriptorPool(vk_state->device, frame_alloc->descriptor_pool, NULL);
+    vkDestroyDescriptorSetLayout(vk_state->device, frame_alloc->set_layout, NULL);
+}
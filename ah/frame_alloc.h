@@ -0,0 +1,66 @@
+#pragma once
+
+#include "ah.h"
+#include "alloc.h"
+#include <cglm/cglm.h>
+#include <stdint.h>
+#include <vulkan/vulkan_core.h>
+
+// Bytes every frame slot can hand out before the allocator fails
+#define AH_FRAME_ALLOC_SIZE (4 * 1024 * 1024)
+// Largest block a shader reads through each dynamic descriptor. The
+// uniform one is the smallest maxUniformBufferRange devices may have.
+#define AH_FRAME_UNIFORM_RANGE 16384
+#define AH_FRAME_STORAGE_RANGE (256 * 1024)
+// Set index of the per-frame descriptors in the scene pipeline layout
+#define AH_FRAME_ALLOC_SET 1
+
+typedef struct vulkan_state vulkan_state_t;
+
+/// Data every scene shader can read for the current frame, matches AhFrame
+/// in shaders/frame.glsl
+typedef struct ah_frame_uniforms {
+    // `vk_state->view_projection` of the frame
+    mat4 view_projection;
+    // Animation step handed to ah_vk_draw_frame
+    uint32_t index;
+    uint32_t frame_count;
+    uint32_t padding[2];
+} ah_frame_uniforms_t;
+
+/// A sub-range handed out for the current frame. `offset` is what goes into
+/// the dynamic offsets of the per-frame set.
+typedef struct ah_frame_range {
+    uint32_t offset;
+    void *data;
+} ah_frame_range_t;
+
+/// Bump allocator over one persistently mapped buffer, a region per frame
+/// slot. Ranges are written in place and read through a uniform and a
+/// storage descriptor with dynamic offsets, so per-frame data costs no heap
+/// allocation, mapping or descriptor update. A region is reset at once when
+/// the graphics timeline reached its slot's value.
+typedef struct ah_frame_allocator {
+    VkBuffer buffer;
+    ah_allocation_t allocation;
+    uint8_t *mapped;
+    // Covers both uniform and storage offset alignment
+    VkDeviceSize alignment;
+
+    uint32_t frame;
+    VkDeviceSize head;
+    // Most bytes any frame used, reported on destroy
+    VkDeviceSize peak;
+
+    VkDescriptorSetLayout set_layout;
+    VkDescriptorPool descriptor_pool;
+    VkDescriptorSet descriptor_set;
+} ah_frame_allocator_t;
+
+AH_RESULT ah_frame_alloc_init(vulkan_state_t *vk_state);
+void ah_frame_alloc_reset(vulkan_state_t *vk_state, uint32_t frame);
+AH_RESULT ah_frame_alloc(vulkan_state_t *vk_state, VkDeviceSize size, ah_frame_range_t *range);
+AH_RESULT ah_frame_alloc_write(vulkan_state_t *vk_state, const void *data, VkDeviceSize size, ah_frame_range_t *range);
+void ah_frame_alloc_bind(vulkan_state_t *vk_state, VkCommandBuffer command_buffer, VkPipelineBindPoint bind_point, VkPipelineLayout layout, uint32_t uniform_offset, uint32_t storage_offset);
+AH_RESULT ah_frame_push(VkCommandBuffer command_buffer, VkPipelineLayout layout, const void *data, uint32_t size);
+void ah_frame_alloc_destroy(vulkan_state_t *vk_state);
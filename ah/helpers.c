@@ -1,8 +1,13 @@
 #include "helpers.h"
 
+#include <fcntl.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 buffer_t* read_file(char *path) {
     FILE *fp;
@@ -35,3 +40,71 @@ buffer_t* read_file(char *path) {
     fclose(fp);
     return buffer;
 }
+
+bool map_file(const char *path, mapped_file_t *file) {
+    file->size = 0;
+    file->data = NULL;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        return false;
+    }
+
+    void *data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // The mapping keeps the file alive on its own
+    close(fd);
+
+    if (data == MAP_FAILED) {
+        return false;
+    }
+
+    // Files are read front to back once, let the kernel read ahead
+    madvise(data, (size_t)st.st_size, MADV_SEQUENTIAL);
+
+    file->size = (size_t)st.st_size;
+    file->data = (const uint8_t*)data;
+    return true;
+}
+
+/// Drop the pages fully inside [offset, offset + size) from the resident
+/// set, they are read back from the file if touched again
+void release_file_range(mapped_file_t *file, size_t offset, size_t size) {
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t start = (size_t)align_up(offset, page_size);
+    size_t end = (offset + size) & ~(page_size - 1);
+
+    if (end > start) {
+        madvise((void*)(file->data + start), end - start, MADV_DONTNEED);
+    }
+}
+
+void unmap_file(mapped_file_t *file) {
+    if (file->data) {
+        munmap((void*)file->data, file->size);
+    }
+    file->size = 0;
+    file->data = NULL;
+}
+
+/// Round `value` up to a multiple of `alignment`, which must be a power of two
+uint64_t align_up(uint64_t value, uint64_t alignment) {
+    return (value + alignment - 1) & ~(alignment - 1);
+}
+
+uint64_t hash_fnv1a(const void *data, size_t size) {
+    const uint8_t *bytes = (const uint8_t*)data;
+    uint64_t hash = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    return hash;
+}
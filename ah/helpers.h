@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -8,4 +9,16 @@ typedef struct buffer {
     uint8_t data[];
 } buffer_t;
 
+/// Read-only view of a whole file. Pages are faulted in on first touch and
+/// never copied to the heap.
+typedef struct mapped_file {
+    size_t size;
+    const uint8_t *data;
+} mapped_file_t;
+
 buffer_t* read_file(char *path);
+bool map_file(const char *path, mapped_file_t *file);
+void release_file_range(mapped_file_t *file, size_t offset, size_t size);
+void unmap_file(mapped_file_t *file);
+uint64_t align_up(uint64_t value, uint64_t alignment);
+uint64_t hash_fnv1a(const void *data, size_t size);
@@ -0,0 +1,396 @@
+#include "hot_reload.h"
+
+#include <dirent.h>
+#include <spawn.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/wait.h>
+#include <threads.h>
+#include <unistd.h>
+#include <vulkan/vulkan_core.h>
+#include "ah.h"
+#include "errors.h"
+#include "instrument.h"
+#include "scheduler.h"
+#include "vk.h"
+
+extern char **environ;
+
+/// Where the build puts the SPIR-V of a shader source, "shader.frag" goes
+/// to "./shader_frag.spv" like the Tupfile rules. False for files that
+/// aren't a shader stage.
+bool shader_spv_path(const char *name, char *spv_path, size_t size) {
+    const char *dot = strrchr(name, '.');
+    if (!dot) {
+        return false;
+    }
+
+    const char *stage = dot + 1;
+    if (strcmp(stage, "vert") != 0 && strcmp(stage, "frag") != 0 && strcmp(stage, "comp") != 0) {
+        return false;
+    }
+
+    snprintf(spv_path, size, "./%.*s_%s.spv", (int)(dot - name), name, stage);
+    return true;
+}
+
+/// Run glslc into a temporary file and move it in place, so a pipeline
+/// build never reads half a file
+bool compile_shader(const char *name, const char *spv_path) {
+    char source_path[AH_HOT_RELOAD_MAX_NAME + 32];
+    char tmp_path[AH_HOT_RELOAD_MAX_NAME + 32];
+    snprintf(source_path, sizeof(source_path), "%s/%s", AH_HOT_RELOAD_SHADER_DIR, name);
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", spv_path);
+
+    char *argv[] = {"glslc", "--target-env=vulkan1.3", source_path, "-o", tmp_path, NULL};
+    pid_t pid;
+    if (posix_spawnp(&pid, "glslc", NULL, NULL, argv, environ) != 0) {
+        printf("Couldn't run glslc for %s\n", name);
+        return false;
+    }
+
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        unlink(tmp_path);
+        printf("Shader %s failed to compile, keeping the previous pipelines\n", name);
+        return false;
+    }
+
+    if (rename(tmp_path, spv_path) != 0) {
+        unlink(tmp_path);
+        printf("Couldn't replace %s\n", spv_path);
+        return false;
+    }
+
+    return true;
+}
+
+bool pipeline_uses(const ah_reload_pipeline_t *pipeline, const char *spv_path) {
+    if (pipeline->compute) {
+        return strcmp(pipeline->compute_desc.comp_path, spv_path) == 0;
+    }
+
+    return strcmp(pipeline->graphics_desc.vert_path, spv_path) == 0 ||
+        strcmp(pipeline->graphics_desc.frag_path, spv_path) == 0;
+}
+
+/// Build a replacement and leave it for the render loop to swap in. A
+/// replacement that was never swapped in is dropped, nothing used it.
+void rebuild_pipeline(ah_hot_reload_t *reload, ah_reload_pipeline_t *pipeline) {
+    AH_ZONE_BEGIN(zone, "pipeline reload");
+    VkPipeline built;
+    AH_RESULT result = pipeline->compute ?
+        ah_vk_build_compute_pipeline(reload->device, reload->cache, &pipeline->compute_desc, &built) :
+        ah_vk_build_graphics_pipeline(reload->device, reload->cache, &pipeline->graphics_desc, &built);
+
+    if (result != AH_SUCCESS) {
+        print_error("hot_reload/rebuild_pipeline");
+        AH_ZONE_END(zone);
+        return;
+    }
+
+    mtx_lock(&reload->lock);
+    if (pipeline->ready != VK_NULL_HANDLE) {
+        vkDestroyPipeline(reload->device, pipeline->ready, NULL);
+    }
+    pipeline->ready = built;
+    mtx_unlock(&reload->lock);
+    AH_ZONE_END(zone);
+}
+
+/// Compiles whatever was queued, then rebuilds every pipeline one of the
+/// new files belongs to. Builds go straight through the shared pipeline
+/// cache instead of the job pool, where a frame waiting on its recording
+/// jobs could end up running them.
+int reload_main(void *arg) {
+    ah_hot_reload_t *reload = (ah_hot_reload_t*)arg;
+    char sources[AH_HOT_RELOAD_MAX_PENDING][AH_HOT_RELOAD_MAX_NAME];
+    ah_instrument_thread_name("shader reload");
+
+    mtx_lock(&reload->lock);
+    while (true) {
+        while (!reload->quit && reload->num_pending == 0) {
+            cnd_wait(&reload->has_work, &reload->lock);
+        }
+        if (reload->quit) {
+            break;
+        }
+
+        uint32_t num_sources = reload->num_pending;
+        memcpy(sources, reload->pending, sizeof(sources[0])*num_sources);
+        reload->num_pending = 0;
+        mtx_unlock(&reload->lock);
+
+        // Pipelines are all tracked during init, before the first poll can
+        // queue anything, so the list is stable here
+        bool rebuild[AH_HOT_RELOAD_MAX_PIPELINES] = {};
+        for (uint32_t i = 0; i < num_sources; i++) {
+            char spv_path[AH_HOT_RELOAD_MAX_NAME + 16];
+            if (!shader_spv_path(sources[i], spv_path, sizeof(spv_path)) || !compile_shader(sources[i], spv_path)) {
+                continue;
+            }
+
+            for (uint32_t j = 0; j < reload->num_pipelines; j++) {
+                rebuild[j] = rebuild[j] || pipeline_uses(&reload->pipelines[j], spv_path);
+            }
+        }
+
+        for (uint32_t i = 0; i < reload->num_pipelines; i++) {
+            if (rebuild[i]) {
+                rebuild_pipeline(reload, &reload->pipelines[i]);
+            }
+        }
+
+        mtx_lock(&reload->lock);
+    }
+    mtx_unlock(&reload->lock);
+
+    return 0;
+}
+
+/// Ahead of the pipelines it tracks, nothing is watched before
+/// `ah_hot_reload_start`
+void ah_hot_reload_init(vulkan_state_t *vk_state) {
+    ah_hot_reload_t *reload = &vk_state->hot_reload;
+    memset(reload, 0, sizeof(ah_hot_reload_t));
+    reload->inotify_fd = -1;
+    reload->device = vk_state->device;
+    reload->cache = vk_state->pipeline_cache;
+}
+
+/// Start watching the shader directory once the tracked pipelines are built
+/// and the worker caches merged, so rebuilds only ever go through the
+/// shared cache. Not having inotify or the directory only turns reloading
+/// off.
+AH_RESULT ah_hot_reload_start(vulkan_state_t *vk_state) {
+    ah_hot_reload_t *reload = &vk_state->hot_reload;
+    if (!vk_state->watch_shaders) {
+        return AH_SUCCESS;
+    }
+
+    reload->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (reload->inotify_fd < 0) {
+        printf("Shader hot reload off, inotify is unavailable\n");
+        return AH_SUCCESS;
+    }
+
+    // Editors that save through a temporary file rename it into place
+    if (inotify_add_watch(reload->inotify_fd, AH_HOT_RELOAD_SHADER_DIR, IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        printf("Shader hot reload off, can't watch %s\n", AH_HOT_RELOAD_SHADER_DIR);
+        close(reload->inotify_fd);
+        reload->inotify_fd = -1;
+        return AH_SUCCESS;
+    }
+
+    if (mtx_init(&reload->lock, mtx_plain) != thrd_success || cnd_init(&reload->has_work) != thrd_success) {
+        set_error("Error creating hot reload lock");
+        return AH_FAILURE;
+    }
+
+    if (thrd_create(&reload->thread, reload_main, reload) != thrd_success) {
+        set_error("Error starting hot reload thread");
+        return AH_FAILURE;
+    }
+    reload->enabled = true;
+
+    printf("Watching %s for shader changes\n", AH_HOT_RELOAD_SHADER_DIR);
+    return AH_SUCCESS;
+}
+
+ah_reload_pipeline_t *track_pipeline(vulkan_state_t *vk_state, const char *name, VkPipeline *target) {
+    ah_hot_reload_t *reload = &vk_state->hot_reload;
+    if (!vk_state->watch_shaders || reload->num_pipelines == AH_HOT_RELOAD_MAX_PIPELINES) {
+        return NULL;
+    }
+
+    ah_reload_pipeline_t *pipeline = &reload->pipelines[reload->num_pipelines++];
+    memset(pipeline, 0, sizeof(ah_reload_pipeline_t));
+    pipeline->name = name;
+    pipeline->target = target;
+    return pipeline;
+}
+
+/// Rebuild `target` from `desc` whenever its shaders change. Paths in the
+/// desc must outlive the reloader.
+void ah_hot_reload_track_graphics(vulkan_state_t *vk_state, const char *name, const ah_graphics_pipeline_desc_t *desc, VkPipeline *target) {
+    ah_reload_pipeline_t *pipeline = track_pipeline(vk_state, name, target);
+    if (pipeline) {
+        pipeline->graphics_desc = *desc;
+        pipeline->queue = AH_QUEUE_GRAPHICS;
+    }
+}
+
+/// Compute pipelines may be dispatched on either queue, `queue` is the one
+/// whose timeline retires the old pipeline
+void ah_hot_reload_track_compute(vulkan_state_t *vk_state, const char *name, const ah_compute_pipeline_desc_t *desc, ah_queue_t queue, VkPipeline *target) {
+    ah_reload_pipeline_t *pipeline = track_pipeline(vk_state, name, target);
+    if (pipeline) {
+        pipeline->compute = true;
+        pipeline->compute_desc = *desc;
+        pipeline->queue = queue;
+    }
+}
+
+/// Queue a source for compiling unless it already is, the lock must be held
+bool queue_source(ah_hot_reload_t *reload, const char *name) {
+    char spv_path[AH_HOT_RELOAD_MAX_NAME + 16];
+    if (strlen(name) >= AH_HOT_RELOAD_MAX_NAME || !shader_spv_path(name, spv_path, sizeof(spv_path))) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < reload->num_pending; i++) {
+        if (strcmp(reload->pending[i], name) == 0) {
+            return false;
+        }
+    }
+    if (reload->num_pending == AH_HOT_RELOAD_MAX_PENDING) {
+        return false;
+    }
+
+    strcpy(reload->pending[reload->num_pending++], name);
+    return true;
+}
+
+/// Includes don't say who includes them, so every stage gets recompiled
+bool queue_all_sources(ah_hot_reload_t *reload) {
+    DIR *dir = opendir(AH_HOT_RELOAD_SHADER_DIR);
+    if (!dir) {
+        return false;
+    }
+
+    bool queued = false;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        queued = queue_source(reload, entry->d_name) || queued;
+    }
+    closedir(dir);
+
+    return queued;
+}
+
+void read_shader_events(ah_hot_reload_t *reload) {
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool queued = false;
+
+    mtx_lock(&reload->lock);
+    ssize_t length;
+    while ((length = read(reload->inotify_fd, buffer, sizeof(buffer))) > 0) {
+        char *ptr = buffer;
+        while (ptr < buffer + length) {
+            const struct inotify_event *event = (const struct inotify_event*)ptr;
+            ptr += sizeof(struct inotify_event) + event->len;
+            if (event->len == 0) {
+                continue;
+            }
+
+            const char *dot = strrchr(event->name, '.');
+            if (dot && strcmp(dot, ".glsl") == 0) {
+                queued = queue_all_sources(reload) || queued;
+            } else {
+                queued = queue_source(reload, event->name) || queued;
+            }
+        }
+    }
+
+    if (queued) {
+        cnd_signal(&reload->has_work);
+    }
+    mtx_unlock(&reload->lock);
+}
+
+void destroy_retired_pipelines(vulkan_state_t *vk_state) {
+    ah_hot_reload_t *reload = &vk_state->hot_reload;
+    uint32_t num_kept = 0;
+
+    for (uint32_t i = 0; i < reload->num_retired; i++) {
+        ah_retired_pipeline_t *retired = &reload->retired[i];
+
+        if (ah_scheduler_poll(vk_state, retired->queue, retired->value)) {
+            vkDestroyPipeline(vk_state->device, retired->pipeline, NULL);
+        } else {
+            reload->retired[num_kept++] = *retired;
+        }
+    }
+
+    reload->num_retired = num_kept;
+}
+
+/// Submissions so far may still bind `pipeline`
+void retire_pipeline(vulkan_state_t *vk_state, VkPipeline pipeline, ah_queue_t queue) {
+    ah_hot_reload_t *reload = &vk_state->hot_reload;
+
+    // Saving faster than frames retire, only happens by hand
+    if (reload->num_retired == AH_HOT_RELOAD_MAX_RETIRED) {
+        ah_retired_pipeline_t *oldest = &reload->retired[0];
+        if (ah_scheduler_wait(vk_state, oldest->queue, oldest->value) != AH_SUCCESS) {
+            print_error("hot_reload/retire_pipeline");
+        }
+        destroy_retired_pipelines(vk_state);
+    }
+
+    ah_retired_pipeline_t *retired = &reload->retired[reload->num_retired++];
+    retired->pipeline = pipeline;
+    retired->queue = queue;
+    retired->value = vk_state->scheduler.timelines[queue].submitted;
+}
+
+/// Called at a frame boundary, before anything is recorded. Picks up saved
+/// shaders, swaps finished pipelines in and destroys replaced ones the GPU
+/// is done with. Never waits on the reload thread.
+void ah_hot_reload_poll(vulkan_state_t *vk_state) {
+    ah_hot_reload_t *reload = &vk_state->hot_reload;
+    if (!reload->enabled) {
+        return;
+    }
+
+    read_shader_events(reload);
+
+    mtx_lock(&reload->lock);
+    for (uint32_t i = 0; i < reload->num_pipelines; i++) {
+        ah_reload_pipeline_t *pipeline = &reload->pipelines[i];
+        if (pipeline->ready == VK_NULL_HANDLE) {
+            continue;
+        }
+
+        if (*pipeline->target != VK_NULL_HANDLE) {
+            retire_pipeline(vk_state, *pipeline->target, pipeline->queue);
+        }
+        *pipeline->target = pipeline->ready;
+        pipeline->ready = VK_NULL_HANDLE;
+        printf("Reloaded %s pipeline\n", pipeline->name);
+    }
+    mtx_unlock(&reload->lock);
+
+    destroy_retired_pipelines(vk_state);
+}
+
+/// Stops the thread, the device must be idle
+void ah_hot_reload_destroy(vulkan_state_t *vk_state) {
+    ah_hot_reload_t *reload = &vk_state->hot_reload;
+    if (!reload->enabled) {
+        return;
+    }
+
+    mtx_lock(&reload->lock);
+    reload->quit = true;
+    cnd_signal(&reload->has_work);
+    mtx_unlock(&reload->lock);
+    thrd_join(reload->thread, NULL);
+
+    for (uint32_t i = 0; i < reload->num_pipelines; i++) {
+        if (reload->pipelines[i].ready != VK_NULL_HANDLE) {
+            vkDestroyPipeline(vk_state->device, reload->pipelines[i].ready, NULL);
+        }
+    }
+    for (uint32_t i = 0; i < reload->num_retired; i++) {
+        vkDestroyPipeline(vk_state->device, reload->retired[i].pipeline, NULL);
+    }
+    reload->num_retired = 0;
+
+    close(reload->inotify_fd);
+    cnd_destroy(&reload->has_work);
+    mtx_destroy(&reload->lock);
+    reload->enabled = false;
+}
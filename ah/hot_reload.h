@@ -0,0 +1,74 @@
+#pragma once
+
+#include "ah.h"
+#include "pipeline_builder.h"
+#include "scheduler.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <threads.h>
+#include <vulkan/vulkan_core.h>
+
+#define AH_HOT_RELOAD_SHADER_DIR "./shaders"
+#define AH_HOT_RELOAD_MAX_PIPELINES 8
+#define AH_HOT_RELOAD_MAX_PENDING 32
+#define AH_HOT_RELOAD_MAX_RETIRED 16
+#define AH_HOT_RELOAD_MAX_NAME 128
+
+typedef struct vulkan_state vulkan_state_t;
+
+/// A pipeline rebuilt whenever one of its SPIR-V files is recompiled
+typedef struct ah_reload_pipeline {
+    const char *name;
+    bool compute;
+    ah_graphics_pipeline_desc_t graphics_desc;
+    ah_compute_pipeline_desc_t compute_desc;
+    // Queue whose timeline tells when a replaced pipeline is unused
+    ah_queue_t queue;
+    // The pipeline the render loop binds, only written at a frame boundary
+    VkPipeline *target;
+    // Built by the reload thread and waiting to be swapped in, guarded by
+    // the lock
+    VkPipeline ready;
+} ah_reload_pipeline_t;
+
+typedef struct ah_retired_pipeline {
+    VkPipeline pipeline;
+    ah_queue_t queue;
+    uint64_t value;
+} ah_retired_pipeline_t;
+
+/// Recompiles shaders as they are saved. inotify reports writes to the
+/// shader directory, glslc runs on a thread of its own and that thread also
+/// rebuilds the pipelines using the files, through the shared pipeline
+/// cache. Nothing blocks the render loop: it only swaps finished pipelines
+/// in before recording and destroys the old ones once their queue is done
+/// with them.
+typedef struct ah_hot_reload {
+    bool enabled;
+    int inotify_fd;
+    VkDevice device;
+    VkPipelineCache cache;
+
+    thrd_t thread;
+    mtx_t lock;
+    cnd_t has_work;
+    bool quit;
+    // Shader sources waiting to be compiled, relative to the shader
+    // directory
+    char pending[AH_HOT_RELOAD_MAX_PENDING][AH_HOT_RELOAD_MAX_NAME];
+    uint32_t num_pending;
+
+    ah_reload_pipeline_t pipelines[AH_HOT_RELOAD_MAX_PIPELINES];
+    uint32_t num_pipelines;
+
+    // Only touched by the render loop
+    ah_retired_pipeline_t retired[AH_HOT_RELOAD_MAX_RETIRED];
+    uint32_t num_retired;
+} ah_hot_reload_t;
+
+void ah_hot_reload_init(vulkan_state_t *vk_state);
+AH_RESULT ah_hot_reload_start(vulkan_state_t *vk_state);
+void ah_hot_reload_track_graphics(vulkan_state_t *vk_state, const char *name, const ah_graphics_pipeline_desc_t *desc, VkPipeline *target);
+void ah_hot_reload_track_compute(vulkan_state_t *vk_state, const char *name, const ah_compute_pipeline_desc_t *desc, ah_queue_t queue, VkPipeline *target);
+void ah_hot_reload_poll(vulkan_state_t *vk_state);
+void ah_hot_reload_destroy(vulkan_state_t *vk_state);
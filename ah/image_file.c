@@ -0,0 +1,196 @@
+#include "image_file.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vulkan/vulkan_core.h>
+#include <zlib.h>
+#include "ah.h"
+#include "errors.h"
+
+const uint8_t png_signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+
+/// Pick the encoder from the extension of `path`
+AH_RESULT ah_image_file_format_from_path(const char *path, ah_image_file_format_t *format) {
+    const char *extension = strrchr(path, '.');
+    if (extension && strcmp(extension, ".png") == 0) {
+        *format = AH_IMAGE_FILE_PNG;
+        return AH_SUCCESS;
+    }
+    if (extension && strcmp(extension, ".ppm") == 0) {
+        *format = AH_IMAGE_FILE_PPM;
+        return AH_SUCCESS;
+    }
+
+    set_error("Images can only be written as .png or .ppm");
+    return AH_FAILURE;
+}
+
+/// One row of 8-bit RGBA or BGRA texels as packed RGB, alpha is dropped
+void pack_rgb_row(const uint8_t *src, uint8_t *dst, uint32_t width, bool bgra) {
+    uint32_t red = bgra ? 2 : 0;
+    uint32_t blue = bgra ? 0 : 2;
+
+    for (uint32_t x = 0; x < width; x++) {
+        dst[3 * x + 0] = src[4 * x + red];
+        dst[3 * x + 1] = src[4 * x + 1];
+        dst[3 * x + 2] = src[4 * x + blue];
+    }
+}
+
+void write_be32(uint8_t *dst, uint32_t value) {
+    dst[0] = (uint8_t)(value >> 24);
+    dst[1] = (uint8_t)(value >> 16);
+    dst[2] = (uint8_t)(value >> 8);
+    dst[3] = (uint8_t)value;
+}
+
+/// Length, type, data, then a CRC over type and data
+bool write_png_chunk(FILE *fp, const char *type, const uint8_t *data, uint32_t size) {
+    uint8_t header[8];
+    write_be32(header, size);
+    memcpy(header + 4, type, 4);
+
+    uLong crc = crc32(0, (const Bytef*)type, 4);
+    if (size > 0) {
+        crc = crc32(crc, data, size);
+    }
+    uint8_t footer[4];
+    write_be32(footer, (uint32_t)crc);
+
+    return fwrite(header, 1, sizeof(header), fp) == sizeof(header) &&
+        (size == 0 || fwrite(data, 1, size, fp) == size) &&
+        fwrite(footer, 1, sizeof(footer), fp) == sizeof(footer);
+}
+
+/// Signature, header, one data chunk and the end marker
+bool write_png_chunks(FILE *fp, const uint8_t *compressed, uint32_t compressed_size, uint32_t width, uint32_t height) {
+    // 8 bits per channel, RGB, no interlacing
+    uint8_t ihdr[13] = {};
+    write_be32(ihdr, width);
+    write_be32(ihdr + 4, height);
+    ihdr[8] = 8;
+    ihdr[9] = 2;
+
+    return fwrite(png_signature, 1, sizeof(png_signature), fp) == sizeof(png_signature) &&
+        write_png_chunk(fp, "IHDR", ihdr, sizeof(ihdr)) &&
+        write_png_chunk(fp, "IDAT", compressed, compressed_size) &&
+        write_png_chunk(fp, "IEND", NULL, 0);
+}
+
+AH_RESULT write_png(FILE *fp, const uint8_t *pixels, bool bgra, uint32_t width, uint32_t height) {
+    // Every row starts with its filter type. Sub stores each byte as the
+    // difference to the same channel on its left, flat areas and gradients
+    // then deflate to almost nothing.
+    size_t row_size = 1 + (size_t)width * 3;
+    size_t raw_size = row_size * height;
+    uint8_t *raw = (uint8_t*)malloc(raw_size);
+    uint8_t *rgb = (uint8_t*)malloc((size_t)width * 3);
+    uLongf compressed_size = compressBound((uLong)raw_size);
+    uint8_t *compressed = (uint8_t*)malloc(compressed_size);
+
+    AH_RESULT result = AH_FAILURE;
+    if (!raw || !rgb || !compressed) {
+        set_error("Out of memory encoding PNG");
+    } else {
+        for (uint32_t y = 0; y < height; y++) {
+            uint8_t *row = raw + row_size * y;
+            pack_rgb_row(pixels + (size_t)width * 4 * y, rgb, width, bgra);
+
+            row[0] = 1;
+            for (uint32_t x = 0; x < width * 3; x++) {
+                row[1 + x] = (uint8_t)(rgb[x] - (x >= 3 ? rgb[x - 3] : 0));
+            }
+        }
+
+        // Speed over size, encoding has to keep up with the GPU
+        if (compress2(compressed, &compressed_size, raw, (uLong)raw_size, Z_BEST_SPEED) != Z_OK) {
+            set_error("Failed to deflate PNG data");
+        } else if (!write_png_chunks(fp, compressed, (uint32_t)compressed_size, width, height)) {
+            set_error("Failed to write PNG");
+        } else {
+            result = AH_SUCCESS;
+        }
+    }
+
+    free(compressed);
+    free(rgb);
+    free(raw);
+    return result;
+}
+
+AH_RESULT write_ppm(FILE *fp, const uint8_t *pixels, bool bgra, uint32_t width, uint32_t height) {
+    uint8_t *rgb = (uint8_t*)malloc((size_t)width * 3);
+    if (!rgb) {
+        set_error("Out of memory encoding PPM");
+        return AH_FAILURE;
+    }
+
+    AH_RESULT result = AH_SUCCESS;
+    if (fprintf(fp, "P6\n%u %u\n255\n", width, height) < 0) {
+        result = AH_FAILURE;
+    }
+    for (uint32_t y = 0; y < height && result == AH_SUCCESS; y++) {
+        pack_rgb_row(pixels + (size_t)width * 4 * y, rgb, width, bgra);
+        if (fwrite(rgb, 1, (size_t)width * 3, fp) != (size_t)width * 3) {
+            result = AH_FAILURE;
+        }
+    }
+    free(rgb);
+
+    if (result != AH_SUCCESS) {
+        set_error("Failed to write PPM");
+    }
+    return result;
+}
+
+/// Encode tightly packed 8-bit RGBA or BGRA pixels to `path`. The file is
+/// written next to it and renamed over it, so readers never see a partial
+/// image.
+AH_RESULT ah_image_file_write(const char *path, ah_image_file_format_t format, const uint8_t *pixels, VkFormat pixel_format, uint32_t width, uint32_t height) {
+    bool bgra;
+    switch (pixel_format) {
+    case VK_FORMAT_B8G8R8A8_UNORM:
+    case VK_FORMAT_B8G8R8A8_SRGB:
+        bgra = true;
+        break;
+    case VK_FORMAT_R8G8B8A8_UNORM:
+    case VK_FORMAT_R8G8B8A8_SRGB:
+        bgra = false;
+        break;
+    default:
+        set_error("Unsupported pixel format for image files");
+        return AH_FAILURE;
+    }
+
+    char tmp_path[4096];
+    if (snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path) >= (int)sizeof(tmp_path)) {
+        set_error("Image path too long");
+        return AH_FAILURE;
+    }
+
+    FILE *fp = fopen(tmp_path, "wb");
+    if (!fp) {
+        set_error("Could not open image file");
+        return AH_FAILURE;
+    }
+
+    AH_RESULT result = format == AH_IMAGE_FILE_PNG ?
+        write_png(fp, pixels, bgra, width, height) :
+        write_ppm(fp, pixels, bgra, width, height);
+
+    if (fclose(fp) != 0 && result == AH_SUCCESS) {
+        set_error("Failed to write image file");
+        result = AH_FAILURE;
+    }
+    if (result == AH_SUCCESS && rename(tmp_path, path) != 0) {
+        set_error("Could not rename image file into place");
+        result = AH_FAILURE;
+    }
+    if (result != AH_SUCCESS) {
+        remove(tmp_path);
+    }
+
+    return result;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "ah.h"
+#include <stdint.h>
+#include <vulkan/vulkan_core.h>
+
+typedef enum ah_image_file_format {
+    AH_IMAGE_FILE_PPM,
+    AH_IMAGE_FILE_PNG,
+} ah_image_file_format_t;
+
+AH_RESULT ah_image_file_format_from_path(const char *path, ah_image_file_format_t *format);
+AH_RESULT ah_image_file_write(const char *path, ah_image_file_format_t format, const uint8_t *pixels, VkFormat pixel_format, uint32_t width, uint32_t height);
@@ -0,0 +1,284 @@
+#include "instancing.h"
+
+#include <math.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vulkan/vulkan_core.h>
+#include "ah.h"
+#include "bindless.h"
+#include "culling.h"
+#include "errors.h"
+#include "frame_alloc.h"
+#include "hot_reload.h"
+#include "instrument.h"
+#include "pipeline_builder.h"
+#include "record.h"
+#include "scheduler.h"
+#include "simulation.h"
+#include "vertex.h"
+#include "vk.h"
+
+/// Queue the instanced pipeline build, it shares the layout and render
+/// target of the main pipeline
+AH_RESULT ah_instancing_init(vulkan_state_t *vk_state) {
+    ah_instancing_t *instancing = &vk_state->instancing;
+    memset(instancing, 0, sizeof(ah_instancing_t));
+
+    ah_graphics_pipeline_desc_t desc = {};
+    desc.vert_path = "./instanced_vert.spv";
+    desc.frag_path = "./shader_frag.spv";
+    desc.layout = vk_state->pipeline_layout;
+    desc.render_pass = vk_state->render_pass;
+    desc.subpass = 0;
+    desc.color_format = vk_state->swapchain_image_format;
+    desc.depth_format = vk_state->depth_format;
+    desc.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+    desc.cull_mode = VK_CULL_MODE_BACK_BIT;
+    desc.instanced = true;
+    desc.vertex_format = vk_state->mesh.vertex_format;
+
+    ah_pipeline_builder_submit(&vk_state->pipeline_builder, &desc, &instancing->pipeline_future, NULL, NULL);
+    ah_hot_reload_track_graphics(vk_state, "instanced", &desc, &instancing->pipeline);
+
+    return AH_SUCCESS;
+}
+
+AH_RESULT ah_instancing_wait(vulkan_state_t *vk_state) {
+    ah_instancing_t *instancing = &vk_state->instancing;
+
+    if (ah_pipeline_future_wait(&vk_state->pipeline_builder, &instancing->pipeline_future) != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
+    instancing->pipeline = instancing->pipeline_future.pipeline;
+
+    return AH_SUCCESS;
+}
+
+/// Hand the buffers to the scheduler, frames still drawing them keep them
+/// alive until they finish
+void retire_instance_buffers(vulkan_state_t *vk_state) {
+    ah_instancing_t *instancing = &vk_state->instancing;
+
+    if (instancing->instance_buffer != VK_NULL_HANDLE) {
+        ah_scheduler_retire_buffer(vk_state, instancing->instance_buffer, &instancing->instance_allocation);
+        instancing->instance_buffer = VK_NULL_HANDLE;
+    }
+    if (instancing->indirect_buffer != VK_NULL_HANDLE) {
+        ah_scheduler_retire_buffer(vk_state, instancing->indirect_buffer, &instancing->indirect_allocation);
+        instancing->indirect_buffer = VK_NULL_HANDLE;
+    }
+    if (instancing->count_buffer != VK_NULL_HANDLE) {
+        ah_scheduler_retire_buffer(vk_state, instancing->count_buffer, &instancing->count_allocation);
+        instancing->count_buffer = VK_NULL_HANDLE;
+    }
+
+    instancing->num_instances = 0;
+    instancing->num_commands = 0;
+}
+
+/// Lay the instances out on a square grid covering the viewport, every one
+/// with its own tint
+void fill_instance_grid(instance_t *instances, uint32_t num_instances) {
+    uint32_t side = (uint32_t)ceil(sqrt((double)num_instances));
+    float cell = 2.0f / (float)side;
+
+    for (uint32_t i = 0; i < num_instances; i++) {
+        uint32_t x = i % side;
+        uint32_t y = i / side;
+
+        glm_mat4_identity(instances[i].transform);
+        instances[i].transform[0][0] = cell;
+        instances[i].transform[1][1] = cell;
+        instances[i].transform[3][0] = -1.0f + cell * ((float)x + 0.5f);
+        instances[i].transform[3][1] = -1.0f + cell * ((float)y + 0.5f);
+
+        instances[i].color[0] = 0.5f + 0.5f * (float)(i % 7) / 6.0f;
+        instances[i].color[1] = 0.5f + 0.5f * (float)(i % 11) / 10.0f;
+        instances[i].color[2] = 0.5f + 0.5f * (float)(i % 13) / 12.0f;
+        instances[i].color[3] = 1.0f;
+    }
+}
+
+/// Replace the instanced scene with `num_instances` copies of the mesh. The
+/// previous buffers are retired, frames in flight can keep drawing them.
+AH_RESULT ah_instancing_set_count(vulkan_state_t *vk_state, uint32_t num_instances) {
+    ah_instancing_t *instancing = &vk_state->instancing;
+    retire_instance_buffers(vk_state);
+
+    if (num_instances == 0) {
+        if (ah_simulation_set_instances(vk_state, VK_NULL_HANDLE, 0) != AH_SUCCESS) {
+            return AH_FAILURE;
+        }
+        return ah_culling_set_instances(vk_state, VK_NULL_HANDLE, 0);
+    }
+
+    instance_t *instances = (instance_t*)malloc(sizeof(instance_t)*num_instances);
+    fill_instance_grid(instances, num_instances);
+
+    AH_RESULT result = ah_vk_create_device_buffer(
+        vk_state,
+        instances,
+        sizeof(instance_t)*num_instances,
+        // Also the input of the compute simulation
+        VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+        &instancing->instance_buffer,
+        &instancing->instance_allocation
+    );
+    free(instances);
+
+    if (result != AH_SUCCESS) {
+        set_error("Failed to create instance buffer");
+        return AH_FAILURE;
+    }
+
+    // A single mesh needs a single command, every instance is drawn by it
+    VkDrawIndexedIndirectCommand command = {};
+    command.indexCount = vk_state->mesh.num_indices;
+    command.instanceCount = num_instances;
+    command.firstIndex = 0;
+    command.vertexOffset = 0;
+    command.firstInstance = 0;
+
+    if (ah_vk_create_device_buffer(
+        vk_state,
+        &command,
+        sizeof(command),
+        VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+        &instancing->indirect_buffer,
+        &instancing->indirect_allocation)
+    != AH_SUCCESS) {
+        set_error("Failed to create indirect buffer");
+        return AH_FAILURE;
+    }
+
+    uint32_t num_commands = 1;
+    if (vk_state->features.draw_indirect_count) {
+        if (ah_vk_create_device_buffer(
+            vk_state,
+            &num_commands,
+            sizeof(num_commands),
+            VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+            &instancing->count_buffer,
+            &instancing->count_allocation)
+        != AH_SUCCESS) {
+            set_error("Failed to create indirect count buffer");
+            return AH_FAILURE;
+        }
+    }
+
+    instancing->num_instances = num_instances;
+    instancing->num_commands = num_commands;
+    instancing->index_count = command.indexCount;
+
+    if (ah_simulation_set_instances(vk_state, instancing->instance_buffer, num_instances) != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
+
+    if (ah_culling_set_instances(vk_state, instancing->instance_buffer, num_instances) != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
+
+    return AH_SUCCESS;
+}
+
+/// Outside any render pass and ahead of the draws: point the commands at
+/// the whole scene mesh once it was swapped. Frames in flight keep drawing
+/// with the count they were recorded with, the fill is ordered after them.
+void ah_instancing_record_update(vulkan_state_t *vk_state, VkCommandBuffer command_buffer) {
+    ah_instancing_t *instancing = &vk_state->instancing;
+    if (instancing->num_instances == 0 || instancing->index_count == vk_state->mesh.num_indices) {
+        return;
+    }
+
+    VkMemoryBarrier2 barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER_2;
+    barrier.srcStageMask = VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT;
+    barrier.srcAccessMask = VK_ACCESS_2_NONE;
+    barrier.dstStageMask = VK_PIPELINE_STAGE_2_CLEAR_BIT;
+    barrier.dstAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+
+    VkDependencyInfo dependency = {};
+    dependency.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
+    dependency.memoryBarrierCount = 1;
+    dependency.pMemoryBarriers = &barrier;
+    vkCmdPipelineBarrier2(command_buffer, &dependency);
+
+    uint32_t stride = sizeof(VkDrawIndexedIndirectCommand);
+    for (uint32_t i = 0; i < instancing->num_commands; i++) {
+        vkCmdFillBuffer(command_buffer, instancing->indirect_buffer, i * stride + offsetof(VkDrawIndexedIndirectCommand, indexCount), sizeof(uint32_t), vk_state->mesh.num_indices);
+    }
+
+    barrier.srcStageMask = VK_PIPELINE_STAGE_2_CLEAR_BIT;
+    barrier.srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+    barrier.dstStageMask = VK_PIPELINE_STAGE_2_DRAW_INDIRECT_BIT;
+    barrier.dstAccessMask = VK_ACCESS_2_INDIRECT_COMMAND_READ_BIT;
+    vkCmdPipelineBarrier2(command_buffer, &dependency);
+
+    instancing->index_count = vk_state->mesh.num_indices;
+}
+
+/// Record the instanced draws into a command buffer that is inside the
+/// scene render pass
+void ah_instancing_record(vulkan_state_t *vk_state, VkCommandBuffer command_buffer) {
+    ah_instancing_t *instancing = &vk_state->instancing;
+    if (instancing->num_instances == 0) {
+        return;
+    }
+
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, instancing->pipeline);
+    ah_bindless_bind(vk_state, command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, vk_state->pipeline_layout);
+    ah_frame_alloc_bind(vk_state, command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, vk_state->pipeline_layout, vk_state->frame_uniforms.offset, 0);
+    ah_record_set_viewport(vk_state, command_buffer);
+    AH_COUNTER_ADD(AH_COUNTER_PIPELINE_BINDS, 1);
+
+    ah_draw_constants_t constants = {};
+    memcpy(constants.dequantize, vk_state->mesh.dequantize, sizeof(constants.dequantize));
+    constants.material = AH_BINDLESS_DEFAULT_MATERIAL;
+    vkCmdPushConstants(command_buffer, vk_state->pipeline_layout, AH_DRAW_CONSTANT_STAGES, 0, sizeof(constants), &constants);
+
+    // After culling the visible instances are packed at the front of their
+    // own buffer and the cull pass wrote how many into a single command
+    uint32_t frame = vk_state->current_frame;
+    VkBuffer instance_buffer = ah_simulation_instance_buffer(vk_state, instancing->instance_buffer, frame);
+    VkBuffer indirect_buffer = instancing->indirect_buffer;
+    if (ah_culling_active(vk_state)) {
+        instance_buffer = vk_state->culling.visible_buffers[frame];
+        indirect_buffer = vk_state->culling.indirect_buffers[frame];
+    }
+
+    VkBuffer vertex_buffers[] = {vk_state->mesh.vertex_buffer, instance_buffer};
+    VkDeviceSize offsets[] = {0, 0};
+    vkCmdBindVertexBuffers(command_buffer, 0, 2, vertex_buffers, offsets);
+    vkCmdBindIndexBuffer(command_buffer, vk_state->mesh.index_buffer, 0, vk_state->mesh.index_type);
+
+    uint32_t stride = sizeof(VkDrawIndexedIndirectCommand);
+    if (vk_state->features.draw_indirect_count) {
+        vkCmdDrawIndexedIndirectCount(
+            command_buffer,
+            indirect_buffer, 0,
+            instancing->count_buffer, 0,
+            instancing->num_commands,
+            stride
+        );
+        AH_COUNTER_ADD(AH_COUNTER_DRAW_CALLS, 1);
+    } else if (vk_state->features.multi_draw_indirect) {
+        vkCmdDrawIndexedIndirect(command_buffer, indirect_buffer, 0, instancing->num_commands, stride);
+        AH_COUNTER_ADD(AH_COUNTER_DRAW_CALLS, 1);
+    } else {
+        for (uint32_t i = 0; i < instancing->num_commands; i++) {
+            vkCmdDrawIndexedIndirect(command_buffer, indirect_buffer, i * stride, 1, stride);
+        }
+        AH_COUNTER_ADD(AH_COUNTER_DRAW_CALLS, instancing->num_commands);
+    }
+}
+
+void ah_instancing_destroy(vulkan_state_t *vk_state) {
+    ah_instancing_t *instancing = &vk_state->instancing;
+
+    retire_instance_buffers(vk_state);
+    if (instancing->pipeline != VK_NULL_HANDLE) {
+        vkDestroyPipeline(vk_state->device, instancing->pipeline, NULL);
+        instancing->pipeline = VK_NULL_HANDLE;
+    }
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "ah.h"
+#include "alloc.h"
+#include "pipeline_builder.h"
+#include <stdint.h>
+#include <vulkan/vulkan_core.h>
+
+typedef struct vulkan_state vulkan_state_t;
+
+/// Many copies of the scene mesh drawn from GPU-resident buffers. Per-instance
+/// transforms live in a vertex buffer read at instance rate, and the draws
+/// themselves are VkDrawIndexedIndirectCommand entries, so the CPU records
+/// the same handful of commands whatever the instance count.
+typedef struct ah_instancing {
+    VkPipeline pipeline;
+    ah_pipeline_future_t pipeline_future;
+
+    uint32_t num_instances;
+    VkBuffer instance_buffer;
+    ah_allocation_t instance_allocation;
+
+    uint32_t num_commands;
+    VkBuffer indirect_buffer;
+    ah_allocation_t indirect_allocation;
+    // Index count in the commands, rewritten when the mesh changes
+    uint32_t index_count;
+    // Number of valid commands in `indirect_buffer`, only used with
+    // `draw_indirect_count`
+    VkBuffer count_buffer;
+    ah_allocation_t count_allocation;
+} ah_instancing_t;
+
+AH_RESULT ah_instancing_init(vulkan_state_t *vk_state);
+AH_RESULT ah_instancing_wait(vulkan_state_t *vk_state);
+AH_RESULT ah_instancing_set_count(vulkan_state_t *vk_state, uint32_t num_instances);
+void ah_instancing_record_update(vulkan_state_t *vk_state, VkCommandBuffer command_buffer);
+void ah_instancing_record(vulkan_state_t *vk_state, VkCommandBuffer command_buffer);
+void ah_instancing_destroy(vulkan_state_t *vk_state);
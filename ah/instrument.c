@@ -0,0 +1,289 @@
+#include "instrument.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "ah.h"
+#include "frame.h"
+#include "trace.h"
+
+#if AH_INSTRUMENT
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define AH_ZONE_RDTSC 1
+#endif
+
+const char *counter_names[AH_COUNTER_COUNT] = {
+    "draw calls",
+    "pipeline binds",
+    "bytes uploaded",
+    "visible instances",
+    "culled instances",
+    "frames captured",
+    "frames dropped",
+};
+
+_Atomic(ah_zone_ring_t*) zone_rings[AH_ZONE_MAX_THREADS];
+_Atomic uint32_t num_zone_rings;
+_Thread_local ah_zone_ring_t *thread_zone_ring;
+_Thread_local bool thread_zone_registered;
+_Thread_local const char *thread_zone_name;
+
+_Atomic uint64_t counters[AH_COUNTER_COUNT];
+uint64_t total_counters[AH_COUNTER_COUNT];
+uint64_t num_instrumented_frames;
+
+// Only touched by the thread draining the rings
+ah_zone_stat_t zone_stats[AH_ZONE_MAX_STATS];
+uint32_t num_zone_stats;
+
+// Zone ticks are turned into `ah_now_ms` time against this anchor
+bool instrument_ready;
+uint64_t anchor_ticks;
+double anchor_ms;
+double ticks_per_ms;
+
+uint64_t ah_zone_now() {
+#ifdef AH_ZONE_RDTSC
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+#endif
+}
+
+/// Anchor the zone clock, call once from the main thread before any zone
+void ah_instrument_init() {
+    if (instrument_ready) {
+        return;
+    }
+
+    anchor_ticks = ah_zone_now();
+    anchor_ms = ah_now_ms();
+    ticks_per_ms = 1000000.0;
+
+#ifdef AH_ZONE_RDTSC
+    // A first estimate of the TSC rate, refined on every drain
+    while (ah_now_ms() - anchor_ms < 1.0) {
+    }
+    ticks_per_ms = (double)(ah_zone_now() - anchor_ticks) / (ah_now_ms() - anchor_ms);
+#endif
+
+    instrument_ready = true;
+}
+
+void refine_calibration() {
+#ifdef AH_ZONE_RDTSC
+    double elapsed_ms = ah_now_ms() - anchor_ms;
+    if (elapsed_ms > 100.0) {
+        ticks_per_ms = (double)(ah_zone_now() - anchor_ticks) / elapsed_ms;
+    }
+#endif
+}
+
+double ticks_to_ms(uint64_t ticks) {
+    return anchor_ms + (double)(int64_t)(ticks - anchor_ticks) / ticks_per_ms;
+}
+
+/// The calling thread's ring, created on its first zone. NULL once every
+/// ring is taken.
+ah_zone_ring_t* thread_ring() {
+    if (thread_zone_registered) {
+        return thread_zone_ring;
+    }
+    thread_zone_registered = true;
+
+    uint32_t index = atomic_fetch_add(&num_zone_rings, 1);
+    if (index >= AH_ZONE_MAX_THREADS) {
+        return NULL;
+    }
+
+    // Rings outlive their threads, the drain may still be reading them
+    ah_zone_ring_t *ring = (ah_zone_ring_t*)calloc(1, sizeof(ah_zone_ring_t));
+    ring->tid = index + 1;
+    ring->thread_name = thread_zone_name;
+    atomic_store_explicit(&zone_rings[index], ring, memory_order_release);
+
+    thread_zone_ring = ring;
+    return ring;
+}
+
+/// Name the calling thread in traces, call before it records any zone
+void ah_instrument_thread_name(const char *name) {
+    thread_zone_name = name;
+    thread_ring();
+}
+
+ah_zone_t ah_zone_begin(const char *name) {
+    ah_zone_t zone;
+    zone.name = name;
+    zone.start = ah_zone_now();
+    return zone;
+}
+
+void ah_zone_end(ah_zone_t *zone) {
+    uint64_t end = ah_zone_now();
+    ah_zone_ring_t *ring = thread_ring();
+    if (!ring) {
+        return;
+    }
+
+    uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (head - tail == AH_ZONE_RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    ah_zone_event_t *event = &ring->events[head & (AH_ZONE_RING_SIZE - 1)];
+    event->name = zone->name;
+    event->start = zone->start;
+    event->end = end;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
+
+void ah_counter_add(ah_counter_t counter, uint64_t value) {
+    atomic_fetch_add_explicit(&counters[counter], value, memory_order_relaxed);
+}
+
+void add_zone_stat(const char *name, double ms) {
+    ah_zone_stat_t *stat = NULL;
+    for (uint32_t i = 0; i < num_zone_stats; i++) {
+        if (strcmp(zone_stats[i].name, name) == 0) {
+            stat = &zone_stats[i];
+            break;
+        }
+    }
+
+    if (!stat) {
+        if (num_zone_stats == AH_ZONE_MAX_STATS) {
+            return;
+        }
+        stat = &zone_stats[num_zone_stats++];
+        memset(stat, 0, sizeof(ah_zone_stat_t));
+        stat->name = name;
+    }
+
+    stat->count++;
+    stat->total_ms += ms;
+    if (ms > stat->max_ms) {
+        stat->max_ms = ms;
+    }
+}
+
+/// Drain every thread's zones into the running totals and `trace`, and
+/// close the frame's counters. Call from one thread only, once per frame.
+void ah_instrument_frame_end(ah_trace_t *trace) {
+    if (!instrument_ready) {
+        return;
+    }
+    refine_calibration();
+
+    uint32_t num_rings = atomic_load(&num_zone_rings);
+    if (num_rings > AH_ZONE_MAX_THREADS) {
+        num_rings = AH_ZONE_MAX_THREADS;
+    }
+
+    for (uint32_t i = 0; i < num_rings; i++) {
+        ah_zone_ring_t *ring = atomic_load_explicit(&zone_rings[i], memory_order_acquire);
+        if (!ring) {
+            continue;
+        }
+
+        if (ah_trace_is_open(trace) && !ring->named_in_trace) {
+            ah_trace_thread_name(trace, ring->tid, ring->thread_name ? ring->thread_name : "thread");
+            ring->named_in_trace = true;
+        }
+
+        uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+        uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        for (; tail != head; tail++) {
+            ah_zone_event_t *event = &ring->events[tail & (AH_ZONE_RING_SIZE - 1)];
+            double start_ms = ticks_to_ms(event->start);
+            double duration_ms = (double)(event->end - event->start) / ticks_per_ms;
+
+            add_zone_stat(event->name, duration_ms);
+            ah_trace_complete(trace, event->name, "cpu", ring->tid, start_ms * 1000.0, duration_ms * 1000.0);
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+
+    double now_us = ah_now_ms() * 1000.0;
+    for (uint32_t i = 0; i < AH_COUNTER_COUNT; i++) {
+        uint64_t value = atomic_exchange_explicit(&counters[i], 0, memory_order_relaxed);
+        total_counters[i] += value;
+        ah_trace_counter(trace, counter_names[i], now_us, (double)value);
+    }
+    num_instrumented_frames++;
+}
+
+void ah_instrument_print() {
+    if (num_instrumented_frames == 0) {
+        return;
+    }
+
+    printf("%-24s %10s %10s %10s\n", "cpu zone ms", "average", "max", "per frame");
+    for (uint32_t i = 0; i < num_zone_stats; i++) {
+        ah_zone_stat_t *stat = &zone_stats[i];
+        printf(
+            "%-24s %10.4f %10.4f %10.4f\n",
+            stat->name,
+            stat->total_ms / stat->count,
+            stat->max_ms,
+            stat->total_ms / num_instrumented_frames
+        );
+    }
+
+    for (uint32_t i = 0; i < AH_COUNTER_COUNT; i++) {
+        printf("%-24s %10.1f per frame\n", counter_names[i], (double)total_counters[i] / num_instrumented_frames);
+    }
+
+    uint64_t dropped = 0;
+    uint32_t num_rings = atomic_load(&num_zone_rings);
+    for (uint32_t i = 0; i < num_rings && i < AH_ZONE_MAX_THREADS; i++) {
+        ah_zone_ring_t *ring = atomic_load(&zone_rings[i]);
+        if (ring) {
+            dropped += atomic_load(&ring->dropped);
+        }
+    }
+    if (dropped > 0) {
+        printf("%lu zones dropped, drain more often\n", (unsigned long)dropped);
+    }
+}
+
+#else
+
+void ah_instrument_init() {
+}
+
+void ah_instrument_thread_name(const char *name) {
+}
+
+uint64_t ah_zone_now() {
+    return 0;
+}
+
+ah_zone_t ah_zone_begin(const char *name) {
+    ah_zone_t zone = {};
+    return zone;
+}
+
+void ah_zone_end(ah_zone_t *zone) {
+}
+
+void ah_counter_add(ah_counter_t counter, uint64_t value) {
+}
+
+void ah_instrument_frame_end(ah_trace_t *trace) {
+}
+
+void ah_instrument_print() {
+}
+
+#endif
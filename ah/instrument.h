@@ -0,0 +1,84 @@
+#pragma once
+
+#include "ah.h"
+#include "jobs.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Build with -DAH_INSTRUMENT=0 to compile zones and counters out, the
+// AH_ZONE and AH_COUNTER macros then expand to nothing
+#ifndef AH_INSTRUMENT
+#define AH_INSTRUMENT 1
+#endif
+
+// Threads that can record zones, later threads are not instrumented
+#define AH_ZONE_MAX_THREADS (AH_JOBS_MAX_WORKERS + 4)
+// Zones a thread can record between two drains, must be a power of two
+#define AH_ZONE_RING_SIZE 4096
+// Distinct zone names that keep a running total
+#define AH_ZONE_MAX_STATS 64
+
+typedef struct ah_trace ah_trace_t;
+
+typedef enum ah_counter {
+    AH_COUNTER_DRAW_CALLS,
+    AH_COUNTER_PIPELINE_BINDS,
+    AH_COUNTER_BYTES_UPLOADED,
+    // Read back from the cull pass, a few frames late
+    AH_COUNTER_VISIBLE_INSTANCES,
+    AH_COUNTER_CULLED_INSTANCES,
+    // Handed to the capture consumer, or not copied because it fell behind
+    AH_COUNTER_FRAMES_CAPTURED,
+    AH_COUNTER_FRAMES_DROPPED,
+    AH_COUNTER_COUNT,
+} ah_counter_t;
+
+typedef struct ah_zone {
+    const char *name;
+    uint64_t start;
+} ah_zone_t;
+
+typedef struct ah_zone_event {
+    const char *name;
+    uint64_t start;
+    uint64_t end;
+} ah_zone_event_t;
+
+/// Zones of one thread. Only the owning thread moves `head` and only the
+/// drain moves `tail`, so neither side takes a lock.
+typedef struct ah_zone_ring {
+    _Atomic uint32_t head;
+    _Atomic uint32_t tail;
+    _Atomic uint64_t dropped;
+    uint32_t tid;
+    const char *thread_name;
+    bool named_in_trace;
+    ah_zone_event_t events[AH_ZONE_RING_SIZE];
+} ah_zone_ring_t;
+
+typedef struct ah_zone_stat {
+    const char *name;
+    uint64_t count;
+    double total_ms;
+    double max_ms;
+} ah_zone_stat_t;
+
+#if AH_INSTRUMENT
+#define AH_ZONE_BEGIN(zone, name) ah_zone_t zone = ah_zone_begin(name)
+#define AH_ZONE_END(zone) ah_zone_end(&zone)
+#define AH_COUNTER_ADD(counter, value) ah_counter_add(counter, value)
+#else
+#define AH_ZONE_BEGIN(zone, name)
+#define AH_ZONE_END(zone)
+#define AH_COUNTER_ADD(counter, value)
+#endif
+
+void ah_instrument_init();
+void ah_instrument_thread_name(const char *name);
+uint64_t ah_zone_now();
+ah_zone_t ah_zone_begin(const char *name);
+void ah_zone_end(ah_zone_t *zone);
+void ah_counter_add(ah_counter_t counter, uint64_t value);
+void ah_instrument_frame_end(ah_trace_t *trace);
+void ah_instrument_print();
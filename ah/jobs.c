@@ -0,0 +1,162 @@
+#include "jobs.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <threads.h>
+#include <unistd.h>
+#include "ah.h"
+#include "errors.h"
+#include "instrument.h"
+
+/// Pop a job, the pool lock must be held
+bool pop_job(ah_job_pool_t *pool, ah_job_t *job) {
+    if (pool->queue_count == 0) {
+        return false;
+    }
+
+    *job = pool->queue[pool->queue_head];
+    pool->queue_head = (pool->queue_head + 1) % AH_JOBS_QUEUE_SIZE;
+    pool->queue_count--;
+    return true;
+}
+
+/// Run a job with the pool lock released, then retire it
+void run_job(ah_job_pool_t *pool, ah_job_t *job, uint32_t worker) {
+    mtx_unlock(&pool->lock);
+    job->fn(job->data, worker);
+    mtx_lock(&pool->lock);
+
+    if (job->counter) {
+        job->counter->pending--;
+    }
+    cnd_broadcast(&pool->job_done);
+}
+
+int worker_main(void *arg) {
+    ah_job_worker_t *worker = (ah_job_worker_t*)arg;
+    ah_job_pool_t *pool = worker->pool;
+    ah_job_t job;
+    ah_instrument_thread_name("job worker");
+
+    mtx_lock(&pool->lock);
+    while (!pool->quit) {
+        if (!pop_job(pool, &job)) {
+            cnd_wait(&pool->has_jobs, &pool->lock);
+            continue;
+        }
+
+        run_job(pool, &job, worker->index);
+    }
+    mtx_unlock(&pool->lock);
+
+    return 0;
+}
+
+/// Start `num_workers` threads, 0 picks one per core minus the caller
+AH_RESULT ah_jobs_init(ah_job_pool_t *pool, uint32_t num_workers) {
+    if (num_workers == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        num_workers = cores > 1 ? (uint32_t)(cores - 1) : 1;
+    }
+    if (num_workers > AH_JOBS_MAX_WORKERS) {
+        num_workers = AH_JOBS_MAX_WORKERS;
+    }
+
+    pool->num_workers = 0;
+    pool->queue_head = 0;
+    pool->queue_count = 0;
+    pool->quit = false;
+
+    if (mtx_init(&pool->lock, mtx_plain) != thrd_success ||
+        cnd_init(&pool->has_jobs) != thrd_success ||
+        cnd_init(&pool->job_done) != thrd_success) {
+        set_error("Error creating job pool sync objects");
+        return AH_FAILURE;
+    }
+
+    for (uint32_t i = 0; i < num_workers; i++) {
+        pool->workers[i].pool = pool;
+        pool->workers[i].index = i;
+
+        if (thrd_create(&pool->threads[i], worker_main, &pool->workers[i]) != thrd_success) {
+            set_error("Error creating job worker");
+            return AH_FAILURE;
+        }
+        pool->num_workers++;
+    }
+
+    return AH_SUCCESS;
+}
+
+void ah_jobs_destroy(ah_job_pool_t *pool) {
+    mtx_lock(&pool->lock);
+    pool->quit = true;
+    cnd_broadcast(&pool->has_jobs);
+    mtx_unlock(&pool->lock);
+
+    for (uint32_t i = 0; i < pool->num_workers; i++) {
+        thrd_join(pool->threads[i], NULL);
+    }
+
+    cnd_destroy(&pool->job_done);
+    cnd_destroy(&pool->has_jobs);
+    mtx_destroy(&pool->lock);
+}
+
+/// Queue a job. `counter` is optional and is decremented once the job ran.
+/// When the queue is full the caller runs queued jobs until there is room.
+void ah_jobs_push(ah_job_pool_t *pool, ah_job_fn fn, void *data, ah_job_counter_t *counter) {
+    ah_job_t job;
+
+    mtx_lock(&pool->lock);
+    while (pool->queue_count == AH_JOBS_QUEUE_SIZE && pop_job(pool, &job)) {
+        run_job(pool, &job, AH_JOBS_CALLER_WORKER);
+    }
+
+    if (counter) {
+        counter->pending++;
+    }
+
+    uint32_t tail = (pool->queue_head + pool->queue_count) % AH_JOBS_QUEUE_SIZE;
+    pool->queue[tail].fn = fn;
+    pool->queue[tail].data = data;
+    pool->queue[tail].counter = counter;
+    pool->queue_count++;
+
+    cnd_signal(&pool->has_jobs);
+    mtx_unlock(&pool->lock);
+}
+
+/// Block until `done` returns true, helping with queued work in the
+/// meantime. `done` runs with the pool lock held after every finished job.
+void ah_jobs_wait_until(ah_job_pool_t *pool, ah_job_predicate_fn done, void *data) {
+    ah_job_t job;
+
+    mtx_lock(&pool->lock);
+    while (!done(data)) {
+        if (pop_job(pool, &job)) {
+            run_job(pool, &job, AH_JOBS_CALLER_WORKER);
+            continue;
+        }
+
+        cnd_wait(&pool->job_done, &pool->lock);
+    }
+    mtx_unlock(&pool->lock);
+}
+
+bool counter_done(void *data) {
+    return ((ah_job_counter_t*)data)->pending == 0;
+}
+
+/// Block until every job tracked by `counter` ran
+void ah_jobs_wait(ah_job_pool_t *pool, ah_job_counter_t *counter) {
+    ah_jobs_wait_until(pool, counter_done, counter);
+}
+
+bool ah_jobs_done(ah_job_pool_t *pool, ah_job_counter_t *counter) {
+    mtx_lock(&pool->lock);
+    bool done = counter->pending == 0;
+    mtx_unlock(&pool->lock);
+
+    return done;
+}
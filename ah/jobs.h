@@ -0,0 +1,56 @@
+#pragma once
+
+#include "ah.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <threads.h>
+
+#define AH_JOBS_MAX_WORKERS 16
+#define AH_JOBS_QUEUE_SIZE 1024
+
+/// `worker` is the index of the thread running the job, in
+/// [0, AH_JOBS_MAX_WORKERS]. The last index belongs to the thread waiting on
+/// the pool, which runs queued jobs instead of sleeping.
+typedef void (*ah_job_fn)(void *data, uint32_t worker);
+
+typedef bool (*ah_job_predicate_fn)(void *data);
+
+typedef struct ah_job_counter {
+    uint32_t pending;
+} ah_job_counter_t;
+
+typedef struct ah_job {
+    ah_job_fn fn;
+    void *data;
+    ah_job_counter_t *counter;
+} ah_job_t;
+
+typedef struct ah_job_worker {
+    struct ah_job_pool *pool;
+    uint32_t index;
+} ah_job_worker_t;
+
+typedef struct ah_job_pool {
+    thrd_t threads[AH_JOBS_MAX_WORKERS];
+    ah_job_worker_t workers[AH_JOBS_MAX_WORKERS];
+    uint32_t num_workers;
+
+    mtx_t lock;
+    cnd_t has_jobs;
+    cnd_t job_done;
+
+    ah_job_t queue[AH_JOBS_QUEUE_SIZE];
+    uint32_t queue_head;
+    uint32_t queue_count;
+
+    bool quit;
+} ah_job_pool_t;
+
+#define AH_JOBS_CALLER_WORKER AH_JOBS_MAX_WORKERS
+
+AH_RESULT ah_jobs_init(ah_job_pool_t *pool, uint32_t num_workers);
+void ah_jobs_destroy(ah_job_pool_t *pool);
+void ah_jobs_push(ah_job_pool_t *pool, ah_job_fn fn, void *data, ah_job_counter_t *counter);
+void ah_jobs_wait(ah_job_pool_t *pool, ah_job_counter_t *counter);
+void ah_jobs_wait_until(ah_job_pool_t *pool, ah_job_predicate_fn done, void *data);
+bool ah_jobs_done(ah_job_pool_t *pool, ah_job_counter_t *counter);
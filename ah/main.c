@@ -9,7 +9,15 @@
 
 #include "ah.h"
 #include "vk.h"
+#include "batch.h"
+#include "capture.h"
 #include "errors.h"
+#include "frame.h"
+#include "instrument.h"
+#include "jobs.h"
+#include "pacing.h"
+#include "profiler.h"
+#include "trace.h"
 #include "vertex.h"
 
 
@@ -22,124 +30,298 @@
 // #include <glm/mat4x4.hpp>
 
 
-void init_window(vulkan_state_t *vk_state) {
-    glfwInit();
-    glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
-    glfwWindowHint(GLFW_RESIZABLE, GLFW_FALSE);
-    vk_state->window = glfwCreateWindow(WIN_WIDTH, WIN_HEIGHT, "Vulkan", NULL, NULL);
+void framebuffer_size_callback(GLFWwindow *window, int width, int height) {
+    (void)width;
+    (void)height;
+    vulkan_state_t *vk_state = (vulkan_state_t*)glfwGetWindowUserPointer(window);
+    vk_state->swapchain_dirty = true;
+}
+
+const VkPresentModeKHR present_modes[] = {
+    VK_PRESENT_MODE_FIFO_KHR,
+    VK_PRESENT_MODE_MAILBOX_KHR,
+    VK_PRESENT_MODE_IMMEDIATE_KHR,
+    VK_PRESENT_MODE_FIFO_RELAXED_KHR,
+};
+const uint32_t present_modes_count = 4;
+
+VkPresentModeKHR parse_present_mode(const char *name) {
+    for (uint32_t i = 0; i < present_modes_count; i++) {
+        if (strcmp(name, ah_vk_present_mode_name(present_modes[i])) == 0) {
+            return present_modes[i];
+        }
+    }
+    return VK_PRESENT_MODE_FIFO_KHR;
 }
 
-AH_RESULT draw_frame(vulkan_state_t *vk_state, uint32_t index) {
-    vkWaitForFences(vk_state->device, 1, &vk_state->in_flight_fence, VK_TRUE, UINT64_MAX);
-    vkResetFences(vk_state->device, 1, &vk_state->in_flight_fence);
-    uint32_t image_index;
-    vkAcquireNextImageKHR(
-        vk_state->device,
-        vk_state->swapchain,
-        UINT64_MAX,
-        vk_state->image_available_sempahore,
-        VK_NULL_HANDLE,
-        &image_index
+/// P cycles the present mode, L toggles low-latency pacing
+void key_callback(GLFWwindow *window, int key, int scancode, int action, int mods) {
+    (void)scancode;
+    (void)mods;
+    vulkan_state_t *vk_state = (vulkan_state_t*)glfwGetWindowUserPointer(window);
+    if (action != GLFW_PRESS) {
+        return;
+    }
+
+    if (key == GLFW_KEY_P) {
+        uint32_t next = 0;
+        for (uint32_t i = 0; i < present_modes_count; i++) {
+            if (present_modes[i] == vk_state->present_mode) {
+                next = (i + 1) % present_modes_count;
+            }
+        }
+        ah_vk_set_present_mode(vk_state, present_modes[next]);
+    } else if (key == GLFW_KEY_L) {
+        vk_state->pacing_mode = vk_state->pacing_mode == AH_PACING_LOW_LATENCY ? AH_PACING_THROUGHPUT : AH_PACING_LOW_LATENCY;
+    }
+}
+
+void update_title(vulkan_state_t *vk_state) {
+    char title[128];
+    snprintf(
+        title,
+        sizeof(title),
+        "Vulkan - %s, %s pacing, %.1f ms latency",
+        ah_vk_present_mode_name(vk_state->active_present_mode),
+        ah_pacing_mode_name(vk_state->pacing_mode),
+        vk_state->pacer.latency_ms
     );
-    vkResetCommandBuffer(vk_state->command_buffer, 0);
-    ah_vk_record_command_buffer(vk_state, vk_state->command_buffer, image_index, index);
-    VkSubmitInfo submit_info = {};
-    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    glfwSetWindowTitle(vk_state->window, title);
+}
+
+/// Frames captured with AH_CAPTURE, appended raw to a file on a thread of
+/// its own for `ffmpeg -f rawvideo`. Frames of another size than the first
+/// are skipped, they would break the stream.
+typedef struct capture_file {
+    FILE *fp;
+    const char *path;
+    ah_job_pool_t writer;
+    ah_job_counter_t pending;
+    ah_capture_t *capture;
+    ah_capture_frame_t frames[AH_CAPTURE_SLOTS];
+    uint32_t width;
+    uint32_t height;
+    VkFormat format;
+    uint32_t num_written;
+} capture_file_t;
 
-    VkSemaphore wait_semaphores[] = {vk_state->image_available_sempahore};
-    VkPipelineStageFlags wait_stages[] = {VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT};
-    submit_info.waitSemaphoreCount = 1;
-    submit_info.pWaitSemaphores = wait_semaphores;
-    submit_info.pWaitDstStageMask = wait_stages;
-    submit_info.commandBufferCount = 1;
-    submit_info.pCommandBuffers = &vk_state->command_buffer;
+capture_file_t capture_file;
 
-    VkSemaphore signal_semaphores[] = {vk_state->render_finished_semaphore};
-    submit_info.signalSemaphoreCount = 1;
-    submit_info.pSignalSemaphores = signal_semaphores;
+void write_captured_frame(void *data, uint32_t worker) {
+    (void)worker;
+    const ah_capture_frame_t *frame = (const ah_capture_frame_t*)data;
 
-    if (vkQueueSubmit(vk_state->graphics_queue, 1, &submit_info, vk_state->in_flight_fence) != VK_SUCCESS) {
-        set_error("Error submitting queue");
-        return AH_FAILURE;
+    if (capture_file.num_written == 0) {
+        capture_file.width = frame->width;
+        capture_file.height = frame->height;
+        capture_file.format = frame->format;
     }
+    size_t size = (size_t)frame->width * frame->height * 4;
+    if (frame->width == capture_file.width && frame->height == capture_file.height &&
+        fwrite(frame->pixels, 1, size, capture_file.fp) == size) {
+        capture_file.num_written++;
+    }
+
+    ah_capture_release(capture_file.capture, frame->slot);
+}
+
+void consume_captured_frame(const ah_capture_frame_t *frame, void *user) {
+    capture_file_t *file = (capture_file_t*)user;
+    file->frames[frame->slot] = *frame;
+    ah_jobs_push(&file->writer, write_captured_frame, &file->frames[frame->slot], &file->pending);
+}
 
-    VkPresentInfoKHR present_info = {};
-    present_info.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
-    present_info.waitSemaphoreCount = 1;
-    present_info.pWaitSemaphores = signal_semaphores;
+void open_capture_file(vulkan_state_t *vk_state, const char *path) {
+    capture_file.fp = fopen(path, "wb");
+    if (!capture_file.fp) {
+        printf("Could not open %s, not capturing\n", path);
+        return;
+    }
+    if (ah_jobs_init(&capture_file.writer, 1) != AH_SUCCESS) {
+        print_error("main/capture_writer");
+        fclose(capture_file.fp);
+        capture_file.fp = NULL;
+        return;
+    }
 
-    VkSwapchainKHR swapchains[] = {vk_state->swapchain};
-    present_info.swapchainCount = 1;
-    present_info.pSwapchains = swapchains;
-    present_info.pImageIndices = &image_index;
-    present_info.pResults = NULL;
+    capture_file.path = path;
+    capture_file.capture = &vk_state->capture;
+    vk_state->capture.consume = consume_captured_frame;
+    vk_state->capture.user = &capture_file;
+}
 
-    if (vkQueuePresentKHR(vk_state->present_queue, &present_info) != VK_SUCCESS) {
-        set_error("Error presenting");
-        return AH_FAILURE;
+/// Before `ah_vk_cleanup`, the writes still queued read capture buffers
+void close_capture_file() {
+    if (!capture_file.fp) {
+        return;
     }
 
-    return AH_SUCCESS;
+    ah_jobs_wait(&capture_file.writer, &capture_file.pending);
+    ah_jobs_destroy(&capture_file.writer);
+    fclose(capture_file.fp);
+    printf(
+        "Captured %u frames of %ux%u, VkFormat %d, to %s\n",
+        capture_file.num_written,
+        capture_file.width,
+        capture_file.height,
+        capture_file.format,
+        capture_file.path
+    );
+}
+
+void init_window(vulkan_state_t *vk_state) {
+    glfwInit();
+    glfwWindowHint(GLFW_CLIENT_API, GLFW_NO_API);
+    glfwWindowHint(GLFW_RESIZABLE, GLFW_TRUE);
+    vk_state->window = glfwCreateWindow(WIN_WIDTH, WIN_HEIGHT, "Vulkan", NULL, NULL);
+    glfwSetWindowUserPointer(vk_state->window, vk_state);
+    glfwSetFramebufferSizeCallback(vk_state->window, framebuffer_size_callback);
+    glfwSetKeyCallback(vk_state->window, key_callback);
 }
 
 void main_loop(vulkan_state_t *vk_state) {
     uint32_t index = 0;
     uint32_t counter = 0;
+    double last_title_ms = 0.0;
 
     while(!glfwWindowShouldClose(vk_state->window)) {
+        // Input is sampled right after pacing lets the frame start
+        ah_pacing_wait(vk_state);
         glfwPollEvents();
+
+        // Nothing to present to while minimized, sleep until that changes
+        int width, height;
+        glfwGetFramebufferSize(vk_state->window, &width, &height);
+        if (width == 0 || height == 0) {
+            glfwWaitEvents();
+            continue;
+        }
         if (counter > 20) {
             counter = 0;
             index += 1;
         }
         counter += 1;
 
-        if (draw_frame(vk_state, index) != AH_SUCCESS) {
+        if (ah_vk_draw_frame(vk_state, index, NULL) != AH_SUCCESS) {
             print_error("main_loop/draw_frame");
             break;
         }
+
+        if (ah_now_ms() - last_title_ms > 1000.0) {
+            last_title_ms = ah_now_ms();
+            update_title(vk_state);
+        }
     }
 }
 
 void cleanup(vulkan_state_t *vk_state) {
-    vkDestroySemaphore(vk_state->device, vk_state->render_finished_semaphore, NULL);
-    vkDestroySemaphore(vk_state->device, vk_state->image_available_sempahore, NULL);
-    vkDestroyFence(vk_state->device, vk_state->in_flight_fence, NULL);
-
-    vkDestroyCommandPool(vk_state->device, vk_state->command_pool, NULL);
+    close_capture_file();
+    ah_profiler_print(vk_state);
+    ah_instrument_print();
+    ah_vk_cleanup(vk_state);
+    glfwDestroyWindow(vk_state->window);
+    glfwTerminate();
+}
 
-    for (int i = 0; i < vk_state->num_swapchain_images; i++) {
-        vkDestroyFramebuffer(vk_state->device, vk_state->swapchain_framebuffers[i], NULL);
+/// Render the job list at `path` headless into image files, see
+/// `ah_batch_load` for its format. AH_BATCH_SIZE sets the image size.
+int run_batch(vulkan_state_t *vk_state, const char *path) {
+    char *size = getenv("AH_BATCH_SIZE");
+    if (size && sscanf(size, "%ux%u", &vk_state->headless_extent.width, &vk_state->headless_extent.height) != 2) {
+        printf("AH_BATCH_SIZE must be WIDTHxHEIGHT\n");
+        return 1;
     }
 
-    vkDestroyPipeline(vk_state->device, vk_state->pipeline, NULL);
-    vkDestroyPipelineLayout(vk_state->device, vk_state->pipeline_layout, NULL);
-    vkDestroyRenderPass(vk_state->device, vk_state->render_pass, NULL);
+    ah_batch_t batch;
+    if (ah_batch_load(&batch, path) != AH_SUCCESS) {
+        print_error("main/batch_load");
+        return 1;
+    }
+    ah_batch_configure(&batch, vk_state);
 
-    for (int i = 0; i < vk_state->num_swapchain_images; i++) {
-        vkDestroyImageView(vk_state->device, vk_state->swapchain_image_views[i], NULL);
+    if (ah_vk_init(vk_state) != AH_SUCCESS) {
+        ah_batch_destroy(&batch, vk_state);
+        return 1;
     }
 
-    vkDestroySwapchainKHR(vk_state->device, vk_state->swapchain, NULL);
-    vkDestroyDevice(vk_state->device, NULL);
-    vkDestroySurfaceKHR(vk_state->instance, vk_state->surface, NULL);
-    vkDestroyInstance(vk_state->instance, NULL);
-    glfwDestroyWindow(vk_state->window);
-    glfwTerminate();
-}
+    AH_RESULT result = ah_batch_init(&batch, vk_state);
+    if (result != AH_SUCCESS) {
+        print_error("main/batch_init");
+    } else {
+        result = ah_batch_run(&batch, vk_state);
+        ah_profiler_print(vk_state);
+        ah_instrument_print();
+    }
 
-void ah_init_vulkan_state(vulkan_state_t *vk_state) {
-    vk_state->window = NULL;
-    vk_state->instance = VK_NULL_HANDLE;
-    vk_state->physical_device = VK_NULL_HANDLE;
-    vk_state->device = VK_NULL_HANDLE;
-    vk_state->surface = VK_NULL_HANDLE;
+    ah_batch_destroy(&batch, vk_state);
+    ah_vk_cleanup(vk_state);
+    return result == AH_SUCCESS ? 0 : 1;
 }
 
-int main() {
+int main(int argc, char **argv) {
     vulkan_state_t vk_state;
     ah_init_vulkan_state(&vk_state);
 
+    char *frames_in_flight = getenv("AH_FRAMES_IN_FLIGHT");
+    if (frames_in_flight) {
+        vk_state.frames_in_flight = (uint32_t)atoi(frames_in_flight);
+    }
+
+    vk_state.mesh_path = getenv("AH_MESH");
+    vk_state.stream_assets = getenv("AH_NO_STREAM") == NULL;
+
+    // Bytes of streamed assets staged per frame
+    char *stream_budget = getenv("AH_STREAM_BUDGET");
+    if (stream_budget) {
+        vk_state.streamer.budget = strtoull(stream_budget, NULL, 10);
+    }
+
+    // KTX2 texture on the scene, and the bytes of device memory all
+    // textures may hold
+    vk_state.texture_path = getenv("AH_TEXTURE");
+    char *texture_budget = getenv("AH_TEXTURE_BUDGET");
+    if (texture_budget) {
+        vk_state.textures.budget = strtoull(texture_budget, NULL, 10);
+    }
+
+    char *present_mode = getenv("AH_PRESENT_MODE");
+    if (present_mode) {
+        vk_state.present_mode = parse_present_mode(present_mode);
+    }
+
+    if (getenv("AH_LOW_LATENCY")) {
+        vk_state.pacing_mode = AH_PACING_LOW_LATENCY;
+    }
+
+    vk_state.simulate = getenv("AH_SIMULATE") != NULL;
+    vk_state.cull_instances = getenv("AH_NO_CULL") == NULL;
+    vk_state.force_render_pass = getenv("AH_RENDER_PASS") != NULL;
+    vk_state.watch_shaders = getenv("AH_NO_HOT_RELOAD") == NULL;
+
+    char *num_instances = getenv("AH_INSTANCES");
+    if (num_instances) {
+        vk_state.num_instances = (uint32_t)atoi(num_instances);
+    }
+
+    // Chrome trace of the CPU zones and GPU scopes, written until exit
+    char *trace_path = getenv("AH_TRACE");
+    if (trace_path) {
+        if (ah_trace_open(&vk_state.trace, trace_path) != AH_SUCCESS) {
+            print_error("main/trace_open");
+        }
+        ah_trace_thread_name(&vk_state.trace, AH_TRACE_GPU_TID, "GPU");
+    }
+
+    if (argc == 3 && strcmp(argv[1], "--batch") == 0) {
+        return run_batch(&vk_state, argv[2]);
+    }
+
+    // Raw frames of the window, dropped while the writer falls behind
+    char *capture_path = getenv("AH_CAPTURE");
+    if (capture_path) {
+        open_capture_file(&vk_state, capture_path);
+    }
+
     init_window(&vk_state);
     ah_vk_init(&vk_state);
     main_loop(&vk_state);
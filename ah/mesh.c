@@ -0,0 +1,332 @@
+#include "mesh.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <vulkan/vulkan_core.h>
+#include "ah.h"
+#include "bindless.h"
+#include "errors.h"
+#include "frame.h"
+#include "helpers.h"
+#include "upload.h"
+#include "vertex.h"
+#include "vk.h"
+
+// Mapped pages are dropped after every slice, so a mesh never holds more
+// than this much resident on top of the staging ring
+#define MESH_UPLOAD_SLICE (AH_UPLOAD_STAGING_SIZE / 4)
+
+const vertex_t triangle_vertices[3] = {
+    {{0.0f, -0.5f}, {1.0f, 0.0f, 0.0f}},
+    {{0.5f, 0.5f}, {0.0f, 1.0f, 0.0f}},
+    {{-0.5f, 0.5f}, {0.0f, 0.0f, 1.0f}},
+};
+
+const uint16_t triangle_indices[3] = {0, 1, 2};
+
+const vertex_t placeholder_vertices[3] = {
+    {{0.0f, -0.5f}, {0.5f, 0.5f, 0.5f}},
+    {{0.5f, 0.5f}, {0.5f, 0.5f, 0.5f}},
+    {{-0.5f, 0.5f}, {0.5f, 0.5f, 0.5f}},
+};
+
+const vertex_quantized_t placeholder_vertices_quantized[3] = {
+    {{0, -16384}, {128, 128, 128, 255}},
+    {{16384, 16384}, {128, 128, 128, 255}},
+    {{-16384, 16384}, {128, 128, 128, 255}},
+};
+
+void set_identity_dequantize(float dequantize[4]) {
+    dequantize[0] = 1.0f;
+    dequantize[1] = 1.0f;
+    dequantize[2] = 0.0f;
+    dequantize[3] = 0.0f;
+}
+
+/// The built-in triangle, used when no mesh file is given
+void ah_mesh_init_triangle(ah_mesh_t *mesh) {
+    memset(mesh, 0, sizeof(ah_mesh_t));
+    mesh->vertex_format = AH_VERTEX_FORMAT_FULL;
+    mesh->index_type = VK_INDEX_TYPE_UINT16;
+    mesh->num_vertices = 3;
+    mesh->num_indices = 3;
+    set_identity_dequantize(mesh->dequantize);
+    mesh->vertex_data = triangle_vertices;
+    mesh->index_data = triangle_indices;
+}
+
+/// Grey stand-in for a mesh that is still streaming in, in the same vertex
+/// format so it draws with the same pipelines. Quantised placeholders span
+/// the mesh's dequantise rectangle.
+void ah_mesh_init_placeholder(ah_mesh_t *mesh, const ah_mesh_t *asset) {
+    memset(mesh, 0, sizeof(ah_mesh_t));
+    mesh->vertex_format = asset->vertex_format;
+    mesh->index_type = VK_INDEX_TYPE_UINT16;
+    mesh->num_vertices = 3;
+    mesh->num_indices = 3;
+    mesh->index_data = triangle_indices;
+
+    if (asset->vertex_format == AH_VERTEX_FORMAT_QUANTIZED) {
+        memcpy(mesh->dequantize, asset->dequantize, sizeof(mesh->dequantize));
+        mesh->vertex_data = placeholder_vertices_quantized;
+    } else {
+        set_identity_dequantize(mesh->dequantize);
+        mesh->vertex_data = placeholder_vertices;
+    }
+}
+
+/// Check the header of a mesh file held in memory and point the mesh's
+/// streams into it. Only the header is read.
+AH_RESULT ah_mesh_parse(ah_mesh_t *mesh, const uint8_t *data, size_t size) {
+    ah_mesh_file_header_t header;
+    if (size < sizeof(header)) {
+        set_error("Mesh file too small");
+        return AH_FAILURE;
+    }
+    memcpy(&header, data, sizeof(header));
+
+    ah_vertex_format_t vertex_format = header.flags & AH_MESH_QUANTIZED ? AH_VERTEX_FORMAT_QUANTIZED : AH_VERTEX_FORMAT_FULL;
+    uint64_t index_size = header.flags & AH_MESH_INDEX_32 ? sizeof(uint32_t) : sizeof(uint16_t);
+    uint64_t vertex_bytes = (uint64_t)header.num_vertices * header.vertex_stride;
+    uint64_t index_bytes = (uint64_t)header.num_indices * index_size;
+
+    if (header.magic != AH_MESH_MAGIC || header.version != AH_MESH_VERSION) {
+        set_error("Not a mesh file or unsupported version");
+        return AH_FAILURE;
+    }
+
+    if (header.vertex_stride != get_vertex_stride(vertex_format) ||
+        header.num_vertices == 0 || header.num_indices == 0 ||
+        header.vertex_offset % AH_MESH_STREAM_ALIGNMENT != 0 ||
+        header.index_offset % AH_MESH_STREAM_ALIGNMENT != 0 ||
+        header.vertex_offset > size || vertex_bytes > size - header.vertex_offset ||
+        header.index_offset > size || index_bytes > size - header.index_offset) {
+        set_error("Corrupt mesh file");
+        return AH_FAILURE;
+    }
+
+    mesh->vertex_format = vertex_format;
+    mesh->index_type = header.flags & AH_MESH_INDEX_32 ? VK_INDEX_TYPE_UINT32 : VK_INDEX_TYPE_UINT16;
+    mesh->num_vertices = header.num_vertices;
+    mesh->num_indices = header.num_indices;
+    memcpy(mesh->dequantize, header.dequantize, sizeof(mesh->dequantize));
+    mesh->vertex_data = data + header.vertex_offset;
+    mesh->index_data = data + header.index_offset;
+
+    return AH_SUCCESS;
+}
+
+/// Map a mesh file and check its header. Only the header page is touched,
+/// the streams are read by `ah_mesh_upload`.
+AH_RESULT ah_mesh_open(ah_mesh_t *mesh, const char *path) {
+    memset(mesh, 0, sizeof(ah_mesh_t));
+
+    if (!map_file(path, &mesh->file)) {
+        set_error("Could not map mesh file");
+        return AH_FAILURE;
+    }
+
+    if (ah_mesh_parse(mesh, mesh->file.data, mesh->file.size) != AH_SUCCESS) {
+        unmap_file(&mesh->file);
+        return AH_FAILURE;
+    }
+
+    return AH_SUCCESS;
+}
+
+VkDeviceSize ah_mesh_vertex_bytes(const ah_mesh_t *mesh) {
+    return (VkDeviceSize)mesh->num_vertices * get_vertex_stride(mesh->vertex_format);
+}
+
+VkDeviceSize ah_mesh_index_bytes(const ah_mesh_t *mesh) {
+    return (VkDeviceSize)mesh->num_indices * (mesh->index_type == VK_INDEX_TYPE_UINT32 ? sizeof(uint32_t) : sizeof(uint16_t));
+}
+
+/// Copy one stream from its source straight into the staging ring, a slice
+/// at a time, releasing the mapped pages behind it
+AH_RESULT upload_stream(vulkan_state_t *vk_state, ah_mesh_t *mesh, VkBuffer dst, const void *data, VkDeviceSize size) {
+    const uint8_t *src = (const uint8_t*)data;
+
+    for (VkDeviceSize offset = 0; offset < size; offset += MESH_UPLOAD_SLICE) {
+        VkDeviceSize slice = size - offset < MESH_UPLOAD_SLICE ? size - offset : MESH_UPLOAD_SLICE;
+
+        if (ah_upload_buffer(vk_state, dst, offset, src + offset, slice) != AH_SUCCESS) {
+            return AH_FAILURE;
+        }
+
+        if (mesh->file.data) {
+            release_file_range(&mesh->file, (size_t)(src + offset - mesh->file.data), (size_t)slice);
+        }
+    }
+
+    return AH_SUCCESS;
+}
+
+/// Bounding sphere of the vertex stream. Quantised positions span exactly
+/// the dequantise rectangle, full vertices are scanned a slice at a time
+/// like the upload does, so a mapped file never becomes resident at once.
+void ah_mesh_compute_bounds(ah_mesh_t *mesh) {
+    float min[2];
+    float max[2];
+
+    if (mesh->vertex_format == AH_VERTEX_FORMAT_QUANTIZED) {
+        for (uint32_t i = 0; i < 2; i++) {
+            min[i] = mesh->dequantize[2 + i] - fabsf(mesh->dequantize[i]);
+            max[i] = mesh->dequantize[2 + i] + fabsf(mesh->dequantize[i]);
+        }
+    } else {
+        const vertex_t *vertices = (const vertex_t*)mesh->vertex_data;
+        uint32_t slice_vertices = MESH_UPLOAD_SLICE / sizeof(vertex_t);
+
+        min[0] = min[1] = INFINITY;
+        max[0] = max[1] = -INFINITY;
+        for (uint32_t start = 0; start < mesh->num_vertices; start += slice_vertices) {
+            uint32_t end = mesh->num_vertices - start < slice_vertices ? mesh->num_vertices : start + slice_vertices;
+            for (uint32_t i = start; i < end; i++) {
+                for (uint32_t j = 0; j < 2; j++) {
+                    min[j] = fminf(min[j], vertices[i].pos[j]);
+                    max[j] = fmaxf(max[j], vertices[i].pos[j]);
+                }
+            }
+
+            if (mesh->file.data) {
+                release_file_range(&mesh->file, (size_t)((const uint8_t*)&vertices[start] - mesh->file.data), (size_t)(end - start) * sizeof(vertex_t));
+            }
+        }
+    }
+
+    float half_x = 0.5f * (max[0] - min[0]);
+    float half_y = 0.5f * (max[1] - min[1]);
+    mesh->bounds[0] = 0.5f * (min[0] + max[0]);
+    mesh->bounds[1] = 0.5f * (min[1] + max[1]);
+    mesh->bounds[2] = 0.0f;
+    mesh->bounds[3] = sqrtf(half_x * half_x + half_y * half_y);
+}
+
+/// Device-local vertex and index buffers sized for the mesh, left empty
+AH_RESULT ah_mesh_create_buffers(vulkan_state_t *vk_state, ah_mesh_t *mesh) {
+    if (ah_vk_create_buffer(
+        vk_state,
+        ah_mesh_vertex_bytes(mesh),
+        VK_BUFFER_USAGE_VERTEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+        &mesh->vertex_buffer,
+        &mesh->vertex_allocation)
+    != AH_SUCCESS) {
+        mesh->vertex_buffer = VK_NULL_HANDLE;
+        set_error("Failed to create vertex buffer");
+        return AH_FAILURE;
+    }
+
+    if (ah_vk_create_buffer(
+        vk_state,
+        ah_mesh_index_bytes(mesh),
+        VK_BUFFER_USAGE_INDEX_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+        &mesh->index_buffer,
+        &mesh->index_allocation)
+    != AH_SUCCESS) {
+        mesh->index_buffer = VK_NULL_HANDLE;
+        set_error("Failed to create index buffer");
+        return AH_FAILURE;
+    }
+
+    return AH_SUCCESS;
+}
+
+/// Create device-local vertex and index buffers for the mesh and queue
+/// their contents on the upload ring. The file is unmapped afterwards.
+AH_RESULT ah_mesh_upload(vulkan_state_t *vk_state, ah_mesh_t *mesh) {
+    double start = ah_now_ms();
+    VkDeviceSize vertex_bytes = ah_mesh_vertex_bytes(mesh);
+    VkDeviceSize index_bytes = ah_mesh_index_bytes(mesh);
+    ah_mesh_compute_bounds(mesh);
+
+    AH_RESULT result = AH_FAILURE;
+    if (ah_mesh_create_buffers(vk_state, mesh) == AH_SUCCESS &&
+        upload_stream(vk_state, mesh, mesh->vertex_buffer, mesh->vertex_data, vertex_bytes) == AH_SUCCESS &&
+        upload_stream(vk_state, mesh, mesh->index_buffer, mesh->index_data, index_bytes) == AH_SUCCESS) {
+        result = AH_SUCCESS;
+    }
+
+    if (mesh->file.data) {
+        printf(
+            "Mesh: %u vertices, %u indices, %.2f MiB staged in %.2f ms\n",
+            mesh->num_vertices,
+            mesh->num_indices,
+            (vertex_bytes + index_bytes) / (1024.0 * 1024.0),
+            ah_now_ms() - start
+        );
+    }
+
+    unmap_file(&mesh->file);
+    mesh->vertex_data = NULL;
+    mesh->index_data = NULL;
+
+    return result;
+}
+
+void ah_mesh_destroy(vulkan_state_t *vk_state, ah_mesh_t *mesh) {
+    if (mesh->vertex_buffer != VK_NULL_HANDLE) {
+        ah_vk_destroy_buffer(vk_state, mesh->vertex_buffer, &mesh->vertex_allocation);
+        mesh->vertex_buffer = VK_NULL_HANDLE;
+    }
+    if (mesh->index_buffer != VK_NULL_HANDLE) {
+        ah_vk_destroy_buffer(vk_state, mesh->index_buffer, &mesh->index_allocation);
+        mesh->index_buffer = VK_NULL_HANDLE;
+    }
+    unmap_file(&mesh->file);
+}
+
+/// A draw of the whole mesh
+ah_draw_t ah_mesh_draw(const ah_mesh_t *mesh) {
+    ah_draw_t draw = {};
+    draw.vertex_buffer = mesh->vertex_buffer;
+    draw.index_buffer = mesh->index_buffer;
+    draw.index_type = mesh->index_type;
+    draw.vertex_count = mesh->num_vertices;
+    draw.first_vertex = 0;
+    draw.index_count = mesh->num_indices;
+    draw.first_index = 0;
+    memcpy(draw.dequantize, mesh->dequantize, sizeof(draw.dequantize));
+    draw.material = AH_BINDLESS_DEFAULT_MATERIAL;
+    return draw;
+}
+
+bool write_padded(FILE *fp, const void *data, size_t size, uint64_t offset) {
+    const uint8_t zeros[AH_MESH_STREAM_ALIGNMENT] = {0};
+    long position = ftell(fp);
+
+    if (position < 0 || (uint64_t)position > offset || offset - (uint64_t)position > sizeof(zeros)) {
+        return false;
+    }
+    if (fwrite(zeros, 1, offset - (uint64_t)position, fp) != offset - (uint64_t)position) {
+        return false;
+    }
+    return fwrite(data, 1, size, fp) == size;
+}
+
+/// Write a mesh file. `header` offsets and counts describe `vertices` and
+/// `indices`; the vertex stream must directly follow the header and the
+/// index stream the vertex stream, each on AH_MESH_STREAM_ALIGNMENT.
+AH_RESULT ah_mesh_write(const char *path, const ah_mesh_file_header_t *header, const void *vertices, const void *indices) {
+    size_t index_size = header->flags & AH_MESH_INDEX_32 ? sizeof(uint32_t) : sizeof(uint16_t);
+
+    FILE *fp = fopen(path, "wb");
+    if (!fp) {
+        set_error("Could not open mesh file for writing");
+        return AH_FAILURE;
+    }
+
+    bool ok = fwrite(header, sizeof(ah_mesh_file_header_t), 1, fp) == 1 &&
+        write_padded(fp, vertices, (size_t)header->num_vertices * header->vertex_stride, header->vertex_offset) &&
+        write_padded(fp, indices, (size_t)header->num_indices * index_size, header->index_offset);
+
+    if (fclose(fp) != 0 || !ok) {
+        set_error("Could not write mesh file");
+        return AH_FAILURE;
+    }
+
+    return AH_SUCCESS;
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "ah.h"
+#include "alloc.h"
+#include "helpers.h"
+#include "record.h"
+#include "vertex.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <vulkan/vulkan_core.h>
+
+// "AHMS" little endian
+#define AH_MESH_MAGIC 0x534d4841
+#define AH_MESH_VERSION 1
+// Streams start on this boundary so they can be copied without realigning
+#define AH_MESH_STREAM_ALIGNMENT 16
+
+typedef struct vulkan_state vulkan_state_t;
+
+typedef enum ah_mesh_flags {
+    // Indices are uint32_t instead of uint16_t
+    AH_MESH_INDEX_32 = 1 << 0,
+    // Vertices are vertex_quantized_t instead of vertex_t
+    AH_MESH_QUANTIZED = 1 << 1,
+} ah_mesh_flags_t;
+
+/// On-disk layout: this header, then the vertex stream and the index stream
+/// at the given offsets, each exactly as the GPU consumes it
+typedef struct ah_mesh_file_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t flags;
+    uint32_t vertex_stride;
+    uint32_t num_vertices;
+    uint32_t num_indices;
+    uint64_t vertex_offset;
+    uint64_t index_offset;
+    // Scale in xy and offset in zw that turn quantised positions back into
+    // model space, (1, 1, 0, 0) for full vertices
+    float dequantize[4];
+} ah_mesh_file_header_t;
+
+typedef struct ah_mesh {
+    ah_vertex_format_t vertex_format;
+    VkIndexType index_type;
+    uint32_t num_vertices;
+    uint32_t num_indices;
+    float dequantize[4];
+    // Model space bounding sphere, centre xyz and radius w, set by
+    // `ah_mesh_upload`
+    float bounds[4];
+
+    VkBuffer vertex_buffer;
+    ah_allocation_t vertex_allocation;
+    VkBuffer index_buffer;
+    ah_allocation_t index_allocation;
+
+    // Source streams until `ah_mesh_upload`, pointing into `file` for
+    // meshes loaded from disk
+    const void *vertex_data;
+    const void *index_data;
+    mapped_file_t file;
+} ah_mesh_t;
+
+void ah_mesh_init_triangle(ah_mesh_t *mesh);
+void ah_mesh_init_placeholder(ah_mesh_t *mesh, const ah_mesh_t *asset);
+AH_RESULT ah_mesh_parse(ah_mesh_t *mesh, const uint8_t *data, size_t size);
+AH_RESULT ah_mesh_open(ah_mesh_t *mesh, const char *path);
+VkDeviceSize ah_mesh_vertex_bytes(const ah_mesh_t *mesh);
+VkDeviceSize ah_mesh_index_bytes(const ah_mesh_t *mesh);
+void ah_mesh_compute_bounds(ah_mesh_t *mesh);
+AH_RESULT ah_mesh_create_buffers(vulkan_state_t *vk_state, ah_mesh_t *mesh);
+AH_RESULT ah_mesh_upload(vulkan_state_t *vk_state, ah_mesh_t *mesh);
+void ah_mesh_destroy(vulkan_state_t *vk_state, ah_mesh_t *mesh);
+ah_draw_t ah_mesh_draw(const ah_mesh_t *mesh);
+AH_RESULT ah_mesh_write(const char *path, const ah_mesh_file_header_t *header, const void *vertices, const void *indices);
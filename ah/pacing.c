@@ -0,0 +1,166 @@
+#include "pacing.h"
+
+#include <string.h>
+#include <threads.h>
+#include <time.h>
+#include <vulkan/vulkan_core.h>
+#include "ah.h"
+#include "frame.h"
+#include "instrument.h"
+#include "scheduler.h"
+#include "vk.h"
+
+double moving_average(double average, double sample) {
+    if (average == 0.0) {
+        return sample;
+    }
+    return average + 0.1 * (sample - average);
+}
+
+void sleep_until_ms(double target_ms) {
+    double delay_ms = target_ms - ah_now_ms();
+    if (delay_ms <= 0.0) {
+        return;
+    }
+
+    struct timespec duration;
+    duration.tv_sec = (time_t)(delay_ms / 1000.0);
+    duration.tv_nsec = (long)((delay_ms - duration.tv_sec * 1000.0) * 1000000.0);
+    thrd_sleep(&duration, NULL);
+}
+
+void ah_pacing_init(vulkan_state_t *vk_state) {
+    ah_pacer_t *pacer = &vk_state->pacer;
+    memset(pacer, 0, sizeof(ah_pacer_t));
+
+    if (vk_state->features.present_wait) {
+        pacer->wait_for_present = (PFN_vkWaitForPresentKHR)vkGetDeviceProcAddr(vk_state->device, "vkWaitForPresentKHR");
+    }
+}
+
+/// Forget presents made to a swapchain that has been replaced, their ids
+/// can't be waited on through the new one
+void ah_pacing_reset(vulkan_state_t *vk_state) {
+    ah_pacer_t *pacer = &vk_state->pacer;
+    pacer->last_presented_id = pacer->next_present_id;
+    pacer->last_present_ms = 0.0;
+}
+
+void present_completed(ah_pacer_t *pacer, uint64_t present_id, double now_ms) {
+    ah_pacing_frame_t *frame = &pacer->frames[present_id % AH_PACING_HISTORY];
+    if (frame->present_id == present_id && frame->input_ms > 0.0) {
+        pacer->latency_ms = moving_average(pacer->latency_ms, now_ms - frame->input_ms);
+    }
+
+    // Only back to back presents measure the refresh interval, and one
+    // that missed a refresh would count it twice
+    if (present_id == pacer->last_presented_id + 1 && pacer->last_present_ms > 0.0) {
+        double interval_ms = now_ms - pacer->last_present_ms;
+        if (pacer->refresh_ms == 0.0 || interval_ms < pacer->refresh_ms * 1.5) {
+            pacer->refresh_ms = moving_average(pacer->refresh_ms, interval_ms);
+        }
+    }
+
+    pacer->last_presented_id = present_id;
+    pacer->last_present_ms = now_ms;
+}
+
+/// Called right before input is sampled for a new frame. In low-latency
+/// mode this blocks until the previous frame is on screen, then sleeps
+/// until the latest start that still makes the following refresh.
+void ah_pacing_wait(vulkan_state_t *vk_state) {
+    ah_pacer_t *pacer = &vk_state->pacer;
+    AH_ZONE_BEGIN(zone, "pacing wait");
+
+    if (vk_state->pacing_mode == AH_PACING_LOW_LATENCY && !vk_state->headless && !vk_state->swapchain_dirty) {
+        if (pacer->wait_for_present) {
+            if (pacer->last_presented_id < pacer->next_present_id) {
+                VkResult result = pacer->wait_for_present(
+                    vk_state->device,
+                    vk_state->swapchain,
+                    pacer->next_present_id,
+                    AH_PACING_MAX_WAIT_NS
+                );
+
+                if (result == VK_SUCCESS) {
+                    present_completed(pacer, pacer->next_present_id, ah_now_ms());
+                } else if (result != VK_TIMEOUT) {
+                    ah_pacing_reset(vk_state);
+                }
+            }
+
+            if (pacer->refresh_ms > 0.0 && pacer->last_present_ms > 0.0) {
+                double start_ms = pacer->last_present_ms + pacer->refresh_ms - pacer->work_ms - AH_PACING_MARGIN_MS;
+                double latest_ms = ah_now_ms() + pacer->refresh_ms;
+                sleep_until_ms(start_ms < latest_ms ? start_ms : latest_ms);
+            }
+        } else {
+            // Presents can't be observed, keep at most one frame queued and
+            // measure up to when the GPU finished it instead
+            uint64_t previous = vk_state->scheduler.timelines[AH_QUEUE_GRAPHICS].submitted;
+            if (ah_scheduler_wait(vk_state, AH_QUEUE_GRAPHICS, previous) != AH_SUCCESS) {
+                ah_pacing_reset(vk_state);
+            }
+
+            ah_pacing_frame_t *frame = &pacer->frames[pacer->next_present_id % AH_PACING_HISTORY];
+            if (frame->present_id == pacer->next_present_id && frame->input_ms > 0.0) {
+                pacer->latency_ms = moving_average(pacer->latency_ms, ah_now_ms() - frame->input_ms);
+            }
+        }
+    }
+
+    AH_ZONE_END(zone);
+    pacer->input_ms = ah_now_ms();
+}
+
+/// Start of a frame, for callers that don't sample input through
+/// `ah_pacing_wait`
+void ah_pacing_frame_begin(vulkan_state_t *vk_state) {
+    if (vk_state->pacer.input_ms == 0.0) {
+        vk_state->pacer.input_ms = ah_now_ms();
+    }
+}
+
+/// Record a frame about to be presented and return its present id. `gpu_ms`
+/// is the latest measured GPU time, negative when unknown.
+uint64_t ah_pacing_frame_presented(vulkan_state_t *vk_state, double gpu_ms) {
+    ah_pacer_t *pacer = &vk_state->pacer;
+    uint64_t present_id = ++pacer->next_present_id;
+
+    // Everything between sampling input and the image being ready
+    double work_ms = ah_now_ms() - pacer->input_ms + (gpu_ms > 0.0 ? gpu_ms : 0.0);
+    pacer->work_ms = moving_average(pacer->work_ms, work_ms);
+
+    pacer->frames[present_id % AH_PACING_HISTORY].present_id = present_id;
+    pacer->frames[present_id % AH_PACING_HISTORY].input_ms = pacer->input_ms;
+    pacer->input_ms = 0.0;
+
+    return present_id;
+}
+
+/// Pick up presents that completed since the last call, never blocks
+void ah_pacing_poll(vulkan_state_t *vk_state) {
+    ah_pacer_t *pacer = &vk_state->pacer;
+    if (!pacer->wait_for_present) {
+        return;
+    }
+
+    while (pacer->last_presented_id < pacer->next_present_id) {
+        uint64_t present_id = pacer->last_presented_id + 1;
+        VkResult result = pacer->wait_for_present(vk_state->device, vk_state->swapchain, present_id, 0);
+
+        if (result == VK_TIMEOUT) {
+            break;
+        }
+        if (result != VK_SUCCESS) {
+            ah_pacing_reset(vk_state);
+            break;
+        }
+
+        present_completed(pacer, present_id, ah_now_ms());
+    }
+}
+
+const char* ah_pacing_mode_name(ah_pacing_mode_t mode) {
+    return mode == AH_PACING_LOW_LATENCY ? "low latency" : "throughput";
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+#include "ah.h"
+#include <stdint.h>
+#include <vulkan/vulkan_core.h>
+
+#define AH_PACING_HISTORY 16
+// Slack left between the predicted end of a frame and the refresh it aims at
+#define AH_PACING_MARGIN_MS 1.0
+// Longest a low-latency wait blocks on a present that may never complete
+#define AH_PACING_MAX_WAIT_NS 100000000ULL
+
+typedef struct vulkan_state vulkan_state_t;
+
+typedef enum ah_pacing_mode {
+    // Frames start as soon as a frame slot is free, best throughput
+    AH_PACING_THROUGHPUT,
+    // Frames start as late as they can while still making the next
+    // refresh, so input is sampled as close to scan-out as possible
+    AH_PACING_LOW_LATENCY,
+} ah_pacing_mode_t;
+
+typedef struct ah_pacing_frame {
+    uint64_t present_id;
+    double input_ms;
+} ah_pacing_frame_t;
+
+/// Measures how long input takes to reach the screen and, in low-latency
+/// mode, delays the start of the next frame to cut that time down. Uses
+/// VK_KHR_present_wait when the device has it, the graphics timeline
+/// otherwise.
+typedef struct ah_pacer {
+    // NULL without VK_KHR_present_wait
+    PFN_vkWaitForPresentKHR wait_for_present;
+
+    // Present ids handed out so far and the last one known to be on screen
+    uint64_t next_present_id;
+    uint64_t last_presented_id;
+    double last_present_ms;
+
+    // When input for the frame being built was sampled, 0 until then
+    double input_ms;
+    ah_pacing_frame_t frames[AH_PACING_HISTORY];
+
+    // Moving averages
+    double refresh_ms;
+    double work_ms;
+    double latency_ms;
+} ah_pacer_t;
+
+void ah_pacing_init(vulkan_state_t *vk_state);
+void ah_pacing_reset(vulkan_state_t *vk_state);
+void ah_pacing_wait(vulkan_state_t *vk_state);
+void ah_pacing_frame_begin(vulkan_state_t *vk_state);
+uint64_t ah_pacing_frame_presented(vulkan_state_t *vk_state, double work_ms);
+void ah_pacing_poll(vulkan_state_t *vk_state);
+const char* ah_pacing_mode_name(ah_pacing_mode_t mode);
@@ -0,0 +1,139 @@
+#include "pipeline_builder.h"
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <vulkan/vulkan_core.h>
+#include "ah.h"
+#include "errors.h"
+#include "jobs.h"
+#include "vk.h"
+
+/// Seed every worker cache with what the shared cache already holds, so a
+/// warm cache on disk still skips compilation on every worker
+AH_RESULT ah_pipeline_builder_init(ah_pipeline_builder_t *builder, VkDevice device, VkPipelineCache cache, ah_job_pool_t *jobs) {
+    builder->device = device;
+    builder->cache = cache;
+    builder->jobs = jobs;
+    builder->counter.pending = 0;
+
+    size_t data_size = 0;
+    void *data = NULL;
+    if (vkGetPipelineCacheData(device, cache, &data_size, NULL) == VK_SUCCESS && data_size > 0) {
+        data = malloc(data_size);
+        if (vkGetPipelineCacheData(device, cache, &data_size, data) != VK_SUCCESS) {
+            data_size = 0;
+        }
+    }
+
+    VkPipelineCacheCreateInfo create_info = {};
+    create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+    create_info.initialDataSize = data_size;
+    create_info.pInitialData = data;
+
+    for (uint32_t i = 0; i <= AH_JOBS_MAX_WORKERS; i++) {
+        builder->worker_caches[i] = VK_NULL_HANDLE;
+
+        // Only the caller slot and the threads that exist need a cache
+        if (i < jobs->num_workers || i == AH_JOBS_CALLER_WORKER) {
+            if (vkCreatePipelineCache(device, &create_info, NULL, &builder->worker_caches[i]) != VK_SUCCESS) {
+                free(data);
+                set_error("Error creating worker pipeline cache");
+                return AH_FAILURE;
+            }
+        }
+    }
+
+    free(data);
+    return AH_SUCCESS;
+}
+
+void ah_pipeline_builder_destroy(ah_pipeline_builder_t *builder) {
+    if (ah_pipeline_builder_merge(builder) != AH_SUCCESS) {
+        print_error("pipeline_builder_destroy/merge");
+    }
+
+    for (uint32_t i = 0; i <= AH_JOBS_MAX_WORKERS; i++) {
+        if (builder->worker_caches[i] != VK_NULL_HANDLE) {
+            vkDestroyPipelineCache(builder->device, builder->worker_caches[i], NULL);
+            builder->worker_caches[i] = VK_NULL_HANDLE;
+        }
+    }
+}
+
+void build_pipeline_job(void *data, uint32_t worker) {
+    ah_pipeline_future_t *future = (ah_pipeline_future_t*)data;
+    ah_pipeline_builder_t *builder = future->builder;
+
+    AH_RESULT result = ah_vk_build_graphics_pipeline(
+        builder->device,
+        builder->worker_caches[worker],
+        &future->desc,
+        &future->pipeline
+    );
+
+    if (result != AH_SUCCESS) {
+        print_error("pipeline_builder/build");
+        future->pipeline = VK_NULL_HANDLE;
+    }
+
+    if (future->callback) {
+        future->callback(future, future->user);
+    }
+
+    atomic_store(&future->status, result == AH_SUCCESS ? AH_PIPELINE_READY : AH_PIPELINE_FAILED);
+}
+
+/// Queue a pipeline build and return right away. `future` must stay alive
+/// until it is ready.
+void ah_pipeline_builder_submit(ah_pipeline_builder_t *builder, const ah_graphics_pipeline_desc_t *desc, ah_pipeline_future_t *future, ah_pipeline_callback_t callback, void *user) {
+    atomic_init(&future->status, AH_PIPELINE_PENDING);
+    future->pipeline = VK_NULL_HANDLE;
+    future->callback = callback;
+    future->user = user;
+    future->desc = *desc;
+    future->builder = builder;
+
+    ah_jobs_push(builder->jobs, build_pipeline_job, future, &builder->counter);
+}
+
+/// Wait for every queued build and fold the worker caches into the shared
+/// one, ready to be written to disk
+AH_RESULT ah_pipeline_builder_merge(ah_pipeline_builder_t *builder) {
+    VkPipelineCache src_caches[AH_JOBS_MAX_WORKERS + 1];
+    uint32_t num_src_caches = 0;
+
+    ah_jobs_wait(builder->jobs, &builder->counter);
+
+    for (uint32_t i = 0; i <= AH_JOBS_MAX_WORKERS; i++) {
+        if (builder->worker_caches[i] != VK_NULL_HANDLE) {
+            src_caches[num_src_caches++] = builder->worker_caches[i];
+        }
+    }
+
+    if (vkMergePipelineCaches(builder->device, builder->cache, num_src_caches, src_caches) != VK_SUCCESS) {
+        set_error("Error merging pipeline caches");
+        return AH_FAILURE;
+    }
+
+    return AH_SUCCESS;
+}
+
+bool ah_pipeline_future_ready(ah_pipeline_future_t *future) {
+    return atomic_load(&future->status) != AH_PIPELINE_PENDING;
+}
+
+bool future_done(void *data) {
+    return ah_pipeline_future_ready((ah_pipeline_future_t*)data);
+}
+
+AH_RESULT ah_pipeline_future_wait(ah_pipeline_builder_t *builder, ah_pipeline_future_t *future) {
+    ah_jobs_wait_until(builder->jobs, future_done, future);
+
+    if (atomic_load(&future->status) != AH_PIPELINE_READY) {
+        set_error("Pipeline build failed");
+        return AH_FAILURE;
+    }
+
+    return AH_SUCCESS;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include "ah.h"
+#include "jobs.h"
+#include "vertex.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <vulkan/vulkan_core.h>
+
+typedef struct ah_graphics_pipeline_desc {
+    const char *vert_path;
+    const char *frag_path;
+    VkPipelineLayout layout;
+    // VK_NULL_HANDLE builds for dynamic rendering into `color_format`
+    VkRenderPass render_pass;
+    uint32_t subpass;
+    VkFormat color_format;
+    // Depth tested and written when not VK_FORMAT_UNDEFINED
+    VkFormat depth_format;
+    VkPrimitiveTopology topology;
+    VkCullModeFlags cull_mode;
+    ah_vertex_format_t vertex_format;
+    // Also read instance_t from binding 1
+    bool instanced;
+} ah_graphics_pipeline_desc_t;
+
+typedef struct ah_compute_pipeline_desc {
+    const char *comp_path;
+    VkPipelineLayout layout;
+} ah_compute_pipeline_desc_t;
+
+typedef enum ah_pipeline_status {
+    AH_PIPELINE_PENDING,
+    AH_PIPELINE_READY,
+    AH_PIPELINE_FAILED,
+} ah_pipeline_status_t;
+
+typedef struct ah_pipeline_future ah_pipeline_future_t;
+
+/// Called on the worker thread that built the pipeline, before the future
+/// turns ready
+typedef void (*ah_pipeline_callback_t)(ah_pipeline_future_t *future, void *user);
+
+struct ah_pipeline_future {
+    atomic_int status;
+    VkPipeline pipeline;
+
+    ah_pipeline_callback_t callback;
+    void *user;
+    // Copied on submit, the paths must outlive the build
+    ah_graphics_pipeline_desc_t desc;
+    struct ah_pipeline_builder *builder;
+};
+
+/// Compiles pipelines on the job pool. Every worker has its own cache so
+/// builds don't contend on one; they are merged into the shared cache by
+/// `ah_pipeline_builder_merge`.
+typedef struct ah_pipeline_builder {
+    VkDevice device;
+    VkPipelineCache cache;
+    VkPipelineCache worker_caches[AH_JOBS_MAX_WORKERS + 1];
+    ah_job_pool_t *jobs;
+    ah_job_counter_t counter;
+} ah_pipeline_builder_t;
+
+AH_RESULT ah_pipeline_builder_init(ah_pipeline_builder_t *builder, VkDevice device, VkPipelineCache cache, ah_job_pool_t *jobs);
+void ah_pipeline_builder_destroy(ah_pipeline_builder_t *builder);
+void ah_pipeline_builder_submit(ah_pipeline_builder_t *builder, const ah_graphics_pipeline_desc_t *desc, ah_pipeline_future_t *future, ah_pipeline_callback_t callback, void *user);
+AH_RESULT ah_pipeline_builder_merge(ah_pipeline_builder_t *builder);
+bool ah_pipeline_future_ready(ah_pipeline_future_t *future);
+AH_RESULT ah_pipeline_future_wait(ah_pipeline_builder_t *builder, ah_pipeline_future_t *future);
@@ -0,0 +1,148 @@
+#include "pipeline_cache.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vulkan/vulkan_core.h>
+#include "ah.h"
+#include "errors.h"
+#include "helpers.h"
+#include "vk.h"
+
+/// Check the file header and the driver header against the device we run on
+bool is_cache_valid(VkPhysicalDeviceProperties *properties, buffer_t *file) {
+    ah_pipeline_cache_file_header_t header;
+
+    if (file->size < sizeof(header)) {
+        return false;
+    }
+    memcpy(&header, file->data, sizeof(header));
+
+    if (header.magic != AH_PIPELINE_CACHE_MAGIC ||
+        header.version != AH_PIPELINE_CACHE_VERSION ||
+        header.vendor_id != properties->vendorID ||
+        header.device_id != properties->deviceID ||
+        header.driver_version != properties->driverVersion ||
+        memcmp(header.uuid, properties->pipelineCacheUUID, VK_UUID_SIZE) != 0) {
+        return false;
+    }
+
+    if (header.data_size != file->size - sizeof(header) ||
+        header.data_hash != hash_fnv1a(file->data + sizeof(header), header.data_size)) {
+        return false;
+    }
+
+    VkPipelineCacheHeaderVersionOne driver_header;
+    if (header.data_size < sizeof(driver_header)) {
+        return false;
+    }
+    memcpy(&driver_header, file->data + sizeof(header), sizeof(driver_header));
+
+    return driver_header.headerSize >= sizeof(driver_header) &&
+        driver_header.headerVersion == VK_PIPELINE_CACHE_HEADER_VERSION_ONE &&
+        driver_header.vendorID == properties->vendorID &&
+        driver_header.deviceID == properties->deviceID &&
+        memcmp(driver_header.pipelineCacheUUID, properties->pipelineCacheUUID, VK_UUID_SIZE) == 0;
+}
+
+/// Create the pipeline cache, seeded from `path` when it holds a cache for
+/// this exact device and driver. Anything else is ignored and the cache
+/// starts cold.
+AH_RESULT ah_pipeline_cache_load(vulkan_state_t *vk_state, const char *path) {
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(vk_state->physical_device, &properties);
+
+    VkPipelineCacheCreateInfo create_info = {};
+    create_info.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+
+    buffer_t *file = read_file((char*)path);
+    if (file && is_cache_valid(&properties, file)) {
+        create_info.initialDataSize = file->size - sizeof(ah_pipeline_cache_file_header_t);
+        create_info.pInitialData = file->data + sizeof(ah_pipeline_cache_file_header_t);
+    } else if (file) {
+        printf("Discarding stale pipeline cache %s\n", path);
+    }
+
+    VkResult result = vkCreatePipelineCache(vk_state->device, &create_info, NULL, &vk_state->pipeline_cache);
+
+    // The driver may still reject data that passed our checks
+    if (result != VK_SUCCESS && create_info.initialDataSize > 0) {
+        printf("Driver rejected pipeline cache %s\n", path);
+        create_info.initialDataSize = 0;
+        create_info.pInitialData = NULL;
+        result = vkCreatePipelineCache(vk_state->device, &create_info, NULL, &vk_state->pipeline_cache);
+    }
+
+    vk_state->pipeline_cache_warm = create_info.initialDataSize > 0;
+    free(file);
+
+    if (result != VK_SUCCESS) {
+        set_error("Error creating pipeline cache");
+        return AH_FAILURE;
+    }
+
+    return AH_SUCCESS;
+}
+
+/// Write the cache next to a temporary name and rename it into place, so a
+/// crash mid-write never leaves a truncated cache behind
+AH_RESULT ah_pipeline_cache_save(vulkan_state_t *vk_state, const char *path) {
+    if (vk_state->pipeline_cache == VK_NULL_HANDLE) {
+        return AH_SUCCESS;
+    }
+
+    size_t data_size = 0;
+    if (vkGetPipelineCacheData(vk_state->device, vk_state->pipeline_cache, &data_size, NULL) != VK_SUCCESS) {
+        set_error("Error reading pipeline cache size");
+        return AH_FAILURE;
+    }
+
+    uint8_t *data = malloc(data_size);
+    if (!data) {
+        set_error("Out of memory saving pipeline cache");
+        return AH_FAILURE;
+    }
+
+    if (vkGetPipelineCacheData(vk_state->device, vk_state->pipeline_cache, &data_size, data) != VK_SUCCESS) {
+        free(data);
+        set_error("Error reading pipeline cache");
+        return AH_FAILURE;
+    }
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(vk_state->physical_device, &properties);
+
+    ah_pipeline_cache_file_header_t header = {};
+    header.magic = AH_PIPELINE_CACHE_MAGIC;
+    header.version = AH_PIPELINE_CACHE_VERSION;
+    header.vendor_id = properties.vendorID;
+    header.device_id = properties.deviceID;
+    header.driver_version = properties.driverVersion;
+    memcpy(header.uuid, properties.pipelineCacheUUID, VK_UUID_SIZE);
+    header.data_size = data_size;
+    header.data_hash = hash_fnv1a(data, data_size);
+
+    char tmp_path[1024];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", path);
+
+    FILE *fp = fopen(tmp_path, "wb");
+    if (!fp) {
+        free(data);
+        set_error("Error opening pipeline cache for writing");
+        return AH_FAILURE;
+    }
+
+    bool written = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+        fwrite(data, 1, data_size, fp) == data_size;
+    written = fclose(fp) == 0 && written;
+    free(data);
+
+    if (!written || rename(tmp_path, path) != 0) {
+        remove(tmp_path);
+        set_error("Error writing pipeline cache");
+        return AH_FAILURE;
+    }
+
+    return AH_SUCCESS;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "ah.h"
+#include <stdint.h>
+#include <vulkan/vulkan_core.h>
+
+#define AH_PIPELINE_CACHE_PATH "./pipeline_cache.bin"
+#define AH_PIPELINE_CACHE_MAGIC 0x43504841 // "AHPC"
+#define AH_PIPELINE_CACHE_VERSION 1
+
+typedef struct vulkan_state vulkan_state_t;
+
+/// Written in front of the driver blob. The driver header carries vendor,
+/// device and cache UUID but not the driver version, and nothing protects
+/// against a truncated file, so both are checked here too.
+typedef struct ah_pipeline_cache_file_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t vendor_id;
+    uint32_t device_id;
+    uint32_t driver_version;
+    uint8_t uuid[VK_UUID_SIZE];
+    uint64_t data_size;
+    uint64_t data_hash;
+} ah_pipeline_cache_file_header_t;
+
+AH_RESULT ah_pipeline_cache_load(vulkan_state_t *vk_state, const char *path);
+AH_RESULT ah_pipeline_cache_save(vulkan_state_t *vk_state, const char *path);
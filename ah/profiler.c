@@ -0,0 +1,251 @@
+#include "profiler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vulkan/vulkan_core.h>
+#include "ah.h"
+#include "errors.h"
+#include "frame.h"
+#include "trace.h"
+#include "vk.h"
+
+AH_RESULT ah_profiler_init(vulkan_state_t *vk_state) {
+    ah_profiler_t *profiler = &vk_state->profiler;
+    memset(profiler, 0, sizeof(ah_profiler_t));
+
+    VkPhysicalDeviceProperties properties;
+    vkGetPhysicalDeviceProperties(vk_state->physical_device, &properties);
+
+    uint32_t queue_family_count = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(vk_state->physical_device, &queue_family_count, NULL);
+    VkQueueFamilyProperties *queue_families = (VkQueueFamilyProperties*)malloc(sizeof(VkQueueFamilyProperties) * queue_family_count);
+    vkGetPhysicalDeviceQueueFamilyProperties(vk_state->physical_device, &queue_family_count, queue_families);
+    uint32_t valid_bits = queue_families[vk_state->queue_family_indices.graphics_family].timestampValidBits;
+    free(queue_families);
+
+    // GPU timings are optional, frames still render without them
+    if (valid_bits == 0 || properties.limits.timestampPeriod == 0.0f) {
+        profiler->query_pool = VK_NULL_HANDLE;
+        return AH_SUCCESS;
+    }
+
+    VkQueryPoolCreateInfo pool_info = {};
+    pool_info.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+    pool_info.queryType = VK_QUERY_TYPE_TIMESTAMP;
+    pool_info.queryCount = vk_state->frames_in_flight * AH_PROFILER_MAX_SCOPES * 2;
+
+    if (vkCreateQueryPool(vk_state->device, &pool_info, NULL, &profiler->query_pool) != VK_SUCCESS) {
+        set_error("Error creating timestamp query pool");
+        return AH_FAILURE;
+    }
+
+    profiler->timestamp_period = properties.limits.timestampPeriod;
+    profiler->timestamp_mask = valid_bits >= 64 ? UINT64_MAX : (1ULL << valid_bits) - 1;
+
+    return AH_SUCCESS;
+}
+
+void ah_profiler_destroy(vulkan_state_t *vk_state) {
+    if (vk_state->profiler.query_pool != VK_NULL_HANDLE) {
+        vkDestroyQueryPool(vk_state->device, vk_state->profiler.query_pool, NULL);
+        vk_state->profiler.query_pool = VK_NULL_HANDLE;
+    }
+}
+
+uint32_t first_query(uint32_t frame) {
+    return frame * AH_PROFILER_MAX_SCOPES * 2;
+}
+
+/// Reset the current slot's queries and open the whole-frame scope. Must be
+/// recorded outside of any render pass.
+void ah_profiler_frame_begin(vulkan_state_t *vk_state, VkCommandBuffer command_buffer) {
+    ah_profiler_t *profiler = &vk_state->profiler;
+    ah_profiler_frame_t *frame = &profiler->frames[vk_state->current_frame];
+    frame->num_scopes = 0;
+    frame->depth = 0;
+
+    if (profiler->query_pool == VK_NULL_HANDLE) {
+        return;
+    }
+
+    vkCmdResetQueryPool(command_buffer, profiler->query_pool, first_query(vk_state->current_frame), AH_PROFILER_MAX_SCOPES * 2);
+    ah_profiler_begin(vk_state, command_buffer, "frame");
+}
+
+void ah_profiler_frame_end(vulkan_state_t *vk_state, VkCommandBuffer command_buffer) {
+    ah_profiler_end(vk_state, command_buffer, 0);
+}
+
+void ah_profiler_frame_submitted(vulkan_state_t *vk_state, uint32_t frame) {
+    ah_profiler_frame_t *profiler_frame = &vk_state->profiler.frames[frame];
+    profiler_frame->pending = profiler_frame->num_scopes > 0;
+    profiler_frame->submit_ms = ah_now_ms();
+}
+
+/// Open a scope in the primary command buffer of the current frame. `name`
+/// must outlive the profiler, string literals are expected.
+uint32_t ah_profiler_begin(vulkan_state_t *vk_state, VkCommandBuffer command_buffer, const char *name) {
+    ah_profiler_t *profiler = &vk_state->profiler;
+    ah_profiler_frame_t *frame = &profiler->frames[vk_state->current_frame];
+
+    if (profiler->query_pool == VK_NULL_HANDLE || frame->num_scopes == AH_PROFILER_MAX_SCOPES) {
+        return AH_PROFILER_NO_SCOPE;
+    }
+
+    uint32_t scope = frame->num_scopes++;
+    frame->names[scope] = name;
+    frame->depths[scope] = frame->depth++;
+    vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, profiler->query_pool, first_query(vk_state->current_frame) + scope * 2);
+
+    return scope;
+}
+
+void ah_profiler_end(vulkan_state_t *vk_state, VkCommandBuffer command_buffer, uint32_t scope) {
+    ah_profiler_t *profiler = &vk_state->profiler;
+    ah_profiler_frame_t *frame = &profiler->frames[vk_state->current_frame];
+
+    if (profiler->query_pool == VK_NULL_HANDLE || scope >= frame->num_scopes) {
+        return;
+    }
+
+    frame->depth--;
+    vkCmdWriteTimestamp(command_buffer, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, profiler->query_pool, first_query(vk_state->current_frame) + scope * 2 + 1);
+}
+
+ah_profiler_stat_t* find_stat(ah_profiler_t *profiler, const char *name, uint32_t depth) {
+    for (uint32_t i = 0; i < profiler->num_stats; i++) {
+        if (strcmp(profiler->stats[i].name, name) == 0) {
+            return &profiler->stats[i];
+        }
+    }
+
+    if (profiler->num_stats == AH_PROFILER_MAX_STATS) {
+        return NULL;
+    }
+
+    ah_profiler_stat_t *stat = &profiler->stats[profiler->num_stats++];
+    memset(stat, 0, sizeof(ah_profiler_stat_t));
+    stat->name = name;
+    stat->depth = depth;
+    return stat;
+}
+
+void push_history(ah_profiler_stat_t *stat, double ms) {
+    stat->history[stat->next] = ms;
+    stat->next = (stat->next + 1) % AH_PROFILER_HISTORY;
+    if (stat->num_samples < AH_PROFILER_HISTORY) {
+        stat->num_samples++;
+    }
+}
+
+/// Read back the scopes of the last submission of a frame slot. The caller
+/// must know the slot's graphics value was reached, so this never blocks. `gpu_ms` is
+/// the whole-frame time, negative when there is no result.
+AH_RESULT ah_profiler_collect(vulkan_state_t *vk_state, uint32_t frame, double *gpu_ms) {
+    ah_profiler_t *profiler = &vk_state->profiler;
+    ah_profiler_frame_t *profiler_frame = &profiler->frames[frame];
+    *gpu_ms = -1.0;
+
+    if (profiler->query_pool == VK_NULL_HANDLE || !profiler_frame->pending) {
+        return AH_SUCCESS;
+    }
+
+    uint64_t timestamps[AH_PROFILER_MAX_SCOPES * 2];
+    VkResult result = vkGetQueryPoolResults(
+        vk_state->device,
+        profiler->query_pool,
+        first_query(frame),
+        profiler_frame->num_scopes * 2,
+        sizeof(timestamps),
+        timestamps,
+        sizeof(uint64_t),
+        VK_QUERY_RESULT_64_BIT
+    );
+
+    if (result == VK_NOT_READY) {
+        return AH_SUCCESS;
+    }
+
+    if (result != VK_SUCCESS) {
+        set_error("Error reading timestamp queries");
+        return AH_FAILURE;
+    }
+    profiler_frame->pending = false;
+
+    double us_per_tick = profiler->timestamp_period / 1000.0;
+    if (!profiler->has_trace_offset) {
+        // The GPU starts the frame no earlier than its submission, close
+        // enough to line both timelines up in a trace
+        profiler->trace_offset_us = profiler_frame->submit_ms * 1000.0 - (double)timestamps[0] * us_per_tick;
+        profiler->has_trace_offset = true;
+    }
+
+    for (uint32_t scope = 0; scope < profiler_frame->num_scopes; scope++) {
+        uint64_t begin = timestamps[scope * 2];
+        uint64_t ticks = (timestamps[scope * 2 + 1] - begin) & profiler->timestamp_mask;
+        double ms = (double)ticks * us_per_tick / 1000.0;
+
+        ah_profiler_stat_t *stat = find_stat(profiler, profiler_frame->names[scope], profiler_frame->depths[scope]);
+        if (stat) {
+            push_history(stat, ms);
+        }
+
+        ah_trace_complete(
+            &vk_state->trace,
+            profiler_frame->names[scope],
+            "gpu",
+            AH_TRACE_GPU_TID,
+            (double)begin * us_per_tick + profiler->trace_offset_us,
+            ms * 1000.0
+        );
+    }
+
+    *gpu_ms = (double)((timestamps[1] - timestamps[0]) & profiler->timestamp_mask) * us_per_tick / 1000.0;
+    return AH_SUCCESS;
+}
+
+/// Average and worst time of a scope over its history, false when it has
+/// never been read back
+bool ah_profiler_get_stats(vulkan_state_t *vk_state, const char *name, double *average_ms, double *max_ms) {
+    ah_profiler_t *profiler = &vk_state->profiler;
+
+    for (uint32_t i = 0; i < profiler->num_stats; i++) {
+        ah_profiler_stat_t *stat = &profiler->stats[i];
+        if (strcmp(stat->name, name) != 0 || stat->num_samples == 0) {
+            continue;
+        }
+
+        double sum = 0.0;
+        *max_ms = 0.0;
+        for (uint32_t j = 0; j < stat->num_samples; j++) {
+            sum += stat->history[j];
+            if (stat->history[j] > *max_ms) {
+                *max_ms = stat->history[j];
+            }
+        }
+        *average_ms = sum / stat->num_samples;
+        return true;
+    }
+
+    return false;
+}
+
+void ah_profiler_print(vulkan_state_t *vk_state) {
+    ah_profiler_t *profiler = &vk_state->profiler;
+    if (profiler->num_stats == 0) {
+        return;
+    }
+
+    printf("%-24s %10s %10s\n", "gpu scope ms", "average", "max");
+    for (uint32_t i = 0; i < profiler->num_stats; i++) {
+        ah_profiler_stat_t *stat = &profiler->stats[i];
+        double average_ms;
+        double max_ms;
+        if (!ah_profiler_get_stats(vk_state, stat->name, &average_ms, &max_ms)) {
+            continue;
+        }
+
+        printf("%*s%-*s %10.4f %10.4f\n", (int)stat->depth * 2, "", 24 - (int)stat->depth * 2, stat->name, average_ms, max_ms);
+    }
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include "ah.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <vulkan/vulkan_core.h>
+
+// Scopes one frame can open, including the whole-frame scope
+#define AH_PROFILER_MAX_SCOPES 32
+// Distinct scope names that keep a history
+#define AH_PROFILER_MAX_STATS 32
+// Frames of history kept per scope
+#define AH_PROFILER_HISTORY 128
+// Returned by `ah_profiler_begin` when timestamps are unavailable or the
+// frame ran out of scopes, ending it does nothing
+#define AH_PROFILER_NO_SCOPE UINT32_MAX
+
+typedef struct vulkan_state vulkan_state_t;
+
+/// Scopes recorded into one frame slot. Its queries are read back once the
+/// slot's graphics value is reached, so reading never stalls.
+typedef struct ah_profiler_frame {
+    const char *names[AH_PROFILER_MAX_SCOPES];
+    uint32_t depths[AH_PROFILER_MAX_SCOPES];
+    uint32_t num_scopes;
+    // Scopes currently open while recording
+    uint32_t depth;
+    // Submitted and not read back yet
+    bool pending;
+    double submit_ms;
+} ah_profiler_frame_t;
+
+typedef struct ah_profiler_stat {
+    const char *name;
+    uint32_t depth;
+    double history[AH_PROFILER_HISTORY];
+    uint32_t num_samples;
+    uint32_t next;
+} ah_profiler_stat_t;
+
+typedef struct ah_profiler {
+    // Two timestamps per scope for each frame slot, VK_NULL_HANDLE when the
+    // graphics queue can't write timestamps
+    VkQueryPool query_pool;
+    // Nanoseconds per tick
+    float timestamp_period;
+    uint64_t timestamp_mask;
+
+    ah_profiler_frame_t frames[AH_MAX_FRAMES_IN_FLIGHT];
+    ah_profiler_stat_t stats[AH_PROFILER_MAX_STATS];
+    uint32_t num_stats;
+
+    // Moves GPU timestamps onto the CPU clock for traces, set from the
+    // first frame read back
+    bool has_trace_offset;
+    double trace_offset_us;
+} ah_profiler_t;
+
+AH_RESULT ah_profiler_init(vulkan_state_t *vk_state);
+void ah_profiler_destroy(vulkan_state_t *vk_state);
+void ah_profiler_frame_begin(vulkan_state_t *vk_state, VkCommandBuffer command_buffer);
+void ah_profiler_frame_end(vulkan_state_t *vk_state, VkCommandBuffer command_buffer);
+void ah_profiler_frame_submitted(vulkan_state_t *vk_state, uint32_t frame);
+uint32_t ah_profiler_begin(vulkan_state_t *vk_state, VkCommandBuffer command_buffer, const char *name);
+void ah_profiler_end(vulkan_state_t *vk_state, VkCommandBuffer command_buffer, uint32_t scope);
+AH_RESULT ah_profiler_collect(vulkan_state_t *vk_state, uint32_t frame, double *gpu_ms);
+bool ah_profiler_get_stats(vulkan_state_t *vk_state, const char *name, double *average_ms, double *max_ms);
+void ah_profiler_print(vulkan_state_t *vk_state);
@@ -0,0 +1,264 @@
+#include "record.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <vulkan/vulkan_core.h>
+#include "ah.h"
+#include "bindless.h"
+#include "errors.h"
+#include "frame_alloc.h"
+#include "instrument.h"
+#include "instancing.h"
+#include "jobs.h"
+#include "vk.h"
+
+AH_RESULT ah_recorder_init(vulkan_state_t *vk_state) {
+    ah_recorder_t *recorder = &vk_state->recorder;
+    memset(recorder, 0, sizeof(ah_recorder_t));
+
+    VkCommandPoolCreateInfo pool_info = {};
+    pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    pool_info.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    pool_info.queueFamilyIndex = vk_state->queue_family_indices.graphics_family;
+
+    for (uint32_t frame = 0; frame < vk_state->frames_in_flight; frame++) {
+        for (uint32_t worker = 0; worker <= AH_JOBS_MAX_WORKERS; worker++) {
+            if (worker >= vk_state->jobs.num_workers && worker != AH_JOBS_CALLER_WORKER) {
+                continue;
+            }
+
+            if (vkCreateCommandPool(vk_state->device, &pool_info, NULL, &recorder->pools[frame][worker].command_pool) != VK_SUCCESS) {
+                set_error("Error creating recording command pool");
+                return AH_FAILURE;
+            }
+        }
+    }
+
+    return AH_SUCCESS;
+}
+
+void ah_recorder_destroy(vulkan_state_t *vk_state) {
+    ah_recorder_t *recorder = &vk_state->recorder;
+
+    for (uint32_t frame = 0; frame < AH_MAX_FRAMES_IN_FLIGHT; frame++) {
+        for (uint32_t worker = 0; worker <= AH_JOBS_MAX_WORKERS; worker++) {
+            ah_record_pool_t *pool = &recorder->pools[frame][worker];
+            if (pool->command_pool == VK_NULL_HANDLE) {
+                continue;
+            }
+
+            vkDestroyCommandPool(vk_state->device, pool->command_pool, NULL);
+            free(pool->command_buffers);
+        }
+    }
+}
+
+/// Cover the whole swapchain image, every scene pipeline has viewport and
+/// scissor as dynamic state
+void ah_record_set_viewport(vulkan_state_t *vk_state, VkCommandBuffer command_buffer) {
+    VkViewport viewport = {};
+    viewport.x = 0.0f;
+    viewport.y = 0.0f;
+    viewport.width = (float)vk_state->swapchain_extent.width;
+    viewport.height = (float)vk_state->swapchain_extent.height;
+    viewport.minDepth = 0.0f;
+    viewport.maxDepth = 1.0f;
+    vkCmdSetViewport(command_buffer, 0, 1, &viewport);
+
+    VkRect2D scissor = {};
+    scissor.offset.x = 0;
+    scissor.offset.y = 0;
+    scissor.extent = vk_state->swapchain_extent;
+    vkCmdSetScissor(command_buffer, 0, 1, &scissor);
+}
+
+/// Record draws into a command buffer that is inside the scene render pass
+void ah_record_draws(vulkan_state_t *vk_state, VkCommandBuffer command_buffer, const ah_draw_t *draws, uint32_t num_draws) {
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, vk_state->pipeline);
+    ah_bindless_bind(vk_state, command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, vk_state->pipeline_layout);
+    ah_frame_alloc_bind(vk_state, command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, vk_state->pipeline_layout, vk_state->frame_uniforms.offset, 0);
+    ah_record_set_viewport(vk_state, command_buffer);
+    AH_COUNTER_ADD(AH_COUNTER_PIPELINE_BINDS, 1);
+    // Counted once per call, several threads record at the same time
+    AH_COUNTER_ADD(AH_COUNTER_DRAW_CALLS, num_draws);
+
+    VkBuffer bound_vertex_buffer = VK_NULL_HANDLE;
+    VkBuffer bound_index_buffer = VK_NULL_HANDLE;
+    const ah_draw_t *pushed = NULL;
+    for (uint32_t i = 0; i < num_draws; i++) {
+        const ah_draw_t *draw = &draws[i];
+
+        // Everything a draw binds besides its buffers is in the push
+        // constants, the bindless set stays bound
+        if (!pushed ||
+            pushed->material != draw->material ||
+            memcmp(pushed->dequantize, draw->dequantize, sizeof(draw->dequantize)) != 0) {
+            pushed = draw;
+
+            ah_draw_constants_t constants = {};
+            memcpy(constants.dequantize, draw->dequantize, sizeof(constants.dequantize));
+            constants.material = draw->material;
+            vkCmdPushConstants(command_buffer, vk_state->pipeline_layout, AH_DRAW_CONSTANT_STAGES, 0, sizeof(constants), &constants);
+        }
+
+        if (draw->vertex_buffer != bound_vertex_buffer) {
+            VkDeviceSize offset = 0;
+            bound_vertex_buffer = draw->vertex_buffer;
+            vkCmdBindVertexBuffers(command_buffer, 0, 1, &bound_vertex_buffer, &offset);
+        }
+
+        if (draw->index_buffer == VK_NULL_HANDLE) {
+            vkCmdDraw(command_buffer, draw->vertex_count, 1, draw->first_vertex, 0);
+            continue;
+        }
+
+        if (draw->index_buffer != bound_index_buffer) {
+            bound_index_buffer = draw->index_buffer;
+            vkCmdBindIndexBuffer(command_buffer, bound_index_buffer, 0, draw->index_type);
+        }
+
+        vkCmdDrawIndexed(command_buffer, draw->index_count, 1, draw->first_index, (int32_t)draw->first_vertex, 0);
+    }
+}
+
+AH_RESULT next_command_buffer(vulkan_state_t *vk_state, ah_record_pool_t *pool, VkCommandBuffer *command_buffer) {
+    if (pool->num_used == pool->num_allocated) {
+        uint32_t num_allocated = pool->num_allocated == 0 ? 2 : pool->num_allocated * 2;
+        pool->command_buffers = (VkCommandBuffer*)realloc(pool->command_buffers, sizeof(VkCommandBuffer)*num_allocated);
+
+        VkCommandBufferAllocateInfo alloc_info = {};
+        alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+        alloc_info.commandPool = pool->command_pool;
+        alloc_info.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+        alloc_info.commandBufferCount = num_allocated - pool->num_allocated;
+
+        if (vkAllocateCommandBuffers(vk_state->device, &alloc_info, &pool->command_buffers[pool->num_allocated]) != VK_SUCCESS) {
+            set_error("Error creating secondary command buffers");
+            return AH_FAILURE;
+        }
+        pool->num_allocated = num_allocated;
+    }
+
+    *command_buffer = pool->command_buffers[pool->num_used++];
+    return AH_SUCCESS;
+}
+
+AH_RESULT record_chunk(ah_record_chunk_t *chunk, uint32_t worker) {
+    vulkan_state_t *vk_state = chunk->vk_state;
+    ah_record_pool_t *pool = &vk_state->recorder.pools[chunk->frame][worker];
+
+    if (next_command_buffer(vk_state, pool, &chunk->command_buffer) != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
+
+    // Dynamic rendering has no render pass to inherit, the secondaries are
+    // told the attachment formats instead
+    VkCommandBufferInheritanceRenderingInfo rendering_info = {};
+    rendering_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_RENDERING_INFO;
+    rendering_info.colorAttachmentCount = 1;
+    rendering_info.pColorAttachmentFormats = &vk_state->swapchain_image_format;
+    rendering_info.depthAttachmentFormat = vk_state->depth_format;
+    rendering_info.stencilAttachmentFormat = VK_FORMAT_UNDEFINED;
+    rendering_info.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
+
+    VkCommandBufferInheritanceInfo inheritance_info = {};
+    inheritance_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+    if (vk_state->features.dynamic_rendering) {
+        inheritance_info.pNext = &rendering_info;
+    } else {
+        inheritance_info.renderPass = vk_state->render_pass;
+        inheritance_info.subpass = 0;
+        inheritance_info.framebuffer = vk_state->swapchain_framebuffers[chunk->image_index];
+    }
+
+    VkCommandBufferBeginInfo begin_info = {};
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT | VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+    begin_info.pInheritanceInfo = &inheritance_info;
+
+    if (vkBeginCommandBuffer(chunk->command_buffer, &begin_info) != VK_SUCCESS) {
+        set_error("Failed to begin recording secondary command buffer");
+        return AH_FAILURE;
+    }
+
+    ah_record_draws(vk_state, chunk->command_buffer, &vk_state->draws[chunk->first_draw], chunk->num_draws);
+    // The instanced scene is a few commands, it rides along with the first
+    // chunk
+    if (chunk->first_draw == 0) {
+        ah_instancing_record(vk_state, chunk->command_buffer);
+    }
+
+    if (vkEndCommandBuffer(chunk->command_buffer) != VK_SUCCESS) {
+        set_error("Couldn't end secondary command buffer");
+        return AH_FAILURE;
+    }
+
+    return AH_SUCCESS;
+}
+
+void record_chunk_job(void *data, uint32_t worker) {
+    ah_record_chunk_t *chunk = (ah_record_chunk_t*)data;
+
+    AH_ZONE_BEGIN(zone, "record chunk");
+    chunk->result = record_chunk(chunk, worker);
+    AH_ZONE_END(zone);
+}
+
+/// Split the draw list across the job pool, one secondary command buffer per
+/// chunk, and execute them in draw order. `command_buffer` must be inside a
+/// render pass begun with VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS, or
+/// dynamic rendering begun with VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT.
+AH_RESULT ah_record_parallel(vulkan_state_t *vk_state, VkCommandBuffer command_buffer, uint32_t frame, uint32_t image_index) {
+    ah_recorder_t *recorder = &vk_state->recorder;
+
+    // Secondary buffers of this slot finished executing once its timeline
+    // value was reached
+    for (uint32_t worker = 0; worker <= AH_JOBS_MAX_WORKERS; worker++) {
+        ah_record_pool_t *pool = &recorder->pools[frame][worker];
+        if (pool->num_used > 0) {
+            vkResetCommandPool(vk_state->device, pool->command_pool, 0);
+            pool->num_used = 0;
+        }
+    }
+
+    uint32_t num_chunks = (vk_state->num_draws + AH_RECORD_MIN_DRAWS_PER_JOB - 1) / AH_RECORD_MIN_DRAWS_PER_JOB;
+    uint32_t max_chunks = 2 * (vk_state->jobs.num_workers + 1);
+    if (num_chunks > max_chunks) {
+        num_chunks = max_chunks;
+    }
+    if (num_chunks == 0) {
+        return AH_SUCCESS;
+    }
+
+    uint32_t draws_per_chunk = (vk_state->num_draws + num_chunks - 1) / num_chunks;
+    num_chunks = (vk_state->num_draws + draws_per_chunk - 1) / draws_per_chunk;
+    uint32_t first_draw = 0;
+
+    for (uint32_t i = 0; i < num_chunks; i++) {
+        ah_record_chunk_t *chunk = &recorder->chunks[i];
+        chunk->vk_state = vk_state;
+        chunk->frame = frame;
+        chunk->image_index = image_index;
+        chunk->first_draw = first_draw;
+        chunk->num_draws = vk_state->num_draws - first_draw < draws_per_chunk ? vk_state->num_draws - first_draw : draws_per_chunk;
+        first_draw += chunk->num_draws;
+
+        ah_jobs_push(&vk_state->jobs, record_chunk_job, chunk, &recorder->counter);
+    }
+
+    ah_jobs_wait(&vk_state->jobs, &recorder->counter);
+
+    VkCommandBuffer secondary_buffers[AH_RECORD_MAX_CHUNKS];
+    for (uint32_t i = 0; i < num_chunks; i++) {
+        // The worker's message stays on its thread
+        if (recorder->chunks[i].result != AH_SUCCESS) {
+            set_error("Failed to record scene chunk");
+            return AH_FAILURE;
+        }
+        secondary_buffers[i] = recorder->chunks[i].command_buffer;
+    }
+
+    vkCmdExecuteCommands(command_buffer, num_chunks, secondary_buffers);
+
+    return AH_SUCCESS;
+}
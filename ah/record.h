@@ -0,0 +1,59 @@
+#pragma once
+
+#include "ah.h"
+#include "jobs.h"
+#include <stdint.h>
+#include <vulkan/vulkan_core.h>
+
+// Below this many draws per job, splitting costs more than it saves
+#define AH_RECORD_MIN_DRAWS_PER_JOB 256
+#define AH_RECORD_MAX_CHUNKS (2 * (AH_JOBS_MAX_WORKERS + 1))
+
+typedef struct vulkan_state vulkan_state_t;
+
+typedef struct ah_draw {
+    VkBuffer vertex_buffer;
+    // VK_NULL_HANDLE draws `vertex_count` vertices without indices
+    VkBuffer index_buffer;
+    VkIndexType index_type;
+    uint32_t vertex_count;
+    uint32_t first_vertex;
+    uint32_t index_count;
+    uint32_t first_index;
+    // Scale in xy and offset in zw applied to positions, pushed with the
+    // material whenever either changes between draws
+    float dequantize[4];
+    // Index into the bindless material table
+    uint32_t material;
+} ah_draw_t;
+
+/// Secondary command buffers of one thread for one frame slot. Only that
+/// thread touches the pool while the frame is recorded.
+typedef struct ah_record_pool {
+    VkCommandPool command_pool;
+    VkCommandBuffer *command_buffers;
+    uint32_t num_allocated;
+    uint32_t num_used;
+} ah_record_pool_t;
+
+typedef struct ah_record_chunk {
+    vulkan_state_t *vk_state;
+    uint32_t frame;
+    uint32_t image_index;
+    uint32_t first_draw;
+    uint32_t num_draws;
+    VkCommandBuffer command_buffer;
+    AH_RESULT result;
+} ah_record_chunk_t;
+
+typedef struct ah_recorder {
+    ah_record_pool_t pools[AH_MAX_FRAMES_IN_FLIGHT][AH_JOBS_MAX_WORKERS + 1];
+    ah_record_chunk_t chunks[AH_RECORD_MAX_CHUNKS];
+    ah_job_counter_t counter;
+} ah_recorder_t;
+
+AH_RESULT ah_recorder_init(vulkan_state_t *vk_state);
+void ah_recorder_destroy(vulkan_state_t *vk_state);
+void ah_record_set_viewport(vulkan_state_t *vk_state, VkCommandBuffer command_buffer);
+void ah_record_draws(vulkan_state_t *vk_state, VkCommandBuffer command_buffer, const ah_draw_t *draws, uint32_t num_draws);
+AH_RESULT ah_record_parallel(vulkan_state_t *vk_state, VkCommandBuffer command_buffer, uint32_t frame, uint32_t image_index);
@@ -0,0 +1,678 @@
+#include "render_graph.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <vulkan/vulkan_core.h>
+#include "ah.h"
+#include "alloc.h"
+#include "errors.h"
+#include "instrument.h"
+#include "profiler.h"
+#include "scheduler.h"
+#include "vk.h"
+
+#define AH_GRAPH_WRITE_ACCESS ( \
+    VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT | \
+    VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT | \
+    VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT | \
+    VK_ACCESS_2_TRANSFER_WRITE_BIT)
+
+typedef struct ah_graph_access_info {
+    VkPipelineStageFlags2 stage;
+    VkAccessFlags2 access;
+    VkImageLayout layout;
+    VkImageUsageFlags usage;
+    bool write;
+} ah_graph_access_info_t;
+
+ah_graph_access_info_t graph_access_info(ah_graph_access_t access) {
+    ah_graph_access_info_t info = {};
+
+    switch (access) {
+    case AH_GRAPH_COLOR_ATTACHMENT:
+        info.stage = VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT;
+        // Blending reads the attachment too
+        info.access = VK_ACCESS_2_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_2_COLOR_ATTACHMENT_WRITE_BIT;
+        info.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+        info.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+        info.write = true;
+        break;
+    case AH_GRAPH_DEPTH_ATTACHMENT:
+        info.stage = VK_PIPELINE_STAGE_2_EARLY_FRAGMENT_TESTS_BIT | VK_PIPELINE_STAGE_2_LATE_FRAGMENT_TESTS_BIT;
+        info.access = VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_READ_BIT | VK_ACCESS_2_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+        info.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+        info.usage = VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT;
+        info.write = true;
+        break;
+    case AH_GRAPH_SAMPLED:
+        info.stage = VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+        info.access = VK_ACCESS_2_SHADER_SAMPLED_READ_BIT;
+        info.layout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+        info.usage = VK_IMAGE_USAGE_SAMPLED_BIT;
+        break;
+    case AH_GRAPH_STORAGE_READ:
+        info.stage = VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT | VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+        info.access = VK_ACCESS_2_SHADER_STORAGE_READ_BIT;
+        info.layout = VK_IMAGE_LAYOUT_GENERAL;
+        info.usage = VK_IMAGE_USAGE_STORAGE_BIT;
+        break;
+    case AH_GRAPH_STORAGE_WRITE:
+        info.stage = VK_PIPELINE_STAGE_2_COMPUTE_SHADER_BIT;
+        info.access = VK_ACCESS_2_SHADER_STORAGE_READ_BIT | VK_ACCESS_2_SHADER_STORAGE_WRITE_BIT;
+        info.layout = VK_IMAGE_LAYOUT_GENERAL;
+        info.usage = VK_IMAGE_USAGE_STORAGE_BIT;
+        info.write = true;
+        break;
+    case AH_GRAPH_TRANSFER_SRC:
+        info.stage = VK_PIPELINE_STAGE_2_ALL_TRANSFER_BIT;
+        info.access = VK_ACCESS_2_TRANSFER_READ_BIT;
+        info.layout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+        info.usage = VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+        break;
+    case AH_GRAPH_TRANSFER_DST:
+        info.stage = VK_PIPELINE_STAGE_2_ALL_TRANSFER_BIT;
+        info.access = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+        info.layout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+        info.usage = VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+        info.write = true;
+        break;
+    }
+
+    return info;
+}
+
+VkImageAspectFlags format_aspect(VkFormat format) {
+    switch (format) {
+    case VK_FORMAT_D16_UNORM:
+    case VK_FORMAT_X8_D24_UNORM_PACK32:
+    case VK_FORMAT_D32_SFLOAT:
+        return VK_IMAGE_ASPECT_DEPTH_BIT;
+    case VK_FORMAT_D16_UNORM_S8_UINT:
+    case VK_FORMAT_D24_UNORM_S8_UINT:
+    case VK_FORMAT_D32_SFLOAT_S8_UINT:
+        return VK_IMAGE_ASPECT_DEPTH_BIT | VK_IMAGE_ASPECT_STENCIL_BIT;
+    default:
+        return VK_IMAGE_ASPECT_COLOR_BIT;
+    }
+}
+
+void ah_render_graph_init(ah_render_graph_t *graph) {
+    memset(graph, 0, sizeof(ah_render_graph_t));
+}
+
+uint32_t add_resource(ah_render_graph_t *graph, const char *name) {
+    if (graph->num_resources == AH_RENDER_GRAPH_MAX_RESOURCES) {
+        graph->overflow = true;
+        return AH_RENDER_GRAPH_NONE;
+    }
+
+    ah_graph_resource_t *resource = &graph->resources[graph->num_resources];
+    memset(resource, 0, sizeof(ah_graph_resource_t));
+    resource->name = name;
+    return graph->num_resources++;
+}
+
+/// Declare an image owned outside the graph, set it with
+/// `ah_render_graph_set_image` before every execute. It is in
+/// `initial_layout` once `initial_stage` is done with it, and is left in
+/// `final_layout`. Passes writing it are never culled.
+uint32_t ah_render_graph_import(ah_render_graph_t *graph, const char *name, VkImageLayout initial_layout, VkPipelineStageFlags2 initial_stage, VkImageLayout final_layout) {
+    uint32_t index = add_resource(graph, name);
+    if (index == AH_RENDER_GRAPH_NONE) {
+        return index;
+    }
+
+    ah_graph_resource_t *resource = &graph->resources[index];
+    resource->imported = true;
+    resource->initial_layout = initial_layout;
+    resource->initial_stage = initial_stage;
+    resource->final_layout = final_layout;
+    return index;
+}
+
+/// Declare an image that only lives within a frame. Its contents are
+/// undefined before the first pass writes it, so its memory can be shared
+/// with transients used at other times.
+uint32_t ah_render_graph_create_image(ah_render_graph_t *graph, const char *name, VkFormat format, VkExtent2D extent) {
+    uint32_t index = add_resource(graph, name);
+    if (index == AH_RENDER_GRAPH_NONE) {
+        return index;
+    }
+
+    graph->resources[index].format = format;
+    graph->resources[index].extent = extent;
+    return index;
+}
+
+uint32_t ah_render_graph_add_pass(ah_render_graph_t *graph, const char *name, ah_graph_record_fn record, void *user) {
+    if (graph->num_passes == AH_RENDER_GRAPH_MAX_PASSES) {
+        graph->overflow = true;
+        return AH_RENDER_GRAPH_NONE;
+    }
+
+    ah_graph_pass_t *pass = &graph->passes[graph->num_passes];
+    memset(pass, 0, sizeof(ah_graph_pass_t));
+    pass->name = name;
+    pass->record = record;
+    pass->user = user;
+    return graph->num_passes++;
+}
+
+/// Declare that `pass` accesses `resource`. Passes must be declared after
+/// the ones producing what they read.
+void ah_render_graph_use(ah_render_graph_t *graph, uint32_t pass, uint32_t resource, ah_graph_access_t access) {
+    if (pass == AH_RENDER_GRAPH_NONE || resource == AH_RENDER_GRAPH_NONE ||
+        graph->passes[pass].num_uses == AH_RENDER_GRAPH_MAX_USES) {
+        graph->overflow = true;
+        return;
+    }
+
+    ah_graph_use_t *use = &graph->passes[pass].uses[graph->passes[pass].num_uses++];
+    use->resource = resource;
+    use->access = access;
+}
+
+/// Keep `pass` even though no image of the graph depends on it, for passes
+/// whose results leave the graph such as readbacks
+void ah_render_graph_keep(ah_render_graph_t *graph, uint32_t pass) {
+    if (pass == AH_RENDER_GRAPH_NONE) {
+        graph->overflow = true;
+        return;
+    }
+
+    graph->passes[pass].keep = true;
+}
+
+void destroy_transients(vulkan_state_t *vk_state, ah_render_graph_t *graph) {
+    for (uint32_t i = 0; i < graph->num_resources; i++) {
+        ah_graph_resource_t *resource = &graph->resources[i];
+        if (resource->imported || resource->image == VK_NULL_HANDLE) {
+            continue;
+        }
+
+        vkDestroyImageView(vk_state->device, resource->view, NULL);
+        vkDestroyImage(vk_state->device, resource->image, NULL);
+        resource->view = VK_NULL_HANDLE;
+        resource->image = VK_NULL_HANDLE;
+    }
+
+    for (uint32_t i = 0; i < graph->num_slots; i++) {
+        ah_alloc_free(&vk_state->allocator, &graph->slots[i].allocation);
+    }
+    graph->num_slots = 0;
+}
+
+/// Keep the passes whose writes reach an imported image or a kept pass,
+/// walking back from the last pass
+void cull_passes(ah_render_graph_t *graph) {
+    bool needed[AH_RENDER_GRAPH_MAX_RESOURCES] = {};
+    for (uint32_t i = 0; i < graph->num_resources; i++) {
+        needed[i] = graph->resources[i].imported;
+    }
+
+    for (uint32_t p = graph->num_passes; p-- > 0;) {
+        ah_graph_pass_t *pass = &graph->passes[p];
+        pass->culled = !pass->keep;
+
+        for (uint32_t u = 0; u < pass->num_uses; u++) {
+            if (graph_access_info(pass->uses[u].access).write && needed[pass->uses[u].resource]) {
+                pass->culled = false;
+            }
+        }
+
+        if (pass->culled) {
+            continue;
+        }
+
+        for (uint32_t u = 0; u < pass->num_uses; u++) {
+            if (!graph_access_info(pass->uses[u].access).write) {
+                needed[pass->uses[u].resource] = true;
+            }
+        }
+    }
+}
+
+bool passes_conflict(ah_graph_pass_t *a, ah_graph_pass_t *b) {
+    for (uint32_t i = 0; i < a->num_uses; i++) {
+        for (uint32_t j = 0; j < b->num_uses; j++) {
+            if (a->uses[i].resource == b->uses[j].resource &&
+                (graph_access_info(a->uses[i].access).write || graph_access_info(b->uses[j].access).write)) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/// Topological order of the kept passes. Among the ready ones, a pass that
+/// doesn't depend on the one just scheduled goes first, so a producer and
+/// its consumer end up further apart and their barrier stalls less.
+void order_passes(ah_render_graph_t *graph) {
+    uint32_t dependencies[AH_RENDER_GRAPH_MAX_PASSES] = {};
+    uint32_t remaining = 0;
+
+    for (uint32_t j = 0; j < graph->num_passes; j++) {
+        if (graph->passes[j].culled) {
+            continue;
+        }
+        remaining |= 1u << j;
+
+        for (uint32_t i = 0; i < j; i++) {
+            if (!graph->passes[i].culled && passes_conflict(&graph->passes[i], &graph->passes[j])) {
+                dependencies[j] |= 1u << i;
+            }
+        }
+    }
+
+    graph->num_ordered = 0;
+    uint32_t scheduled = 0;
+    uint32_t last = AH_RENDER_GRAPH_NONE;
+
+    while (remaining != 0) {
+        uint32_t pick = AH_RENDER_GRAPH_NONE;
+
+        for (uint32_t i = 0; i < graph->num_passes; i++) {
+            if (!(remaining & (1u << i)) || (dependencies[i] & ~scheduled) != 0) {
+                continue;
+            }
+            if (pick == AH_RENDER_GRAPH_NONE) {
+                pick = i;
+            }
+            if (last == AH_RENDER_GRAPH_NONE || !(dependencies[i] & (1u << last))) {
+                pick = i;
+                break;
+            }
+        }
+
+        graph->order[graph->num_ordered++] = pick;
+        scheduled |= 1u << pick;
+        remaining &= ~(1u << pick);
+        last = pick;
+    }
+}
+
+AH_RESULT create_transient(vulkan_state_t *vk_state, ah_graph_resource_t *resource, VkMemoryRequirements *requirements) {
+    VkExtent2D extent = resource->extent;
+    if (extent.width == 0 || extent.height == 0) {
+        extent = vk_state->swapchain_extent;
+    }
+
+    VkImageCreateInfo image_info = {};
+    image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    image_info.imageType = VK_IMAGE_TYPE_2D;
+    image_info.format = resource->format;
+    image_info.extent.width = extent.width;
+    image_info.extent.height = extent.height;
+    image_info.extent.depth = 1;
+    image_info.mipLevels = 1;
+    image_info.arrayLayers = 1;
+    image_info.samples = VK_SAMPLE_COUNT_1_BIT;
+    image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+    image_info.usage = resource->usage;
+    image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+    if (vkCreateImage(vk_state->device, &image_info, NULL, &resource->image) != VK_SUCCESS) {
+        set_error("Failed to create transient image");
+        resource->image = VK_NULL_HANDLE;
+        return AH_FAILURE;
+    }
+
+    vkGetImageMemoryRequirements(vk_state->device, resource->image, requirements);
+    return AH_SUCCESS;
+}
+
+/// Place every used transient in the first memory slot that is free for its
+/// whole lifetime and has a compatible memory type
+void assign_slots(ah_render_graph_t *graph, VkMemoryRequirements *requirements) {
+    uint32_t transients[AH_RENDER_GRAPH_MAX_RESOURCES];
+    uint32_t num_transients = 0;
+
+    for (uint32_t i = 0; i < graph->num_resources; i++) {
+        ah_graph_resource_t *resource = &graph->resources[i];
+        if (resource->imported || resource->image == VK_NULL_HANDLE) {
+            continue;
+        }
+
+        // Sorted by first use
+        uint32_t at = num_transients++;
+        while (at > 0 && graph->resources[transients[at - 1]].first_use > resource->first_use) {
+            transients[at] = transients[at - 1];
+            at--;
+        }
+        transients[at] = i;
+    }
+
+    for (uint32_t t = 0; t < num_transients; t++) {
+        ah_graph_resource_t *resource = &graph->resources[transients[t]];
+        VkMemoryRequirements *required = &requirements[transients[t]];
+        ah_graph_memory_slot_t *slot = NULL;
+
+        for (uint32_t s = 0; s < graph->num_slots; s++) {
+            if (graph->slots[s].last_use < resource->first_use &&
+                (graph->slots[s].requirements.memoryTypeBits & required->memoryTypeBits) != 0) {
+                slot = &graph->slots[s];
+                break;
+            }
+        }
+
+        if (!slot) {
+            slot = &graph->slots[graph->num_slots++];
+            memset(slot, 0, sizeof(ah_graph_memory_slot_t));
+            slot->requirements = *required;
+        } else {
+            if (required->size > slot->requirements.size) {
+                slot->requirements.size = required->size;
+            }
+            if (required->alignment > slot->requirements.alignment) {
+                slot->requirements.alignment = required->alignment;
+            }
+            slot->requirements.memoryTypeBits &= required->memoryTypeBits;
+        }
+
+        slot->last_use = resource->last_use;
+        resource->slot = (uint32_t)(slot - graph->slots);
+    }
+}
+
+/// Cull, order and allocate. Call again when the swapchain extent changes,
+/// transients that follow it are recreated.
+AH_RESULT ah_render_graph_compile(vulkan_state_t *vk_state, ah_render_graph_t *graph) {
+    if (graph->overflow) {
+        set_error("Render graph has too many passes, resources or uses");
+        return AH_FAILURE;
+    }
+
+    // Frames in flight may still be using the old transients
+    if (graph->num_slots > 0) {
+        if (ah_scheduler_wait(vk_state, AH_QUEUE_GRAPHICS, vk_state->scheduler.timelines[AH_QUEUE_GRAPHICS].submitted) != AH_SUCCESS) {
+            return AH_FAILURE;
+        }
+        destroy_transients(vk_state, graph);
+    }
+
+    cull_passes(graph);
+    order_passes(graph);
+
+    for (uint32_t i = 0; i < graph->num_resources; i++) {
+        graph->resources[i].first_use = AH_RENDER_GRAPH_NONE;
+        graph->resources[i].last_use = 0;
+        if (!graph->resources[i].imported) {
+            graph->resources[i].usage = 0;
+        }
+    }
+
+    for (uint32_t position = 0; position < graph->num_ordered; position++) {
+        ah_graph_pass_t *pass = &graph->passes[graph->order[position]];
+
+        for (uint32_t u = 0; u < pass->num_uses; u++) {
+            ah_graph_resource_t *resource = &graph->resources[pass->uses[u].resource];
+            if (resource->first_use == AH_RENDER_GRAPH_NONE) {
+                resource->first_use = position;
+            }
+            resource->last_use = position;
+            resource->usage |= graph_access_info(pass->uses[u].access).usage;
+        }
+    }
+
+    VkMemoryRequirements requirements[AH_RENDER_GRAPH_MAX_RESOURCES];
+    VkDeviceSize unaliased_size = 0;
+
+    for (uint32_t i = 0; i < graph->num_resources; i++) {
+        ah_graph_resource_t *resource = &graph->resources[i];
+        if (resource->imported || resource->first_use == AH_RENDER_GRAPH_NONE) {
+            continue;
+        }
+
+        if (create_transient(vk_state, resource, &requirements[i]) != AH_SUCCESS) {
+            destroy_transients(vk_state, graph);
+            return AH_FAILURE;
+        }
+        unaliased_size += requirements[i].size;
+    }
+
+    assign_slots(graph, requirements);
+
+    VkDeviceSize aliased_size = 0;
+    for (uint32_t s = 0; s < graph->num_slots; s++) {
+        if (ah_alloc_memory(
+            &vk_state->allocator,
+            &graph->slots[s].requirements,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            AH_ALLOC_OPTIMAL,
+            &graph->slots[s].allocation)
+        != AH_SUCCESS) {
+            set_error("Failed to allocate transient memory");
+            // Only the slots before this one hold memory
+            graph->num_slots = s;
+            destroy_transients(vk_state, graph);
+            return AH_FAILURE;
+        }
+        aliased_size += graph->slots[s].requirements.size;
+    }
+
+    for (uint32_t i = 0; i < graph->num_resources; i++) {
+        ah_graph_resource_t *resource = &graph->resources[i];
+        if (resource->imported || resource->image == VK_NULL_HANDLE) {
+            continue;
+        }
+
+        ah_allocation_t *allocation = &graph->slots[resource->slot].allocation;
+        vkBindImageMemory(vk_state->device, resource->image, allocation->memory, allocation->offset);
+
+        VkImageViewCreateInfo view_info = {};
+        view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+        view_info.image = resource->image;
+        view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+        view_info.format = resource->format;
+        view_info.subresourceRange.aspectMask = format_aspect(resource->format);
+        view_info.subresourceRange.baseMipLevel = 0;
+        view_info.subresourceRange.levelCount = 1;
+        view_info.subresourceRange.baseArrayLayer = 0;
+        view_info.subresourceRange.layerCount = 1;
+
+        if (vkCreateImageView(vk_state->device, &view_info, NULL, &resource->view) != VK_SUCCESS) {
+            set_error("Failed to create transient image view");
+            destroy_transients(vk_state, graph);
+            return AH_FAILURE;
+        }
+    }
+
+#if AH_INSTRUMENT
+    printf(
+        "Render graph: %u of %u passes, %u transient slots, %.2f MB (%.2f MB unaliased)\n",
+        graph->num_ordered,
+        graph->num_passes,
+        graph->num_slots,
+        (double)aliased_size / (1024.0 * 1024.0),
+        (double)unaliased_size / (1024.0 * 1024.0)
+    );
+#else
+    (void)aliased_size;
+    (void)unaliased_size;
+#endif
+
+    return AH_SUCCESS;
+}
+
+void ah_render_graph_set_image(ah_render_graph_t *graph, uint32_t resource, VkImage image, VkImageView view) {
+    graph->resources[resource].image = image;
+    graph->resources[resource].view = view;
+}
+
+VkImage ah_render_graph_image(ah_render_graph_t *graph, uint32_t resource) {
+    return graph->resources[resource].image;
+}
+
+VkImageView ah_render_graph_image_view(ah_render_graph_t *graph, uint32_t resource) {
+    return graph->resources[resource].view;
+}
+
+/// Move `resource` to `layout` for an access at `stage`. Returns false when
+/// the access needs no barrier: same layout, and any earlier write is
+/// already visible to that stage.
+bool image_barrier(ah_graph_resource_t *resource, ah_graph_access_info_t *info, bool *dirty, VkPipelineStageFlags2 *visible, VkImageMemoryBarrier2 *barrier) {
+    bool transition = resource->layout != info->layout;
+    bool raw = *dirty && (info->stage & ~*visible) != 0;
+    bool war = info->write && resource->stage != 0;
+
+    if (!transition && !raw && !war) {
+        return false;
+    }
+
+    memset(barrier, 0, sizeof(VkImageMemoryBarrier2));
+    barrier->sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2;
+    barrier->srcStageMask = resource->stage;
+    barrier->srcAccessMask = resource->access;
+    barrier->dstStageMask = info->stage;
+    barrier->dstAccessMask = info->access;
+    barrier->oldLayout = resource->layout;
+    barrier->newLayout = info->layout;
+    barrier->srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier->dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier->image = resource->image;
+    barrier->subresourceRange.aspectMask = format_aspect(resource->format);
+    barrier->subresourceRange.baseMipLevel = 0;
+    barrier->subresourceRange.levelCount = VK_REMAINING_MIP_LEVELS;
+    barrier->subresourceRange.baseArrayLayer = 0;
+    barrier->subresourceRange.layerCount = VK_REMAINING_ARRAY_LAYERS;
+
+    resource->layout = info->layout;
+    // A layout transition is a write the next stages have to see as well
+    *dirty = *dirty || transition;
+    *visible = info->stage;
+    return true;
+}
+
+/// Record every kept pass in order, preceded by the barriers its accesses
+/// need. Imported images must have been set for this frame.
+AH_RESULT ah_render_graph_execute(vulkan_state_t *vk_state, ah_render_graph_t *graph, VkCommandBuffer command_buffer, uint32_t frame, uint32_t image_index) {
+    // Whether something was written since the last barrier and which stages
+    // that barrier made it visible to
+    bool dirty[AH_RENDER_GRAPH_MAX_RESOURCES];
+    VkPipelineStageFlags2 visible[AH_RENDER_GRAPH_MAX_RESOURCES];
+
+    // `stage` holds every stage the next barrier has to wait for, `access`
+    // the writes it has to make available
+    for (uint32_t i = 0; i < graph->num_resources; i++) {
+        ah_graph_resource_t *resource = &graph->resources[i];
+        dirty[i] = false;
+        visible[i] = 0;
+
+        if (resource->imported) {
+            if (resource->image == VK_NULL_HANDLE) {
+                set_error("Render graph image was not imported");
+                return AH_FAILURE;
+            }
+            resource->layout = resource->initial_layout;
+            resource->stage = resource->initial_stage;
+            resource->access = 0;
+        } else {
+            // Picks up the slot once its first pass is reached
+            resource->layout = VK_IMAGE_LAYOUT_UNDEFINED;
+            resource->stage = 0;
+            resource->access = 0;
+        }
+    }
+
+    ah_graph_pass_context_t context = {};
+    context.vk_state = vk_state;
+    context.graph = graph;
+    context.command_buffer = command_buffer;
+    context.frame = frame;
+    context.image_index = image_index;
+
+    for (uint32_t position = 0; position < graph->num_ordered; position++) {
+        ah_graph_pass_t *pass = &graph->passes[graph->order[position]];
+        VkImageMemoryBarrier2 barriers[AH_RENDER_GRAPH_MAX_USES];
+        uint32_t num_barriers = 0;
+
+        // Whatever last used the slot, an earlier alias in this frame or the
+        // last one of the previous frame, has to be done before the contents
+        // are discarded
+        for (uint32_t i = 0; i < graph->num_resources; i++) {
+            ah_graph_resource_t *resource = &graph->resources[i];
+            if (!resource->imported && resource->image != VK_NULL_HANDLE && resource->first_use == position) {
+                resource->stage = graph->slots[resource->slot].stage;
+                resource->access = graph->slots[resource->slot].access;
+            }
+        }
+
+        for (uint32_t u = 0; u < pass->num_uses; u++) {
+            uint32_t index = pass->uses[u].resource;
+            ah_graph_resource_t *resource = &graph->resources[index];
+            ah_graph_access_info_t info = graph_access_info(pass->uses[u].access);
+
+            if (image_barrier(resource, &info, &dirty[index], &visible[index], &barriers[num_barriers])) {
+                num_barriers++;
+                // Waited for, the barrier chains every earlier access
+                resource->stage = info.stage;
+                resource->access = 0;
+            } else {
+                resource->stage |= info.stage;
+            }
+
+            if (info.write) {
+                resource->access = info.access & AH_GRAPH_WRITE_ACCESS;
+                dirty[index] = true;
+                visible[index] = 0;
+            }
+
+            if (!resource->imported) {
+                graph->slots[resource->slot].stage = resource->stage;
+                graph->slots[resource->slot].access = resource->access;
+            }
+        }
+
+        if (num_barriers > 0) {
+            VkDependencyInfo dependency_info = {};
+            dependency_info.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
+            dependency_info.imageMemoryBarrierCount = num_barriers;
+            dependency_info.pImageMemoryBarriers = barriers;
+            vkCmdPipelineBarrier2(command_buffer, &dependency_info);
+        }
+
+        uint32_t scope = ah_profiler_begin(vk_state, command_buffer, pass->name);
+        if (pass->record(&context, pass->user) != AH_SUCCESS) {
+            return AH_FAILURE;
+        }
+        ah_profiler_end(vk_state, command_buffer, scope);
+    }
+
+    // Leave imported images the way their owner expects them, presentation
+    // and later submissions are ordered by semaphores
+    VkImageMemoryBarrier2 barriers[AH_RENDER_GRAPH_MAX_RESOURCES];
+    uint32_t num_barriers = 0;
+    for (uint32_t i = 0; i < graph->num_resources; i++) {
+        ah_graph_resource_t *resource = &graph->resources[i];
+        if (!resource->imported || resource->layout == resource->final_layout) {
+            continue;
+        }
+
+        ah_graph_access_info_t info = {};
+        info.stage = VK_PIPELINE_STAGE_2_NONE;
+        info.access = 0;
+        info.layout = resource->final_layout;
+        image_barrier(resource, &info, &dirty[i], &visible[i], &barriers[num_barriers++]);
+    }
+
+    if (num_barriers > 0) {
+        VkDependencyInfo dependency_info = {};
+        dependency_info.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
+        dependency_info.imageMemoryBarrierCount = num_barriers;
+        dependency_info.pImageMemoryBarriers = barriers;
+        vkCmdPipelineBarrier2(command_buffer, &dependency_info);
+    }
+
+    return AH_SUCCESS;
+}
+
+/// Destroy the transients, the device must be idle
+void ah_render_graph_destroy(vulkan_state_t *vk_state, ah_render_graph_t *graph) {
+    destroy_transients(vk_state, graph);
+    graph->num_passes = 0;
+    graph->num_resources = 0;
+    graph->num_ordered = 0;
+}
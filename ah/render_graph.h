@@ -0,0 +1,128 @@
+#pragma once
+
+#include "ah.h"
+#include "alloc.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <vulkan/vulkan_core.h>
+
+#define AH_RENDER_GRAPH_MAX_PASSES 32
+#define AH_RENDER_GRAPH_MAX_RESOURCES 32
+#define AH_RENDER_GRAPH_MAX_USES 8
+// Returned when a pass or resource doesn't fit, compiling then fails
+#define AH_RENDER_GRAPH_NONE UINT32_MAX
+
+typedef struct vulkan_state vulkan_state_t;
+typedef struct ah_render_graph ah_render_graph_t;
+
+/// How a pass touches an image, decides its layout and the stages a
+/// barrier has to cover
+typedef enum ah_graph_access {
+    AH_GRAPH_COLOR_ATTACHMENT,
+    AH_GRAPH_DEPTH_ATTACHMENT,
+    AH_GRAPH_SAMPLED,
+    AH_GRAPH_STORAGE_READ,
+    AH_GRAPH_STORAGE_WRITE,
+    AH_GRAPH_TRANSFER_SRC,
+    AH_GRAPH_TRANSFER_DST,
+} ah_graph_access_t;
+
+typedef struct ah_graph_pass_context {
+    vulkan_state_t *vk_state;
+    ah_render_graph_t *graph;
+    VkCommandBuffer command_buffer;
+    uint32_t frame;
+    uint32_t image_index;
+} ah_graph_pass_context_t;
+
+/// Records a pass, every image it declared is already in the right layout
+typedef AH_RESULT (*ah_graph_record_fn)(const ah_graph_pass_context_t *context, void *user);
+
+typedef struct ah_graph_use {
+    uint32_t resource;
+    ah_graph_access_t access;
+} ah_graph_use_t;
+
+typedef struct ah_graph_pass {
+    const char *name;
+    ah_graph_record_fn record;
+    void *user;
+    ah_graph_use_t uses[AH_RENDER_GRAPH_MAX_USES];
+    uint32_t num_uses;
+    // Has effects outside the graph, like copying an image out, and is
+    // never culled
+    bool keep;
+    // Nothing kept reads what it writes
+    bool culled;
+} ah_graph_pass_t;
+
+typedef struct ah_graph_resource {
+    const char *name;
+    // Owned outside the graph and set every frame, like the swapchain image
+    bool imported;
+    VkImage image;
+    VkImageView view;
+
+    // Transient images are created by the graph. An extent of 0 follows
+    // the swapchain, usage is gathered from the declared accesses.
+    VkFormat format;
+    VkExtent2D extent;
+    VkImageUsageFlags usage;
+    // Memory slot shared with transients whose lifetimes don't overlap
+    uint32_t slot;
+
+    // State of imported images when the frame starts and once it ends
+    VkImageLayout initial_layout;
+    VkPipelineStageFlags2 initial_stage;
+    VkImageLayout final_layout;
+
+    // First and last position in the execution order using it
+    uint32_t first_use;
+    uint32_t last_use;
+
+    // Tracked while executing
+    VkImageLayout layout;
+    VkPipelineStageFlags2 stage;
+    VkAccessFlags2 access;
+} ah_graph_resource_t;
+
+/// Device memory aliased by the transients placed in it. The stages of its
+/// last use carry over to the first barrier of the next image placed there.
+typedef struct ah_graph_memory_slot {
+    VkMemoryRequirements requirements;
+    ah_allocation_t allocation;
+    uint32_t last_use;
+    VkPipelineStageFlags2 stage;
+    VkAccessFlags2 access;
+} ah_graph_memory_slot_t;
+
+/// Frame described as passes and the images they read and write. Compiling
+/// drops passes nothing depends on, orders the rest and places transient
+/// images in shared memory; executing records each pass behind the fewest
+/// synchronization2 barriers its accesses need.
+typedef struct ah_render_graph {
+    ah_graph_pass_t passes[AH_RENDER_GRAPH_MAX_PASSES];
+    uint32_t num_passes;
+    ah_graph_resource_t resources[AH_RENDER_GRAPH_MAX_RESOURCES];
+    uint32_t num_resources;
+    bool overflow;
+
+    uint32_t order[AH_RENDER_GRAPH_MAX_PASSES];
+    uint32_t num_ordered;
+
+    ah_graph_memory_slot_t slots[AH_RENDER_GRAPH_MAX_RESOURCES];
+    uint32_t num_slots;
+} ah_render_graph_t;
+
+void ah_render_graph_init(ah_render_graph_t *graph);
+uint32_t ah_render_graph_import(ah_render_graph_t *graph, const char *name, VkImageLayout initial_layout, VkPipelineStageFlags2 initial_stage, VkImageLayout final_layout);
+uint32_t ah_render_graph_create_image(ah_render_graph_t *graph, const char *name, VkFormat format, VkExtent2D extent);
+uint32_t ah_render_graph_add_pass(ah_render_graph_t *graph, const char *name, ah_graph_record_fn record, void *user);
+void ah_render_graph_use(ah_render_graph_t *graph, uint32_t pass, uint32_t resource, ah_graph_access_t access);
+void ah_render_graph_keep(ah_render_graph_t *graph, uint32_t pass);
+AH_RESULT ah_render_graph_compile(vulkan_state_t *vk_state, ah_render_graph_t *graph);
+void ah_render_graph_set_image(ah_render_graph_t *graph, uint32_t resource, VkImage image, VkImageView view);
+VkImage ah_render_graph_image(ah_render_graph_t *graph, uint32_t resource);
+VkImageView ah_render_graph_image_view(ah_render_graph_t *graph, uint32_t resource);
+AH_RESULT ah_render_graph_execute(vulkan_state_t *vk_state, ah_render_graph_t *graph, VkCommandBuffer command_buffer, uint32_t frame, uint32_t image_index);
+void ah_render_graph_destroy(vulkan_state_t *vk_state, ah_render_graph_t *graph);
@@ -0,0 +1,269 @@
+#include "scheduler.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <vulkan/vulkan_core.h>
+#include "ah.h"
+#include "errors.h"
+#include "instrument.h"
+#include "vk.h"
+
+void destroy_retired(vulkan_state_t *vk_state, ah_retired_buffer_t *retired);
+
+AH_RESULT ah_scheduler_init(vulkan_state_t *vk_state) {
+    ah_scheduler_t *scheduler = &vk_state->scheduler;
+    memset(scheduler, 0, sizeof(ah_scheduler_t));
+
+    scheduler->timelines[AH_QUEUE_GRAPHICS].queue = vk_state->graphics_queue;
+    scheduler->timelines[AH_QUEUE_COMPUTE].queue = vk_state->compute_queue;
+    scheduler->timelines[AH_QUEUE_TRANSFER].queue = vk_state->transfer_queue;
+
+    VkSemaphoreTypeCreateInfo type_info = {};
+    type_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+    type_info.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+    type_info.initialValue = 0;
+
+    VkSemaphoreCreateInfo semaphore_info = {};
+    semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+    semaphore_info.pNext = &type_info;
+
+    for (uint32_t i = 0; i < AH_QUEUE_COUNT; i++) {
+        if (vkCreateSemaphore(vk_state->device, &semaphore_info, NULL, &scheduler->timelines[i].semaphore) != VK_SUCCESS) {
+            set_error("Error creating timeline semaphore");
+            return AH_FAILURE;
+        }
+    }
+
+    return AH_SUCCESS;
+}
+
+/// Destroy whatever is still retired and the timelines, the device must be
+/// idle
+void ah_scheduler_destroy(vulkan_state_t *vk_state) {
+    ah_scheduler_t *scheduler = &vk_state->scheduler;
+
+    for (uint32_t i = 0; i < scheduler->num_retired; i++) {
+        destroy_retired(vk_state, &scheduler->retired[i]);
+    }
+    scheduler->num_retired = 0;
+
+    for (uint32_t i = 0; i < AH_QUEUE_COUNT; i++) {
+        vkDestroySemaphore(vk_state->device, scheduler->timelines[i].semaphore, NULL);
+    }
+}
+
+/// Whether `queue` reached `value`, without blocking. The counter is only
+/// read back when the cached value isn't enough.
+bool ah_scheduler_poll(vulkan_state_t *vk_state, ah_queue_t queue, uint64_t value) {
+    ah_timeline_t *timeline = &vk_state->scheduler.timelines[queue];
+    if (value <= timeline->completed) {
+        return true;
+    }
+
+    uint64_t counter;
+    if (vkGetSemaphoreCounterValue(vk_state->device, timeline->semaphore, &counter) == VK_SUCCESS && counter > timeline->completed) {
+        timeline->completed = counter;
+    }
+
+    return value <= timeline->completed;
+}
+
+/// Block until `queue` reached `value`, returns right away when it already
+/// did
+AH_RESULT ah_scheduler_wait(vulkan_state_t *vk_state, ah_queue_t queue, uint64_t value) {
+    if (ah_scheduler_poll(vk_state, queue, value)) {
+        return AH_SUCCESS;
+    }
+
+    ah_timeline_t *timeline = &vk_state->scheduler.timelines[queue];
+    AH_ZONE_BEGIN(zone, "timeline wait");
+
+    VkSemaphoreWaitInfo wait_info = {};
+    wait_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+    wait_info.semaphoreCount = 1;
+    wait_info.pSemaphores = &timeline->semaphore;
+    wait_info.pValues = &value;
+
+    if (vkWaitSemaphores(vk_state->device, &wait_info, UINT64_MAX) != VK_SUCCESS) {
+        set_error("Error waiting on timeline semaphore");
+        return AH_FAILURE;
+    }
+    timeline->completed = value;
+
+    AH_ZONE_END(zone);
+    return AH_SUCCESS;
+}
+
+/// Block until every queue finished everything submitted so far
+AH_RESULT ah_scheduler_wait_idle(vulkan_state_t *vk_state) {
+    for (uint32_t i = 0; i < AH_QUEUE_COUNT; i++) {
+        if (ah_scheduler_wait(vk_state, (ah_queue_t)i, vk_state->scheduler.timelines[i].submitted) != AH_SUCCESS) {
+            return AH_FAILURE;
+        }
+    }
+
+    return AH_SUCCESS;
+}
+
+/// Make a submission wait on `queue` reaching `value` at `stage`. Skipped
+/// when the value is already known to be reached.
+/// A second wait on the same semaphore is folded into the first, waiting
+/// for the larger value at every stage either of them named
+AH_RESULT push_wait(ah_submit_waits_t *waits, VkSemaphore semaphore, uint64_t value, VkPipelineStageFlags stage) {
+    for (uint32_t i = 0; i < waits->count; i++) {
+        if (waits->semaphores[i] == semaphore) {
+            waits->values[i] = value > waits->values[i] ? value : waits->values[i];
+            waits->stages[i] |= stage;
+            return AH_SUCCESS;
+        }
+    }
+
+    if (waits->count == AH_SCHEDULER_MAX_WAITS) {
+        set_error("Too many semaphores to wait on");
+        return AH_FAILURE;
+    }
+
+    waits->semaphores[waits->count] = semaphore;
+    waits->values[waits->count] = value;
+    waits->stages[waits->count] = stage;
+    waits->count++;
+    return AH_SUCCESS;
+}
+
+AH_RESULT ah_scheduler_add_wait(vulkan_state_t *vk_state, ah_submit_waits_t *waits, ah_queue_t queue, uint64_t value, VkPipelineStageFlags stage) {
+    ah_timeline_t *timeline = &vk_state->scheduler.timelines[queue];
+    if (value <= timeline->completed) {
+        return AH_SUCCESS;
+    }
+
+    return push_wait(waits, timeline->semaphore, value, stage);
+}
+
+AH_RESULT ah_scheduler_add_binary_wait(ah_submit_waits_t *waits, VkSemaphore semaphore, VkPipelineStageFlags stage) {
+    return push_wait(waits, semaphore, 0, stage);
+}
+
+/// Submit `command_buffer` to `queue`, signaling its timeline with the next
+/// value and `binary_signal` too unless it is VK_NULL_HANDLE. `value` gets
+/// the signaled value when not NULL.
+AH_RESULT ah_scheduler_submit(vulkan_state_t *vk_state, ah_queue_t queue, VkCommandBuffer command_buffer, const ah_submit_waits_t *waits, VkSemaphore binary_signal, uint64_t *value) {
+    ah_timeline_t *timeline = &vk_state->scheduler.timelines[queue];
+    uint64_t signal_value = timeline->submitted + 1;
+
+    VkSemaphore signal_semaphores[] = {timeline->semaphore, binary_signal};
+    uint64_t signal_values[] = {signal_value, 0};
+    uint32_t num_signal_semaphores = binary_signal != VK_NULL_HANDLE ? 2 : 1;
+    uint32_t num_wait_semaphores = waits ? waits->count : 0;
+
+    VkTimelineSemaphoreSubmitInfo timeline_info = {};
+    timeline_info.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+    timeline_info.waitSemaphoreValueCount = num_wait_semaphores;
+    timeline_info.pWaitSemaphoreValues = waits ? waits->values : NULL;
+    timeline_info.signalSemaphoreValueCount = num_signal_semaphores;
+    timeline_info.pSignalSemaphoreValues = signal_values;
+
+    VkSubmitInfo submit_info = {};
+    submit_info.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+    submit_info.pNext = &timeline_info;
+    submit_info.waitSemaphoreCount = num_wait_semaphores;
+    submit_info.pWaitSemaphores = waits ? waits->semaphores : NULL;
+    submit_info.pWaitDstStageMask = waits ? waits->stages : NULL;
+    submit_info.commandBufferCount = 1;
+    submit_info.pCommandBuffers = &command_buffer;
+    submit_info.signalSemaphoreCount = num_signal_semaphores;
+    submit_info.pSignalSemaphores = signal_semaphores;
+
+    if (vkQueueSubmit(timeline->queue, 1, &submit_info, VK_NULL_HANDLE) != VK_SUCCESS) {
+        set_error("Error submitting queue");
+        return AH_FAILURE;
+    }
+
+    timeline->submitted = signal_value;
+    if (value) {
+        *value = signal_value;
+    }
+
+    return AH_SUCCESS;
+}
+
+bool retired_buffer_done(vulkan_state_t *vk_state, ah_retired_buffer_t *retired) {
+    for (uint32_t i = 0; i < AH_QUEUE_COUNT; i++) {
+        if (!ah_scheduler_poll(vk_state, (ah_queue_t)i, retired->values[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void destroy_retired(vulkan_state_t *vk_state, ah_retired_buffer_t *retired) {
+    if (retired->image != VK_NULL_HANDLE) {
+        vkDestroyImageView(vk_state->device, retired->view, NULL);
+        ah_vk_destroy_image(vk_state, retired->image, &retired->allocation);
+    } else {
+        ah_vk_destroy_buffer(vk_state, retired->buffer, &retired->allocation);
+    }
+}
+
+/// Next free retired entry, stamped with what every queue submitted so far
+ah_retired_buffer_t *push_retired(vulkan_state_t *vk_state) {
+    ah_scheduler_t *scheduler = &vk_state->scheduler;
+
+    if (scheduler->num_retired == AH_SCHEDULER_MAX_RETIRED) {
+        ah_scheduler_collect(vk_state);
+    }
+
+    // Still full, the oldest one has to go now
+    if (scheduler->num_retired == AH_SCHEDULER_MAX_RETIRED) {
+        ah_retired_buffer_t *oldest = &scheduler->retired[0];
+        for (uint32_t i = 0; i < AH_QUEUE_COUNT; i++) {
+            if (ah_scheduler_wait(vk_state, (ah_queue_t)i, oldest->values[i]) != AH_SUCCESS) {
+                print_error("scheduler/retire_buffer");
+            }
+        }
+        ah_scheduler_collect(vk_state);
+    }
+
+    ah_retired_buffer_t *retired = &scheduler->retired[scheduler->num_retired++];
+    for (uint32_t i = 0; i < AH_QUEUE_COUNT; i++) {
+        retired->values[i] = scheduler->timelines[i].submitted;
+    }
+    return retired;
+}
+
+/// Destroy `buffer` once the work already submitted to any queue is done
+/// with it, instead of waiting for the device to go idle
+void ah_scheduler_retire_buffer(vulkan_state_t *vk_state, VkBuffer buffer, ah_allocation_t *allocation) {
+    ah_retired_buffer_t *retired = push_retired(vk_state);
+    retired->buffer = buffer;
+    retired->image = VK_NULL_HANDLE;
+    retired->view = VK_NULL_HANDLE;
+    retired->allocation = *allocation;
+}
+
+/// Same for an image and its view
+void ah_scheduler_retire_image(vulkan_state_t *vk_state, VkImage image, VkImageView view, ah_allocation_t *allocation) {
+    ah_retired_buffer_t *retired = push_retired(vk_state);
+    retired->buffer = VK_NULL_HANDLE;
+    retired->image = image;
+    retired->view = view;
+    retired->allocation = *allocation;
+}
+
+/// Destroy the retired buffers and images every queue is done with, without blocking
+void ah_scheduler_collect(vulkan_state_t *vk_state) {
+    ah_scheduler_t *scheduler = &vk_state->scheduler;
+    uint32_t num_kept = 0;
+
+    for (uint32_t i = 0; i < scheduler->num_retired; i++) {
+        ah_retired_buffer_t *retired = &scheduler->retired[i];
+
+        if (retired_buffer_done(vk_state, retired)) {
+            destroy_retired(vk_state, retired);
+        } else {
+            scheduler->retired[num_kept++] = *retired;
+        }
+    }
+
+    scheduler->num_retired = num_kept;
+}
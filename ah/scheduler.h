@@ -0,0 +1,74 @@
+#pragma once
+
+#include "ah.h"
+#include "alloc.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <vulkan/vulkan_core.h>
+
+// Transfer, compute and the acquired image, with room to spare
+#define AH_SCHEDULER_MAX_WAITS 4
+#define AH_SCHEDULER_MAX_RETIRED 64
+
+typedef struct vulkan_state vulkan_state_t;
+
+typedef enum ah_queue {
+    AH_QUEUE_GRAPHICS,
+    AH_QUEUE_COMPUTE,
+    AH_QUEUE_TRANSFER,
+    AH_QUEUE_COUNT,
+} ah_queue_t;
+
+/// Timeline semaphore counting the submissions of one queue. Submission `n`
+/// signals value `n`, so `completed` tells exactly which ones are done.
+typedef struct ah_timeline {
+    VkQueue queue;
+    VkSemaphore semaphore;
+    uint64_t submitted;
+    // Last value read back from the semaphore, it only grows
+    uint64_t completed;
+} ah_timeline_t;
+
+/// A buffer, or an image and its view, destroyed once every queue passed the
+/// work submitted before it was retired
+typedef struct ah_retired_buffer {
+    uint64_t values[AH_QUEUE_COUNT];
+    VkBuffer buffer;
+    // VK_NULL_HANDLE for buffers
+    VkImage image;
+    VkImageView view;
+    ah_allocation_t allocation;
+} ah_retired_buffer_t;
+
+/// Semaphores a submission waits on, binary ones have a value of 0
+typedef struct ah_submit_waits {
+    uint32_t count;
+    VkSemaphore semaphores[AH_SCHEDULER_MAX_WAITS];
+    uint64_t values[AH_SCHEDULER_MAX_WAITS];
+    VkPipelineStageFlags stages[AH_SCHEDULER_MAX_WAITS];
+} ah_submit_waits_t;
+
+/// Orders work between the graphics, compute and transfer queues with one
+/// timeline per queue. The CPU checks progress by reading counters and only
+/// blocks when the value it needs is not reached yet.
+typedef struct ah_scheduler {
+    ah_timeline_t timelines[AH_QUEUE_COUNT];
+    // Graphics value each frame slot signaled last, its command buffers
+    // and per-slot resources are free again once it is reached
+    uint64_t frame_values[AH_MAX_FRAMES_IN_FLIGHT];
+
+    ah_retired_buffer_t retired[AH_SCHEDULER_MAX_RETIRED];
+    uint32_t num_retired;
+} ah_scheduler_t;
+
+AH_RESULT ah_scheduler_init(vulkan_state_t *vk_state);
+void ah_scheduler_destroy(vulkan_state_t *vk_state);
+bool ah_scheduler_poll(vulkan_state_t *vk_state, ah_queue_t queue, uint64_t value);
+AH_RESULT ah_scheduler_wait(vulkan_state_t *vk_state, ah_queue_t queue, uint64_t value);
+AH_RESULT ah_scheduler_wait_idle(vulkan_state_t *vk_state);
+AH_RESULT ah_scheduler_add_wait(vulkan_state_t *vk_state, ah_submit_waits_t *waits, ah_queue_t queue, uint64_t value, VkPipelineStageFlags stage);
+AH_RESULT ah_scheduler_add_binary_wait(ah_submit_waits_t *waits, VkSemaphore semaphore, VkPipelineStageFlags stage);
+AH_RESULT ah_scheduler_submit(vulkan_state_t *vk_state, ah_queue_t queue, VkCommandBuffer command_buffer, const ah_submit_waits_t *waits, VkSemaphore binary_signal, uint64_t *value);
+void ah_scheduler_retire_buffer(vulkan_state_t *vk_state, VkBuffer buffer, ah_allocation_t *allocation);
+void ah_scheduler_retire_image(vulkan_state_t *vk_state, VkImage image, VkImageView view, ah_allocation_t *allocation);
+void ah_scheduler_collect(vulkan_state_t *vk_state);
@@ -0,0 +1,280 @@
+#include "simulation.h"
+
+#include <string.h>
+#include <vulkan/vulkan_core.h>
+#include "ah.h"
+#include "errors.h"
+#include "frame.h"
+#include "hot_reload.h"
+#include "instrument.h"
+#include "pipeline_builder.h"
+#include "scheduler.h"
+#include "upload.h"
+#include "vertex.h"
+#include "vk.h"
+
+AH_RESULT create_simulation_descriptors(vulkan_state_t *vk_state) {
+    ah_simulation_t *simulation = &vk_state->simulation;
+
+    // Base instances in, simulated instances out
+    VkDescriptorSetLayoutBinding bindings[2] = {};
+    for (uint32_t i = 0; i < 2; i++) {
+        bindings[i].binding = i;
+        bindings[i].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        bindings[i].descriptorCount = 1;
+        bindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    }
+
+    VkDescriptorSetLayoutCreateInfo layout_info = {};
+    layout_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+    layout_info.bindingCount = 2;
+    layout_info.pBindings = bindings;
+
+    if (vkCreateDescriptorSetLayout(vk_state->device, &layout_info, NULL, &simulation->set_layout) != VK_SUCCESS) {
+        set_error("Error creating simulation descriptor set layout");
+        return AH_FAILURE;
+    }
+
+    VkDescriptorPoolSize pool_size = {};
+    pool_size.type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+    pool_size.descriptorCount = 2 * vk_state->frames_in_flight;
+
+    VkDescriptorPoolCreateInfo pool_info = {};
+    pool_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+    pool_info.maxSets = vk_state->frames_in_flight;
+    pool_info.poolSizeCount = 1;
+    pool_info.pPoolSizes = &pool_size;
+
+    if (vkCreateDescriptorPool(vk_state->device, &pool_info, NULL, &simulation->descriptor_pool) != VK_SUCCESS) {
+        set_error("Error creating simulation descriptor pool");
+        return AH_FAILURE;
+    }
+
+    VkDescriptorSetLayout set_layouts[AH_MAX_FRAMES_IN_FLIGHT];
+    for (uint32_t i = 0; i < vk_state->frames_in_flight; i++) {
+        set_layouts[i] = simulation->set_layout;
+    }
+
+    VkDescriptorSetAllocateInfo alloc_info = {};
+    alloc_info.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+    alloc_info.descriptorPool = simulation->descriptor_pool;
+    alloc_info.descriptorSetCount = vk_state->frames_in_flight;
+    alloc_info.pSetLayouts = set_layouts;
+
+    if (vkAllocateDescriptorSets(vk_state->device, &alloc_info, simulation->descriptor_sets) != VK_SUCCESS) {
+        set_error("Error allocating simulation descriptor sets");
+        return AH_FAILURE;
+    }
+
+    return AH_SUCCESS;
+}
+
+/// Set up the compute pipeline and command buffers. Does nothing
+/// unless `vk_state->simulate` is set.
+AH_RESULT ah_simulation_init(vulkan_state_t *vk_state) {
+    ah_simulation_t *simulation = &vk_state->simulation;
+    memset(simulation, 0, sizeof(ah_simulation_t));
+
+    if (!vk_state->simulate) {
+        return AH_SUCCESS;
+    }
+    simulation->enabled = true;
+    simulation->start_ms = ah_now_ms();
+
+    if (create_simulation_descriptors(vk_state) != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
+
+    VkPushConstantRange push_constant_range = {};
+    push_constant_range.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+    push_constant_range.offset = 0;
+    push_constant_range.size = sizeof(ah_simulation_params_t);
+
+    VkPipelineLayoutCreateInfo pipeline_layout_info = {};
+    pipeline_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    pipeline_layout_info.setLayoutCount = 1;
+    pipeline_layout_info.pSetLayouts = &simulation->set_layout;
+    pipeline_layout_info.pushConstantRangeCount = 1;
+    pipeline_layout_info.pPushConstantRanges = &push_constant_range;
+
+    if (vkCreatePipelineLayout(vk_state->device, &pipeline_layout_info, NULL, &simulation->pipeline_layout) != VK_SUCCESS) {
+        set_error("Error creating simulation pipeline layout");
+        return AH_FAILURE;
+    }
+
+    ah_compute_pipeline_desc_t desc = {};
+    desc.comp_path = "./simulate_comp.spv";
+    desc.layout = simulation->pipeline_layout;
+
+    if (ah_vk_build_compute_pipeline(vk_state->device, vk_state->pipeline_cache, &desc, &simulation->pipeline) != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
+    ah_hot_reload_track_compute(vk_state, "simulation", &desc, AH_QUEUE_COMPUTE, &simulation->pipeline);
+
+    VkCommandPoolCreateInfo pool_info = {};
+    pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+    pool_info.queueFamilyIndex = vk_state->queue_family_indices.compute_family;
+
+    if (vkCreateCommandPool(vk_state->device, &pool_info, NULL, &simulation->command_pool) != VK_SUCCESS) {
+        set_error("Error creating compute command pool");
+        return AH_FAILURE;
+    }
+
+    VkCommandBufferAllocateInfo alloc_info = {};
+    alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    alloc_info.commandPool = simulation->command_pool;
+    alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    alloc_info.commandBufferCount = vk_state->frames_in_flight;
+
+    if (vkAllocateCommandBuffers(vk_state->device, &alloc_info, simulation->command_buffers) != VK_SUCCESS) {
+        set_error("Error creating compute command buffers");
+        return AH_FAILURE;
+    }
+
+    return AH_SUCCESS;
+}
+
+/// Hand the output buffers to the scheduler, they are destroyed once the
+/// frames drawing from them are done
+void retire_simulation_buffers(vulkan_state_t *vk_state) {
+    ah_simulation_t *simulation = &vk_state->simulation;
+
+    for (uint32_t i = 0; i < AH_MAX_FRAMES_IN_FLIGHT; i++) {
+        if (simulation->instance_buffers[i] != VK_NULL_HANDLE) {
+            ah_scheduler_retire_buffer(vk_state, simulation->instance_buffers[i], &simulation->instance_allocations[i]);
+            simulation->instance_buffers[i] = VK_NULL_HANDLE;
+        }
+    }
+    simulation->num_instances = 0;
+}
+
+/// Simulate `num_instances` instances starting from `base_buffer`, which
+/// must have storage buffer usage. The previous output buffers are retired,
+/// only the descriptor sets wait for the dispatches already submitted.
+AH_RESULT ah_simulation_set_instances(vulkan_state_t *vk_state, VkBuffer base_buffer, uint32_t num_instances) {
+    ah_simulation_t *simulation = &vk_state->simulation;
+    if (!simulation->enabled) {
+        return AH_SUCCESS;
+    }
+
+    retire_simulation_buffers(vk_state);
+    if (num_instances == 0) {
+        return AH_SUCCESS;
+    }
+
+    // The sets are rewritten in place, so no dispatch may still read them
+    if (ah_scheduler_wait(vk_state, AH_QUEUE_COMPUTE, vk_state->scheduler.timelines[AH_QUEUE_COMPUTE].submitted) != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
+
+    VkDeviceSize size = sizeof(instance_t) * num_instances;
+    for (uint32_t i = 0; i < vk_state->frames_in_flight; i++) {
+        if (ah_vk_create_buffer(
+            vk_state,
+            size,
+            VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            &simulation->instance_buffers[i],
+            &simulation->instance_allocations[i])
+        != AH_SUCCESS) {
+            set_error("Failed to create simulated instance buffer");
+            return AH_FAILURE;
+        }
+
+        VkDescriptorBufferInfo buffer_infos[2] = {};
+        buffer_infos[0].buffer = base_buffer;
+        buffer_infos[0].offset = 0;
+        buffer_infos[0].range = size;
+        buffer_infos[1].buffer = simulation->instance_buffers[i];
+        buffer_infos[1].offset = 0;
+        buffer_infos[1].range = size;
+
+        VkWriteDescriptorSet write = {};
+        write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+        write.dstSet = simulation->descriptor_sets[i];
+        write.dstBinding = 0;
+        write.descriptorCount = 2;
+        write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+        write.pBufferInfo = buffer_infos;
+        vkUpdateDescriptorSets(vk_state->device, 1, &write, 0, NULL);
+    }
+
+    simulation->num_instances = num_instances;
+    return AH_SUCCESS;
+}
+
+/// Record and submit this frame's dispatch on the compute queue, after the
+/// uploads flushed so far. The wait the graphics submit needs is added to
+/// `graphics_waits`, nothing is added when there is nothing to simulate.
+AH_RESULT ah_simulation_submit(vulkan_state_t *vk_state, uint32_t frame, ah_submit_waits_t *graphics_waits) {
+    ah_simulation_t *simulation = &vk_state->simulation;
+
+    if (!simulation->enabled || simulation->num_instances == 0) {
+        return AH_SUCCESS;
+    }
+
+    AH_ZONE_BEGIN(zone, "simulate");
+    VkCommandBuffer command_buffer = simulation->command_buffers[frame];
+    vkResetCommandBuffer(command_buffer, 0);
+
+    VkCommandBufferBeginInfo begin_info = {};
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+    if (vkBeginCommandBuffer(command_buffer, &begin_info) != VK_SUCCESS) {
+        set_error("Failed to begin recording compute command buffer");
+        return AH_FAILURE;
+    }
+
+    ah_simulation_params_t params = {};
+    params.time = (float)((ah_now_ms() - simulation->start_ms) / 1000.0);
+    params.num_instances = simulation->num_instances;
+
+    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, simulation->pipeline);
+    vkCmdBindDescriptorSets(command_buffer, VK_PIPELINE_BIND_POINT_COMPUTE, simulation->pipeline_layout, 0, 1, &simulation->descriptor_sets[frame], 0, NULL);
+    vkCmdPushConstants(command_buffer, simulation->pipeline_layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, sizeof(params), &params);
+    vkCmdDispatch(command_buffer, (simulation->num_instances + AH_SIMULATION_GROUP_SIZE - 1) / AH_SIMULATION_GROUP_SIZE, 1, 1);
+
+    if (vkEndCommandBuffer(command_buffer) != VK_SUCCESS) {
+        set_error("Couldn't end compute command buffer");
+        return AH_FAILURE;
+    }
+
+    ah_submit_waits_t waits = {};
+    if (ah_upload_add_wait(vk_state, &waits) != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
+
+    uint64_t signal_value;
+    if (ah_scheduler_submit(vk_state, AH_QUEUE_COMPUTE, command_buffer, &waits, VK_NULL_HANDLE, &signal_value) != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
+    AH_ZONE_END(zone);
+
+    // Read as vertex input, or by the cull pass before any draw
+    return ah_scheduler_add_wait(vk_state, graphics_waits, AH_QUEUE_COMPUTE, signal_value, VK_PIPELINE_STAGE_VERTEX_INPUT_BIT | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+}
+
+/// Instance buffer the frame in slot `frame` should draw from
+VkBuffer ah_simulation_instance_buffer(vulkan_state_t *vk_state, VkBuffer base_buffer, uint32_t frame) {
+    ah_simulation_t *simulation = &vk_state->simulation;
+    if (!simulation->enabled || simulation->num_instances == 0) {
+        return base_buffer;
+    }
+    return simulation->instance_buffers[frame];
+}
+
+void ah_simulation_destroy(vulkan_state_t *vk_state) {
+    ah_simulation_t *simulation = &vk_state->simulation;
+    if (!simulation->enabled) {
+        return;
+    }
+
+    retire_simulation_buffers(vk_state);
+    vkDestroyCommandPool(vk_state->device, simulation->command_pool, NULL);
+    vkDestroyPipeline(vk_state->device, simulation->pipeline, NULL);
+    vkDestroyPipelineLayout(vk_state->device, simulation->pipeline_layout, NULL);
+    vkDestroyDescriptorPool(vk_state->device, simulation->descriptor_pool, NULL);
+    vkDestroyDescriptorSetLayout(vk_state->device, simulation->set_layout, NULL);
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "ah.h"
+#include "alloc.h"
+#include "scheduler.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <vulkan/vulkan_core.h>
+
+#define AH_SIMULATION_GROUP_SIZE 64
+
+typedef struct vulkan_state vulkan_state_t;
+
+typedef struct ah_simulation_params {
+    float time;
+    uint32_t num_instances;
+} ah_simulation_params_t;
+
+/// Animates the instanced scene on the compute queue. Every frame slot has
+/// its own output instance buffer, so the dispatch for the next frame runs
+/// while the graphics queue is still drawing the previous one from another
+/// buffer. The graphics submit waits on the compute timeline reaching the
+/// value the dispatch signals.
+typedef struct ah_simulation {
+    bool enabled;
+
+    VkDescriptorSetLayout set_layout;
+    VkDescriptorPool descriptor_pool;
+    VkDescriptorSet descriptor_sets[AH_MAX_FRAMES_IN_FLIGHT];
+    VkPipelineLayout pipeline_layout;
+    VkPipeline pipeline;
+
+    VkCommandPool command_pool;
+    VkCommandBuffer command_buffers[AH_MAX_FRAMES_IN_FLIGHT];
+
+    uint32_t num_instances;
+    VkBuffer instance_buffers[AH_MAX_FRAMES_IN_FLIGHT];
+    ah_allocation_t instance_allocations[AH_MAX_FRAMES_IN_FLIGHT];
+
+    double start_ms;
+} ah_simulation_t;
+
+AH_RESULT ah_simulation_init(vulkan_state_t *vk_state);
+AH_RESULT ah_simulation_set_instances(vulkan_state_t *vk_state, VkBuffer base_buffer, uint32_t num_instances);
+AH_RESULT ah_simulation_submit(vulkan_state_t *vk_state, uint32_t frame, ah_submit_waits_t *graphics_waits);
+VkBuffer ah_simulation_instance_buffer(vulkan_state_t *vk_state, VkBuffer base_buffer, uint32_t frame);
+void ah_simulation_destroy(vulkan_state_t *vk_state);
@@ -0,0 +1,369 @@
+#include "streaming.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <threads.h>
+#include <unistd.h>
+#include <vulkan/vulkan_core.h>
+#include "ah.h"
+#include "errors.h"
+#include "frame.h"
+#include "helpers.h"
+#include "instrument.h"
+#include "jobs.h"
+#include "mesh.h"
+#include "scheduler.h"
+#include "upload.h"
+#include "vk.h"
+
+/// The whole file in one heap buffer, a chunk per pread
+bool read_asset(ah_stream_asset_t *asset) {
+    int fd = open(asset->path, O_RDONLY);
+    if (fd < 0) {
+        asset->error = "Could not open file";
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        asset->error = "Could not stat file";
+        return false;
+    }
+    size_t size = (size_t)st.st_size;
+
+    buffer_t *buffer = (buffer_t*)malloc(sizeof(buffer_t) + size);
+    if (!buffer) {
+        close(fd);
+        asset->error = "Out of memory";
+        return false;
+    }
+    buffer->size = size;
+
+    // Read once front to back
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    size_t done = 0;
+    while (done < size) {
+        size_t chunk = size - done < AH_STREAM_READ_CHUNK ? size - done : AH_STREAM_READ_CHUNK;
+        ssize_t n = pread(fd, buffer->data + done, chunk, (off_t)done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += (size_t)n;
+    }
+    close(fd);
+
+    if (done < size) {
+        free(buffer);
+        asset->error = "Could not read file";
+        return false;
+    }
+
+    asset->data = buffer;
+    return true;
+}
+
+/// Runs on the job pool: check the header and compute the bounds, the
+/// streams are uploaded exactly as they are in the file
+void decode_asset(void *data, uint32_t worker) {
+    (void)worker;
+    ah_stream_asset_t *asset = (ah_stream_asset_t*)data;
+
+    AH_ZONE_BEGIN(zone, "stream decode");
+    memset(&asset->mesh, 0, sizeof(ah_mesh_t));
+    if (ah_mesh_parse(&asset->mesh, asset->data->data, asset->data->size) != AH_SUCCESS) {
+        free(asset->data);
+        asset->data = NULL;
+        asset->error = "Not a valid mesh file";
+        atomic_store_explicit(&asset->state, AH_RESIDENCY_FAILED, memory_order_release);
+    } else {
+        ah_mesh_compute_bounds(&asset->mesh);
+        atomic_store_explicit(&asset->state, AH_RESIDENCY_DECODED, memory_order_release);
+    }
+    AH_ZONE_END(zone);
+}
+
+/// Highest priority queued asset, oldest first among equals. The lock must
+/// be held.
+ah_stream_asset_t *next_request(ah_streamer_t *streamer) {
+    ah_stream_asset_t *next = NULL;
+
+    for (uint32_t i = 0; i < streamer->num_assets; i++) {
+        ah_stream_asset_t *asset = &streamer->assets[i];
+        if (atomic_load_explicit(&asset->state, memory_order_relaxed) == AH_RESIDENCY_QUEUED &&
+            (!next || asset->priority > next->priority)) {
+            next = asset;
+        }
+    }
+
+    return next;
+}
+
+int io_main(void *arg) {
+    ah_streamer_t *streamer = (ah_streamer_t*)arg;
+    ah_instrument_thread_name("stream io");
+
+    mtx_lock(&streamer->lock);
+    while (!streamer->quit) {
+        ah_stream_asset_t *asset = next_request(streamer);
+        if (!asset) {
+            cnd_wait(&streamer->has_requests, &streamer->lock);
+            continue;
+        }
+        atomic_store_explicit(&asset->state, AH_RESIDENCY_READING, memory_order_relaxed);
+        mtx_unlock(&streamer->lock);
+
+        AH_ZONE_BEGIN(zone, "stream read");
+        bool read = read_asset(asset);
+        AH_ZONE_END(zone);
+
+        if (read) {
+            atomic_store_explicit(&asset->state, AH_RESIDENCY_DECODING, memory_order_relaxed);
+            ah_jobs_push(&streamer->decoders, decode_asset, asset, &streamer->decoding);
+        } else {
+            atomic_store_explicit(&asset->state, AH_RESIDENCY_FAILED, memory_order_release);
+        }
+
+        mtx_lock(&streamer->lock);
+    }
+    mtx_unlock(&streamer->lock);
+
+    return 0;
+}
+
+/// Start the I/O threads and decoders, after the upload ring. Does
+/// nothing unless `vk_state->stream_assets` is set.
+AH_RESULT ah_stream_init(vulkan_state_t *vk_state) {
+    ah_streamer_t *streamer = &vk_state->streamer;
+    streamer->enabled = false;
+    streamer->num_threads = 0;
+    streamer->num_assets = 0;
+    streamer->quit = false;
+    streamer->decoding.pending = 0;
+
+    if (!vk_state->stream_assets) {
+        return AH_SUCCESS;
+    }
+
+    if (mtx_init(&streamer->lock, mtx_plain) != thrd_success || cnd_init(&streamer->has_requests) != thrd_success) {
+        set_error("Error creating streaming lock");
+        return AH_FAILURE;
+    }
+    streamer->enabled = true;
+
+    if (ah_jobs_init(&streamer->decoders, AH_STREAM_DECODE_THREADS) != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
+
+    for (uint32_t i = 0; i < AH_STREAM_IO_THREADS; i++) {
+        if (thrd_create(&streamer->threads[i], io_main, streamer) != thrd_success) {
+            set_error("Error starting streaming I/O thread");
+            return AH_FAILURE;
+        }
+        streamer->num_threads++;
+    }
+
+    return AH_SUCCESS;
+}
+
+/// Queue a mesh file for streaming, higher priorities are read first.
+/// Returns the handle to poll, or AH_STREAM_NONE when the table is full.
+uint32_t ah_stream_mesh(vulkan_state_t *vk_state, const char *path, int32_t priority) {
+    ah_streamer_t *streamer = &vk_state->streamer;
+    if (!streamer->enabled || streamer->num_assets == AH_STREAM_MAX_ASSETS || strlen(path) >= AH_STREAM_MAX_PATH) {
+        set_error("Can't stream asset");
+        return AH_STREAM_NONE;
+    }
+
+    mtx_lock(&streamer->lock);
+    uint32_t handle = streamer->num_assets;
+    ah_stream_asset_t *asset = &streamer->assets[handle];
+    memset(asset, 0, sizeof(ah_stream_asset_t));
+    strcpy(asset->path, path);
+    asset->priority = priority;
+    asset->requested_ms = ah_now_ms();
+    atomic_init(&asset->state, AH_RESIDENCY_QUEUED);
+    streamer->num_assets++;
+    cnd_signal(&streamer->has_requests);
+    mtx_unlock(&streamer->lock);
+
+    return handle;
+}
+
+/// Reorders reads that haven't started and uploads that haven't finished
+void ah_stream_set_priority(vulkan_state_t *vk_state, uint32_t handle, int32_t priority) {
+    ah_streamer_t *streamer = &vk_state->streamer;
+    mtx_lock(&streamer->lock);
+    streamer->assets[handle].priority = priority;
+    mtx_unlock(&streamer->lock);
+}
+
+ah_residency_t ah_stream_residency(vulkan_state_t *vk_state, uint32_t handle) {
+    return atomic_load_explicit(&vk_state->streamer.assets[handle].state, memory_order_acquire);
+}
+
+/// Decoded asset that gets the upload budget first
+ah_stream_asset_t *next_upload(ah_streamer_t *streamer, uint32_t num_assets) {
+    ah_stream_asset_t *next = NULL;
+
+    for (uint32_t i = 0; i < num_assets; i++) {
+        ah_stream_asset_t *asset = &streamer->assets[i];
+        if (atomic_load_explicit(&asset->state, memory_order_acquire) == AH_RESIDENCY_DECODED &&
+            (!next || asset->priority > next->priority)) {
+            next = asset;
+        }
+    }
+
+    return next;
+}
+
+/// Queue up to `*budget` more bytes of the asset's streams, vertices then
+/// indices. `done` tells whether all of them are queued now.
+AH_RESULT stage_asset(vulkan_state_t *vk_state, ah_stream_asset_t *asset, uint64_t *budget, bool *done) {
+    ah_mesh_t *mesh = &asset->mesh;
+    VkDeviceSize vertex_bytes = ah_mesh_vertex_bytes(mesh);
+    VkDeviceSize total = vertex_bytes + ah_mesh_index_bytes(mesh);
+
+    while (*budget > 0 && asset->staged < total) {
+        VkDeviceSize size = total - asset->staged < *budget ? total - asset->staged : *budget;
+        AH_RESULT result;
+
+        if (asset->staged < vertex_bytes) {
+            size = size < vertex_bytes - asset->staged ? size : vertex_bytes - asset->staged;
+            result = ah_upload_buffer(vk_state, mesh->vertex_buffer, asset->staged, (const uint8_t*)mesh->vertex_data + asset->staged, size);
+        } else {
+            VkDeviceSize offset = asset->staged - vertex_bytes;
+            result = ah_upload_buffer(vk_state, mesh->index_buffer, offset, (const uint8_t*)mesh->index_data + offset, size);
+        }
+        if (result != AH_SUCCESS) {
+            return AH_FAILURE;
+        }
+
+        asset->staged += size;
+        *budget -= size;
+    }
+
+    *done = asset->staged == total;
+    return AH_SUCCESS;
+}
+
+/// Once a frame before the upload flush: stage this frame's share of the
+/// decoded assets, highest priority first, and mark the ones whose copies
+/// landed as resident
+AH_RESULT ah_stream_update(vulkan_state_t *vk_state) {
+    ah_streamer_t *streamer = &vk_state->streamer;
+    if (!streamer->enabled) {
+        return AH_SUCCESS;
+    }
+
+    AH_ZONE_BEGIN(zone, "stream update");
+    // Only this thread adds assets
+    uint32_t num_assets = streamer->num_assets;
+    uint64_t budget = streamer->budget;
+
+    ah_stream_asset_t *staged[AH_STREAM_MAX_ASSETS];
+    uint32_t num_staged = 0;
+    ah_stream_asset_t *asset;
+    while (budget > 0 && (asset = next_upload(streamer, num_assets)) != NULL) {
+        if (asset->mesh.vertex_buffer == VK_NULL_HANDLE && ah_mesh_create_buffers(vk_state, &asset->mesh) != AH_SUCCESS) {
+            ah_mesh_destroy(vk_state, &asset->mesh);
+            free(asset->data);
+            asset->data = NULL;
+            asset->error = "Out of device memory";
+            atomic_store_explicit(&asset->state, AH_RESIDENCY_FAILED, memory_order_relaxed);
+            continue;
+        }
+
+        bool done;
+        if (stage_asset(vk_state, asset, &budget, &done) != AH_SUCCESS) {
+            return AH_FAILURE;
+        }
+        if (done) {
+            free(asset->data);
+            asset->data = NULL;
+            asset->mesh.vertex_data = NULL;
+            asset->mesh.index_data = NULL;
+            atomic_store_explicit(&asset->state, AH_RESIDENCY_UPLOADING, memory_order_relaxed);
+            staged[num_staged++] = asset;
+        }
+    }
+
+    // Submitted here rather than with the frame's uploads so the value the
+    // staged assets wait for is known
+    if (budget < streamer->budget && ah_upload_flush(vk_state) != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
+    for (uint32_t i = 0; i < num_staged; i++) {
+        staged[i]->value = vk_state->scheduler.timelines[AH_QUEUE_TRANSFER].submitted;
+    }
+
+    for (uint32_t i = 0; i < num_assets; i++) {
+        asset = &streamer->assets[i];
+        ah_residency_t state = atomic_load_explicit(&asset->state, memory_order_acquire);
+
+        if (state == AH_RESIDENCY_UPLOADING && ah_scheduler_poll(vk_state, AH_QUEUE_TRANSFER, asset->value)) {
+            atomic_store_explicit(&asset->state, AH_RESIDENCY_RESIDENT, memory_order_relaxed);
+            printf(
+                "Streamed %s: %.2f MiB resident after %.1f ms\n",
+                asset->path,
+                (ah_mesh_vertex_bytes(&asset->mesh) + ah_mesh_index_bytes(&asset->mesh)) / (1024.0 * 1024.0),
+                ah_now_ms() - asset->requested_ms
+            );
+        } else if (state == AH_RESIDENCY_FAILED && asset->error) {
+            printf("Streaming %s failed: %s\n", asset->path, asset->error);
+            asset->error = NULL;
+        }
+    }
+    AH_ZONE_END(zone);
+
+    return AH_SUCCESS;
+}
+
+/// Move a resident mesh out of the streamer, the caller destroys it
+void ah_stream_take_mesh(vulkan_state_t *vk_state, uint32_t handle, ah_mesh_t *mesh) {
+    ah_stream_asset_t *asset = &vk_state->streamer.assets[handle];
+    *mesh = asset->mesh;
+    memset(&asset->mesh, 0, sizeof(ah_mesh_t));
+    asset->taken = true;
+}
+
+/// After the device went idle
+void ah_stream_destroy(vulkan_state_t *vk_state) {
+    ah_streamer_t *streamer = &vk_state->streamer;
+    if (!streamer->enabled) {
+        return;
+    }
+
+    mtx_lock(&streamer->lock);
+    streamer->quit = true;
+    cnd_broadcast(&streamer->has_requests);
+    mtx_unlock(&streamer->lock);
+
+    for (uint32_t i = 0; i < streamer->num_threads; i++) {
+        thrd_join(streamer->threads[i], NULL);
+    }
+    ah_jobs_wait(&streamer->decoders, &streamer->decoding);
+    ah_jobs_destroy(&streamer->decoders);
+
+    for (uint32_t i = 0; i < streamer->num_assets; i++) {
+        ah_stream_asset_t *asset = &streamer->assets[i];
+        free(asset->data);
+        if (!asset->taken) {
+            ah_mesh_destroy(vk_state, &asset->mesh);
+        }
+    }
+
+    cnd_destroy(&streamer->has_requests);
+    mtx_destroy(&streamer->lock);
+    streamer->enabled = false;
+}
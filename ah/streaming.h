@@ -0,0 +1,92 @@
+#pragma once
+
+#include "ah.h"
+#include "helpers.h"
+#include "jobs.h"
+#include "mesh.h"
+#include "upload.h"
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <threads.h>
+#include <vulkan/vulkan_core.h>
+
+#define AH_STREAM_MAX_ASSETS 64
+#define AH_STREAM_MAX_PATH 256
+#define AH_STREAM_IO_THREADS 2
+#define AH_STREAM_DECODE_THREADS 2
+// One pread, so a read never holds more than this outside the heap buffer
+// it goes into
+#define AH_STREAM_READ_CHUNK (1024 * 1024)
+// Half the staging ring, a frame's share of uploads never waits on the
+// transfer queue to free ring space
+#define AH_STREAM_DEFAULT_BUDGET (AH_UPLOAD_STAGING_SIZE / 2)
+#define AH_STREAM_NONE UINT32_MAX
+
+typedef struct vulkan_state vulkan_state_t;
+
+typedef enum ah_residency {
+    // Waiting for an I/O thread, highest priority first
+    AH_RESIDENCY_QUEUED,
+    AH_RESIDENCY_READING,
+    // Header checked and bounds computed on the job pool
+    AH_RESIDENCY_DECODING,
+    // Waiting for upload budget, or part way through its uploads
+    AH_RESIDENCY_DECODED,
+    // Every copy submitted, on the GPU once the transfer timeline reaches
+    // `value`
+    AH_RESIDENCY_UPLOADING,
+    AH_RESIDENCY_RESIDENT,
+    AH_RESIDENCY_FAILED,
+} ah_residency_t;
+
+typedef struct ah_stream_asset {
+    char path[AH_STREAM_MAX_PATH];
+    // Guarded by the lock while queued
+    int32_t priority;
+    _Atomic ah_residency_t state;
+    const char *error;
+
+    // The whole file, read by an I/O thread and freed once staged
+    buffer_t *data;
+    ah_mesh_t mesh;
+    // Bytes of the vertex then index stream queued on the upload ring
+    VkDeviceSize staged;
+    uint64_t value;
+    // Taken by `ah_stream_take_mesh`, nothing left to free
+    bool taken;
+    double requested_ms;
+} ah_stream_asset_t;
+
+/// Loads meshes in the background so nothing but headers is read before
+/// the first frame. I/O threads pread whole files in priority order, a
+/// job pool of its own decodes them, and the render loop stages at most `budget`
+/// bytes a frame on the upload ring. Until an asset is resident the
+/// renderer keeps drawing its placeholder.
+typedef struct ah_streamer {
+    bool enabled;
+    // Bytes staged per frame, across every asset
+    uint64_t budget;
+
+    thrd_t threads[AH_STREAM_IO_THREADS];
+    uint32_t num_threads;
+    mtx_t lock;
+    cnd_t has_requests;
+    bool quit;
+
+    ah_stream_asset_t assets[AH_STREAM_MAX_ASSETS];
+    // Only grows, under the lock
+    uint32_t num_assets;
+    // Apart from the render pool, an I/O thread running queued jobs while
+    // the queue is full must never pick up a recording job
+    ah_job_pool_t decoders;
+    ah_job_counter_t decoding;
+} ah_streamer_t;
+
+AH_RESULT ah_stream_init(vulkan_state_t *vk_state);
+uint32_t ah_stream_mesh(vulkan_state_t *vk_state, const char *path, int32_t priority);
+void ah_stream_set_priority(vulkan_state_t *vk_state, uint32_t handle, int32_t priority);
+ah_residency_t ah_stream_residency(vulkan_state_t *vk_state, uint32_t handle);
+AH_RESULT ah_stream_update(vulkan_state_t *vk_state);
+void ah_stream_take_mesh(vulkan_state_t *vk_state, uint32_t handle, ah_mesh_t *mesh);
+void ah_stream_destroy(vulkan_state_t *vk_state);
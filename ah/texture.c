@@ -0,0 +1,630 @@
+#include "texture.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <vulkan/vulkan_core.h>
+#include "ah.h"
+#include "bindless.h"
+#include "errors.h"
+#include "helpers.h"
+#include "instrument.h"
+#include "profiler.h"
+#include "scheduler.h"
+#include "upload.h"
+#include "vk.h"
+
+const uint8_t ktx2_identifier[12] = {0xab, 'K', 'T', 'X', ' ', '2', '0', 0xbb, '\r', '\n', 0x1a, '\n'};
+
+ah_format_block_t make_block(uint32_t width, uint32_t height, uint32_t bytes, bool compressed) {
+    ah_format_block_t block = {};
+    block.width = width;
+    block.height = height;
+    block.bytes = bytes;
+    block.compressed = compressed;
+    return block;
+}
+
+#define ASTC_BLOCK(w, h) \
+    case VK_FORMAT_ASTC_##w##x##h##_UNORM_BLOCK: \
+    case VK_FORMAT_ASTC_##w##x##h##_SRGB_BLOCK: \
+        return make_block(w, h, 16, true);
+
+/// Formats textures can be stored in, 0 bytes for the rest
+ah_format_block_t ah_format_block(VkFormat format) {
+    switch (format) {
+    case VK_FORMAT_BC1_RGB_UNORM_BLOCK:
+    case VK_FORMAT_BC1_RGB_SRGB_BLOCK:
+    case VK_FORMAT_BC1_RGBA_UNORM_BLOCK:
+    case VK_FORMAT_BC1_RGBA_SRGB_BLOCK:
+    case VK_FORMAT_BC4_UNORM_BLOCK:
+    case VK_FORMAT_BC4_SNORM_BLOCK:
+        return make_block(4, 4, 8, true);
+    case VK_FORMAT_BC2_UNORM_BLOCK:
+    case VK_FORMAT_BC2_SRGB_BLOCK:
+    case VK_FORMAT_BC3_UNORM_BLOCK:
+    case VK_FORMAT_BC3_SRGB_BLOCK:
+    case VK_FORMAT_BC5_UNORM_BLOCK:
+    case VK_FORMAT_BC5_SNORM_BLOCK:
+    case VK_FORMAT_BC6H_UFLOAT_BLOCK:
+    case VK_FORMAT_BC6H_SFLOAT_BLOCK:
+    case VK_FORMAT_BC7_UNORM_BLOCK:
+    case VK_FORMAT_BC7_SRGB_BLOCK:
+        return make_block(4, 4, 16, true);
+    ASTC_BLOCK(4, 4)
+    ASTC_BLOCK(5, 4)
+    ASTC_BLOCK(5, 5)
+    ASTC_BLOCK(6, 5)
+    ASTC_BLOCK(6, 6)
+    ASTC_BLOCK(8, 5)
+    ASTC_BLOCK(8, 6)
+    ASTC_BLOCK(8, 8)
+    ASTC_BLOCK(10, 5)
+    ASTC_BLOCK(10, 6)
+    ASTC_BLOCK(10, 8)
+    ASTC_BLOCK(10, 10)
+    ASTC_BLOCK(12, 10)
+    ASTC_BLOCK(12, 12)
+    case VK_FORMAT_R8_UNORM:
+        return make_block(1, 1, 1, false);
+    case VK_FORMAT_R8G8_UNORM:
+        return make_block(1, 1, 2, false);
+    case VK_FORMAT_R8G8B8A8_UNORM:
+    case VK_FORMAT_R8G8B8A8_SRGB:
+    case VK_FORMAT_B8G8R8A8_UNORM:
+    case VK_FORMAT_B8G8R8A8_SRGB:
+        return make_block(1, 1, 4, false);
+    case VK_FORMAT_R16G16B16A16_SFLOAT:
+        return make_block(1, 1, 8, false);
+    case VK_FORMAT_R32G32B32A32_SFLOAT:
+        return make_block(1, 1, 16, false);
+    default:
+        return make_block(1, 1, 0, false);
+    }
+}
+
+uint64_t level_size(ah_format_block_t block, uint32_t width, uint32_t height) {
+    uint64_t blocks_x = (width + block.width - 1) / block.width;
+    uint64_t blocks_y = (height + block.height - 1) / block.height;
+    return blocks_x * blocks_y * block.bytes;
+}
+
+bool format_has_features(vulkan_state_t *vk_state, VkFormat format, VkFormatFeatureFlags features) {
+    VkFormatProperties properties;
+    vkGetPhysicalDeviceFormatProperties(vk_state->physical_device, format, &properties);
+    return (properties.optimalTilingFeatures & features) == features;
+}
+
+/// Check the header and level index of the mapped file and lay out the
+/// chain. Missing levels are generated when the format can be blitted,
+/// compressed formats never can, so those keep the levels the file has.
+AH_RESULT parse_ktx2(vulkan_state_t *vk_state, ah_texture_t *texture) {
+    const mapped_file_t *file = &texture->file;
+    ah_ktx2_header_t header;
+    if (file->size < sizeof(header)) {
+        set_error("Texture file too small");
+        return AH_FAILURE;
+    }
+    memcpy(&header, file->data, sizeof(header));
+
+    if (memcmp(header.identifier, ktx2_identifier, sizeof(ktx2_identifier)) != 0) {
+        set_error("Not a KTX2 file");
+        return AH_FAILURE;
+    }
+    // Inflating supercompressed levels would cost CPU time on every rebuild
+    if (header.supercompression_scheme != 0) {
+        set_error("Supercompressed KTX2 files are not supported");
+        return AH_FAILURE;
+    }
+    if (header.pixel_width == 0 || header.pixel_height == 0 || header.pixel_depth > 1 ||
+        header.layer_count > 1 || header.face_count != 1) {
+        set_error("Only 2D KTX2 textures are supported");
+        return AH_FAILURE;
+    }
+
+    texture->format = (VkFormat)header.vk_format;
+    texture->block = ah_format_block(texture->format);
+    if (texture->block.bytes == 0 ||
+        !format_has_features(vk_state, texture->format, VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT | VK_FORMAT_FEATURE_SAMPLED_IMAGE_FILTER_LINEAR_BIT | VK_FORMAT_FEATURE_TRANSFER_DST_BIT)) {
+        set_error("Texture format not supported by the device");
+        return AH_FAILURE;
+    }
+
+    uint32_t full_chain = 1;
+    uint32_t largest = header.pixel_width > header.pixel_height ? header.pixel_width : header.pixel_height;
+    while (full_chain < 32 && largest >> full_chain) {
+        full_chain++;
+    }
+
+    uint32_t num_file_levels = header.level_count > 0 ? header.level_count : 1;
+    if (full_chain > AH_TEXTURE_MAX_LEVELS || num_file_levels > full_chain ||
+        sizeof(header) + num_file_levels * sizeof(ah_ktx2_level_t) > file->size) {
+        set_error("Corrupt KTX2 file");
+        return AH_FAILURE;
+    }
+
+    for (uint32_t i = 0; i < full_chain; i++) {
+        ah_texture_level_t *level = &texture->levels[i];
+        level->width = header.pixel_width >> i > 0 ? header.pixel_width >> i : 1;
+        level->height = header.pixel_height >> i > 0 ? header.pixel_height >> i : 1;
+        level->offset = 0;
+        level->size = level_size(texture->block, level->width, level->height);
+    }
+
+    for (uint32_t i = 0; i < num_file_levels; i++) {
+        ah_ktx2_level_t entry;
+        memcpy(&entry, file->data + sizeof(header) + i * sizeof(ah_ktx2_level_t), sizeof(entry));
+
+        ah_texture_level_t *level = &texture->levels[i];
+        if (entry.byte_length != level->size || entry.byte_offset > file->size || entry.byte_length > file->size - entry.byte_offset) {
+            set_error("Corrupt KTX2 file");
+            return AH_FAILURE;
+        }
+        level->offset = entry.byte_offset;
+    }
+
+    texture->num_file_levels = num_file_levels;
+    texture->num_levels = num_file_levels;
+    if (num_file_levels < full_chain &&
+        format_has_features(vk_state, texture->format, VK_FORMAT_FEATURE_BLIT_SRC_BIT | VK_FORMAT_FEATURE_BLIT_DST_BIT)) {
+        texture->num_levels = full_chain;
+    }
+
+    return AH_SUCCESS;
+}
+
+AH_RESULT ah_textures_init(vulkan_state_t *vk_state) {
+    ah_textures_t *textures = &vk_state->textures;
+    textures->bytes_resident = 0;
+    textures->num_textures = 0;
+    textures->pending = AH_TEXTURE_NONE;
+    return AH_SUCCESS;
+}
+
+/// Map a KTX2 file and check it, nothing is uploaded until the next
+/// `ah_textures_update`. The texture of `material` is pointed at every
+/// image the texture gets, pass AH_BINDLESS_NONE to use `handle` directly.
+uint32_t ah_texture_load(vulkan_state_t *vk_state, const char *path, uint32_t material) {
+    ah_textures_t *textures = &vk_state->textures;
+    if (textures->num_textures == AH_TEXTURE_MAX || strlen(path) >= AH_TEXTURE_MAX_PATH) {
+        set_error("Can't load texture");
+        return AH_TEXTURE_NONE;
+    }
+
+    ah_texture_t *texture = &textures->textures[textures->num_textures];
+    memset(texture, 0, sizeof(ah_texture_t));
+    strcpy(texture->path, path);
+
+    if (!map_file(path, &texture->file)) {
+        set_error("Could not open texture file");
+        return AH_TEXTURE_NONE;
+    }
+    if (parse_ktx2(vk_state, texture) != AH_SUCCESS) {
+        unmap_file(&texture->file);
+        return AH_TEXTURE_NONE;
+    }
+
+    texture->material = material;
+    texture->state = AH_TEXTURE_IDLE;
+    texture->resident.image = VK_NULL_HANDLE;
+    texture->pending.image = VK_NULL_HANDLE;
+    // Past the end of the chain while nothing is resident
+    texture->resident.first_level = texture->num_levels;
+    texture->handle = AH_BINDLESS_NONE;
+    // Only the smallest file level until more is asked for
+    texture->wanted_level = texture->num_file_levels - 1;
+
+    return textures->num_textures++;
+}
+
+/// Grow or shrink the texture so `level` is its largest one. The smallest
+/// file level always stays resident.
+void ah_texture_request(vulkan_state_t *vk_state, uint32_t handle, uint32_t level) {
+    ah_texture_t *texture = &vk_state->textures.textures[handle];
+    texture->wanted_level = level < texture->num_file_levels ? level : texture->num_file_levels - 1;
+}
+
+/// Largest level worth having for a texture covering at most `extent`
+/// pixels, a larger one would only be minified away
+uint32_t ah_texture_level_for_extent(vulkan_state_t *vk_state, uint32_t handle, VkExtent2D extent) {
+    ah_texture_t *texture = &vk_state->textures.textures[handle];
+    uint32_t level = 0;
+
+    while (level + 1 < texture->num_levels &&
+           (texture->levels[level].width > extent.width || texture->levels[level].height > extent.height)) {
+        level++;
+    }
+
+    return level;
+}
+
+/// Chain level the texture's image should start at after its next
+/// rebuild, the current one when it stays as it is
+uint32_t next_first_level(const ah_texture_t *texture) {
+    if (texture->resident.image == VK_NULL_HANDLE) {
+        return texture->num_file_levels - 1;
+    }
+    if (texture->wanted_level < texture->resident.first_level) {
+        return texture->resident.first_level - 1;
+    }
+    return texture->wanted_level;
+}
+
+/// Estimate from the level sizes, the allocation adds alignment on top
+uint64_t chain_bytes(const ah_texture_t *texture, uint32_t first_level) {
+    uint64_t bytes = 0;
+    for (uint32_t i = first_level; i < texture->num_levels; i++) {
+        bytes += texture->levels[i].size;
+    }
+    return bytes;
+}
+
+/// Shrinks first since they free memory, then the first growth that fits
+/// in the budget next to what is resident. A texture that doesn't fit
+/// waits for others to shrink.
+uint32_t pick_texture(ah_textures_t *textures) {
+    for (uint32_t i = 0; i < textures->num_textures; i++) {
+        ah_texture_t *texture = &textures->textures[i];
+        if (!texture->failed && texture->resident.image != VK_NULL_HANDLE &&
+            texture->wanted_level > texture->resident.first_level) {
+            return i;
+        }
+    }
+
+    for (uint32_t i = 0; i < textures->num_textures; i++) {
+        ah_texture_t *texture = &textures->textures[i];
+        uint32_t first_level = next_first_level(texture);
+        if (!texture->failed && first_level != texture->resident.first_level &&
+            textures->bytes_resident + chain_bytes(texture, first_level) <= textures->budget) {
+            return i;
+        }
+    }
+
+    return AH_TEXTURE_NONE;
+}
+
+/// Image and view for the chain from `first_level` down. Shared with the
+/// transfer family so the upload ring can fill it without ownership
+/// transfers, the same as buffers.
+AH_RESULT create_texture_image(vulkan_state_t *vk_state, ah_texture_t *texture, uint32_t first_level, ah_texture_image_t *image) {
+    uint32_t num_levels = texture->num_levels - first_level;
+
+    VkImageCreateInfo image_info = {};
+    image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+    image_info.imageType = VK_IMAGE_TYPE_2D;
+    image_info.format = texture->format;
+    image_info.extent.width = texture->levels[first_level].width;
+    image_info.extent.height = texture->levels[first_level].height;
+    image_info.extent.depth = 1;
+    image_info.mipLevels = num_levels;
+    image_info.arrayLayers = 1;
+    image_info.samples = VK_SAMPLE_COUNT_1_BIT;
+    image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+    image_info.usage = VK_IMAGE_USAGE_SAMPLED_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+    image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+    image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+    // Generated levels are blitted from the level before them
+    if (texture->num_levels > texture->num_file_levels) {
+        image_info.usage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+    }
+
+    uint32_t queue_family_indices[2] = {
+        vk_state->queue_family_indices.graphics_family,
+        vk_state->queue_family_indices.transfer_family,
+    };
+    if (queue_family_indices[0] != queue_family_indices[1]) {
+        image_info.sharingMode = VK_SHARING_MODE_CONCURRENT;
+        image_info.queueFamilyIndexCount = 2;
+        image_info.pQueueFamilyIndices = queue_family_indices;
+    }
+
+    if (ah_vk_create_image(vk_state, &image_info, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, &image->image, &image->allocation) != AH_SUCCESS) {
+        image->image = VK_NULL_HANDLE;
+        return AH_FAILURE;
+    }
+
+    VkImageViewCreateInfo view_info = {};
+    view_info.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
+    view_info.image = image->image;
+    view_info.viewType = VK_IMAGE_VIEW_TYPE_2D;
+    view_info.format = texture->format;
+    view_info.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    view_info.subresourceRange.baseMipLevel = 0;
+    view_info.subresourceRange.levelCount = num_levels;
+    view_info.subresourceRange.baseArrayLayer = 0;
+    view_info.subresourceRange.layerCount = 1;
+
+    if (vkCreateImageView(vk_state->device, &view_info, NULL, &image->view) != VK_SUCCESS) {
+        ah_vk_destroy_image(vk_state, image->image, &image->allocation);
+        image->image = VK_NULL_HANDLE;
+        set_error("Failed to create texture image view");
+        return AH_FAILURE;
+    }
+
+    image->first_level = first_level;
+    return AH_SUCCESS;
+}
+
+/// Queue up to `*budget` more bytes of the pending image's file levels. A
+/// level larger than the whole budget goes alone in its frame.
+AH_RESULT stage_texture(vulkan_state_t *vk_state, ah_texture_t *texture, uint64_t *budget) {
+    uint64_t upload_budget = vk_state->textures.upload_budget;
+
+    while (texture->next_level < texture->num_file_levels) {
+        ah_texture_level_t *level = &texture->levels[texture->next_level];
+        if (level->size > *budget && *budget < upload_budget) {
+            break;
+        }
+
+        VkExtent2D extent = {level->width, level->height};
+        if (ah_upload_image(
+            vk_state,
+            texture->pending.image,
+            VK_IMAGE_ASPECT_COLOR_BIT,
+            texture->next_level - texture->pending.first_level,
+            extent,
+            texture->block.height,
+            texture->file.data + level->offset,
+            level->size)
+        != AH_SUCCESS) {
+            return AH_FAILURE;
+        }
+        release_file_range(&texture->file, (size_t)level->offset, (size_t)level->size);
+
+        *budget = level->size < *budget ? *budget - level->size : 0;
+        texture->next_level++;
+    }
+
+    if (texture->next_level == texture->num_file_levels) {
+        texture->state = AH_TEXTURE_STAGED;
+    }
+    return AH_SUCCESS;
+}
+
+/// The pending image is complete, give it a bindless slot. Without update
+/// after bind the slot reaches each set as its frame slot comes up, the
+/// material keeps the resident image until then.
+void register_pending(vulkan_state_t *vk_state, ah_texture_t *texture) {
+    ah_textures_t *textures = &vk_state->textures;
+
+    uint32_t handle = ah_bindless_add_image(vk_state, texture->pending.view, VK_NULL_HANDLE);
+    if (handle == AH_BINDLESS_NONE) {
+        print_error("textures/register");
+        // Nothing sampled it, the frame that finished it is done
+        textures->bytes_resident -= texture->pending.allocation.size;
+        vkDestroyImageView(vk_state->device, texture->pending.view, NULL);
+        ah_vk_destroy_image(vk_state, texture->pending.image, &texture->pending.allocation);
+        texture->pending.image = VK_NULL_HANDLE;
+        texture->failed = true;
+        texture->state = AH_TEXTURE_IDLE;
+        return;
+    }
+
+    texture->pending_handle = handle;
+    texture->state = AH_TEXTURE_REGISTERED;
+}
+
+/// Every set has the pending image, point the material at it and retire
+/// the resident one after the frames that may still read it
+void swap_in(vulkan_state_t *vk_state, ah_texture_t *texture) {
+    ah_textures_t *textures = &vk_state->textures;
+    texture->state = AH_TEXTURE_IDLE;
+
+    if (texture->resident.image != VK_NULL_HANDLE) {
+        textures->bytes_resident -= texture->resident.allocation.size;
+        ah_bindless_remove_image(vk_state, texture->handle);
+        ah_scheduler_retire_image(vk_state, texture->resident.image, texture->resident.view, &texture->resident.allocation);
+    }
+    texture->resident = texture->pending;
+    texture->pending.image = VK_NULL_HANDLE;
+    texture->handle = texture->pending_handle;
+
+    // Frames in flight read either image, both stay valid until they are
+    // done
+    if (texture->material != AH_BINDLESS_NONE) {
+        ah_material_t material = vk_state->bindless.material_data[texture->material];
+        material.texture = texture->handle;
+        ah_bindless_update_material(vk_state, texture->material, &material);
+    }
+
+    const ah_texture_level_t *level = &texture->levels[texture->resident.first_level];
+    printf(
+        "Texture %s: %ux%u resident, %.2f of %.2f MiB used by textures\n",
+        texture->path,
+        level->width,
+        level->height,
+        textures->bytes_resident / (1024.0 * 1024.0),
+        textures->budget / (1024.0 * 1024.0)
+    );
+}
+
+/// Once a frame before the upload flush: start rebuilding the next texture
+/// that needs it, stage this frame's share of its levels and swap in the
+/// one whose frame finished
+AH_RESULT ah_textures_update(vulkan_state_t *vk_state) {
+    ah_textures_t *textures = &vk_state->textures;
+    AH_ZONE_BEGIN(zone, "texture update");
+
+    if (textures->pending == AH_TEXTURE_NONE) {
+        textures->pending = pick_texture(textures);
+
+        if (textures->pending != AH_TEXTURE_NONE) {
+            ah_texture_t *texture = &textures->textures[textures->pending];
+            uint32_t first_level = next_first_level(texture);
+
+            if (create_texture_image(vk_state, texture, first_level, &texture->pending) != AH_SUCCESS) {
+                print_error("textures/create_image");
+                texture->failed = true;
+                textures->pending = AH_TEXTURE_NONE;
+            } else {
+                textures->bytes_resident += texture->pending.allocation.size;
+                texture->next_level = first_level;
+                texture->state = AH_TEXTURE_STAGING;
+            }
+        }
+    }
+
+    if (textures->pending != AH_TEXTURE_NONE) {
+        ah_texture_t *texture = &textures->textures[textures->pending];
+        uint64_t budget = textures->upload_budget;
+
+        if (texture->state == AH_TEXTURE_STAGING && stage_texture(vk_state, texture, &budget) != AH_SUCCESS) {
+            return AH_FAILURE;
+        }
+
+        if (texture->state == AH_TEXTURE_SUBMITTED && ah_scheduler_poll(vk_state, AH_QUEUE_GRAPHICS, texture->value)) {
+            register_pending(vk_state, texture);
+        }
+        if (texture->state == AH_TEXTURE_REGISTERED && ah_bindless_image_written(vk_state, texture->pending_handle)) {
+            swap_in(vk_state, texture);
+        }
+        if (texture->state == AH_TEXTURE_IDLE) {
+            textures->pending = AH_TEXTURE_NONE;
+        }
+    }
+    AH_ZONE_END(zone);
+
+    return AH_SUCCESS;
+}
+
+VkImageMemoryBarrier2 mip_barrier(VkImage image, uint32_t base_level, uint32_t num_levels, VkImageLayout old_layout, VkImageLayout new_layout) {
+    VkImageMemoryBarrier2 barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2;
+    barrier.oldLayout = old_layout;
+    barrier.newLayout = new_layout;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = image;
+    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+    barrier.subresourceRange.baseMipLevel = base_level;
+    barrier.subresourceRange.levelCount = num_levels;
+    barrier.subresourceRange.baseArrayLayer = 0;
+    barrier.subresourceRange.layerCount = 1;
+    return barrier;
+}
+
+void pipeline_barrier(VkCommandBuffer command_buffer, const VkImageMemoryBarrier2 *barriers, uint32_t count) {
+    VkDependencyInfo dependency = {};
+    dependency.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
+    dependency.imageMemoryBarrierCount = count;
+    dependency.pImageMemoryBarriers = barriers;
+    vkCmdPipelineBarrier2(command_buffer, &dependency);
+}
+
+/// Ahead of the render graph: blit the levels the file lacks from the
+/// smallest one it has, in the frame that waits for its copies. The
+/// material only switches over once this frame is done.
+void ah_textures_record(vulkan_state_t *vk_state, VkCommandBuffer command_buffer) {
+    ah_textures_t *textures = &vk_state->textures;
+    if (textures->pending == AH_TEXTURE_NONE) {
+        return;
+    }
+
+    ah_texture_t *texture = &textures->textures[textures->pending];
+    if (texture->state != AH_TEXTURE_STAGED || texture->num_levels == texture->num_file_levels) {
+        return;
+    }
+
+    ah_texture_image_t *image = &texture->pending;
+    // Image levels, not chain levels
+    uint32_t source = texture->num_file_levels - 1 - image->first_level;
+    uint32_t num_levels = texture->num_levels - image->first_level;
+    uint32_t scope = ah_profiler_begin(vk_state, command_buffer, "mip generation");
+
+    // Chains onto the wait for the transfer timeline, which covers the
+    // copies and their layout transitions
+    VkImageMemoryBarrier2 barriers[2];
+    barriers[0] = mip_barrier(image->image, source, 1, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+    barriers[0].srcStageMask = VK_PIPELINE_STAGE_2_BLIT_BIT;
+    barriers[0].dstStageMask = VK_PIPELINE_STAGE_2_BLIT_BIT;
+    barriers[0].dstAccessMask = VK_ACCESS_2_TRANSFER_READ_BIT;
+    barriers[1] = mip_barrier(image->image, source + 1, num_levels - source - 1, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+    barriers[1].srcStageMask = VK_PIPELINE_STAGE_2_BLIT_BIT;
+    barriers[1].dstStageMask = VK_PIPELINE_STAGE_2_BLIT_BIT;
+    barriers[1].dstAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+    pipeline_barrier(command_buffer, barriers, 2);
+
+    for (uint32_t level = source + 1; level < num_levels; level++) {
+        const ah_texture_level_t *src = &texture->levels[image->first_level + level - 1];
+        const ah_texture_level_t *dst = &texture->levels[image->first_level + level];
+
+        VkImageBlit blit = {};
+        blit.srcSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        blit.srcSubresource.mipLevel = level - 1;
+        blit.srcSubresource.layerCount = 1;
+        blit.srcOffsets[1].x = (int32_t)src->width;
+        blit.srcOffsets[1].y = (int32_t)src->height;
+        blit.srcOffsets[1].z = 1;
+        blit.dstSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+        blit.dstSubresource.mipLevel = level;
+        blit.dstSubresource.layerCount = 1;
+        blit.dstOffsets[1].x = (int32_t)dst->width;
+        blit.dstOffsets[1].y = (int32_t)dst->height;
+        blit.dstOffsets[1].z = 1;
+
+        vkCmdBlitImage(
+            command_buffer,
+            image->image,
+            VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+            image->image,
+            VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
+            1,
+            &blit,
+            VK_FILTER_LINEAR
+        );
+
+        // The next blit reads this level
+        barriers[0] = mip_barrier(image->image, level, 1, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL);
+        barriers[0].srcStageMask = VK_PIPELINE_STAGE_2_BLIT_BIT;
+        barriers[0].srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+        barriers[0].dstStageMask = VK_PIPELINE_STAGE_2_BLIT_BIT;
+        barriers[0].dstAccessMask = VK_ACCESS_2_TRANSFER_READ_BIT;
+        pipeline_barrier(command_buffer, barriers, 1);
+    }
+
+    barriers[0] = mip_barrier(image->image, source, num_levels - source, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+    barriers[0].srcStageMask = VK_PIPELINE_STAGE_2_BLIT_BIT;
+    barriers[0].dstStageMask = VK_PIPELINE_STAGE_2_FRAGMENT_SHADER_BIT;
+    barriers[0].dstAccessMask = VK_ACCESS_2_SHADER_SAMPLED_READ_BIT;
+    pipeline_barrier(command_buffer, barriers, 1);
+
+    ah_profiler_end(vk_state, command_buffer, scope);
+}
+
+/// After the frame in `frame` was submitted, a texture staged for it is
+/// complete once that frame is
+void ah_textures_frame_submitted(vulkan_state_t *vk_state, uint32_t frame) {
+    ah_textures_t *textures = &vk_state->textures;
+    if (textures->pending == AH_TEXTURE_NONE) {
+        return;
+    }
+
+    ah_texture_t *texture = &textures->textures[textures->pending];
+    if (texture->state == AH_TEXTURE_STAGED) {
+        texture->value = vk_state->scheduler.frame_values[frame];
+        texture->state = AH_TEXTURE_SUBMITTED;
+    }
+}
+
+/// The device must be idle
+void ah_textures_destroy(vulkan_state_t *vk_state) {
+    ah_textures_t *textures = &vk_state->textures;
+
+    for (uint32_t i = 0; i < textures->num_textures; i++) {
+        ah_texture_t *texture = &textures->textures[i];
+        if (texture->resident.image != VK_NULL_HANDLE) {
+            vkDestroyImageView(vk_state->device, texture->resident.view, NULL);
+            ah_vk_destroy_image(vk_state, texture->resident.image, &texture->resident.allocation);
+        }
+        if (texture->pending.image != VK_NULL_HANDLE) {
+            vkDestroyImageView(vk_state->device, texture->pending.view, NULL);
+            ah_vk_destroy_image(vk_state, texture->pending.image, &texture->pending.allocation);
+        }
+        unmap_file(&texture->file);
+    }
+
+    textures->num_textures = 0;
+    textures->pending = AH_TEXTURE_NONE;
+}
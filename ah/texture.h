@@ -0,0 +1,149 @@
+#pragma once
+
+#include "ah.h"
+#include "alloc.h"
+#include "helpers.h"
+#include "upload.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <vulkan/vulkan_core.h>
+
+#define AH_TEXTURE_MAX 64
+#define AH_TEXTURE_MAX_PATH 256
+// A full chain of a 32768 texel texture
+#define AH_TEXTURE_MAX_LEVELS 16
+#define AH_TEXTURE_DEFAULT_BUDGET (256 * 1024 * 1024)
+// A quarter of the staging ring a frame, mesh streaming takes half
+#define AH_TEXTURE_DEFAULT_UPLOAD_BUDGET (AH_UPLOAD_STAGING_SIZE / 4)
+#define AH_TEXTURE_NONE UINT32_MAX
+
+typedef struct vulkan_state vulkan_state_t;
+
+/// Fixed part of a KTX2 file, followed by one ah_ktx2_level_t per level,
+/// base level first. Only what the renderer reads is checked, the data
+/// format descriptor and key/value data are skipped.
+typedef struct ah_ktx2_header {
+    uint8_t identifier[12];
+    uint32_t vk_format;
+    uint32_t type_size;
+    uint32_t pixel_width;
+    uint32_t pixel_height;
+    uint32_t pixel_depth;
+    uint32_t layer_count;
+    uint32_t face_count;
+    // 0 asks the loader to generate the chain
+    uint32_t level_count;
+    uint32_t supercompression_scheme;
+    uint32_t dfd_byte_offset;
+    uint32_t dfd_byte_length;
+    uint32_t kvd_byte_offset;
+    uint32_t kvd_byte_length;
+    uint64_t sgd_byte_offset;
+    uint64_t sgd_byte_length;
+} ah_ktx2_header_t;
+
+typedef struct ah_ktx2_level {
+    uint64_t byte_offset;
+    uint64_t byte_length;
+    uint64_t uncompressed_byte_length;
+} ah_ktx2_level_t;
+
+/// Texel block of a format, 1x1 for uncompressed ones
+typedef struct ah_format_block {
+    uint32_t width;
+    uint32_t height;
+    uint32_t bytes;
+    bool compressed;
+} ah_format_block_t;
+
+typedef struct ah_texture_level {
+    uint32_t width;
+    uint32_t height;
+    // Where the level is in the file, generated levels have no offset
+    uint64_t offset;
+    uint64_t size;
+} ah_texture_level_t;
+
+/// An image holding the chain from `first_level` down to the smallest
+/// level, its level 0 is chain level `first_level`
+typedef struct ah_texture_image {
+    VkImage image;
+    ah_allocation_t allocation;
+    VkImageView view;
+    uint32_t first_level;
+} ah_texture_image_t;
+
+typedef enum ah_texture_state {
+    // Nothing pending, `resident` is what materials sample
+    AH_TEXTURE_IDLE,
+    // The file levels of `pending` are being queued on the upload ring
+    AH_TEXTURE_STAGING,
+    // Every copy is queued, the frame being recorded waits for them and
+    // blits the generated levels
+    AH_TEXTURE_STAGED,
+    // Registered once the graphics timeline reaches `value`
+    AH_TEXTURE_SUBMITTED,
+    // Registered as `pending_handle`, swapped in for `resident` once every
+    // bindless set has it
+    AH_TEXTURE_REGISTERED,
+} ah_texture_state_t;
+
+typedef struct ah_texture {
+    char path[AH_TEXTURE_MAX_PATH];
+    // Mapped for the texture's lifetime, levels are read again whenever
+    // the image is rebuilt and their pages dropped once staged
+    mapped_file_t file;
+    VkFormat format;
+    ah_format_block_t block;
+    ah_texture_level_t levels[AH_TEXTURE_MAX_LEVELS];
+    uint32_t num_levels;
+    // Levels at or past this one are blitted from the one before
+    uint32_t num_file_levels;
+    // Material whose texture is pointed at the resident image
+    uint32_t material;
+
+    ah_texture_state_t state;
+    ah_texture_image_t resident;
+    // Bindless handle of `resident`
+    uint32_t handle;
+    ah_texture_image_t pending;
+    // Bindless handle of `pending` once registered
+    uint32_t pending_handle;
+    // Next file level of `pending` to stage
+    uint32_t next_level;
+    uint64_t value;
+    // Largest level asked for, the chain only grows up to it
+    uint32_t wanted_level;
+    // An image couldn't be created or registered, left as it is
+    bool failed;
+} ah_texture_t;
+
+/// Block compressed textures from KTX2 files, sampled as they are stored.
+/// Each texture becomes resident smallest level first and grows one level
+/// at a time towards the level it is asked for, while every texture image
+/// together stays within `budget` bytes of device memory. A texture is
+/// rebuilt into a new image sized for its resident levels, so levels that
+/// aren't wanted take no memory, and materials switch over once the new
+/// image is complete.
+typedef struct ah_textures {
+    // Device memory held by texture images, resident and pending
+    uint64_t budget;
+    uint64_t bytes_resident;
+    // Bytes staged per frame
+    uint64_t upload_budget;
+
+    ah_texture_t textures[AH_TEXTURE_MAX];
+    uint32_t num_textures;
+    // The one texture being rebuilt, or none
+    uint32_t pending;
+} ah_textures_t;
+
+ah_format_block_t ah_format_block(VkFormat format);
+AH_RESULT ah_textures_init(vulkan_state_t *vk_state);
+uint32_t ah_texture_load(vulkan_state_t *vk_state, const char *path, uint32_t material);
+void ah_texture_request(vulkan_state_t *vk_state, uint32_t handle, uint32_t level);
+uint32_t ah_texture_level_for_extent(vulkan_state_t *vk_state, uint32_t handle, VkExtent2D extent);
+AH_RESULT ah_textures_update(vulkan_state_t *vk_state);
+void ah_textures_record(vulkan_state_t *vk_state, VkCommandBuffer command_buffer);
+void ah_textures_frame_submitted(vulkan_state_t *vk_state, uint32_t frame);
+void ah_textures_destroy(vulkan_state_t *vk_state);
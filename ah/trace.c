@@ -0,0 +1,87 @@
+#include "trace.h"
+
+#include <stdio.h>
+#include "ah.h"
+#include "errors.h"
+
+AH_RESULT ah_trace_open(ah_trace_t *trace, const char *path) {
+    trace->fp = fopen(path, "w");
+    trace->has_events = false;
+
+    if (!trace->fp) {
+        set_error("Could not open trace file");
+        return AH_FAILURE;
+    }
+
+    fprintf(trace->fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    return AH_SUCCESS;
+}
+
+void ah_trace_close(ah_trace_t *trace) {
+    if (!trace->fp) {
+        return;
+    }
+
+    fprintf(trace->fp, "\n]}\n");
+    fclose(trace->fp);
+    trace->fp = NULL;
+}
+
+bool ah_trace_is_open(const ah_trace_t *trace) {
+    return trace->fp != NULL;
+}
+
+void begin_event(ah_trace_t *trace) {
+    if (trace->has_events) {
+        fprintf(trace->fp, ",\n");
+    }
+    trace->has_events = true;
+}
+
+void ah_trace_thread_name(ah_trace_t *trace, uint32_t tid, const char *name) {
+    if (!trace->fp) {
+        return;
+    }
+
+    begin_event(trace);
+    fprintf(
+        trace->fp,
+        "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"%s\"}}",
+        tid,
+        name
+    );
+}
+
+/// A span that is already over. `name` and `category` are written as is and
+/// must not need JSON escaping.
+void ah_trace_complete(ah_trace_t *trace, const char *name, const char *category, uint32_t tid, double start_us, double duration_us) {
+    if (!trace->fp) {
+        return;
+    }
+
+    begin_event(trace);
+    fprintf(
+        trace->fp,
+        "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+        name,
+        category,
+        tid,
+        start_us,
+        duration_us
+    );
+}
+
+void ah_trace_counter(ah_trace_t *trace, const char *name, double time_us, double value) {
+    if (!trace->fp) {
+        return;
+    }
+
+    begin_event(trace);
+    fprintf(
+        trace->fp,
+        "{\"name\":\"%s\",\"ph\":\"C\",\"pid\":1,\"ts\":%.3f,\"args\":{\"value\":%.0f}}",
+        name,
+        time_us,
+        value
+    );
+}
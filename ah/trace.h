@@ -0,0 +1,24 @@
+#pragma once
+
+#include "ah.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+// Thread id the GPU timeline is shown under
+#define AH_TRACE_GPU_TID 1000
+
+/// Writer for the Chrome trace event format, open the file in
+/// chrome://tracing or Perfetto. Timestamps are microseconds on the
+/// `ah_now_ms` clock.
+typedef struct ah_trace {
+    FILE *fp;
+    bool has_events;
+} ah_trace_t;
+
+AH_RESULT ah_trace_open(ah_trace_t *trace, const char *path);
+void ah_trace_close(ah_trace_t *trace);
+bool ah_trace_is_open(const ah_trace_t *trace);
+void ah_trace_thread_name(ah_trace_t *trace, uint32_t tid, const char *name);
+void ah_trace_complete(ah_trace_t *trace, const char *name, const char *category, uint32_t tid, double start_us, double duration_us);
+void ah_trace_counter(ah_trace_t *trace, const char *name, double time_us, double value);
@@ -0,0 +1,406 @@
+#include "upload.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vulkan/vulkan_core.h>
+#include "ah.h"
+#include "errors.h"
+#include "helpers.h"
+#include "instrument.h"
+#include "scheduler.h"
+#include "vk.h"
+
+AH_RESULT ah_upload_init(vulkan_state_t *vk_state) {
+    ah_uploader_t *uploader = &vk_state->uploader;
+    memset(uploader, 0, sizeof(ah_uploader_t));
+
+    VkCommandPoolCreateInfo pool_info = {};
+    pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+    pool_info.flags = VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT | VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+    pool_info.queueFamilyIndex = vk_state->queue_family_indices.transfer_family;
+
+    if (vkCreateCommandPool(vk_state->device, &pool_info, NULL, &uploader->command_pool) != VK_SUCCESS) {
+        set_error("Error creating upload command pool");
+        return AH_FAILURE;
+    }
+
+    if (ah_vk_create_buffer(
+        vk_state,
+        AH_UPLOAD_STAGING_SIZE,
+        VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+        &uploader->staging_buffer,
+        &uploader->staging_allocation)
+    != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
+
+    // Host visible memory stays mapped for the lifetime of the allocator
+    uploader->staging_data = (uint8_t*)uploader->staging_allocation.mapped;
+
+    uint32_t num_families = 0;
+    vkGetPhysicalDeviceQueueFamilyProperties(vk_state->physical_device, &num_families, NULL);
+    VkQueueFamilyProperties *families = (VkQueueFamilyProperties*)malloc(sizeof(VkQueueFamilyProperties) * num_families);
+    if (!families) {
+        set_error("Error allocating queue family properties");
+        return AH_FAILURE;
+    }
+    vkGetPhysicalDeviceQueueFamilyProperties(vk_state->physical_device, &num_families, families);
+    uploader->image_granularity = families[vk_state->queue_family_indices.transfer_family].minImageTransferGranularity;
+    free(families);
+
+    VkCommandBuffer command_buffers[AH_UPLOAD_MAX_BATCHES];
+    VkCommandBufferAllocateInfo alloc_info = {};
+    alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    alloc_info.commandPool = uploader->command_pool;
+    alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    alloc_info.commandBufferCount = AH_UPLOAD_MAX_BATCHES;
+
+    if (vkAllocateCommandBuffers(vk_state->device, &alloc_info, command_buffers) != VK_SUCCESS) {
+        set_error("Error creating upload command buffers");
+        return AH_FAILURE;
+    }
+
+    for (uint32_t i = 0; i < AH_UPLOAD_MAX_BATCHES; i++) {
+        uploader->batches[i].command_buffer = command_buffers[i];
+    }
+
+    return AH_SUCCESS;
+}
+
+void ah_upload_destroy(vulkan_state_t *vk_state) {
+    ah_uploader_t *uploader = &vk_state->uploader;
+
+    vkDestroyCommandPool(vk_state->device, uploader->command_pool, NULL);
+    ah_vk_destroy_buffer(vk_state, uploader->staging_buffer, &uploader->staging_allocation);
+}
+
+void retire_batch(ah_uploader_t *uploader) {
+    uploader->tail = uploader->batches[uploader->oldest_batch].ring_end;
+    uploader->oldest_batch = (uploader->oldest_batch + 1) % AH_UPLOAD_MAX_BATCHES;
+    uploader->num_in_flight--;
+}
+
+/// Give back the staging space of every batch the transfer queue finished,
+/// without blocking
+void ah_upload_retire(vulkan_state_t *vk_state) {
+    ah_uploader_t *uploader = &vk_state->uploader;
+
+    while (uploader->num_in_flight > 0) {
+        ah_upload_batch_t *batch = &uploader->batches[uploader->oldest_batch];
+        if (!ah_scheduler_poll(vk_state, AH_QUEUE_TRANSFER, batch->value)) {
+            break;
+        }
+        retire_batch(uploader);
+    }
+}
+
+AH_RESULT wait_oldest_batch(vulkan_state_t *vk_state) {
+    ah_uploader_t *uploader = &vk_state->uploader;
+    ah_upload_batch_t *batch = &uploader->batches[uploader->oldest_batch];
+
+    if (ah_scheduler_wait(vk_state, AH_QUEUE_TRANSFER, batch->value) != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
+    retire_batch(uploader);
+
+    return AH_SUCCESS;
+}
+
+/// Reserve `size` contiguous bytes of the staging ring, flushing and waiting
+/// on older batches when it is full
+AH_RESULT reserve_staging(vulkan_state_t *vk_state, VkDeviceSize size, VkDeviceSize *offset) {
+    ah_uploader_t *uploader = &vk_state->uploader;
+
+    ah_upload_retire(vk_state);
+
+    for (;;) {
+        if (uploader->num_in_flight == 0 && uploader->num_copies == 0) {
+            uploader->head = 0;
+            uploader->tail = 0;
+        }
+
+        VkDeviceSize start = align_up(uploader->head, AH_UPLOAD_ALIGNMENT);
+        VkDeviceSize start_offset = start % AH_UPLOAD_STAGING_SIZE;
+
+        // Never split a reservation across the end of the ring
+        if (start_offset + size > AH_UPLOAD_STAGING_SIZE) {
+            start += AH_UPLOAD_STAGING_SIZE - start_offset;
+            start_offset = 0;
+        }
+
+        if (start + size - uploader->tail <= AH_UPLOAD_STAGING_SIZE) {
+            uploader->head = start + size;
+            *offset = start_offset;
+            return AH_SUCCESS;
+        }
+
+        // Copies still waiting to be recorded hold ring space too
+        if (uploader->num_copies > 0) {
+            if (ah_upload_flush(vk_state) != AH_SUCCESS) {
+                return AH_FAILURE;
+            }
+            continue;
+        }
+
+        if (uploader->num_in_flight == 0) {
+            set_error("Staging ring too small for upload");
+            return AH_FAILURE;
+        }
+
+        if (wait_oldest_batch(vk_state) != AH_SUCCESS) {
+            return AH_FAILURE;
+        }
+    }
+}
+
+/// Queue a copy of `data` into `dst`. The copy is recorded and submitted in
+/// batches, call `ah_upload_flush` to submit what is queued so far.
+AH_RESULT ah_upload_buffer(vulkan_state_t *vk_state, VkBuffer dst, VkDeviceSize dst_offset, const void *data, VkDeviceSize size) {
+    ah_uploader_t *uploader = &vk_state->uploader;
+    const uint8_t *src = (const uint8_t*)data;
+
+    // Large uploads go through the ring in chunks, so any mesh size fits
+    while (size > 0) {
+        VkDeviceSize chunk = size < AH_UPLOAD_STAGING_SIZE / 4 ? size : AH_UPLOAD_STAGING_SIZE / 4;
+        VkDeviceSize staging_offset;
+
+        if (uploader->num_copies == AH_UPLOAD_MAX_COPIES && ah_upload_flush(vk_state) != AH_SUCCESS) {
+            return AH_FAILURE;
+        }
+
+        if (reserve_staging(vk_state, chunk, &staging_offset) != AH_SUCCESS) {
+            return AH_FAILURE;
+        }
+
+        memcpy(uploader->staging_data + staging_offset, src, chunk);
+
+        ah_upload_copy_t *copy = &uploader->copies[uploader->num_copies++];
+        copy->dst = dst;
+        copy->dst_offset = dst_offset;
+        copy->src_offset = staging_offset;
+        copy->size = chunk;
+        copy->dst_image = VK_NULL_HANDLE;
+
+        uploader->bytes_uploaded += chunk;
+        AH_COUNTER_ADD(AH_COUNTER_BYTES_UPLOADED, chunk);
+        src += chunk;
+        dst_offset += chunk;
+        size -= chunk;
+    }
+
+    return AH_SUCCESS;
+}
+
+/// Queue a copy of one mip level, `data` holding its rows of texel blocks
+/// tightly packed. Levels larger than a ring chunk go in bands of whole
+/// block rows. Only `level` is touched, the image's other levels can be
+/// sampled meanwhile, and it ends in SHADER_READ_ONLY_OPTIMAL.
+AH_RESULT ah_upload_image(vulkan_state_t *vk_state, VkImage dst, VkImageAspectFlags aspect, uint32_t level, VkExtent2D extent, uint32_t block_height, const void *data, VkDeviceSize size) {
+    ah_uploader_t *uploader = &vk_state->uploader;
+    const uint8_t *src = (const uint8_t*)data;
+
+    uint32_t block_rows = (extent.height + block_height - 1) / block_height;
+    VkDeviceSize row_bytes = size / block_rows;
+    uint32_t band_rows = block_rows;
+
+    // The granularity counts blocks for compressed formats, so it rounds
+    // block rows either way
+    if (size > AH_UPLOAD_STAGING_SIZE / 4) {
+        uint32_t granularity = uploader->image_granularity.height;
+        band_rows = (uint32_t)((AH_UPLOAD_STAGING_SIZE / 4) / row_bytes);
+        if (granularity > 0) {
+            band_rows -= band_rows % granularity;
+        }
+        if (granularity == 0 || band_rows == 0) {
+            set_error("Mip level too large for the staging ring");
+            return AH_FAILURE;
+        }
+    }
+
+    for (uint32_t row = 0; row < block_rows; row += band_rows) {
+        uint32_t rows = block_rows - row < band_rows ? block_rows - row : band_rows;
+        uint32_t y = row * block_height;
+        VkDeviceSize chunk = rows * row_bytes;
+        VkDeviceSize staging_offset;
+
+        if (uploader->num_copies == AH_UPLOAD_MAX_COPIES && ah_upload_flush(vk_state) != AH_SUCCESS) {
+            return AH_FAILURE;
+        }
+
+        if (reserve_staging(vk_state, chunk, &staging_offset) != AH_SUCCESS) {
+            return AH_FAILURE;
+        }
+
+        memcpy(uploader->staging_data + staging_offset, src, chunk);
+
+        ah_upload_copy_t *copy = &uploader->copies[uploader->num_copies++];
+        memset(copy, 0, sizeof(ah_upload_copy_t));
+        copy->src_offset = staging_offset;
+        copy->size = chunk;
+        copy->dst_image = dst;
+        copy->region.bufferOffset = staging_offset;
+        copy->region.imageSubresource.aspectMask = aspect;
+        copy->region.imageSubresource.mipLevel = level;
+        copy->region.imageSubresource.layerCount = 1;
+        copy->region.imageOffset.y = (int32_t)y;
+        copy->region.imageExtent.width = extent.width;
+        copy->region.imageExtent.height = extent.height - y < rows * block_height ? extent.height - y : rows * block_height;
+        copy->region.imageExtent.depth = 1;
+        copy->first_band = row == 0;
+        copy->last_band = row + rows == block_rows;
+
+        uploader->bytes_uploaded += chunk;
+        AH_COUNTER_ADD(AH_COUNTER_BYTES_UPLOADED, chunk);
+        src += chunk;
+    }
+
+    return AH_SUCCESS;
+}
+
+VkImageMemoryBarrier2 level_barrier(const ah_upload_copy_t *copy, VkImageLayout old_layout, VkImageLayout new_layout) {
+    VkImageMemoryBarrier2 barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER_2;
+    barrier.oldLayout = old_layout;
+    barrier.newLayout = new_layout;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = copy->dst_image;
+    barrier.subresourceRange.aspectMask = copy->region.imageSubresource.aspectMask;
+    barrier.subresourceRange.baseMipLevel = copy->region.imageSubresource.mipLevel;
+    barrier.subresourceRange.levelCount = 1;
+    barrier.subresourceRange.baseArrayLayer = 0;
+    barrier.subresourceRange.layerCount = 1;
+    return barrier;
+}
+
+/// Record the run of image copies starting at `first` behind one barrier
+/// for the levels they start and ahead of one for the levels they finish,
+/// returns how many there were
+uint32_t record_image_copies(ah_uploader_t *uploader, VkCommandBuffer command_buffer, uint32_t first) {
+    uint32_t count = 0;
+    while (first + count < uploader->num_copies && uploader->copies[first + count].dst_image != VK_NULL_HANDLE) {
+        count++;
+    }
+
+    VkImageMemoryBarrier2 barriers[AH_UPLOAD_MAX_COPIES];
+    uint32_t num_barriers = 0;
+    VkDependencyInfo dependency = {};
+    dependency.sType = VK_STRUCTURE_TYPE_DEPENDENCY_INFO;
+    dependency.pImageMemoryBarriers = barriers;
+
+    // Bands of a level split across batches find it in TRANSFER_DST_OPTIMAL
+    // already, and write rows the earlier bands didn't
+    for (uint32_t i = 0; i < count; i++) {
+        const ah_upload_copy_t *copy = &uploader->copies[first + i];
+        if (copy->first_band) {
+            barriers[num_barriers] = level_barrier(copy, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL);
+            barriers[num_barriers].dstStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+            barriers[num_barriers].dstAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+            num_barriers++;
+        }
+    }
+    if (num_barriers > 0) {
+        dependency.imageMemoryBarrierCount = num_barriers;
+        vkCmdPipelineBarrier2(command_buffer, &dependency);
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        const ah_upload_copy_t *copy = &uploader->copies[first + i];
+        vkCmdCopyBufferToImage(command_buffer, uploader->staging_buffer, copy->dst_image, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &copy->region);
+    }
+
+    // Readers wait on the transfer timeline, which makes the writes visible
+    num_barriers = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        const ah_upload_copy_t *copy = &uploader->copies[first + i];
+        if (copy->last_band) {
+            barriers[num_barriers] = level_barrier(copy, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL);
+            barriers[num_barriers].srcStageMask = VK_PIPELINE_STAGE_2_COPY_BIT;
+            barriers[num_barriers].srcAccessMask = VK_ACCESS_2_TRANSFER_WRITE_BIT;
+            barriers[num_barriers].dstStageMask = VK_PIPELINE_STAGE_2_ALL_COMMANDS_BIT;
+            num_barriers++;
+        }
+    }
+    if (num_barriers > 0) {
+        dependency.imageMemoryBarrierCount = num_barriers;
+        vkCmdPipelineBarrier2(command_buffer, &dependency);
+    }
+
+    return count;
+}
+
+/// Record every queued copy into one command buffer and submit it to the
+/// transfer queue
+AH_RESULT ah_upload_flush(vulkan_state_t *vk_state) {
+    ah_uploader_t *uploader = &vk_state->uploader;
+
+    if (uploader->num_copies == 0) {
+        return AH_SUCCESS;
+    }
+
+    if (uploader->num_in_flight == AH_UPLOAD_MAX_BATCHES && wait_oldest_batch(vk_state) != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
+
+    uint32_t batch_index = (uploader->oldest_batch + uploader->num_in_flight) % AH_UPLOAD_MAX_BATCHES;
+    ah_upload_batch_t *batch = &uploader->batches[batch_index];
+
+    vkResetCommandBuffer(batch->command_buffer, 0);
+
+    VkCommandBufferBeginInfo begin_info = {};
+    begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+    begin_info.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+    if (vkBeginCommandBuffer(batch->command_buffer, &begin_info) != VK_SUCCESS) {
+        set_error("Failed to begin recording upload command buffer");
+        return AH_FAILURE;
+    }
+
+    // Consecutive copies into the same buffer become one vkCmdCopyBuffer
+    VkBufferCopy regions[AH_UPLOAD_MAX_COPIES];
+    uint32_t first = 0;
+    while (first < uploader->num_copies) {
+        if (uploader->copies[first].dst_image != VK_NULL_HANDLE) {
+            first += record_image_copies(uploader, batch->command_buffer, first);
+            continue;
+        }
+
+        uint32_t count = 0;
+        VkBuffer dst = uploader->copies[first].dst;
+
+        while (first + count < uploader->num_copies && uploader->copies[first + count].dst == dst) {
+            regions[count].srcOffset = uploader->copies[first + count].src_offset;
+            regions[count].dstOffset = uploader->copies[first + count].dst_offset;
+            regions[count].size = uploader->copies[first + count].size;
+            count++;
+        }
+
+        vkCmdCopyBuffer(batch->command_buffer, uploader->staging_buffer, dst, count, regions);
+        first += count;
+    }
+
+    if (vkEndCommandBuffer(batch->command_buffer) != VK_SUCCESS) {
+        set_error("Couldn't end upload command buffer");
+        return AH_FAILURE;
+    }
+
+    if (ah_scheduler_submit(vk_state, AH_QUEUE_TRANSFER, batch->command_buffer, NULL, VK_NULL_HANDLE, &batch->value) != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
+
+    batch->ring_end = uploader->head;
+    uploader->num_in_flight++;
+    uploader->num_copies = 0;
+
+    return AH_SUCCESS;
+}
+
+/// Make a submission wait for every upload flushed so far. Any number of
+/// submissions can wait on the same transfer value.
+AH_RESULT ah_upload_add_wait(vulkan_state_t *vk_state, ah_submit_waits_t *waits) {
+    // Uploaded buffers may be read by any stage
+    uint64_t value = vk_state->scheduler.timelines[AH_QUEUE_TRANSFER].submitted;
+    return ah_scheduler_add_wait(vk_state, waits, AH_QUEUE_TRANSFER, value, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT);
+}
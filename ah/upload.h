@@ -0,0 +1,73 @@
+#pragma once
+
+#include "ah.h"
+#include "alloc.h"
+#include "scheduler.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <vulkan/vulkan_core.h>
+
+#define AH_UPLOAD_STAGING_SIZE (8 * 1024 * 1024)
+#define AH_UPLOAD_MAX_BATCHES 8
+#define AH_UPLOAD_MAX_COPIES 256
+#define AH_UPLOAD_ALIGNMENT 16
+
+typedef struct vulkan_state vulkan_state_t;
+
+typedef struct ah_upload_copy {
+    VkBuffer dst;
+    VkDeviceSize dst_offset;
+    VkDeviceSize src_offset;
+    VkDeviceSize size;
+
+    // Set instead of `dst` for copies into a mip level, `region` covers a
+    // band of its rows. The first band moves the level to
+    // TRANSFER_DST_OPTIMAL, the last one to SHADER_READ_ONLY_OPTIMAL.
+    VkImage dst_image;
+    VkBufferImageCopy region;
+    bool first_band;
+    bool last_band;
+} ah_upload_copy_t;
+
+/// One submission of copies to the transfer queue. The staging bytes it reads
+/// stay reserved until the transfer timeline reaches `value`.
+typedef struct ah_upload_batch {
+    VkCommandBuffer command_buffer;
+    uint64_t value;
+    // Ring head once this batch was recorded, the tail moves here on retire
+    VkDeviceSize ring_end;
+} ah_upload_batch_t;
+
+typedef struct ah_uploader {
+    VkCommandPool command_pool;
+
+    VkBuffer staging_buffer;
+    ah_allocation_t staging_allocation;
+    uint8_t *staging_data;
+
+    // Monotonic ring positions, the staging offset is `position % size`
+    VkDeviceSize head;
+    VkDeviceSize tail;
+
+    ah_upload_batch_t batches[AH_UPLOAD_MAX_BATCHES];
+    uint32_t oldest_batch;
+    uint32_t num_in_flight;
+
+    ah_upload_copy_t copies[AH_UPLOAD_MAX_COPIES];
+    uint32_t num_copies;
+
+    // Copies into images on the transfer family have to start and end on
+    // multiples of this unless they reach the edge of the level, 0 when
+    // only whole levels can be copied
+    VkExtent3D image_granularity;
+
+    uint64_t bytes_uploaded;
+} ah_uploader_t;
+
+AH_RESULT ah_upload_init(vulkan_state_t *vk_state);
+void ah_upload_destroy(vulkan_state_t *vk_state);
+AH_RESULT ah_upload_buffer(vulkan_state_t *vk_state, VkBuffer dst, VkDeviceSize dst_offset, const void *data, VkDeviceSize size);
+AH_RESULT ah_upload_image(vulkan_state_t *vk_state, VkImage dst, VkImageAspectFlags aspect, uint32_t level, VkExtent2D extent, uint32_t block_height, const void *data, VkDeviceSize size);
+AH_RESULT ah_upload_flush(vulkan_state_t *vk_state);
+void ah_upload_retire(vulkan_state_t *vk_state);
+AH_RESULT ah_upload_add_wait(vulkan_state_t *vk_state, ah_submit_waits_t *waits);
@@ -1,28 +1,74 @@
 #include "vertex.h"
 
 
-VkVertexInputBindingDescription get_vertex_binding_description() {
+uint32_t get_vertex_stride(ah_vertex_format_t format) {
+    return format == AH_VERTEX_FORMAT_QUANTIZED ? sizeof(vertex_quantized_t) : sizeof(vertex_t);
+}
+
+VkVertexInputBindingDescription get_vertex_binding_description(ah_vertex_format_t format) {
     VkVertexInputBindingDescription binding_description = {};
 
     binding_description.binding = 0;
-    binding_description.stride = sizeof(vertex_t);
+    binding_description.stride = get_vertex_stride(format);
     binding_description.inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
 
     return binding_description;
 }
 
-vertex_input_attribute_description_t get_vertex_attribute_descriptions() {
+vertex_input_attribute_description_t get_vertex_attribute_descriptions(ah_vertex_format_t format) {
     vertex_input_attribute_description_t attribute_descriptions = {};
     attribute_descriptions.num_attributes = 2;
 
     attribute_descriptions.attr_desc[0].binding = 0;
     attribute_descriptions.attr_desc[0].location = 0;
-    attribute_descriptions.attr_desc[0].format = VK_FORMAT_R32G32_SFLOAT;
-    attribute_descriptions.attr_desc[0].offset = offsetof(vertex_t, pos);
-
     attribute_descriptions.attr_desc[1].binding = 0;
     attribute_descriptions.attr_desc[1].location = 1;
-    attribute_descriptions.attr_desc[1].format = VK_FORMAT_R32G32B32_SFLOAT;
-    attribute_descriptions.attr_desc[1].offset = offsetof(vertex_t, color);
+
+    // The shader reads the same vec2 and vec3 either way, the vertex fetch
+    // unpacks the narrow formats
+    if (format == AH_VERTEX_FORMAT_QUANTIZED) {
+        attribute_descriptions.attr_desc[0].format = VK_FORMAT_R16G16_SNORM;
+        attribute_descriptions.attr_desc[0].offset = offsetof(vertex_quantized_t, pos);
+        attribute_descriptions.attr_desc[1].format = VK_FORMAT_R8G8B8A8_UNORM;
+        attribute_descriptions.attr_desc[1].offset = offsetof(vertex_quantized_t, color);
+    } else {
+        attribute_descriptions.attr_desc[0].format = VK_FORMAT_R32G32_SFLOAT;
+        attribute_descriptions.attr_desc[0].offset = offsetof(vertex_t, pos);
+        attribute_descriptions.attr_desc[1].format = VK_FORMAT_R32G32B32_SFLOAT;
+        attribute_descriptions.attr_desc[1].offset = offsetof(vertex_t, color);
+    }
+
+    return attribute_descriptions;
+}
+
+VkVertexInputBindingDescription get_instance_binding_description() {
+    VkVertexInputBindingDescription binding_description = {};
+
+    binding_description.binding = 1;
+    binding_description.stride = sizeof(instance_t);
+    binding_description.inputRate = VK_VERTEX_INPUT_RATE_INSTANCE;
+
+    return binding_description;
+}
+
+/// Per-vertex attributes followed by the per-instance ones. A mat4 takes
+/// one location per column.
+vertex_input_attribute_description_t get_instanced_attribute_descriptions(ah_vertex_format_t format) {
+    vertex_input_attribute_description_t attribute_descriptions = get_vertex_attribute_descriptions(format);
+
+    for (uint32_t column = 0; column < 4; column++) {
+        VkVertexInputAttributeDescription *attr = &attribute_descriptions.attr_desc[attribute_descriptions.num_attributes++];
+        attr->binding = 1;
+        attr->location = 2 + column;
+        attr->format = VK_FORMAT_R32G32B32A32_SFLOAT;
+        attr->offset = offsetof(instance_t, transform) + sizeof(vec4)*column;
+    }
+
+    VkVertexInputAttributeDescription *attr = &attribute_descriptions.attr_desc[attribute_descriptions.num_attributes++];
+    attr->binding = 1;
+    attr->location = 6;
+    attr->format = VK_FORMAT_R32G32B32A32_SFLOAT;
+    attr->offset = offsetof(instance_t, color);
+
     return attribute_descriptions;
 }
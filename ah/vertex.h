@@ -2,17 +2,40 @@
 
 #include "ah.h"
 #include <cglm/cglm.h>
+#include <stdint.h>
 #include <vulkan/vulkan_core.h>
 
+typedef enum ah_vertex_format {
+    AH_VERTEX_FORMAT_FULL,
+    // vertex_quantized_t, positions are scaled back in the vertex shader
+    AH_VERTEX_FORMAT_QUANTIZED,
+} ah_vertex_format_t;
+
 typedef struct vertex {
     vec2 pos;
     vec3 color;
 } vertex_t;
 
+/// Snorm16 position relative to the mesh bounds and unorm8 colour, 8 bytes
+/// instead of 20
+typedef struct vertex_quantized {
+    int16_t pos[2];
+    uint8_t color[4];
+} vertex_quantized_t;
+
+/// Per-instance data, read at VK_VERTEX_INPUT_RATE_INSTANCE from binding 1
+typedef struct instance {
+    mat4 transform;
+    vec4 color;
+} instance_t;
+
 typedef struct vertex_input_attribute_description {
     uint32_t num_attributes;
-    VkVertexInputAttributeDescription attr_desc[6];
+    VkVertexInputAttributeDescription attr_desc[8];
 } vertex_input_attribute_description_t;
 
-VkVertexInputBindingDescription get_vertex_binding_description();
-vertex_input_attribute_description_t get_vertex_attribute_descriptions();
+uint32_t get_vertex_stride(ah_vertex_format_t format);
+VkVertexInputBindingDescription get_vertex_binding_description(ah_vertex_format_t format);
+vertex_input_attribute_description_t get_vertex_attribute_descriptions(ah_vertex_format_t format);
+VkVertexInputBindingDescription get_instance_binding_description();
+vertex_input_attribute_description_t get_instanced_attribute_descriptions(ah_vertex_format_t format);
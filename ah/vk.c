@@ -8,8 +8,26 @@
 #include <time.h>
 #include <vulkan/vulkan_core.h>
 #include "ah.h"
+#include "alloc.h"
+#include "capture.h"
+#include "culling.h"
 #include "errors.h"
+#include "frame.h"
 #include "helpers.h"
+#include "instancing.h"
+#include "instrument.h"
+#include "jobs.h"
+#include "mesh.h"
+#include "pacing.h"
+#include "pipeline_builder.h"
+#include "pipeline_cache.h"
+#include "record.h"
+#include "render_graph.h"
+#include "scheduler.h"
+#include "simulation.h"
+#include "streaming.h"
+#include "texture.h"
+#include "upload.h"
 #include "vertex.h"
 
 const char* validation_layers[] = {
@@ -22,15 +40,73 @@ const char* extensions[] = {
 };
 const int32_t extensions_count = 1;
 
-const vertex_t vertices[3] = {
-    {{0.0f, -0.5f}, {1.0f, 0.0f, 0.0f}},
-    {{0.5f, 0.5f}, {0.0f, 1.0f, 0.0f}},
-    {{-0.5f, 0.5f}, {0.0f, 0.0f, 1.0f}},
-};
-
 void populate_queue_families(vulkan_state_t *vk_state);
 
+void ah_init_vulkan_state(vulkan_state_t *vk_state) {
+    vk_state->headless = false;
+    vk_state->headless_extent.width = 800;
+    vk_state->headless_extent.height = 600;
+    vk_state->enable_validation = true;
+    vk_state->num_instances = 0;
+    vk_state->simulate = false;
+    vk_state->cull_instances = true;
+    vk_state->force_render_pass = false;
+    glm_mat4_identity(vk_state->view_projection);
+    vk_state->watch_shaders = false;
+    vk_state->mesh_path = NULL;
+    vk_state->present_mode = VK_PRESENT_MODE_FIFO_KHR;
+    vk_state->active_present_mode = VK_PRESENT_MODE_FIFO_KHR;
+    vk_state->pacing_mode = AH_PACING_THROUGHPUT;
+    vk_state->window = NULL;
+    vk_state->instance = VK_NULL_HANDLE;
+    vk_state->physical_device = VK_NULL_HANDLE;
+    vk_state->device = VK_NULL_HANDLE;
+    vk_state->surface = VK_NULL_HANDLE;
+    vk_state->swapchain = VK_NULL_HANDLE;
+    vk_state->pipeline_cache = VK_NULL_HANDLE;
+    vk_state->pipeline_cache_warm = false;
+    vk_state->headless_image_allocations = NULL;
+    vk_state->frames_in_flight = AH_DEFAULT_FRAMES_IN_FLIGHT;
+    vk_state->current_frame = 0;
+    vk_state->frame_count = 0;
+    vk_state->swapchain_dirty = false;
+    vk_state->num_retired_swapchains = 0;
+    vk_state->last_present_value = 0;
+    vk_state->swapchain_images = NULL;
+    vk_state->swapchain_image_views = NULL;
+    vk_state->swapchain_framebuffers = NULL;
+    vk_state->render_pass = VK_NULL_HANDLE;
+    vk_state->swapchain_support.formats = NULL;
+    vk_state->swapchain_support.present_modes = NULL;
+    vk_state->render_finished_semaphores = NULL;
+    vk_state->draws = NULL;
+    vk_state->num_draws = 0;
+    vk_state->stream_assets = true;
+    vk_state->streamer.budget = AH_STREAM_DEFAULT_BUDGET;
+    vk_state->streamer.enabled = false;
+    vk_state->scene_asset = AH_STREAM_NONE;
+    vk_state->texture_path = NULL;
+    vk_state->textures.budget = AH_TEXTURE_DEFAULT_BUDGET;
+    vk_state->textures.upload_budget = AH_TEXTURE_DEFAULT_UPLOAD_BUDGET;
+    vk_state->textures.num_textures = 0;
+    vk_state->scene_texture = AH_TEXTURE_NONE;
+    vk_state->capture.consume = NULL;
+    vk_state->capture.user = NULL;
+    vk_state->profiler.query_pool = VK_NULL_HANDLE;
+    vk_state->trace.fp = NULL;
+}
+
 AH_RESULT ah_vk_init(vulkan_state_t *vk_state) {
+    if (vk_state->frames_in_flight == 0) {
+        vk_state->frames_in_flight = 1;
+    } else if (vk_state->frames_in_flight > AH_MAX_FRAMES_IN_FLIGHT) {
+        vk_state->frames_in_flight = AH_MAX_FRAMES_IN_FLIGHT;
+    }
+    vk_state->current_frame = 0;
+    double init_start = ah_now_ms();
+    ah_instrument_init();
+    ah_instrument_thread_name("main");
+
     if (ah_vk_create_instance(vk_state) != AH_SUCCESS) {
         print_error("init_vulkan/create_instance");
         return AH_FAILURE;
@@ -53,6 +129,39 @@ AH_RESULT ah_vk_init(vulkan_state_t *vk_state) {
         return AH_FAILURE;
     }
 
+    if (ah_scheduler_init(vk_state) != AH_SUCCESS) {
+        print_error("init_vulkan/scheduler_init");
+        return AH_FAILURE;
+    }
+
+    ah_pacing_init(vk_state);
+
+    // Only the header is read here, pipelines need the vertex format
+    if (ah_vk_open_mesh(vk_state) != AH_SUCCESS) {
+        print_error("init_vulkan/open_mesh");
+        return AH_FAILURE;
+    }
+
+    if (ah_pipeline_cache_load(vk_state, AH_PIPELINE_CACHE_PATH) != AH_SUCCESS) {
+        print_error("init_vulkan/pipeline_cache_load");
+        return AH_FAILURE;
+    }
+
+    if (ah_alloc_init(&vk_state->allocator, vk_state->physical_device, vk_state->device) != AH_SUCCESS) {
+        print_error("init_vulkan/alloc_init");
+        return AH_FAILURE;
+    }
+
+    if (ah_bindless_init(vk_state) != AH_SUCCESS) {
+        print_error("init_vulkan/bindless_init");
+        return AH_FAILURE;
+    }
+
+    if (ah_frame_alloc_init(vk_state) != AH_SUCCESS) {
+        print_error("init_vulkan/frame_alloc_init");
+        return AH_FAILURE;
+    }
+
     if (ah_vk_create_swapchain(vk_state) != AH_SUCCESS) {
         print_error("init_vulkan/create_swapchain");
         return AH_FAILURE;
@@ -63,17 +172,64 @@ AH_RESULT ah_vk_init(vulkan_state_t *vk_state) {
         return AH_FAILURE;
     }
 
-    if (ah_vk_create_render_pass(vk_state) != AH_SUCCESS) {
+    if (ah_vk_pick_depth_format(vk_state) != AH_SUCCESS) {
+        print_error("init_vulkan/pick_depth_format");
+        return AH_FAILURE;
+    }
+
+    // Dynamic rendering pipelines only need the attachment formats
+    if (!vk_state->features.dynamic_rendering && ah_vk_create_render_pass(vk_state) != AH_SUCCESS) {
         print_error("init_vulkan/create_render_pass");
         return AH_FAILURE;
     }
 
+    if (ah_jobs_init(&vk_state->jobs, 0) != AH_SUCCESS) {
+        print_error("init_vulkan/jobs_init");
+        return AH_FAILURE;
+    }
+
+    if (ah_pipeline_builder_init(&vk_state->pipeline_builder, vk_state->device, vk_state->pipeline_cache, &vk_state->jobs) != AH_SUCCESS) {
+        print_error("init_vulkan/pipeline_builder_init");
+        return AH_FAILURE;
+    }
+
+    ah_hot_reload_init(vk_state);
+
+    // Pipelines compile on the job pool while the rest of the renderer
+    // is set up
+    double pipelines_start = ah_now_ms();
     if (ah_vk_create_graphics_pipeline(vk_state) != AH_SUCCESS) {
         print_error("init_vulkan/create_graphics_pipeline");
         return AH_FAILURE;
     }
 
-    if (ah_vk_create_framebuffers(vk_state) != AH_SUCCESS) {
+    if (ah_instancing_init(vk_state) != AH_SUCCESS) {
+        print_error("init_vulkan/instancing_init");
+        return AH_FAILURE;
+    }
+
+    if (ah_simulation_init(vk_state) != AH_SUCCESS) {
+        print_error("init_vulkan/simulation_init");
+        return AH_FAILURE;
+    }
+
+    if (ah_culling_init(vk_state) != AH_SUCCESS) {
+        print_error("init_vulkan/culling_init");
+        return AH_FAILURE;
+    }
+
+    if (ah_capture_init(vk_state) != AH_SUCCESS) {
+        print_error("init_vulkan/capture_init");
+        return AH_FAILURE;
+    }
+
+    if (ah_vk_create_render_graph(vk_state) != AH_SUCCESS) {
+        print_error("init_vulkan/create_render_graph");
+        return AH_FAILURE;
+    }
+
+    // Framebuffers take the depth view the graph created
+    if (!vk_state->features.dynamic_rendering && ah_vk_create_framebuffers(vk_state) != AH_SUCCESS) {
         print_error("init_vulkan/create_framebuffers");
         return AH_FAILURE;
     }
@@ -83,8 +239,41 @@ AH_RESULT ah_vk_init(vulkan_state_t *vk_state) {
         return AH_FAILURE;
     }
 
-    if (ah_vk_create_vertex_buffer(vk_state) != AH_SUCCESS) {
-        print_error("init_vulkan/create_vertex_buffers");
+    if (ah_upload_init(vk_state) != AH_SUCCESS) {
+        print_error("init_vulkan/upload_init");
+        return AH_FAILURE;
+    }
+
+    if (ah_stream_init(vk_state) != AH_SUCCESS) {
+        print_error("init_vulkan/stream_init");
+        return AH_FAILURE;
+    }
+
+    if (ah_vk_upload_mesh(vk_state) != AH_SUCCESS) {
+        print_error("init_vulkan/upload_mesh");
+        return AH_FAILURE;
+    }
+
+    if (ah_textures_init(vk_state) != AH_SUCCESS) {
+        print_error("init_vulkan/textures_init");
+        return AH_FAILURE;
+    }
+
+    if (vk_state->texture_path) {
+        vk_state->scene_texture = ah_texture_load(vk_state, vk_state->texture_path, AH_BINDLESS_DEFAULT_MATERIAL);
+        if (vk_state->scene_texture == AH_TEXTURE_NONE) {
+            print_error("init_vulkan/texture_load");
+            return AH_FAILURE;
+        }
+    }
+
+    if (ah_instancing_set_count(vk_state, vk_state->num_instances) != AH_SUCCESS) {
+        print_error("init_vulkan/instancing_set_count");
+        return AH_FAILURE;
+    }
+
+    if (ah_recorder_init(vk_state) != AH_SUCCESS) {
+        print_error("init_vulkan/recorder_init");
         return AH_FAILURE;
     }
 
@@ -98,6 +287,45 @@ AH_RESULT ah_vk_init(vulkan_state_t *vk_state) {
         return AH_FAILURE;
     }
 
+    if (ah_profiler_init(vk_state) != AH_SUCCESS) {
+        print_error("init_vulkan/profiler_init");
+        return AH_FAILURE;
+    }
+
+    if (ah_upload_flush(vk_state) != AH_SUCCESS) {
+        print_error("init_vulkan/upload_flush");
+        return AH_FAILURE;
+    }
+
+    if (ah_pipeline_future_wait(&vk_state->pipeline_builder, &vk_state->pipeline_future) != AH_SUCCESS) {
+        print_error("init_vulkan/create_graphics_pipeline");
+        return AH_FAILURE;
+    }
+    vk_state->pipeline = vk_state->pipeline_future.pipeline;
+
+    if (ah_instancing_wait(vk_state) != AH_SUCCESS) {
+        print_error("init_vulkan/instancing_wait");
+        return AH_FAILURE;
+    }
+    double pipelines_ms = ah_now_ms() - pipelines_start;
+
+    if (ah_pipeline_builder_merge(&vk_state->pipeline_builder) != AH_SUCCESS) {
+        print_error("init_vulkan/pipeline_builder_merge");
+        return AH_FAILURE;
+    }
+
+    if (ah_hot_reload_start(vk_state) != AH_SUCCESS) {
+        print_error("init_vulkan/hot_reload_start");
+        return AH_FAILURE;
+    }
+
+    printf(
+        "Startup took %.2f ms, pipelines %.2f ms with a %s pipeline cache\n",
+        ah_now_ms() - init_start,
+        pipelines_ms,
+        vk_state->pipeline_cache_warm ? "warm" : "cold"
+    );
+
     return AH_SUCCESS;
 }
 
@@ -130,8 +358,30 @@ bool check_validation_layer_support() {
     return true;
 }
 
+bool has_device_extension(vulkan_state_t *vk_state, const char *name) {
+    uint32_t extension_count = 0;
+    vkEnumerateDeviceExtensionProperties(vk_state->physical_device, NULL, &extension_count, NULL);
+
+    VkExtensionProperties *properties = (VkExtensionProperties*)malloc(sizeof(VkExtensionProperties)*extension_count);
+    vkEnumerateDeviceExtensionProperties(vk_state->physical_device, NULL, &extension_count, properties);
+
+    bool found = false;
+    for (uint32_t i = 0; i < extension_count; i++) {
+        if (strcmp(properties[i].extensionName, name) == 0) {
+            found = true;
+            break;
+        }
+    }
+
+    free(properties);
+    return found;
+}
+
 void populate_queue_families(vulkan_state_t *vk_state) {
     vk_state->queue_family_indices.has_graphics_family = false;
+    vk_state->queue_family_indices.has_present_family = false;
+    vk_state->queue_family_indices.has_transfer_family = false;
+    vk_state->queue_family_indices.has_compute_family = false;
 
     uint32_t queue_family_count = 0;
 
@@ -142,23 +392,82 @@ void populate_queue_families(vulkan_state_t *vk_state) {
 
     printf("# Families: %d\n", queue_family_count);
 
+    // Without a surface nothing is presented, the graphics queue stands in
+    // for the present queue
+    VkBool32 *present_support = (VkBool32*)calloc(queue_family_count, sizeof(VkBool32));
+    for (uint32_t i = 0; i < queue_family_count && !vk_state->headless; i++) {
+        vkGetPhysicalDeviceSurfaceSupportKHR(vk_state->physical_device, i, vk_state->surface, &present_support[i]);
+    }
+
+    // The first family of each kind is kept, drivers list their primary
+    // queues first
     for (int i = 0; i < queue_family_count; i++) {
-        if (queue_families[i].queueFlags & VK_QUEUE_GRAPHICS_BIT) {
+        VkQueueFlags flags = queue_families[i].queueFlags;
+
+        // A graphics family that can also present avoids a cross-family
+        // present, prefer it over an earlier one that can't
+        if ((flags & VK_QUEUE_GRAPHICS_BIT) &&
+            (!vk_state->queue_family_indices.has_graphics_family ||
+             (present_support[i] && !present_support[vk_state->queue_family_indices.graphics_family]))) {
             vk_state->queue_family_indices.has_graphics_family = true;
             vk_state->queue_family_indices.graphics_family = i;
         }
 
-        VkBool32 present_support = false;
-        vkGetPhysicalDeviceSurfaceSupportKHR(vk_state->physical_device, i, vk_state->surface, &present_support);
-
-        if (present_support) {
+        if (present_support[i] && !vk_state->queue_family_indices.has_present_family) {
             vk_state->queue_family_indices.has_present_family = true;
             vk_state->queue_family_indices.present_family = i;
         }
+
+        // Transfer-only families map to the DMA engines of discrete GPUs,
+        // copies there run alongside rendering
+        if ((flags & VK_QUEUE_TRANSFER_BIT) && !(flags & (VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT)) &&
+            !vk_state->queue_family_indices.has_transfer_family) {
+            vk_state->queue_family_indices.has_transfer_family = true;
+            vk_state->queue_family_indices.transfer_family = i;
+        }
+
+        // Compute families without graphics are the async compute engines,
+        // dispatches there overlap with rasterisation
+        if ((flags & VK_QUEUE_COMPUTE_BIT) && !(flags & VK_QUEUE_GRAPHICS_BIT) &&
+            !vk_state->queue_family_indices.has_compute_family) {
+            vk_state->queue_family_indices.has_compute_family = true;
+            vk_state->queue_family_indices.compute_family = i;
+        }
     }
+
+    if (vk_state->headless ||
+        (vk_state->queue_family_indices.has_graphics_family && present_support[vk_state->queue_family_indices.graphics_family])) {
+        vk_state->queue_family_indices.has_present_family = vk_state->queue_family_indices.has_graphics_family;
+        vk_state->queue_family_indices.present_family = vk_state->queue_family_indices.graphics_family;
+    }
+    free(present_support);
+
+    // Graphics queues can always copy and dispatch
+    if (!vk_state->queue_family_indices.has_transfer_family) {
+        vk_state->queue_family_indices.has_transfer_family = vk_state->queue_family_indices.has_graphics_family;
+        vk_state->queue_family_indices.transfer_family = vk_state->queue_family_indices.graphics_family;
+    }
+    if (!vk_state->queue_family_indices.has_compute_family) {
+        vk_state->queue_family_indices.has_compute_family = vk_state->queue_family_indices.has_graphics_family;
+        vk_state->queue_family_indices.compute_family = vk_state->queue_family_indices.graphics_family;
+    }
+
+    printf(
+        "Compute family %u%s\n",
+        vk_state->queue_family_indices.compute_family,
+        vk_state->queue_family_indices.compute_family == vk_state->queue_family_indices.graphics_family ? ", shared with graphics" : ", async"
+    );
+
+    free(queue_families);
 }
 
 void populate_swapchain_support(vulkan_state_t *vk_state) {
+    // Queried again on every swapchain recreation
+    free(vk_state->swapchain_support.formats);
+    free(vk_state->swapchain_support.present_modes);
+    vk_state->swapchain_support.formats = NULL;
+    vk_state->swapchain_support.present_modes = NULL;
+
     vkGetPhysicalDeviceSurfaceCapabilitiesKHR(vk_state->physical_device, vk_state->surface, &vk_state->swapchain_support.capabilities);
 
     vkGetPhysicalDeviceSurfaceFormatsKHR(vk_state->physical_device, vk_state->surface, &vk_state->swapchain_support.num_formats, NULL);
@@ -198,20 +507,24 @@ AH_RESULT ah_vk_create_instance(vulkan_state_t *vk_state) {
     create_info.pApplicationInfo = &app_info;
 
     uint32_t glfw_extension_count = 0;
-    const char** glfw_extensions;
+    const char** glfw_extensions = NULL;
 
-    glfw_extensions = glfwGetRequiredInstanceExtensions(&glfw_extension_count);
+    if (!vk_state->headless) {
+        glfw_extensions = glfwGetRequiredInstanceExtensions(&glfw_extension_count);
+    }
 
     create_info.enabledExtensionCount = glfw_extension_count;
     create_info.ppEnabledExtensionNames = glfw_extensions;
 
-    if (!check_validation_layer_support()) {
-        set_error("Required validation layers not found");
-        return AH_FAILURE;
-    }
+    if (vk_state->enable_validation) {
+        if (!check_validation_layer_support()) {
+            set_error("Required validation layers not found");
+            return AH_FAILURE;
+        }
 
-    create_info.enabledLayerCount = validation_layers_count;
-    create_info.ppEnabledLayerNames = validation_layers;
+        create_info.enabledLayerCount = validation_layers_count;
+        create_info.ppEnabledLayerNames = validation_layers;
+    }
 
     if (vkCreateInstance(&create_info, NULL, &vk_state->instance) != VK_SUCCESS) {
         set_error("Failed creating instance");
@@ -264,31 +577,144 @@ AH_RESULT ah_vk_pick_physical_device(vulkan_state_t *vk_state) {
 
 
 AH_RESULT ah_vk_create_logical_device(vulkan_state_t *vk_state) {
-    VkDeviceQueueCreateInfo queue_create_infos[2] = {};
+    uint32_t families[4] = {
+        vk_state->queue_family_indices.graphics_family,
+        vk_state->queue_family_indices.present_family,
+        vk_state->queue_family_indices.transfer_family,
+        vk_state->queue_family_indices.compute_family,
+    };
+    VkDeviceQueueCreateInfo queue_create_infos[4] = {};
+    uint32_t num_queue_create_infos = 0;
 
     float queue_priority = 1.0f;
 
-    queue_create_infos[0].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-    queue_create_infos[0].queueFamilyIndex = vk_state->queue_family_indices.graphics_family;
-    queue_create_infos[0].queueCount = 1;
-    queue_create_infos[0].pQueuePriorities = &queue_priority;
-    queue_create_infos[1].sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
-    queue_create_infos[1].queueFamilyIndex = vk_state->queue_family_indices.present_family;
-    queue_create_infos[1].queueCount = 1;
-    queue_create_infos[1].pQueuePriorities = &queue_priority;
+    // Every family may only be listed once
+    for (uint32_t i = 0; i < 4; i++) {
+        bool duplicate = false;
+        for (uint32_t j = 0; j < num_queue_create_infos; j++) {
+            if (queue_create_infos[j].queueFamilyIndex == families[i]) {
+                duplicate = true;
+            }
+        }
 
-    VkPhysicalDeviceFeatures device_features = {};
+        if (duplicate) {
+            continue;
+        }
+
+        VkDeviceQueueCreateInfo *queue_create_info = &queue_create_infos[num_queue_create_infos++];
+        queue_create_info->sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+        queue_create_info->queueFamilyIndex = families[i];
+        queue_create_info->queueCount = 1;
+        queue_create_info->pQueuePriorities = &queue_priority;
+    }
+
+    // Present id and present wait are only looked at when there is a
+    // swapchain to present to
+    bool has_present_wait = !vk_state->headless &&
+        has_device_extension(vk_state, VK_KHR_PRESENT_ID_EXTENSION_NAME) &&
+        has_device_extension(vk_state, VK_KHR_PRESENT_WAIT_EXTENSION_NAME);
+
+    VkPhysicalDevicePresentWaitFeaturesKHR supported_present_wait = {};
+    supported_present_wait.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR;
+    VkPhysicalDevicePresentIdFeaturesKHR supported_present_id = {};
+    supported_present_id.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR;
+    supported_present_id.pNext = &supported_present_wait;
+    VkPhysicalDeviceVulkan12Features supported_features_12 = {};
+    supported_features_12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    supported_features_12.pNext = has_present_wait ? &supported_present_id : NULL;
+    VkPhysicalDeviceVulkan13Features supported_features_13 = {};
+    supported_features_13.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES;
+    supported_features_13.pNext = &supported_features_12;
+    VkPhysicalDeviceFeatures2 supported_features = {};
+    supported_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    supported_features.pNext = &supported_features_13;
+    vkGetPhysicalDeviceFeatures2(vk_state->physical_device, &supported_features);
+
+    vk_state->features.multi_draw_indirect = supported_features.features.multiDrawIndirect;
+    vk_state->features.draw_indirect_count = supported_features_12.drawIndirectCount;
+    vk_state->features.present_wait = has_present_wait &&
+        supported_present_id.presentId &&
+        supported_present_wait.presentWait;
+    vk_state->features.dynamic_rendering = supported_features_13.dynamicRendering && !vk_state->force_render_pass;
+    vk_state->features.texture_compression_bc = supported_features.features.textureCompressionBC;
+    vk_state->features.texture_compression_astc = supported_features.features.textureCompressionASTC_LDR;
+
+    vk_state->features.update_after_bind = supported_features_12.descriptorBindingUpdateUnusedWhilePending &&
+        supported_features_12.descriptorBindingSampledImageUpdateAfterBind &&
+        supported_features_12.descriptorBindingStorageBufferUpdateAfterBind;
+
+    if (!supported_features_12.runtimeDescriptorArray ||
+        !supported_features_12.descriptorBindingPartiallyBound ||
+        !supported_features_12.shaderSampledImageArrayNonUniformIndexing) {
+        set_error("Device lacks the descriptor indexing features of the bindless set");
+        return AH_FAILURE;
+    }
+
+    VkPhysicalDevicePresentWaitFeaturesKHR device_present_wait = {};
+    device_present_wait.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_WAIT_FEATURES_KHR;
+    device_present_wait.presentWait = VK_TRUE;
+    VkPhysicalDevicePresentIdFeaturesKHR device_present_id = {};
+    device_present_id.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PRESENT_ID_FEATURES_KHR;
+    device_present_id.pNext = &device_present_wait;
+    device_present_id.presentId = VK_TRUE;
+
+    VkPhysicalDeviceVulkan12Features device_features_12 = {};
+    device_features_12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+    device_features_12.pNext = vk_state->features.present_wait ? &device_present_id : NULL;
+    device_features_12.drawIndirectCount = vk_state->features.draw_indirect_count;
+    // Core since Vulkan 1.2, orders the compute queue against graphics
+    device_features_12.timelineSemaphore = VK_TRUE;
+    // Bindless set, see ah_bindless_t
+    device_features_12.descriptorIndexing = supported_features_12.descriptorIndexing;
+    device_features_12.runtimeDescriptorArray = VK_TRUE;
+    device_features_12.descriptorBindingPartiallyBound = VK_TRUE;
+    device_features_12.descriptorBindingUpdateUnusedWhilePending = vk_state->features.update_after_bind;
+    device_features_12.descriptorBindingSampledImageUpdateAfterBind = vk_state->features.update_after_bind;
+    device_features_12.descriptorBindingStorageBufferUpdateAfterBind = vk_state->features.update_after_bind;
+    device_features_12.shaderSampledImageArrayNonUniformIndexing = VK_TRUE;
+    device_features_12.shaderStorageBufferArrayNonUniformIndexing = supported_features_12.shaderStorageBufferArrayNonUniformIndexing;
+
+    // Required by Vulkan 1.3, the render graph records its barriers with it
+    VkPhysicalDeviceVulkan13Features device_features_13 = {};
+    device_features_13.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_3_FEATURES;
+    device_features_13.pNext = &device_features_12;
+    device_features_13.synchronization2 = VK_TRUE;
+    device_features_13.dynamicRendering = vk_state->features.dynamic_rendering;
+
+    VkPhysicalDeviceFeatures2 device_features = {};
+    device_features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+    device_features.pNext = &device_features_13;
+    device_features.features.multiDrawIndirect = vk_state->features.multi_draw_indirect;
+    device_features.features.textureCompressionBC = vk_state->features.texture_compression_bc;
+    device_features.features.textureCompressionASTC_LDR = vk_state->features.texture_compression_astc;
+
+    const char *device_extensions[3];
+    uint32_t num_device_extensions = 0;
+    if (!vk_state->headless) {
+        for (int32_t i = 0; i < extensions_count; i++) {
+            device_extensions[num_device_extensions++] = extensions[i];
+        }
+    }
+    if (vk_state->features.present_wait) {
+        device_extensions[num_device_extensions++] = VK_KHR_PRESENT_ID_EXTENSION_NAME;
+        device_extensions[num_device_extensions++] = VK_KHR_PRESENT_WAIT_EXTENSION_NAME;
+    }
 
     VkDeviceCreateInfo create_info = {};
     create_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
+    create_info.pNext = &device_features;
     create_info.pQueueCreateInfos = queue_create_infos;
-    create_info.queueCreateInfoCount = 2;
-    create_info.pEnabledFeatures = &device_features;
+    create_info.queueCreateInfoCount = num_queue_create_infos;
 
-    create_info.enabledExtensionCount = extensions_count;
-    create_info.ppEnabledExtensionNames = extensions;
-    create_info.enabledLayerCount = validation_layers_count;
-    create_info.ppEnabledLayerNames = validation_layers;
+    // Headless rendering never creates a swapchain, so it also runs on
+    // drivers that don't expose VK_KHR_swapchain at all
+    create_info.enabledExtensionCount = num_device_extensions;
+    create_info.ppEnabledExtensionNames = device_extensions;
+
+    if (vk_state->enable_validation) {
+        create_info.enabledLayerCount = validation_layers_count;
+        create_info.ppEnabledLayerNames = validation_layers;
+    }
 
     if (vkCreateDevice(vk_state->physical_device, &create_info, NULL, &vk_state->device) != VK_SUCCESS) {
         set_error("Could not create logical device");
@@ -309,10 +735,28 @@ AH_RESULT ah_vk_create_logical_device(vulkan_state_t *vk_state) {
         &vk_state->present_queue
     );
 
+    vkGetDeviceQueue(
+        vk_state->device,
+        vk_state->queue_family_indices.transfer_family,
+        0,
+        &vk_state->transfer_queue
+    );
+
+    vkGetDeviceQueue(
+        vk_state->device,
+        vk_state->queue_family_indices.compute_family,
+        0,
+        &vk_state->compute_queue
+    );
+
     return AH_SUCCESS;
 }
 
 AH_RESULT ah_vk_create_surface(vulkan_state_t *vk_state) {
+    if (vk_state->headless) {
+        return AH_SUCCESS;
+    }
+
     if (glfwCreateWindowSurface(vk_state->instance, vk_state->window, NULL, &vk_state->surface) != VK_SUCCESS) {
         set_error("Error creating surface");
         return AH_FAILURE;
@@ -333,14 +777,110 @@ VkSurfaceFormatKHR choose_swap_surface_format(vulkan_state_t *vk_state) {
 }
 
 VkPresentModeKHR choose_swap_present_mode(vulkan_state_t *vk_state) {
+    for (uint32_t i = 0; i < vk_state->swapchain_support.num_present_modes; i++) {
+        if (vk_state->swapchain_support.present_modes[i] == vk_state->present_mode) {
+            return vk_state->present_mode;
+        }
+    }
+
+    // The only mode every surface has to support
     return VK_PRESENT_MODE_FIFO_KHR;
 }
 
+/// Switch present mode, the swapchain is recreated at the next frame
+void ah_vk_set_present_mode(vulkan_state_t *vk_state, VkPresentModeKHR present_mode) {
+    vk_state->present_mode = present_mode;
+    if (!vk_state->headless && present_mode != vk_state->active_present_mode) {
+        vk_state->swapchain_dirty = true;
+    }
+}
+
+const char* ah_vk_present_mode_name(VkPresentModeKHR present_mode) {
+    switch (present_mode) {
+        case VK_PRESENT_MODE_IMMEDIATE_KHR:
+            return "immediate";
+        case VK_PRESENT_MODE_MAILBOX_KHR:
+            return "mailbox";
+        case VK_PRESENT_MODE_FIFO_KHR:
+            return "fifo";
+        case VK_PRESENT_MODE_FIFO_RELAXED_KHR:
+            return "fifo relaxed";
+        default:
+            return "unknown";
+    }
+}
+
 VkExtent2D choose_swap_extent(vulkan_state_t *vk_state) {
-    return vk_state->swapchain_support.capabilities.currentExtent;
+    VkSurfaceCapabilitiesKHR *capabilities = &vk_state->swapchain_support.capabilities;
+
+    if (capabilities->currentExtent.width != UINT32_MAX) {
+        return capabilities->currentExtent;
+    }
+
+    // The surface takes its size from the swapchain, use the window's
+    int width, height;
+    glfwGetFramebufferSize(vk_state->window, &width, &height);
+
+    VkExtent2D extent = {(uint32_t)width, (uint32_t)height};
+    if (extent.width < capabilities->minImageExtent.width) {
+        extent.width = capabilities->minImageExtent.width;
+    } else if (extent.width > capabilities->maxImageExtent.width) {
+        extent.width = capabilities->maxImageExtent.width;
+    }
+    if (extent.height < capabilities->minImageExtent.height) {
+        extent.height = capabilities->minImageExtent.height;
+    } else if (extent.height > capabilities->maxImageExtent.height) {
+        extent.height = capabilities->maxImageExtent.height;
+    }
+
+    return extent;
+}
+
+/// Create the images rendered into when running headless. There is one per
+/// frame in flight, so a frame slot always renders into the same image.
+AH_RESULT create_offscreen_targets(vulkan_state_t *vk_state) {
+    vk_state->num_swapchain_images = vk_state->frames_in_flight;
+    vk_state->swapchain_extent = vk_state->headless_extent;
+    vk_state->swapchain_image_format = VK_FORMAT_B8G8R8A8_SRGB;
+    vk_state->swapchain_images = (VkImage*)malloc(sizeof(VkImage)*vk_state->num_swapchain_images);
+    vk_state->headless_image_allocations = (ah_allocation_t*)malloc(sizeof(ah_allocation_t)*vk_state->num_swapchain_images);
+
+    for (uint32_t i = 0; i < vk_state->num_swapchain_images; i++) {
+        VkImageCreateInfo image_info = {};
+        image_info.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
+        image_info.imageType = VK_IMAGE_TYPE_2D;
+        image_info.format = vk_state->swapchain_image_format;
+        image_info.extent.width = vk_state->swapchain_extent.width;
+        image_info.extent.height = vk_state->swapchain_extent.height;
+        image_info.extent.depth = 1;
+        image_info.mipLevels = 1;
+        image_info.arrayLayers = 1;
+        image_info.samples = VK_SAMPLE_COUNT_1_BIT;
+        image_info.tiling = VK_IMAGE_TILING_OPTIMAL;
+        image_info.usage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+        image_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+        image_info.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+        if (ah_vk_create_image(
+            vk_state,
+            &image_info,
+            VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+            &vk_state->swapchain_images[i],
+            &vk_state->headless_image_allocations[i])
+        != AH_SUCCESS) {
+            set_error("Error creating offscreen image");
+            return AH_FAILURE;
+        }
+    }
+
+    return AH_SUCCESS;
 }
 
 AH_RESULT ah_vk_create_swapchain(vulkan_state_t *vk_state) {
+    if (vk_state->headless) {
+        return create_offscreen_targets(vk_state);
+    }
+
     populate_swapchain_support(vk_state);
 
     VkSurfaceFormatKHR surface_format = choose_swap_surface_format(vk_state);
@@ -357,6 +897,11 @@ AH_RESULT ah_vk_create_swapchain(vulkan_state_t *vk_state) {
     create_info.imageExtent = extent;
     create_info.imageArrayLayers = 1;
     create_info.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT;
+    // Captured frames are copied out of the swapchain image
+    if (vk_state->capture.consume &&
+        (vk_state->swapchain_support.capabilities.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_SRC_BIT)) {
+        create_info.imageUsage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+    }
 
     uint32_t queue_family_indices[2] = {
         vk_state->queue_family_indices.graphics_family,
@@ -368,26 +913,33 @@ AH_RESULT ah_vk_create_swapchain(vulkan_state_t *vk_state) {
         create_info.queueFamilyIndexCount = 2;
         create_info.pQueueFamilyIndices = queue_family_indices;
     } else {
-        set_error("Can only use concurrent sharing mode");
-        return AH_FAILURE;
+        create_info.imageSharingMode = VK_SHARING_MODE_EXCLUSIVE;
     }
 
     create_info.preTransform = vk_state->swapchain_support.capabilities.currentTransform;
     create_info.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
     create_info.presentMode = present_mode;
     create_info.clipped = VK_TRUE;
-    create_info.oldSwapchain = VK_NULL_HANDLE;
-
-    if (vkCreateSwapchainKHR(vk_state->device, &create_info, NULL, &vk_state->swapchain) != VK_SUCCESS) {
+    // Lets the driver reuse resources of the swapchain being replaced, and
+    // keeps its images presentable until the new one takes over
+    create_info.oldSwapchain = vk_state->swapchain;
+
+    // Nothing is touched until the new swapchain exists, a failed
+    // recreation keeps the old one
+    VkSwapchainKHR swapchain;
+    if (vkCreateSwapchainKHR(vk_state->device, &create_info, NULL, &swapchain) != VK_SUCCESS) {
         set_error("Error creating swapchain");
         return AH_FAILURE;
     }
+    vk_state->swapchain = swapchain;
 
     vkGetSwapchainImagesKHR(vk_state->device, vk_state->swapchain, &vk_state->num_swapchain_images, NULL);
     vk_state->swapchain_images = (VkImage*)malloc(sizeof(VkImage)*vk_state->num_swapchain_images);
     vkGetSwapchainImagesKHR(vk_state->device, vk_state->swapchain, &vk_state->num_swapchain_images, vk_state->swapchain_images);
     vk_state->swapchain_extent = extent;
     vk_state->swapchain_image_format = surface_format.format;
+    vk_state->active_present_mode = present_mode;
+    printf("Swapchain %ux%u, %s present mode\n", extent.width, extent.height, ah_vk_present_mode_name(present_mode));
 
     return AH_SUCCESS;
 }
@@ -420,13 +972,13 @@ AH_RESULT ah_vk_create_image_views(vulkan_state_t *vk_state) {
     return AH_SUCCESS;
 }
 
-AH_RESULT create_shader_module(vulkan_state_t *vk_state, buffer_t *spv_buffer, VkShaderModule *module) {
+AH_RESULT create_shader_module(VkDevice device, buffer_t *spv_buffer, VkShaderModule *module) {
     VkShaderModuleCreateInfo create_info = {};
     create_info.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
     create_info.codeSize = spv_buffer->size;
     create_info.pCode = (uint32_t*)&spv_buffer->data;
 
-    if (vkCreateShaderModule(vk_state->device, &create_info, NULL, module) != VK_SUCCESS) {
+    if (vkCreateShaderModule(device, &create_info, NULL, module) != VK_SUCCESS) {
         set_error("Error creating shadow module");
         return AH_FAILURE;
     }
@@ -434,6 +986,24 @@ AH_RESULT create_shader_module(vulkan_state_t *vk_state, buffer_t *spv_buffer, V
     return AH_SUCCESS;
 }
 
+/// First depth format the device can render to, one of the two is always
+/// supported
+AH_RESULT ah_vk_pick_depth_format(vulkan_state_t *vk_state) {
+    VkFormat candidates[] = {VK_FORMAT_D32_SFLOAT, VK_FORMAT_X8_D24_UNORM_PACK32};
+
+    for (uint32_t i = 0; i < sizeof(candidates) / sizeof(candidates[0]); i++) {
+        VkFormatProperties properties;
+        vkGetPhysicalDeviceFormatProperties(vk_state->physical_device, candidates[i], &properties);
+        if (properties.optimalTilingFeatures & VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT) {
+            vk_state->depth_format = candidates[i];
+            return AH_SUCCESS;
+        }
+    }
+
+    set_error("No supported depth format");
+    return AH_FAILURE;
+}
+
 AH_RESULT ah_vk_create_render_pass(vulkan_state_t *vk_state) {
     VkAttachmentDescription color_attachment = {};
     color_attachment.format = vk_state->swapchain_image_format;
@@ -442,34 +1012,43 @@ AH_RESULT ah_vk_create_render_pass(vulkan_state_t *vk_state) {
     color_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
     color_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
     color_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
-    color_attachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-    color_attachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+    // The render graph moves the image in and out of the attachment layout
+    // with its own barriers
+    color_attachment.initialLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+    color_attachment.finalLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+
+    VkAttachmentDescription depth_attachment = {};
+    depth_attachment.format = vk_state->depth_format;
+    depth_attachment.samples = VK_SAMPLE_COUNT_1_BIT;
+    depth_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+    depth_attachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    depth_attachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
+    depth_attachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+    depth_attachment.initialLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+    depth_attachment.finalLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
+    VkAttachmentDescription attachments[] = {color_attachment, depth_attachment};
 
     VkAttachmentReference color_attachment_ref = {};
     color_attachment_ref.attachment = 0;
     color_attachment_ref.layout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
 
+    VkAttachmentReference depth_attachment_ref = {};
+    depth_attachment_ref.attachment = 1;
+    depth_attachment_ref.layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+
     VkSubpassDescription subpass = {};
     subpass.pipelineBindPoint = VK_PIPELINE_BIND_POINT_GRAPHICS;
     subpass.colorAttachmentCount = 1;
     subpass.pColorAttachments = &color_attachment_ref;
-
-    VkSubpassDependency dependency = {};
-    dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
-    dependency.dstSubpass = 0;
-    dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-    dependency.srcAccessMask = 0;
-    dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-    dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    subpass.pDepthStencilAttachment = &depth_attachment_ref;
 
     VkRenderPassCreateInfo render_pass_info = {};
     render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_CREATE_INFO;
-    render_pass_info.attachmentCount = 1;
-    render_pass_info.pAttachments = &color_attachment;
+    render_pass_info.attachmentCount = 2;
+    render_pass_info.pAttachments = attachments;
     render_pass_info.subpassCount = 1;
     render_pass_info.pSubpasses = &subpass;
-    render_pass_info.dependencyCount = 1;
-    render_pass_info.pDependencies = &dependency;
 
     if (vkCreateRenderPass(vk_state->device, &render_pass_info, NULL, &vk_state->render_pass) != VK_SUCCESS) {
         set_error("Error creating render pass");
@@ -479,9 +1058,18 @@ AH_RESULT ah_vk_create_render_pass(vulkan_state_t *vk_state) {
     return AH_SUCCESS;
 }
 
-AH_RESULT ah_vk_create_graphics_pipeline(vulkan_state_t *vk_state) {
-    buffer_t *vert_shader_code = read_file("./shader_vert.spv");
-    buffer_t *frag_shader_code = read_file("./shader_frag.spv");
+/// Build one graphics pipeline from its description. Only touches `device`
+/// and `pipeline_cache`, so it is safe to call from worker threads.
+AH_RESULT ah_vk_build_graphics_pipeline(VkDevice device, VkPipelineCache pipeline_cache, const ah_graphics_pipeline_desc_t *desc, VkPipeline *pipeline) {
+    buffer_t *vert_shader_code = read_file((char*)desc->vert_path);
+    buffer_t *frag_shader_code = read_file((char*)desc->frag_path);
+
+    if (!vert_shader_code || !frag_shader_code) {
+        free(vert_shader_code);
+        free(frag_shader_code);
+        set_error("Error reading shader code");
+        return AH_FAILURE;
+    }
 
     printf("VERT: %ld bytes\n", vert_shader_code->size);
     printf("FRAG: %ld bytes\n", frag_shader_code->size);
@@ -489,8 +1077,20 @@ AH_RESULT ah_vk_create_graphics_pipeline(vulkan_state_t *vk_state) {
     VkShaderModule vert_shader_module;
     VkShaderModule frag_shader_module;
 
-    create_shader_module(vk_state, vert_shader_code, &vert_shader_module);
-    create_shader_module(vk_state, frag_shader_code, &frag_shader_module);
+    AH_RESULT vert_result = create_shader_module(device, vert_shader_code, &vert_shader_module);
+    AH_RESULT frag_result = create_shader_module(device, frag_shader_code, &frag_shader_module);
+    free(vert_shader_code);
+    free(frag_shader_code);
+
+    if (vert_result != AH_SUCCESS || frag_result != AH_SUCCESS) {
+        if (vert_result == AH_SUCCESS) {
+            vkDestroyShaderModule(device, vert_shader_module, NULL);
+        }
+        if (frag_result == AH_SUCCESS) {
+            vkDestroyShaderModule(device, frag_shader_module, NULL);
+        }
+        return AH_FAILURE;
+    }
 
     VkPipelineShaderStageCreateInfo vert_shader_stage_info = {};
     vert_shader_stage_info.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
@@ -519,34 +1119,32 @@ AH_RESULT ah_vk_create_graphics_pipeline(vulkan_state_t *vk_state) {
     dynamic_state.dynamicStateCount = 2;
     dynamic_state.pDynamicStates = dynamic_states;
 
-    VkVertexInputBindingDescription bind_desc = get_vertex_binding_description();
-    vertex_input_attribute_description_t attr_descs = get_vertex_attribute_descriptions();
+    VkVertexInputBindingDescription bind_descs[2];
+    uint32_t num_bind_descs = 0;
+    bind_descs[num_bind_descs++] = get_vertex_binding_description(desc->vertex_format);
+
+    vertex_input_attribute_description_t attr_descs;
+    if (desc->instanced) {
+        bind_descs[num_bind_descs++] = get_instance_binding_description();
+        attr_descs = get_instanced_attribute_descriptions(desc->vertex_format);
+    } else {
+        attr_descs = get_vertex_attribute_descriptions(desc->vertex_format);
+    }
 
     VkPipelineVertexInputStateCreateInfo vertex_input_info = {};
     vertex_input_info.sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-    vertex_input_info.vertexBindingDescriptionCount = 1;
-    vertex_input_info.pVertexBindingDescriptions = &bind_desc;
+    vertex_input_info.vertexBindingDescriptionCount = num_bind_descs;
+    vertex_input_info.pVertexBindingDescriptions = bind_descs;
     vertex_input_info.vertexAttributeDescriptionCount = attr_descs.num_attributes;
     vertex_input_info.pVertexAttributeDescriptions = attr_descs.attr_desc;
 
     VkPipelineInputAssemblyStateCreateInfo input_assembly = {};
     input_assembly.sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-    input_assembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+    input_assembly.topology = desc->topology;
     input_assembly.primitiveRestartEnable = VK_FALSE;
 
-    VkViewport viewport = {};
-    viewport.x = 0.0f;
-    viewport.y = 0.0f;
-    viewport.width = (float)vk_state->swapchain_extent.width;
-    viewport.height = (float)vk_state->swapchain_extent.height;
-    viewport.minDepth = 0.0f;
-    viewport.maxDepth = 1.0f;
-
-    VkRect2D scissor = {};
-    scissor.offset.x = 0;
-    scissor.offset.y = 0;
-    scissor.extent = vk_state->swapchain_extent;
-
+    // Viewport and scissor are dynamic, so the pipeline outlives swapchain
+    // size changes
     VkPipelineViewportStateCreateInfo viewport_state = {};
     viewport_state.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
     viewport_state.viewportCount = 1;
@@ -558,7 +1156,7 @@ AH_RESULT ah_vk_create_graphics_pipeline(vulkan_state_t *vk_state) {
     rasterizer.rasterizerDiscardEnable = VK_FALSE;
     rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
     rasterizer.lineWidth = 1.0f;
-    rasterizer.cullMode = VK_CULL_MODE_BACK_BIT;
+    rasterizer.cullMode = desc->cull_mode;
     rasterizer.frontFace = VK_FRONT_FACE_CLOCKWISE;
     rasterizer.depthBiasEnable = VK_FALSE;
     rasterizer.depthBiasConstantFactor = 0.0f;
@@ -591,15 +1189,13 @@ AH_RESULT ah_vk_create_graphics_pipeline(vulkan_state_t *vk_state) {
     color_blending.attachmentCount = 1;
     color_blending.pAttachments = &color_blend_attachment;
 
-    VkPipelineLayoutCreateInfo pipeline_layout_info = {};
-    pipeline_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
-    pipeline_layout_info.setLayoutCount = 0;
-    pipeline_layout_info.pSetLayouts = NULL;
-
-    if (vkCreatePipelineLayout(vk_state->device, &pipeline_layout_info, NULL, &vk_state->pipeline_layout) != VK_SUCCESS) {
-        set_error("Error creating pipeline layout");
-        return AH_FAILURE;
-    }
+    VkPipelineDepthStencilStateCreateInfo depth_stencil = {};
+    depth_stencil.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+    depth_stencil.depthTestEnable = VK_TRUE;
+    depth_stencil.depthWriteEnable = VK_TRUE;
+    depth_stencil.depthCompareOp = VK_COMPARE_OP_LESS;
+    depth_stencil.depthBoundsTestEnable = VK_FALSE;
+    depth_stencil.stencilTestEnable = VK_FALSE;
 
     VkGraphicsPipelineCreateInfo pipeline_info = {};
     pipeline_info.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
@@ -610,22 +1206,115 @@ AH_RESULT ah_vk_create_graphics_pipeline(vulkan_state_t *vk_state) {
     pipeline_info.pViewportState = &viewport_state;
     pipeline_info.pRasterizationState = &rasterizer;
     pipeline_info.pMultisampleState = &multisampling;
-    pipeline_info.pDepthStencilState = NULL;
+    pipeline_info.pDepthStencilState = desc->depth_format != VK_FORMAT_UNDEFINED ? &depth_stencil : NULL;
     pipeline_info.pColorBlendState = &color_blending;
     pipeline_info.pDynamicState = &dynamic_state;
-    pipeline_info.layout = vk_state->pipeline_layout;
-    pipeline_info.renderPass = vk_state->render_pass;
-    pipeline_info.subpass = 0;
+    pipeline_info.layout = desc->layout;
+    pipeline_info.renderPass = desc->render_pass;
+    pipeline_info.subpass = desc->subpass;
+
+    // Without a render pass the attachment formats are all the pipeline
+    // has to know about its target
+    VkPipelineRenderingCreateInfo rendering_info = {};
+    rendering_info.sType = VK_STRUCTURE_TYPE_PIPELINE_RENDERING_CREATE_INFO;
+    rendering_info.colorAttachmentCount = 1;
+    rendering_info.pColorAttachmentFormats = &desc->color_format;
+    rendering_info.depthAttachmentFormat = desc->depth_format;
+    rendering_info.stencilAttachmentFormat = VK_FORMAT_UNDEFINED;
+    if (desc->render_pass == VK_NULL_HANDLE) {
+        pipeline_info.pNext = &rendering_info;
+    }
     pipeline_info.basePipelineHandle = VK_NULL_HANDLE;
     pipeline_info.basePipelineIndex = -1;
 
-    if (vkCreateGraphicsPipelines(vk_state->device, VK_NULL_HANDLE, 1, &pipeline_info, NULL, &vk_state->pipeline) != VK_SUCCESS) {
+    VkResult result = vkCreateGraphicsPipelines(device, pipeline_cache, 1, &pipeline_info, NULL, pipeline);
+
+    vkDestroyShaderModule(device, vert_shader_module, NULL);
+    vkDestroyShaderModule(device, frag_shader_module, NULL);
+
+    if (result != VK_SUCCESS) {
         set_error("Error creating graphics pipeline");
         return AH_FAILURE;
     }
 
-    vkDestroyShaderModule(vk_state->device, vert_shader_module, NULL);
-    vkDestroyShaderModule(vk_state->device, frag_shader_module, NULL);
+    return AH_SUCCESS;
+}
+
+/// Build one compute pipeline, thread safe like
+/// `ah_vk_build_graphics_pipeline`
+AH_RESULT ah_vk_build_compute_pipeline(VkDevice device, VkPipelineCache pipeline_cache, const ah_compute_pipeline_desc_t *desc, VkPipeline *pipeline) {
+    buffer_t *comp_shader_code = read_file((char*)desc->comp_path);
+    if (!comp_shader_code) {
+        set_error("Error reading shader code");
+        return AH_FAILURE;
+    }
+
+    VkShaderModule comp_shader_module;
+    AH_RESULT comp_result = create_shader_module(device, comp_shader_code, &comp_shader_module);
+    free(comp_shader_code);
+    if (comp_result != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
+
+    VkComputePipelineCreateInfo pipeline_info = {};
+    pipeline_info.sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+    pipeline_info.stage.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+    pipeline_info.stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+    pipeline_info.stage.module = comp_shader_module;
+    pipeline_info.stage.pName = "main";
+    pipeline_info.layout = desc->layout;
+    pipeline_info.basePipelineHandle = VK_NULL_HANDLE;
+    pipeline_info.basePipelineIndex = -1;
+
+    VkResult result = vkCreateComputePipelines(device, pipeline_cache, 1, &pipeline_info, NULL, pipeline);
+    vkDestroyShaderModule(device, comp_shader_module, NULL);
+
+    if (result != VK_SUCCESS) {
+        set_error("Error creating compute pipeline");
+        return AH_FAILURE;
+    }
+
+    return AH_SUCCESS;
+}
+
+/// Create the pipeline layout and start building the scene pipeline on the
+/// job pool. `ah_vk_init` waits for it right before the first frame.
+AH_RESULT ah_vk_create_graphics_pipeline(vulkan_state_t *vk_state) {
+    VkPipelineLayoutCreateInfo pipeline_layout_info = {};
+    pipeline_layout_info.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+    // Bindless resources, then the per-frame ranges at AH_FRAME_ALLOC_SET
+    VkDescriptorSetLayout set_layouts[] = {vk_state->bindless.set_layout, vk_state->frame_alloc.set_layout};
+    pipeline_layout_info.setLayoutCount = 2;
+    pipeline_layout_info.pSetLayouts = set_layouts;
+
+    // Position dequantisation and material of the mesh being drawn, see
+    // ah_draw_t, followed by room for small per-draw data
+    VkPushConstantRange push_constant_range = {};
+    push_constant_range.stageFlags = AH_DRAW_CONSTANT_STAGES;
+    push_constant_range.offset = 0;
+    push_constant_range.size = AH_PUSH_CONSTANT_SIZE;
+    pipeline_layout_info.pushConstantRangeCount = 1;
+    pipeline_layout_info.pPushConstantRanges = &push_constant_range;
+
+    if (vkCreatePipelineLayout(vk_state->device, &pipeline_layout_info, NULL, &vk_state->pipeline_layout) != VK_SUCCESS) {
+        set_error("Error creating pipeline layout");
+        return AH_FAILURE;
+    }
+
+    ah_graphics_pipeline_desc_t desc = {};
+    desc.vert_path = "./shader_vert.spv";
+    desc.frag_path = "./shader_frag.spv";
+    desc.layout = vk_state->pipeline_layout;
+    desc.render_pass = vk_state->render_pass;
+    desc.subpass = 0;
+    desc.color_format = vk_state->swapchain_image_format;
+    desc.depth_format = vk_state->depth_format;
+    desc.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+    desc.cull_mode = VK_CULL_MODE_BACK_BIT;
+    desc.vertex_format = vk_state->mesh.vertex_format;
+
+    ah_pipeline_builder_submit(&vk_state->pipeline_builder, &desc, &vk_state->pipeline_future, NULL, NULL);
+    ah_hot_reload_track_graphics(vk_state, "scene", &desc, &vk_state->pipeline);
 
     return AH_SUCCESS;
 }
@@ -635,13 +1324,14 @@ AH_RESULT ah_vk_create_framebuffers(vulkan_state_t *vk_state) {
 
     for (int i = 0; i < vk_state->num_swapchain_images; i++) {
         VkImageView attachments[] = {
-            vk_state->swapchain_image_views[i]
+            vk_state->swapchain_image_views[i],
+            ah_render_graph_image_view(&vk_state->render_graph, vk_state->depth)
         };
 
         VkFramebufferCreateInfo framebuffer_info = {};
         framebuffer_info.sType = VK_STRUCTURE_TYPE_FRAMEBUFFER_CREATE_INFO;
         framebuffer_info.renderPass = vk_state->render_pass;
-        framebuffer_info.attachmentCount = 1;
+        framebuffer_info.attachmentCount = 2;
         framebuffer_info.pAttachments = attachments;
         framebuffer_info.width = vk_state->swapchain_extent.width;
         framebuffer_info.height = vk_state->swapchain_extent.height;
@@ -656,6 +1346,109 @@ AH_RESULT ah_vk_create_framebuffers(vulkan_state_t *vk_state) {
     return AH_SUCCESS;
 }
 
+void destroy_retired_swapchain(vulkan_state_t *vk_state, vulkan_retired_swapchain_t *retired) {
+    for (uint32_t i = 0; i < retired->num_images; i++) {
+        if (retired->framebuffers) {
+            vkDestroyFramebuffer(vk_state->device, retired->framebuffers[i], NULL);
+        }
+        vkDestroyImageView(vk_state->device, retired->image_views[i], NULL);
+        vkDestroySemaphore(vk_state->device, retired->render_finished_semaphores[i], NULL);
+    }
+    vkDestroySwapchainKHR(vk_state->device, retired->swapchain, NULL);
+
+    free(retired->images);
+    free(retired->image_views);
+    free(retired->framebuffers);
+    free(retired->render_finished_semaphores);
+}
+
+/// Destroy the retired swapchains no submitted frame can still be using.
+/// Only reads the graphics timeline, never blocks.
+void ah_vk_collect_retired_swapchains(vulkan_state_t *vk_state) {
+    uint32_t num_kept = 0;
+
+    for (uint32_t i = 0; i < vk_state->num_retired_swapchains; i++) {
+        vulkan_retired_swapchain_t *retired = &vk_state->retired_swapchains[i];
+
+        if (ah_scheduler_poll(vk_state, AH_QUEUE_GRAPHICS, retired->retire_value)) {
+            destroy_retired_swapchain(vk_state, retired);
+        } else {
+            vk_state->retired_swapchains[num_kept++] = *retired;
+        }
+    }
+
+    vk_state->num_retired_swapchains = num_kept;
+}
+
+/// Replace the swapchain after a resize or an out of date error. Only the
+/// swapchain, its views, framebuffers, present semaphores and the graph's
+/// transients are rebuilt. The render pass and pipelines stay valid since
+/// viewport and scissor are dynamic. The old objects are retired instead
+/// of waiting for the device to go idle.
+AH_RESULT ah_vk_recreate_swapchain(vulkan_state_t *vk_state) {
+    if (vk_state->headless) {
+        vk_state->swapchain_dirty = false;
+        return AH_SUCCESS;
+    }
+
+    // A minimized window has no size, stay dirty until it gets one back
+    populate_swapchain_support(vk_state);
+    VkExtent2D extent = choose_swap_extent(vk_state);
+    if (extent.width == 0 || extent.height == 0) {
+        return AH_SUCCESS;
+    }
+
+    // Resizing faster than frames retire, drain them instead of keeping
+    // more swapchains alive
+    if (vk_state->num_retired_swapchains == AH_MAX_RETIRED_SWAPCHAINS) {
+        if (ah_scheduler_wait(vk_state, AH_QUEUE_GRAPHICS, vk_state->scheduler.timelines[AH_QUEUE_GRAPHICS].submitted) != AH_SUCCESS) {
+            return AH_FAILURE;
+        }
+        for (uint32_t i = 0; i < vk_state->num_retired_swapchains; i++) {
+            destroy_retired_swapchain(vk_state, &vk_state->retired_swapchains[i]);
+        }
+        vk_state->num_retired_swapchains = 0;
+    }
+
+    vulkan_retired_swapchain_t old = {};
+    old.swapchain = vk_state->swapchain;
+    old.num_images = vk_state->num_swapchain_images;
+    old.images = vk_state->swapchain_images;
+    old.image_views = vk_state->swapchain_image_views;
+    old.framebuffers = vk_state->swapchain_framebuffers;
+    old.render_finished_semaphores = vk_state->render_finished_semaphores;
+    // The last frame presenting to the old swapchain is the last one
+    // touching its images and semaphores
+    old.retire_value = vk_state->last_present_value;
+    VkFormat old_format = vk_state->swapchain_image_format;
+
+    if (ah_vk_create_swapchain(vk_state) != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
+    ah_pacing_reset(vk_state);
+
+    vk_state->retired_swapchains[vk_state->num_retired_swapchains++] = old;
+    vk_state->last_present_value = 0;
+    vk_state->swapchain_image_views = NULL;
+    vk_state->swapchain_framebuffers = NULL;
+    vk_state->render_finished_semaphores = NULL;
+
+    if (vk_state->swapchain_image_format != old_format) {
+        set_error("Swapchain format changed, pipelines are incompatible");
+        return AH_FAILURE;
+    }
+
+    if (ah_vk_create_image_views(vk_state) != AH_SUCCESS ||
+        ah_vk_create_render_finished_semaphores(vk_state) != AH_SUCCESS ||
+        ah_render_graph_compile(vk_state, &vk_state->render_graph) != AH_SUCCESS ||
+        (!vk_state->features.dynamic_rendering && ah_vk_create_framebuffers(vk_state) != AH_SUCCESS)) {
+        return AH_FAILURE;
+    }
+
+    vk_state->swapchain_dirty = false;
+    return AH_SUCCESS;
+}
+
 AH_RESULT ah_vk_create_command_pool(vulkan_state_t *vk_state) {
     VkCommandPoolCreateInfo pool_info = {};
     pool_info.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
@@ -675,9 +1468,9 @@ AH_RESULT ah_vk_create_command_buffer(vulkan_state_t *vk_state) {
     alloc_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
     alloc_info.commandPool = vk_state->command_pool;
     alloc_info.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-    alloc_info.commandBufferCount = 1;
+    alloc_info.commandBufferCount = vk_state->frames_in_flight;
 
-    if (vkAllocateCommandBuffers(vk_state->device, &alloc_info, &vk_state->command_buffer) != VK_SUCCESS) {
+    if (vkAllocateCommandBuffers(vk_state->device, &alloc_info, vk_state->command_buffers) != VK_SUCCESS) {
         set_error("Error creating command buffer");
         return AH_FAILURE;
     }
@@ -685,6 +1478,133 @@ AH_RESULT ah_vk_create_command_buffer(vulkan_state_t *vk_state) {
     return AH_SUCCESS;
 }
 
+/// Start rendering into the backbuffer, through the render pass or
+/// dynamic rendering
+void begin_scene_rendering(const ah_graph_pass_context_t *context, bool secondaries) {
+    vulkan_state_t *vk_state = context->vk_state;
+    VkClearValue clear_values[2] = {};
+    clear_values[0].color = (VkClearColorValue){{0.0f, 0.0f, 0.0f, 1.0f}};
+    clear_values[1].depthStencil.depth = 1.0f;
+    VkRect2D render_area = {};
+    render_area.extent = vk_state->swapchain_extent;
+
+    if (vk_state->features.dynamic_rendering) {
+        VkRenderingAttachmentInfo color_attachment = {};
+        color_attachment.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO;
+        color_attachment.imageView = ah_render_graph_image_view(context->graph, vk_state->backbuffer);
+        color_attachment.imageLayout = VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL;
+        color_attachment.resolveMode = VK_RESOLVE_MODE_NONE;
+        color_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+        color_attachment.storeOp = VK_ATTACHMENT_STORE_OP_STORE;
+        color_attachment.clearValue = clear_values[0];
+
+        // Only lives through the scene pass, never stored
+        VkRenderingAttachmentInfo depth_attachment = {};
+        depth_attachment.sType = VK_STRUCTURE_TYPE_RENDERING_ATTACHMENT_INFO;
+        depth_attachment.imageView = ah_render_graph_image_view(context->graph, vk_state->depth);
+        depth_attachment.imageLayout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL;
+        depth_attachment.resolveMode = VK_RESOLVE_MODE_NONE;
+        depth_attachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
+        depth_attachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+        depth_attachment.clearValue = clear_values[1];
+
+        VkRenderingInfo rendering_info = {};
+        rendering_info.sType = VK_STRUCTURE_TYPE_RENDERING_INFO;
+        rendering_info.flags = secondaries ? VK_RENDERING_CONTENTS_SECONDARY_COMMAND_BUFFERS_BIT : 0;
+        rendering_info.renderArea = render_area;
+        rendering_info.layerCount = 1;
+        rendering_info.colorAttachmentCount = 1;
+        rendering_info.pColorAttachments = &color_attachment;
+        rendering_info.pDepthAttachment = &depth_attachment;
+
+        vkCmdBeginRendering(context->command_buffer, &rendering_info);
+        return;
+    }
+
+    VkRenderPassBeginInfo render_pass_info = {};
+    render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+    render_pass_info.renderPass = vk_state->render_pass;
+    render_pass_info.framebuffer = vk_state->swapchain_framebuffers[context->image_index];
+    render_pass_info.renderArea = render_area;
+    render_pass_info.clearValueCount = 2;
+    render_pass_info.pClearValues = clear_values;
+
+    vkCmdBeginRenderPass(
+        context->command_buffer,
+        &render_pass_info,
+        secondaries ? VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS : VK_SUBPASS_CONTENTS_INLINE
+    );
+}
+
+/// The scene pass of the render graph, every draw and the instances into
+/// the backbuffer
+AH_RESULT record_scene_pass(const ah_graph_pass_context_t *context, void *user) {
+    (void)user;
+    vulkan_state_t *vk_state = context->vk_state;
+    VkCommandBuffer command_buffer = context->command_buffer;
+
+    // Small draw lists are cheaper to record inline than to fan out. A
+    // subpass of secondaries can only execute them, so only the inline path
+    // times draws separately.
+    if (vk_state->num_draws >= 2 * AH_RECORD_MIN_DRAWS_PER_JOB) {
+        begin_scene_rendering(context, true);
+        if (ah_record_parallel(vk_state, command_buffer, context->frame, context->image_index) != AH_SUCCESS) {
+            return AH_FAILURE;
+        }
+    } else {
+        begin_scene_rendering(context, false);
+
+        uint32_t draws_scope = ah_profiler_begin(vk_state, command_buffer, "draws");
+        ah_record_draws(vk_state, command_buffer, vk_state->draws, vk_state->num_draws);
+        ah_profiler_end(vk_state, command_buffer, draws_scope);
+
+        uint32_t instances_scope = ah_profiler_begin(vk_state, command_buffer, "instances");
+        ah_instancing_record(vk_state, command_buffer);
+        ah_profiler_end(vk_state, command_buffer, instances_scope);
+    }
+
+    if (vk_state->features.dynamic_rendering) {
+        vkCmdEndRendering(command_buffer);
+    } else {
+        vkCmdEndRenderPass(command_buffer);
+    }
+    return AH_SUCCESS;
+}
+
+/// Declare the frame's passes. The backbuffer is the swapchain image, or
+/// the offscreen target when headless, and is set again every frame.
+AH_RESULT ah_vk_create_render_graph(vulkan_state_t *vk_state) {
+    ah_render_graph_t *graph = &vk_state->render_graph;
+    ah_render_graph_init(graph);
+
+    // Acquire waits at color attachment output, the first barrier chains
+    // onto it. Offscreen targets are never presented, leave them ready to
+    // be copied out.
+    vk_state->backbuffer = ah_render_graph_import(
+        graph,
+        "backbuffer",
+        VK_IMAGE_LAYOUT_UNDEFINED,
+        VK_PIPELINE_STAGE_2_COLOR_ATTACHMENT_OUTPUT_BIT,
+        vk_state->headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR
+    );
+
+    // Follows the swapchain extent
+    VkExtent2D depth_extent = {};
+    vk_state->depth = ah_render_graph_create_image(graph, "depth", vk_state->depth_format, depth_extent);
+
+    uint32_t scene_pass = ah_render_graph_add_pass(graph, "scene pass", record_scene_pass, NULL);
+    ah_render_graph_use(graph, scene_pass, vk_state->backbuffer, AH_GRAPH_COLOR_ATTACHMENT);
+    ah_render_graph_use(graph, scene_pass, vk_state->depth, AH_GRAPH_DEPTH_ATTACHMENT);
+
+    if (vk_state->capture.enabled) {
+        uint32_t capture_pass = ah_render_graph_add_pass(graph, "capture", ah_capture_record, NULL);
+        ah_render_graph_use(graph, capture_pass, vk_state->backbuffer, AH_GRAPH_TRANSFER_SRC);
+        ah_render_graph_keep(graph, capture_pass);
+    }
+
+    return ah_render_graph_compile(vk_state, graph);
+}
+
 AH_RESULT ah_vk_record_command_buffer(vulkan_state_t *vk_state, VkCommandBuffer command_buffer, uint32_t image_index, uint32_t index) {
     VkCommandBufferBeginInfo begin_info = {};
     begin_info.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
@@ -696,44 +1616,30 @@ AH_RESULT ah_vk_record_command_buffer(vulkan_state_t *vk_state, VkCommandBuffer
         return AH_FAILURE;
     }
 
-    VkRenderPassBeginInfo render_pass_info = {};
-    render_pass_info.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-    render_pass_info.renderPass = vk_state->render_pass;
-    render_pass_info.framebuffer = vk_state->swapchain_framebuffers[image_index];
-    render_pass_info.renderArea.offset.x = 0;
-    render_pass_info.renderArea.offset.y = 0;
-    render_pass_info.renderArea.extent = vk_state->swapchain_extent;
-
-    VkClearValue clear_color = {{{0.0f, 0.0f, 0.0f, 1.0f}}};
-    render_pass_info.clearValueCount = 1;
-    render_pass_info.pClearValues = &clear_color;
+    ah_profiler_frame_begin(vk_state, command_buffer);
 
-    vkCmdBeginRenderPass(command_buffer, &render_pass_info, VK_SUBPASS_CONTENTS_INLINE);
-
-    vkCmdBindPipeline(command_buffer, VK_PIPELINE_BIND_POINT_GRAPHICS, vk_state->pipeline);
-
-    VkViewport viewport = {};
-    viewport.x = 0.0f;
-    viewport.y = 0.0f;
-    viewport.width = (float)vk_state->swapchain_extent.width;
-    viewport.height = (float)vk_state->swapchain_extent.height;
-    viewport.minDepth = 0.0f;
-    viewport.maxDepth = 1.0f;
-    vkCmdSetViewport(command_buffer, 0, 1, &viewport);
+    // Read by every scene draw through the per-frame set
+    ah_frame_uniforms_t uniforms = {};
+    glm_mat4_copy(vk_state->view_projection, uniforms.view_projection);
+    uniforms.index = index;
+    uniforms.frame_count = (uint32_t)vk_state->frame_count;
+    if (ah_frame_alloc_write(vk_state, &uniforms, sizeof(uniforms), &vk_state->frame_uniforms) != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
 
-    VkRect2D scissor = {};
-    scissor.offset.x = 0;
-    scissor.offset.y = 0;
-    scissor.extent = vk_state->swapchain_extent;
-    vkCmdSetScissor(command_buffer, 0, 1, &scissor);
+    ah_textures_record(vk_state, command_buffer);
+    ah_instancing_record_update(vk_state, command_buffer);
 
-    VkBuffer vertex_buffers[1] = {vk_state->vertex_buffer};
-    VkDeviceSize offsets[1] = {0};
-    vkCmdBindVertexBuffers(command_buffer, 0, 1, vertex_buffers, offsets);
+    // Ahead of the graph, the scene pass draws what it leaves visible
+    ah_culling_record(vk_state, command_buffer, vk_state->current_frame);
 
-    vkCmdDraw(command_buffer, 3, 1, 0, 0);
+    ah_render_graph_t *graph = &vk_state->render_graph;
+    ah_render_graph_set_image(graph, vk_state->backbuffer, vk_state->swapchain_images[image_index], vk_state->swapchain_image_views[image_index]);
+    if (ah_render_graph_execute(vk_state, graph, command_buffer, vk_state->current_frame, image_index) != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
 
-    vkCmdEndRenderPass(command_buffer);
+    ah_profiler_frame_end(vk_state, command_buffer);
 
     if (vkEndCommandBuffer(command_buffer) != VK_SUCCESS) {
         set_error("Couldn't end command buffer");
@@ -747,74 +1653,279 @@ AH_RESULT ah_vk_record_command_buffer(vulkan_state_t *vk_state, VkCommandBuffer
 AH_RESULT ah_vk_create_sync_objects(vulkan_state_t *vk_state) {
     VkSemaphoreCreateInfo semaphore_info = {};
     semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-    VkFenceCreateInfo fence_info = {};
-    fence_info.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
-    fence_info.flags = VK_FENCE_CREATE_SIGNALED_BIT;
 
-    if (vkCreateSemaphore(vk_state->device, &semaphore_info, NULL, &vk_state->image_available_sempahore) != VK_SUCCESS ||
-        vkCreateSemaphore(vk_state->device, &semaphore_info, NULL, &vk_state->render_finished_semaphore) != VK_SUCCESS ||
-        vkCreateFence(vk_state->device, &fence_info, NULL, &vk_state->in_flight_fence) != VK_SUCCESS) {
-       set_error("Failed to create sync objects") ;
-       return AH_FAILURE;
+    // Frame slots are tracked by the graphics timeline, only acquire needs
+    // binary semaphores
+    for (uint32_t i = 0; i < vk_state->frames_in_flight; i++) {
+        if (vkCreateSemaphore(vk_state->device, &semaphore_info, NULL, &vk_state->image_available_semaphores[i]) != VK_SUCCESS) {
+           set_error("Failed to create sync objects");
+           return AH_FAILURE;
+        }
     }
 
-    return AH_SUCCESS;
+    return ah_vk_create_render_finished_semaphores(vk_state);
 }
 
-AH_RESULT find_memory_type(vulkan_state_t *vk_state, uint32_t type_filter, VkMemoryPropertyFlags properties, uint32_t *memory_type) {
-    VkPhysicalDeviceMemoryProperties mem_properties;
-    vkGetPhysicalDeviceMemoryProperties(vk_state->physical_device, &mem_properties);
+AH_RESULT ah_vk_create_render_finished_semaphores(vulkan_state_t *vk_state) {
+    VkSemaphoreCreateInfo semaphore_info = {};
+    semaphore_info.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
 
-    for (uint32_t i = 0; i < mem_properties.memoryTypeCount; i++) {
-        if (type_filter & (1 << i) && (mem_properties.memoryTypes[i].propertyFlags & properties) == properties) {
-            *memory_type = i;
-            return AH_SUCCESS;
+    vk_state->render_finished_semaphores = (VkSemaphore*)malloc(sizeof(VkSemaphore)*vk_state->num_swapchain_images);
+    for (uint32_t i = 0; i < vk_state->num_swapchain_images; i++) {
+        if (vkCreateSemaphore(vk_state->device, &semaphore_info, NULL, &vk_state->render_finished_semaphores[i]) != VK_SUCCESS) {
+           set_error("Failed to create sync objects");
+           return AH_FAILURE;
         }
     }
 
-    set_error("Couldn't find appropriate memory type");
-    return AH_FAILURE;
+    return AH_SUCCESS;
 }
 
-AH_RESULT ah_vk_create_vertex_buffer(vulkan_state_t *vk_state) {
+AH_RESULT ah_vk_create_buffer(vulkan_state_t *vk_state, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer *buffer, ah_allocation_t *allocation) {
     VkBufferCreateInfo buffer_info = {};
     buffer_info.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-    buffer_info.size = sizeof(vertices[0]) * 3;
-    buffer_info.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
+    buffer_info.size = size;
+    buffer_info.usage = usage;
     buffer_info.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
 
-    if (vkCreateBuffer(vk_state->device, &buffer_info, NULL, &vk_state->vertex_buffer) != VK_SUCCESS) {
-        set_error("Failed to create vertex buffer");
+    // Buffers filled by the transfer queue or accessed by compute are read
+    // by the graphics queue, sharing them avoids queue family ownership
+    // transfers
+    uint32_t queue_family_indices[3] = {vk_state->queue_family_indices.graphics_family};
+    uint32_t num_queue_families = 1;
+    if ((usage & VK_BUFFER_USAGE_TRANSFER_DST_BIT) && vk_state->queue_family_indices.transfer_family != queue_family_indices[0]) {
+        queue_family_indices[num_queue_families++] = vk_state->queue_family_indices.transfer_family;
+    }
+    if ((usage & VK_BUFFER_USAGE_STORAGE_BUFFER_BIT) &&
+        vk_state->queue_family_indices.compute_family != queue_family_indices[0] &&
+        vk_state->queue_family_indices.compute_family != queue_family_indices[num_queue_families - 1]) {
+        queue_family_indices[num_queue_families++] = vk_state->queue_family_indices.compute_family;
+    }
+
+    if (num_queue_families > 1) {
+        buffer_info.sharingMode = VK_SHARING_MODE_CONCURRENT;
+        buffer_info.queueFamilyIndexCount = num_queue_families;
+        buffer_info.pQueueFamilyIndices = queue_family_indices;
+    }
+
+    if (vkCreateBuffer(vk_state->device, &buffer_info, NULL, buffer) != VK_SUCCESS) {
+        set_error("Failed to create buffer");
         return AH_FAILURE;
     }
 
     VkMemoryRequirements mem_requirements;
-    vkGetBufferMemoryRequirements(vk_state->device, vk_state->vertex_buffer, &mem_requirements);
+    vkGetBufferMemoryRequirements(vk_state->device, *buffer, &mem_requirements);
 
-    VkMemoryAllocateInfo alloc_info = {};
-    alloc_info.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-    alloc_info.allocationSize = mem_requirements.size;
+    if (ah_alloc_memory(&vk_state->allocator, &mem_requirements, properties, AH_ALLOC_LINEAR, allocation) != AH_SUCCESS) {
+        vkDestroyBuffer(vk_state->device, *buffer, NULL);
+        return AH_FAILURE;
+    }
+
+    vkBindBufferMemory(vk_state->device, *buffer, allocation->memory, allocation->offset);
+
+    return AH_SUCCESS;
+}
 
-    if (find_memory_type(
+void ah_vk_destroy_buffer(vulkan_state_t *vk_state, VkBuffer buffer, ah_allocation_t *allocation) {
+    vkDestroyBuffer(vk_state->device, buffer, NULL);
+    ah_alloc_free(&vk_state->allocator, allocation);
+}
+
+AH_RESULT ah_vk_create_image(vulkan_state_t *vk_state, const VkImageCreateInfo *image_info, VkMemoryPropertyFlags properties, VkImage *image, ah_allocation_t *allocation) {
+    if (vkCreateImage(vk_state->device, image_info, NULL, image) != VK_SUCCESS) {
+        set_error("Failed to create image");
+        return AH_FAILURE;
+    }
+
+    VkMemoryRequirements mem_requirements;
+    vkGetImageMemoryRequirements(vk_state->device, *image, &mem_requirements);
+
+    ah_alloc_kind_t kind = image_info->tiling == VK_IMAGE_TILING_OPTIMAL ? AH_ALLOC_OPTIMAL : AH_ALLOC_LINEAR;
+    if (ah_alloc_memory(&vk_state->allocator, &mem_requirements, properties, kind, allocation) != AH_SUCCESS) {
+        vkDestroyImage(vk_state->device, *image, NULL);
+        return AH_FAILURE;
+    }
+
+    vkBindImageMemory(vk_state->device, *image, allocation->memory, allocation->offset);
+
+    return AH_SUCCESS;
+}
+
+void ah_vk_destroy_image(vulkan_state_t *vk_state, VkImage image, ah_allocation_t *allocation) {
+    vkDestroyImage(vk_state->device, image, NULL);
+    ah_alloc_free(&vk_state->allocator, allocation);
+}
+
+/// Create a device-local buffer and queue `data` to be copied into it through
+/// the staging ring. The copy is visible to frames drawn after the next
+/// `ah_upload_flush`.
+AH_RESULT ah_vk_create_device_buffer(vulkan_state_t *vk_state, const void *data, VkDeviceSize size, VkBufferUsageFlags usage, VkBuffer *buffer, ah_allocation_t *allocation) {
+    if (ah_vk_create_buffer(
         vk_state,
-        mem_requirements.memoryTypeBits,
-        VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-        &alloc_info.memoryTypeIndex)
+        size,
+        usage | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+        VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+        buffer,
+        allocation)
     != AH_SUCCESS) {
         return AH_FAILURE;
     }
 
-    if (vkAllocateMemory(vk_state->device, &alloc_info, NULL, &vk_state->vertex_buffer_memory) != VK_SUCCESS) {
-        set_error("Failed allocating memory for vertex buffer");
+    return ah_upload_buffer(vk_state, *buffer, 0, data, size);
+}
+
+AH_RESULT ah_vk_open_mesh(vulkan_state_t *vk_state) {
+    if (!vk_state->mesh_path) {
+        ah_mesh_init_triangle(&vk_state->mesh);
+        return AH_SUCCESS;
+    }
+    if (!vk_state->stream_assets) {
+        return ah_mesh_open(&vk_state->mesh, vk_state->mesh_path);
+    }
+
+    // Streamed meshes start as a placeholder in their own vertex format,
+    // nothing past the header is read here
+    ah_mesh_t header;
+    if (ah_mesh_open(&header, vk_state->mesh_path) != AH_SUCCESS) {
         return AH_FAILURE;
     }
+    ah_mesh_init_placeholder(&vk_state->mesh, &header);
+    unmap_file(&header.file);
+
+    return AH_SUCCESS;
+}
 
-    vkBindBufferMemory(vk_state->device, vk_state->vertex_buffer, vk_state->vertex_buffer_memory, 0);
+AH_RESULT ah_vk_upload_mesh(vulkan_state_t *vk_state) {
+    if (ah_mesh_upload(vk_state, &vk_state->mesh) != AH_SUCCESS) {
+        return AH_FAILURE;
+    }
 
-    void *data;
-    vkMapMemory(vk_state->device, vk_state->vertex_buffer_memory, 0, buffer_info.size, 0, &data);
-    memcpy(data, vertices, (size_t)buffer_info.size);
-    vkUnmapMemory(vk_state->device, vk_state->vertex_buffer_memory);
+    vk_state->draws = (ah_draw_t*)malloc(sizeof(ah_draw_t));
+    vk_state->draws[0] = ah_mesh_draw(&vk_state->mesh);
+    vk_state->num_draws = 1;
+
+    if (vk_state->mesh_path && vk_state->stream_assets) {
+        vk_state->scene_asset = ah_stream_mesh(vk_state, vk_state->mesh_path, 0);
+        if (vk_state->scene_asset == AH_STREAM_NONE) {
+            return AH_FAILURE;
+        }
+    }
 
     return AH_SUCCESS;
 }
+
+/// Swap the streamed scene mesh in for its placeholder once it is
+/// resident. A failed stream keeps the placeholder.
+AH_RESULT ah_vk_poll_scene_mesh(vulkan_state_t *vk_state) {
+    if (vk_state->scene_asset == AH_STREAM_NONE) {
+        return AH_SUCCESS;
+    }
+
+    ah_residency_t residency = ah_stream_residency(vk_state, vk_state->scene_asset);
+    if (residency == AH_RESIDENCY_FAILED) {
+        vk_state->scene_asset = AH_STREAM_NONE;
+        return AH_SUCCESS;
+    }
+    if (residency != AH_RESIDENCY_RESIDENT) {
+        return AH_SUCCESS;
+    }
+
+    // Frames in flight still draw the placeholder
+    VkBuffer placeholder = vk_state->mesh.vertex_buffer;
+    ah_scheduler_retire_buffer(vk_state, vk_state->mesh.vertex_buffer, &vk_state->mesh.vertex_allocation);
+    ah_scheduler_retire_buffer(vk_state, vk_state->mesh.index_buffer, &vk_state->mesh.index_allocation);
+    ah_stream_take_mesh(vk_state, vk_state->scene_asset, &vk_state->mesh);
+    vk_state->scene_asset = AH_STREAM_NONE;
+
+    ah_draw_t draw = ah_mesh_draw(&vk_state->mesh);
+    for (uint32_t i = 0; i < vk_state->num_draws; i++) {
+        if (vk_state->draws[i].vertex_buffer == placeholder) {
+            vk_state->draws[i] = draw;
+        }
+    }
+
+    // The indirect commands pick up the index count as the next frames are
+    // recorded, the cull pass reads the bounds every frame
+    return AH_SUCCESS;
+}
+
+void ah_vk_cleanup(vulkan_state_t *vk_state) {
+    vkDeviceWaitIdle(vk_state->device);
+
+    ah_hot_reload_destroy(vk_state);
+    ah_stream_destroy(vk_state);
+    ah_profiler_destroy(vk_state);
+    ah_trace_close(&vk_state->trace);
+
+    for (uint32_t i = 0; i < vk_state->num_retired_swapchains; i++) {
+        destroy_retired_swapchain(vk_state, &vk_state->retired_swapchains[i]);
+    }
+    vk_state->num_retired_swapchains = 0;
+
+    for (uint32_t i = 0; i < vk_state->num_swapchain_images; i++) {
+        vkDestroySemaphore(vk_state->device, vk_state->render_finished_semaphores[i], NULL);
+    }
+    free(vk_state->render_finished_semaphores);
+
+    for (uint32_t i = 0; i < vk_state->frames_in_flight; i++) {
+        vkDestroySemaphore(vk_state->device, vk_state->image_available_semaphores[i], NULL);
+    }
+
+    vkDestroyCommandPool(vk_state->device, vk_state->command_pool, NULL);
+    ah_recorder_destroy(vk_state);
+    ah_upload_destroy(vk_state);
+    free(vk_state->draws);
+    ah_capture_destroy(vk_state);
+    ah_textures_destroy(vk_state);
+    ah_culling_destroy(vk_state);
+    ah_simulation_destroy(vk_state);
+    ah_instancing_destroy(vk_state);
+    ah_frame_alloc_destroy(vk_state);
+    ah_bindless_destroy(vk_state);
+    ah_scheduler_destroy(vk_state);
+    ah_render_graph_destroy(vk_state, &vk_state->render_graph);
+
+    ah_mesh_destroy(vk_state, &vk_state->mesh);
+
+    if (vk_state->swapchain_framebuffers) {
+        for (uint32_t i = 0; i < vk_state->num_swapchain_images; i++) {
+            vkDestroyFramebuffer(vk_state->device, vk_state->swapchain_framebuffers[i], NULL);
+        }
+    }
+    free(vk_state->swapchain_framebuffers);
+
+    vkDestroyPipeline(vk_state->device, vk_state->pipeline, NULL);
+    ah_pipeline_builder_destroy(&vk_state->pipeline_builder);
+    ah_jobs_destroy(&vk_state->jobs);
+    if (ah_pipeline_cache_save(vk_state, AH_PIPELINE_CACHE_PATH) != AH_SUCCESS) {
+        print_error("cleanup/pipeline_cache_save");
+    }
+    vkDestroyPipelineCache(vk_state->device, vk_state->pipeline_cache, NULL);
+    vkDestroyPipelineLayout(vk_state->device, vk_state->pipeline_layout, NULL);
+    vkDestroyRenderPass(vk_state->device, vk_state->render_pass, NULL);
+
+    for (uint32_t i = 0; i < vk_state->num_swapchain_images; i++) {
+        vkDestroyImageView(vk_state->device, vk_state->swapchain_image_views[i], NULL);
+    }
+    free(vk_state->swapchain_image_views);
+
+    if (vk_state->headless) {
+        for (uint32_t i = 0; i < vk_state->num_swapchain_images; i++) {
+            ah_vk_destroy_image(vk_state, vk_state->swapchain_images[i], &vk_state->headless_image_allocations[i]);
+        }
+        free(vk_state->headless_image_allocations);
+    } else {
+        vkDestroySwapchainKHR(vk_state->device, vk_state->swapchain, NULL);
+    }
+    free(vk_state->swapchain_images);
+    free(vk_state->swapchain_support.formats);
+    free(vk_state->swapchain_support.present_modes);
+
+    ah_alloc_print_stats(&vk_state->allocator);
+    ah_alloc_destroy(&vk_state->allocator);
+    vkDestroyDevice(vk_state->device, NULL);
+    if (vk_state->surface != VK_NULL_HANDLE) {
+        vkDestroySurfaceKHR(vk_state->instance, vk_state->surface, NULL);
+    }
+    vkDestroyInstance(vk_state->instance, NULL);
+}
@@ -1,6 +1,26 @@
 #pragma once
 
 #include "ah.h"
+#include "alloc.h"
+#include "bindless.h"
+#include "capture.h"
+#include "culling.h"
+#include "frame_alloc.h"
+#include "hot_reload.h"
+#include "instancing.h"
+#include "jobs.h"
+#include "mesh.h"
+#include "pacing.h"
+#include "pipeline_builder.h"
+#include "profiler.h"
+#include "record.h"
+#include "render_graph.h"
+#include "scheduler.h"
+#include "simulation.h"
+#include "streaming.h"
+#include "texture.h"
+#include "trace.h"
+#include "upload.h"
 #include <stdbool.h>
 #include <vulkan/vulkan_core.h>
 
@@ -17,34 +37,179 @@ typedef struct vulkan_queue_family_indices {
     uint32_t graphics_family;
     bool has_present_family;
     uint32_t present_family;
+    // A transfer-only family when the device has one, otherwise the
+    // graphics family
+    bool has_transfer_family;
+    uint32_t transfer_family;
+    // A compute family without graphics when the device has one, otherwise
+    // the graphics family
+    bool has_compute_family;
+    uint32_t compute_family;
 } vulkan_queue_family_indices_t;
 
+/// Optional device features, enabled only when the physical device has them
+typedef struct vulkan_device_features {
+    // More than one command per vkCmdDrawIndexedIndirect
+    bool multi_draw_indirect;
+    // vkCmdDrawIndexedIndirectCount, draw count read from a GPU buffer
+    bool draw_indirect_count;
+    // VK_KHR_present_id and VK_KHR_present_wait, lets frame pacing block
+    // until a given present reached the screen
+    bool present_wait;
+    // vkCmdBeginRendering, draws straight into image views without render
+    // pass and framebuffer objects
+    bool dynamic_rendering;
+    // Block compressed texture formats, sampled without decompressing them
+    // on the CPU
+    bool texture_compression_bc;
+    bool texture_compression_astc;
+    // Bindless slots written while frames in flight have the set bound,
+    // without it every frame slot gets a set of its own
+    bool update_after_bind;
+} vulkan_device_features_t;
+
+#define AH_MAX_RETIRED_SWAPCHAINS 4
+
+/// Swapchain objects replaced by a recreation. Frames already submitted may
+/// still use them, so they are destroyed once the graphics timeline reaches
+/// `retire_value`.
+typedef struct vulkan_retired_swapchain {
+    VkSwapchainKHR swapchain;
+    uint32_t num_images;
+    VkImage *images;
+    VkImageView *image_views;
+    VkFramebuffer *framebuffers;
+    VkSemaphore *render_finished_semaphores;
+    uint64_t retire_value;
+} vulkan_retired_swapchain_t;
+
 typedef struct vulkan_state {
+    // Render into offscreen images instead of a window swapchain, for
+    // machines without a display. Set before `ah_vk_init`.
+    bool headless;
+    VkExtent2D headless_extent;
+    bool enable_validation;
+    // Copies of the triangle drawn through the instanced indirect path
+    uint32_t num_instances;
+    // Animate the instances with a compute pass on the async compute queue
+    bool simulate;
+    // Frustum cull the instances on the GPU before drawing them
+    bool cull_instances;
+    // Keep the VkRenderPass path even when dynamic rendering is supported
+    bool force_render_pass;
+    // Recompile shaders/ as it changes and swap the pipelines in
+    bool watch_shaders;
+    // Clip space transform of the scene, the cull pass takes its frustum
+    // from it. Identity draws the scene straight in clip space.
+    mat4 view_projection;
+    // Requested present mode, FIFO is used when the surface lacks it. Change
+    // at runtime with `ah_vk_set_present_mode`.
+    VkPresentModeKHR present_mode;
+    ah_pacing_mode_t pacing_mode;
+
     GLFWwindow *window;
     VkInstance instance;
     VkPhysicalDevice physical_device;
     VkDevice device;
     VkQueue graphics_queue;
     VkQueue present_queue;
+    VkQueue transfer_queue;
+    VkQueue compute_queue;
+    vulkan_device_features_t features;
+    ah_allocator_t allocator;
     VkSurfaceKHR surface;
     VkSwapchainKHR swapchain;
     uint32_t num_swapchain_images;
     VkImage *swapchain_images;
     VkImageView *swapchain_image_views;
+    // NULL with dynamic rendering
     VkFramebuffer *swapchain_framebuffers;
+    // Backing memory of the offscreen images when running headless
+    ah_allocation_t *headless_image_allocations;
     VkFormat swapchain_image_format;
     VkExtent2D swapchain_extent;
+    VkPresentModeKHR active_present_mode;
+    ah_pacer_t pacer;
+    // Set on resize or when present reports the swapchain out of date, the
+    // next frame recreates it first
+    bool swapchain_dirty;
+    vulkan_retired_swapchain_t retired_swapchains[AH_MAX_RETIRED_SWAPCHAINS];
+    uint32_t num_retired_swapchains;
+    // Graphics timeline value of the last frame presented to `swapchain`,
+    // it is retired once that frame is done
+    uint64_t last_present_value;
+    // VK_NULL_HANDLE with dynamic rendering
     VkRenderPass render_pass;
+    // Bindless set and the draw push constants, shared by every scene
+    // pipeline
+    ah_bindless_t bindless;
+    // Per-frame uniform and storage data, and the uniforms of the frame
+    // being recorded
+    ah_frame_allocator_t frame_alloc;
+    ah_frame_range_t frame_uniforms;
     VkPipelineLayout pipeline_layout;
     VkPipeline pipeline;
+    VkPipelineCache pipeline_cache;
+    // The pipeline cache was seeded from disk
+    bool pipeline_cache_warm;
+    ah_job_pool_t jobs;
+    ah_pipeline_builder_t pipeline_builder;
+    ah_pipeline_future_t pipeline_future;
+    ah_hot_reload_t hot_reload;
     VkCommandPool command_pool;
-    VkCommandBuffer command_buffer;
-    VkBuffer vertex_buffer;
-    VkDeviceMemory vertex_buffer_memory;
+    // Scene geometry, loaded from `mesh_path` or the built-in triangle when
+    // that is NULL
+    const char *mesh_path;
+    ah_mesh_t mesh;
+    ah_uploader_t uploader;
+    // Draw a placeholder for `mesh_path` until it streamed in, instead of
+    // loading it before the first frame
+    bool stream_assets;
+    ah_streamer_t streamer;
+    // Streamed scene mesh still waiting to replace the placeholder
+    uint32_t scene_asset;
+    // KTX2 file sampled by the default material, none when NULL. Grows
+    // towards the largest level the swapchain can show.
+    const char *texture_path;
+    ah_textures_t textures;
+    uint32_t scene_texture;
+
+    // Everything drawn in the scene pass, recorded across the job pool once
+    // there are enough draws to split
+    ah_draw_t *draws;
+    uint32_t num_draws;
+    ah_recorder_t recorder;
+    // Passes of a frame, the backbuffer they end in and the scene depth,
+    // a transient of the graph
+    ah_render_graph_t render_graph;
+    uint32_t backbuffer;
+    uint32_t depth;
+    VkFormat depth_format;
+    // Copies finished frames out to `capture.consume` when that is set
+    ah_capture_t capture;
+    ah_instancing_t instancing;
+    ah_simulation_t simulation;
+    ah_culling_t culling;
+
+    // Frames in flight ring, `frames_in_flight` must be set before
+    // `ah_vk_init` and is clamped to [1, AH_MAX_FRAMES_IN_FLIGHT]
+    uint32_t frames_in_flight;
+    uint32_t current_frame;
+    // Frames submitted so far
+    uint64_t frame_count;
+    VkCommandBuffer command_buffers[AH_MAX_FRAMES_IN_FLIGHT];
+    VkSemaphore image_available_semaphores[AH_MAX_FRAMES_IN_FLIGHT];
+    // Per-queue timelines, a frame slot is free once the graphics timeline
+    // reaches its value
+    ah_scheduler_t scheduler;
+
+    // One per swapchain image, so a present never waits on a semaphore
+    // that a later frame is already signaling again
+    VkSemaphore *render_finished_semaphores;
 
-    VkSemaphore image_available_sempahore;
-    VkSemaphore render_finished_semaphore;
-    VkFence in_flight_fence;
+    // GPU scope timings, and the trace they are written to while it is open
+    ah_profiler_t profiler;
+    ah_trace_t trace;
 
     vulkan_queue_family_indices_t queue_family_indices;
     vulkan_swapchain_support_details_t swapchain_support;
@@ -58,12 +223,29 @@ AH_RESULT ah_vk_pick_physical_device(vulkan_state_t *vk_state);
 AH_RESULT ah_vk_create_logical_device(vulkan_state_t *vk_state);
 AH_RESULT ah_vk_create_image_views(vulkan_state_t *vk_state);
 AH_RESULT ah_vk_create_graphics_pipeline(vulkan_state_t *vk_state);
+AH_RESULT ah_vk_build_graphics_pipeline(VkDevice device, VkPipelineCache pipeline_cache, const ah_graphics_pipeline_desc_t *desc, VkPipeline *pipeline);
+AH_RESULT ah_vk_build_compute_pipeline(VkDevice device, VkPipelineCache pipeline_cache, const ah_compute_pipeline_desc_t *desc, VkPipeline *pipeline);
 AH_RESULT ah_vk_create_swapchain(vulkan_state_t *vk_state);
+AH_RESULT ah_vk_recreate_swapchain(vulkan_state_t *vk_state);
+void ah_vk_set_present_mode(vulkan_state_t *vk_state, VkPresentModeKHR present_mode);
+const char* ah_vk_present_mode_name(VkPresentModeKHR present_mode);
+void ah_vk_collect_retired_swapchains(vulkan_state_t *vk_state);
+AH_RESULT ah_vk_pick_depth_format(vulkan_state_t *vk_state);
 AH_RESULT ah_vk_create_render_pass(vulkan_state_t *vk_state);
 AH_RESULT ah_vk_create_framebuffers(vulkan_state_t *vk_state);
+AH_RESULT ah_vk_create_render_graph(vulkan_state_t *vk_state);
 AH_RESULT ah_vk_create_command_pool(vulkan_state_t *vk_state);
 AH_RESULT ah_vk_create_command_buffer(vulkan_state_t *vk_state);
 AH_RESULT ah_vk_create_sync_objects(vulkan_state_t *vk_state);
-AH_RESULT ah_vk_create_vertex_buffer(vulkan_state_t *vk_state);
+AH_RESULT ah_vk_create_render_finished_semaphores(vulkan_state_t *vk_state);
+AH_RESULT ah_vk_create_buffer(vulkan_state_t *vk_state, VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer *buffer, ah_allocation_t *allocation);
+void ah_vk_destroy_buffer(vulkan_state_t *vk_state, VkBuffer buffer, ah_allocation_t *allocation);
+AH_RESULT ah_vk_create_image(vulkan_state_t *vk_state, const VkImageCreateInfo *image_info, VkMemoryPropertyFlags properties, VkImage *image, ah_allocation_t *allocation);
+void ah_vk_destroy_image(vulkan_state_t *vk_state, VkImage image, ah_allocation_t *allocation);
+AH_RESULT ah_vk_create_device_buffer(vulkan_state_t *vk_state, const void *data, VkDeviceSize size, VkBufferUsageFlags usage, VkBuffer *buffer, ah_allocation_t *allocation);
+AH_RESULT ah_vk_open_mesh(vulkan_state_t *vk_state);
+AH_RESULT ah_vk_upload_mesh(vulkan_state_t *vk_state);
+AH_RESULT ah_vk_poll_scene_mesh(vulkan_state_t *vk_state);
+void ah_vk_cleanup(vulkan_state_t *vk_state);
 
 AH_RESULT ah_vk_record_command_buffer(vulkan_state_t *vk_state, VkCommandBuffer command_buffer, uint32_t image_index, uint32_t index);
@@ -0,0 +1,407 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "ah/ah.h"
+#include "ah/vk.h"
+#include "ah/culling.h"
+#include "ah/errors.h"
+#include "ah/frame.h"
+#include "ah/instrument.h"
+#include "ah/instancing.h"
+#include "ah/mesh.h"
+#include "ah/profiler.h"
+#include "ah/scheduler.h"
+#include "ah/trace.h"
+
+#define DEFAULT_FRAMES 1000
+#define DEFAULT_WARMUP_FRAMES 50
+#define DEFAULT_SWEEP_INSTANCES 100000
+
+typedef struct bench_samples {
+    uint32_t count;
+    double *values;
+} bench_samples_t;
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+void push_sample(bench_samples_t *samples, double value) {
+    if (value < 0.0) {
+        return;
+    }
+    samples->values[samples->count++] = value;
+}
+
+void sort_samples(bench_samples_t *samples) {
+    qsort(samples->values, samples->count, sizeof(double), compare_doubles);
+}
+
+/// `samples` must be sorted, -1 when there are none
+double sample_percentile(bench_samples_t *samples, double percentile) {
+    if (samples->count == 0) {
+        return -1.0;
+    }
+    return samples->values[(uint32_t)((samples->count - 1) * percentile)];
+}
+
+void print_samples(const char *name, bench_samples_t *samples) {
+    if (samples->count == 0) {
+        printf("%-8s %10s %10s %10s %10s\n", name, "n/a", "n/a", "n/a", "n/a");
+        return;
+    }
+
+    printf(
+        "%-8s %10.4f %10.4f %10.4f %10.4f\n",
+        name,
+        sample_percentile(samples, 0.0),
+        sample_percentile(samples, 0.5),
+        sample_percentile(samples, 0.99),
+        sample_percentile(samples, 1.0)
+    );
+}
+
+typedef struct bench_run {
+    double fps;
+    bench_samples_t record;
+    bench_samples_t submit;
+    bench_samples_t gpu;
+} bench_run_t;
+
+void free_run(bench_run_t *run) {
+    free(run->record.values);
+    free(run->submit.values);
+    free(run->gpu.values);
+}
+
+/// Render `num_warmup` untimed frames, then `num_frames` timed ones. The
+/// samples come back sorted.
+AH_RESULT run_frames(vulkan_state_t *vk_state, uint32_t num_frames, uint32_t num_warmup, bench_run_t *run) {
+    run->record = (bench_samples_t){0, malloc(sizeof(double)*num_frames)};
+    run->submit = (bench_samples_t){0, malloc(sizeof(double)*num_frames)};
+    // GPU results of the last frames are read after the loop, one per slot
+    run->gpu = (bench_samples_t){0, malloc(sizeof(double)*(num_frames + AH_MAX_FRAMES_IN_FLIGHT))};
+
+    double start = 0.0;
+    for (uint32_t i = 0; i < num_warmup + num_frames; i++) {
+        if (i == num_warmup) {
+            start = ah_now_ms();
+        }
+
+        ah_frame_timings_t timings;
+        if (ah_vk_draw_frame(vk_state, i, &timings) != AH_SUCCESS) {
+            print_error("bench/draw_frame");
+            return AH_FAILURE;
+        }
+
+        if (i < num_warmup) {
+            continue;
+        }
+
+        push_sample(&run->record, timings.record_ms);
+        push_sample(&run->submit, timings.submit_ms);
+        // The GPU time belongs to the frame that used this slot before, skip
+        // the ones rendered during warmup
+        if (i >= num_warmup + vk_state->frames_in_flight) {
+            push_sample(&run->gpu, timings.gpu_ms);
+        }
+    }
+
+    if (ah_scheduler_wait_idle(vk_state) != AH_SUCCESS) {
+        print_error("bench/wait_idle");
+        return AH_FAILURE;
+    }
+    run->fps = num_frames * 1000.0 / (ah_now_ms() - start);
+
+    for (uint32_t frame = 0; frame < vk_state->frames_in_flight; frame++) {
+        double gpu_ms;
+        if (ah_profiler_collect(vk_state, frame, &gpu_ms) != AH_SUCCESS) {
+            print_error("bench/profiler_collect");
+            return AH_FAILURE;
+        }
+        push_sample(&run->gpu, gpu_ms);
+    }
+
+    sort_samples(&run->record);
+    sort_samples(&run->submit);
+    sort_samples(&run->gpu);
+
+    return AH_SUCCESS;
+}
+
+/// Draw the instanced scene at growing instance counts up to
+/// `max_instances`, one line each
+AH_RESULT run_instance_sweep(vulkan_state_t *vk_state, uint32_t num_frames, uint32_t num_warmup, uint32_t max_instances) {
+    printf(
+        "%10s %10s %10s %10s %10s %10s\n",
+        "instances", "fps", "frame ms", "record ms", "gpu ms", "gpu p99"
+    );
+
+    for (uint32_t num_instances = 1; num_instances <= max_instances; num_instances *= 10) {
+        if (ah_instancing_set_count(vk_state, num_instances) != AH_SUCCESS) {
+            print_error("bench/instancing_set_count");
+            return AH_FAILURE;
+        }
+
+        bench_run_t run;
+        if (run_frames(vk_state, num_frames, num_warmup, &run) != AH_SUCCESS) {
+            free_run(&run);
+            return AH_FAILURE;
+        }
+
+        printf(
+            "%10u %10.2f %10.4f %10.4f %10.4f %10.4f\n",
+            num_instances,
+            run.fps,
+            1000.0 / run.fps,
+            sample_percentile(&run.record, 0.5),
+            sample_percentile(&run.gpu, 0.5),
+            sample_percentile(&run.gpu, 0.99)
+        );
+        free_run(&run);
+
+        if (num_instances > max_instances / 10) {
+            break;
+        }
+    }
+
+    return AH_SUCCESS;
+}
+
+/// Write a `cells` x `cells` grid of quads covering most of the viewport,
+/// big enough to measure mesh loading
+AH_RESULT generate_grid_mesh(const char *path, uint32_t cells, bool quantized) {
+    uint32_t side = cells + 1;
+    uint32_t num_vertices = side * side;
+    uint32_t num_indices = cells * cells * 6;
+    const float extent = 0.9f;
+
+    ah_mesh_file_header_t header = {};
+    header.magic = AH_MESH_MAGIC;
+    header.version = AH_MESH_VERSION;
+    header.flags = (quantized ? AH_MESH_QUANTIZED : 0) | (num_vertices > UINT16_MAX ? AH_MESH_INDEX_32 : 0);
+    header.vertex_stride = quantized ? sizeof(vertex_quantized_t) : sizeof(vertex_t);
+    header.num_vertices = num_vertices;
+    header.num_indices = num_indices;
+    header.vertex_offset = align_up(sizeof(header), AH_MESH_STREAM_ALIGNMENT);
+    header.index_offset = align_up(header.vertex_offset + (uint64_t)num_vertices * header.vertex_stride, AH_MESH_STREAM_ALIGNMENT);
+    header.dequantize[0] = quantized ? extent : 1.0f;
+    header.dequantize[1] = quantized ? extent : 1.0f;
+
+    uint8_t *vertices = malloc((size_t)num_vertices * header.vertex_stride);
+    for (uint32_t y = 0; y < side; y++) {
+        for (uint32_t x = 0; x < side; x++) {
+            uint32_t v = y * side + x;
+            float u = (float)x / (float)cells;
+            float t = (float)y / (float)cells;
+            float px = -extent + 2.0f * extent * u;
+            float py = -extent + 2.0f * extent * t;
+
+            if (quantized) {
+                vertex_quantized_t *vertex = &((vertex_quantized_t*)vertices)[v];
+                vertex->pos[0] = (int16_t)(px / extent * INT16_MAX);
+                vertex->pos[1] = (int16_t)(py / extent * INT16_MAX);
+                vertex->color[0] = (uint8_t)(u * 255.0f);
+                vertex->color[1] = (uint8_t)(t * 255.0f);
+                vertex->color[2] = 128;
+                vertex->color[3] = 255;
+            } else {
+                vertex_t *vertex = &((vertex_t*)vertices)[v];
+                vertex->pos[0] = px;
+                vertex->pos[1] = py;
+                vertex->color[0] = u;
+                vertex->color[1] = t;
+                vertex->color[2] = 0.5f;
+            }
+        }
+    }
+
+    bool index_32 = header.flags & AH_MESH_INDEX_32;
+    uint8_t *indices = malloc((size_t)num_indices * (index_32 ? sizeof(uint32_t) : sizeof(uint16_t)));
+    uint32_t n = 0;
+    for (uint32_t y = 0; y < cells; y++) {
+        for (uint32_t x = 0; x < cells; x++) {
+            uint32_t v00 = y * side + x;
+            uint32_t quad[6] = {v00, v00 + 1, v00 + side + 1, v00, v00 + side + 1, v00 + side};
+
+            for (uint32_t k = 0; k < 6; k++, n++) {
+                if (index_32) {
+                    ((uint32_t*)indices)[n] = quad[k];
+                } else {
+                    ((uint16_t*)indices)[n] = (uint16_t)quad[k];
+                }
+            }
+        }
+    }
+
+    AH_RESULT result = ah_mesh_write(path, &header, vertices, indices);
+    free(vertices);
+    free(indices);
+
+    return result;
+}
+
+void usage() {
+    printf("usage: atom-heart-bench [-n frames] [-w warmup] [-d draws] [-i instances] [-c] [-u] [-S] [-m mesh [-a]] [-G cells [-q]] [-f frames-in-flight] [-s WIDTHxHEIGHT] [-t trace.json] [-v]\n");
+    printf("  -c animates the instances with the compute simulation\n");
+    printf("  -u draws every instance without the GPU frustum cull\n");
+    printf("  -a streams the mesh in after the first frame instead of loading it during init\n");
+    printf("  -t writes a Chrome trace of the CPU zones and GPU scopes of every rendered frame\n");
+    printf("  -G writes a grid mesh of cells x cells quads to the -m path and exits, -q quantises it\n");
+}
+
+/// Render a fixed number of frames headless and report frame-time
+/// percentiles, so regressions can be caught on machines without a display.
+/// Set VK_ICD_FILENAMES to run on a software driver such as lavapipe.
+int main(int argc, char **argv) {
+    uint32_t num_frames = DEFAULT_FRAMES;
+    uint32_t num_warmup = DEFAULT_WARMUP_FRAMES;
+    uint32_t num_draws = 1;
+    uint32_t num_instances = 0;
+    bool sweep = false;
+    uint32_t grid_cells = 0;
+    bool quantized = false;
+    const char *trace_path = NULL;
+
+    vulkan_state_t vk_state;
+    ah_init_vulkan_state(&vk_state);
+    vk_state.headless = true;
+    // Validation layers skew timings and are usually missing on CI boxes
+    vk_state.enable_validation = false;
+    // Measured frames draw the whole mesh unless -a asks for streaming
+    vk_state.stream_assets = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+            num_frames = (uint32_t)atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-w") && i + 1 < argc) {
+            num_warmup = (uint32_t)atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-d") && i + 1 < argc) {
+            num_draws = (uint32_t)atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-i") && i + 1 < argc) {
+            num_instances = (uint32_t)atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-c")) {
+            vk_state.simulate = true;
+        } else if (!strcmp(argv[i], "-u")) {
+            vk_state.cull_instances = false;
+        } else if (!strcmp(argv[i], "-S")) {
+            sweep = true;
+        } else if (!strcmp(argv[i], "-m") && i + 1 < argc) {
+            vk_state.mesh_path = argv[++i];
+        } else if (!strcmp(argv[i], "-a")) {
+            vk_state.stream_assets = true;
+        } else if (!strcmp(argv[i], "-G") && i + 1 < argc) {
+            grid_cells = (uint32_t)atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-q")) {
+            quantized = true;
+        } else if (!strcmp(argv[i], "-f") && i + 1 < argc) {
+            vk_state.frames_in_flight = (uint32_t)atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+            if (sscanf(argv[++i], "%ux%u", &vk_state.headless_extent.width, &vk_state.headless_extent.height) != 2) {
+                usage();
+                return 1;
+            }
+        } else if (!strcmp(argv[i], "-t") && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (!strcmp(argv[i], "-v")) {
+            vk_state.enable_validation = true;
+        } else {
+            usage();
+            return 1;
+        }
+    }
+
+    if (num_frames == 0 || num_draws == 0) {
+        usage();
+        return 1;
+    }
+
+    if (grid_cells > 0) {
+        if (!vk_state.mesh_path) {
+            usage();
+            return 1;
+        }
+        if (generate_grid_mesh(vk_state.mesh_path, grid_cells, quantized) != AH_SUCCESS) {
+            print_error("bench/generate_grid_mesh");
+            return 1;
+        }
+        return 0;
+    }
+
+    if (!sweep) {
+        vk_state.num_instances = num_instances;
+    }
+
+    double init_start = ah_now_ms();
+    if (ah_vk_init(&vk_state) != AH_SUCCESS) {
+        return 1;
+    }
+
+    // Peak RSS includes the whole of init, so a mesh copied through the
+    // heap shows up here
+    struct rusage resources;
+    getrusage(RUSAGE_SELF, &resources);
+    printf("Init %.2f ms, peak RSS %.1f MiB\n", ah_now_ms() - init_start, resources.ru_maxrss / 1024.0);
+
+    // Repeat the scene draw to load the CPU recording path
+    vk_state.draws = realloc(vk_state.draws, sizeof(ah_draw_t)*num_draws);
+    for (uint32_t i = 1; i < num_draws; i++) {
+        vk_state.draws[i] = vk_state.draws[0];
+    }
+    vk_state.num_draws = num_draws;
+
+    // Sweeping re-creates the instanced scene at every step
+    if (sweep) {
+        uint32_t max_instances = num_instances > 0 ? num_instances : DEFAULT_SWEEP_INSTANCES;
+        AH_RESULT result = run_instance_sweep(&vk_state, num_frames, num_warmup, max_instances);
+        ah_vk_cleanup(&vk_state);
+        return result == AH_SUCCESS ? 0 : 1;
+    }
+
+    // Opened after init so startup stays out of the trace
+    if (trace_path) {
+        if (ah_trace_open(&vk_state.trace, trace_path) != AH_SUCCESS) {
+            print_error("bench/trace_open");
+            ah_vk_cleanup(&vk_state);
+            return 1;
+        }
+        ah_trace_thread_name(&vk_state.trace, AH_TRACE_GPU_TID, "GPU");
+    }
+
+    bench_run_t run;
+    if (run_frames(&vk_state, num_frames, num_warmup, &run) != AH_SUCCESS) {
+        return 1;
+    }
+
+    printf(
+        "%u frames, %u draws, %u instances, %ux%u, %u in flight, %.2f fps\n",
+        num_frames,
+        num_draws,
+        vk_state.instancing.num_instances,
+        vk_state.swapchain_extent.width,
+        vk_state.swapchain_extent.height,
+        vk_state.frames_in_flight,
+        run.fps
+    );
+    if (ah_culling_active(&vk_state)) {
+        printf("Culling: %u visible, %u culled in the last finished frame\n", vk_state.culling.stats.visible, vk_state.culling.stats.culled);
+    }
+    printf("%-8s %10s %10s %10s %10s\n", "ms", "min", "median", "p99", "max");
+    print_samples("record", &run.record);
+    print_samples("submit", &run.submit);
+    print_samples("gpu", &run.gpu);
+    ah_profiler_print(&vk_state);
+    ah_instrument_print();
+
+    free_run(&run);
+
+    ah_vk_cleanup(&vk_state);
+
+    return 0;
+}
@@ -0,0 +1,41 @@
+// Bindless set and draw push constants shared by the scene pipelines, see
+// ah/bindless.h. Include it right after #version.
+#extension GL_EXT_nonuniform_qualifier : require
+
+#define AH_BINDLESS_NONE 0xffffffffu
+#define AH_BINDLESS_MATERIAL_TABLE 0u
+
+struct Material {
+    vec4 color;
+    // Bindless image handle, AH_BINDLESS_NONE when untextured
+    uint texture;
+    uint padding0;
+    uint padding1;
+    uint padding2;
+};
+
+layout(set = 0, binding = 0) uniform sampler2D ahTextures[];
+
+// Storage buffers share binding 1, other block types can be declared on it
+// the same way
+layout(std430, set = 0, binding = 1) readonly buffer AhMaterials {
+    Material materials[];
+} ahMaterialTables[];
+
+layout(push_constant) uniform AhDraw {
+    // Scale in xy, offset in zw, undoes position quantisation
+    vec4 dequantize;
+    uint material;
+    // Small per-draw data from ah_frame_push, reinterpret as needed
+    layout(offset = 32) uvec4 pushData[6];
+} ahDraw;
+
+Material ahMaterial(uint index) {
+    return ahMaterialTables[AH_BINDLESS_MATERIAL_TABLE].materials[index];
+}
+
+// The handle may differ between invocations of a draw, when it comes from
+// per-instance data for example
+vec4 ahSampleTexture(uint handle, vec2 uv) {
+    return texture(ahTextures[nonuniformEXT(handle)], uv);
+}
@@ -0,0 +1,10 @@
+// Per-frame set, see ah/frame_alloc.h. Ranges come from the frame
+// allocator and are placed with dynamic offsets when bound.
+
+layout(std140, set = 1, binding = 0) uniform AhFrame {
+    // Model space of the instances to clip space
+    mat4 viewProjection;
+    // Animation step handed to ah_vk_draw_frame
+    uint index;
+    uint frameCount;
+} ahFrame;
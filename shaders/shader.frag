@@ -1,8 +1,21 @@
 #version 450
+#extension GL_GOOGLE_include_directive : require
+#include "bindless.glsl"
+#include "frame.glsl"
 
 layout(location = 0) in vec3 fragColor;
+layout(location = 1) in vec2 fragUV;
 layout(location = 0) out vec4 outColor;
 
 void main() {
-    outColor = vec4(fragColor, 1.0);
+    Material material = ahMaterial(ahDraw.material);
+    vec4 albedo = material.color;
+    // Untextured until the texture's first levels are resident
+    if (material.texture != AH_BINDLESS_NONE) {
+        albedo *= ahSampleTexture(material.texture, fragUV);
+    }
+
+    // Slow pulse stepped by the main loop's animation index
+    float pulse = 0.85 + 0.15 * cos(float(ahFrame.index) * 0.3);
+    outColor = vec4(fragColor * pulse, 1.0) * albedo;
 }
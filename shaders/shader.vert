@@ -1,11 +1,19 @@
 #version 450
+#extension GL_GOOGLE_include_directive : require
+#include "bindless.glsl"
+#include "frame.glsl"
 
 layout(location = 0) in vec2 inPosition;
 layout(location = 1) in vec3 inColor;
 
 layout(location = 0) out vec3 fragColor;
+layout(location = 1) out vec2 fragUV;
 
 void main() {
-    gl_Position = vec4(inPosition, 0.0, 1.0);
+    vec2 position = inPosition * ahDraw.dequantize.xy + ahDraw.dequantize.zw;
+    gl_Position = ahFrame.viewProjection * vec4(position, 0.0, 1.0);
     fragColor = inColor;
+    // Vertices carry no texture coordinates, textures repeat once per
+    // model space unit
+    fragUV = position;
 }